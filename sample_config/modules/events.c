@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb/nxweb.h"
+
+#include <pthread.h>
+
+// events: GET /events/<topic> opens Server-Sent Events stream subscribed to <topic>
+//         (add ?poll=1 for long-poll: response ends after first event);
+//         POST /events/<topic> publishes request body to all subscribers of <topic>;
+//         topic "clock" gets an event every second from a thread of its own;
+//         only topics listed below are served, so clients can't create topics at will
+
+static const char* const topic_names[]={"news", "chat", "clock", 0};
+
+static const char* topic_name(nxweb_http_request* req) {
+  const char* name=req->path_info;
+  while (*name=='/') name++;
+  if (!*name) return "news";
+  int i;
+  for (i=0; topic_names[i]; i++) {
+    if (!strcmp(name, topic_names[i])) return topic_names[i];
+  }
+  return 0;
+}
+
+static nxweb_result events_on_request(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
+  if (req->post_method) {
+    const char* name=topic_name(req);
+    if (!name) {
+    nxweb_send_http_error(resp, 404, "Not Found");
+    return NXWEB_ERROR;
+  }
+    nxweb_sse_topic* topic=nxweb_sse_topic_find(name); // no subscribers = no topic
+    int n=0;
+    if (topic) {
+      n=nxweb_sse_topic_publish(topic, 0, 0, req->content, req->content? req->content_received : 0);
+      nxweb_sse_topic_unref(topic);
+    }
+    nxweb_set_response_content_type(resp, "text/plain");
+    nxweb_response_printf(resp, "published to %d net threads\n", n);
+    return NXWEB_OK;
+  }
+  nxweb_parse_request_parameters(req, 0); // also cuts query string off path_info
+  const char* name=topic_name(req);
+  if (!name) {
+    nxweb_send_http_error(resp, 404, "Not Found");
+    return NXWEB_ERROR;
+  }
+  nxweb_event_stream* es=nxweb_event_stream_start(conn, resp, !!nxweb_get_request_parameter(req, "poll"));
+  nxweb_sse_topic* topic=nxweb_sse_topic_get(name);
+  nxweb_sse_topic_subscribe(topic, es); // subscription keeps its own reference
+  nxweb_sse_topic_unref(topic);
+  const char* last_id=nxweb_get_request_header(req, "Last-Event-ID");
+  if (last_id) nxweb_event_stream_send(es, "resumed", 0, last_id, strlen(last_id)); // real app would replay missed events here
+  return NXWEB_OK;
+}
+
+NXWEB_DEFINE_HANDLER(events, .on_request=events_on_request,
+        .flags=NXWEB_HANDLE_GET|NXWEB_HANDLE_POST);
+
+
+static void* clock_thread_main(void* ptr) {
+  nxweb_sse_topic* clock=nxweb_sse_topic_get("clock"); // held until exit
+  unsigned long n=0;
+  char id[24];
+  char text[32];
+  while (1) {
+    sleep(1);
+    time_t t=time(0);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    int size=strftime(text, sizeof(text), "%H:%M:%S", &tm);
+    nxweb_sse_topic_publish(clock, "tick", uint_to_decimal_string(++n, id, sizeof(id)), text, size);
+  }
+  return 0;
+}
+
+static int events_init() {
+  pthread_t t;
+  pthread_attr_t tattr;
+  pthread_attr_init(&tattr);
+  pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&t, &tattr, clock_thread_main, 0);
+  return 0;
+}
+
+NXWEB_MODULE(events, .on_server_startup=events_init);
@@ -21,16 +21,21 @@
 
 #include <fcntl.h>
 
-#define MAX_UPLOAD_SIZE 16000
+#define MAX_UPLOAD_SIZE 100000000
 
 static const char upload_handler_key; // variable's address only matters
 #define UPLOAD_HANDLER_KEY ((nxe_data)&upload_handler_key)
 
+typedef struct upload_file {
+  int fd;
+  nxe_size_t size;
+} upload_file;
+
 static void upload_request_data_finalize(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxe_data data) {
-  nxd_fwbuffer* fwb=data.ptr;
-  if (fwb && fwb->fd) {
-    close(fwb->fd);
-    fwb->fd=0;
+  upload_file* uf=data.ptr;
+  if (uf && uf->fd) {
+    close(uf->fd);
+    uf->fd=0;
   }
 }
 
@@ -39,18 +44,10 @@ static nxweb_result upload_on_request(nxweb_http_server_connection* conn, nxweb_
 
   nxweb_response_append_str(resp, "<html><head><title>Upload Module</title></head><body>\n");
 
-  nxd_fwbuffer* fwb=nxweb_get_request_data(req, UPLOAD_HANDLER_KEY).ptr;
+  upload_file* uf=nxweb_get_request_data(req, UPLOAD_HANDLER_KEY).ptr;
 
-  if (fwb) {
-    nxe_size_t stored_size;
-    if (fwb->size > fwb->max_size) {
-      stored_size=fwb->max_size;
-      nxweb_response_printf(resp, "<p>POST content (%ld bytes) stored in file 'upload.tmp' (truncated to %ld bytes)</p>\n", fwb->size, stored_size);
-    }
-    else {
-      stored_size=fwb->size;
-      nxweb_response_printf(resp, "<p>POST content (%ld bytes) stored in file 'upload.tmp'</p>\n", stored_size);
-    }
+  if (uf) {
+    nxweb_response_printf(resp, "<p>POST content (%ld bytes) stored in file 'upload.tmp'</p>\n", uf->size);
   }
 
   nxweb_response_printf(resp, "<form method='post' enctype='multipart/form-data'>File(s) to upload: <input type='file' multiple name='uploadedfile' /> <input type='submit' value='Go!' /></form>\n");
@@ -109,19 +106,26 @@ static nxweb_result upload_on_request(nxweb_http_server_connection* conn, nxweb_
   return NXWEB_OK;
 }
 
-static nxweb_result upload_on_post_data(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
-  if (req->content_length>MAX_UPLOAD_SIZE) {
-    nxweb_send_http_error(resp, 413, "Request Entity Too Large");
-    resp->keep_alive=0; // close connection
-    nxweb_start_sending_response(conn, resp);
-    return NXWEB_OK;
+static nxweb_result upload_on_post_data_chunk(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, const char* data, nxe_size_t size) {
+  // This handler is NXWEB_INWORKER so body chunks arrive in worker thread
+  // (fed from network thread through bounded ring buffer); blocking write() is fine here.
+  // Body size limit is enforced by nxweb according to .max_body_size
+  upload_file* uf=nxweb_get_request_data(req, UPLOAD_HANDLER_KEY).ptr;
+  if (!uf) {
+    uf=nxb_calloc_obj(req->nxb, sizeof(upload_file));
+    nxweb_set_request_data(req, UPLOAD_HANDLER_KEY, (nxe_data)(void*)uf, upload_request_data_finalize);
+    int fd=open("upload.tmp", O_WRONLY|O_CREAT|O_TRUNC, 0664);
+    if (fd==-1) {
+      nxweb_send_http_error(resp, 500, "Internal Server Error");
+      return NXWEB_ERROR; // the rest of the body is discarded
+    }
+    uf->fd=fd;
+  }
+  if (write(uf->fd, data, size)!=size) {
+    nxweb_send_http_error(resp, 500, "Internal Server Error");
+    return NXWEB_ERROR;
   }
-  nxd_fwbuffer* fwb=nxb_alloc_obj(req->nxb, sizeof(nxd_fwbuffer));
-  nxweb_set_request_data(req, UPLOAD_HANDLER_KEY, (nxe_data)(void*)fwb, upload_request_data_finalize);
-  int fd=open("upload.tmp", O_WRONLY|O_CREAT|O_TRUNC, 0664);
-  nxd_fwbuffer_init(fwb, fd, MAX_UPLOAD_SIZE);
-  conn->hsp.cls->connect_request_body_out(&conn->hsp, &fwb->data_in);
-  conn->hsp.cls->start_receiving_request_body(&conn->hsp);
+  uf->size+=size;
   return NXWEB_OK;
 }
 
@@ -130,14 +134,17 @@ static nxweb_result upload_on_post_data_complete(nxweb_http_server_connection* c
   // as we are closing it anyway in request data finalizer.
   // Releasing resources in finalizer is the proper way of doing this
   // as any other callbacks might not be invoked under error conditions.
-  nxd_fwbuffer* fwb=nxweb_get_request_data(req, UPLOAD_HANDLER_KEY).ptr;
-  close(fwb->fd);
-  fwb->fd=0;
+  upload_file* uf=nxweb_get_request_data(req, UPLOAD_HANDLER_KEY).ptr;
+  if (uf && uf->fd) {
+    close(uf->fd);
+    uf->fd=0;
+  }
   return NXWEB_OK;
 }
 
 NXWEB_DEFINE_HANDLER(upload,
         .on_request=upload_on_request,
-        .on_post_data=upload_on_post_data,
+        .on_post_data_chunk=upload_on_post_data_chunk,
         .on_post_data_complete=upload_on_post_data_complete,
-        .flags=NXWEB_HANDLE_ANY);
+        .max_body_size=MAX_UPLOAD_SIZE,
+        .flags=NXWEB_HANDLE_ANY|NXWEB_INWORKER);
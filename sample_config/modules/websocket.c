@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb/nxweb.h"
+
+// ws_echo: sends every message back
+// ws_chat: every message goes to all members of chat room (across all net threads);
+//          "/slow text" is answered from worker thread after a second
+
+static void ws_echo_on_message(nxweb_websocket* ws, const char* data, nxe_size_t size, _Bool binary) {
+  nxweb_websocket_send(ws, data, size, binary);
+}
+
+NXWEB_DEFINE_HANDLER(ws_echo, .on_ws_message=ws_echo_on_message, .flags=NXWEB_HANDLE_GET);
+
+
+static nxweb_ws_channel chat_room={.name="chat"};
+
+typedef struct slow_job {
+  nxw_completion complete;
+  nxweb_websocket* ws;
+  int size;
+  char text[];
+} slow_job;
+
+static void slow_job_run(void* param) {
+  slow_job* job=param;
+  sleep(1); // pretend we are doing something heavy
+  nxweb_websocket_post(job->ws, job->text, job->size, 0);
+}
+
+static void slow_job_complete(nxw_completion* c) {
+  slow_job* job=OBJ_PTR_FROM_FLD_PTR(slow_job, complete, c);
+  nxweb_websocket_unref(job->ws);
+  nx_free(job);
+}
+
+static void ws_chat_on_open(nxweb_websocket* ws, nxweb_http_request* req) {
+  nxweb_ws_channel_subscribe(&chat_room, ws);
+}
+
+static void ws_chat_on_message(nxweb_websocket* ws, const char* data, nxe_size_t size, _Bool binary) {
+  if (size>6 && !memcmp(data, "/slow ", 6)) {
+    nxw_worker* w=nxw_get_worker(&ws->tdata->workers_factory);
+    if (!w) {
+      nxweb_websocket_send(ws, "busy", 4, 0);
+      return;
+    }
+    slow_job* job=nx_alloc(sizeof(slow_job)+size-6);
+    job->complete.on_complete=slow_job_complete;
+    job->ws=ws;
+    nxweb_websocket_ref(ws); // worker may finish after websocket is closed
+    job->size=size-6;
+    memcpy(job->text, data+6, size-6);
+    nxw_start_worker(w, slow_job_run, job, &job->complete);
+    return;
+  }
+  nxweb_ws_channel_publish(&chat_room, data, size, binary);
+}
+
+NXWEB_DEFINE_HANDLER(ws_chat, .on_ws_open=ws_chat_on_open, .on_ws_message=ws_chat_on_message, .flags=NXWEB_HANDLE_GET);
@@ -0,0 +1,1610 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * nxweb_bench: multithreaded HTTP load generator built on nxweb's own
+ * event loop and http client protocol (nxd_http_proxy).
+ *
+ * Runs scripted scenarios from a JSON file (see sample_config/nxweb_bench.json)
+ * against a running nxweb instance and reports throughput and latency percentiles.
+ * Optionally runs a trivial stub backend (-b) for proxy scenarios.
+ * TLS scenarios use blocking gnutls clients, one thread per connection.
+ * Handshake scenarios open new TLS connection per request; a TLS handshake
+ * storm can be run in background to see its effect on another scenario.
+ * HTTP/2 scenarios keep several streams in flight per connection.
+ */
+
+#include "nxweb/nxweb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef WITH_SSL
+#include <gnutls/gnutls.h>
+#endif
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_SCENARIOS 64
+#define BENCH_SCRATCH_SIZE 65536
+
+#define LAT_SUB_BUCKETS 16
+#define LAT_BUCKETS (LAT_SUB_BUCKETS*40)
+
+enum bench_timers {
+  BENCH_TIMER_STOP=NXWEB_TIMER_ACCEPT_RETRY+1,
+  BENCH_TIMER_RETRY
+};
+
+typedef struct bench_scenario {
+  const char* name;
+  const char* uri;
+  const char* server; // host:port to connect to (default: -H or global server)
+  const char* host; // Host header value
+  const char* fixture_path; // file to create before run (eg for large sendfile)
+  long fixture_size;
+  int connections;
+  int threads;
+  int duration; // seconds
+  int warmup; // seconds
+  _Bool keep_alive;
+  _Bool gzip;
+  _Bool tls;
+  _Bool handshakes; // TLS connection per request; latency includes connect & handshake
+  _Bool tls_resume; // resume previous TLS session on reconnect
+  const char* storm_server; // run background handshake storm against this host:port
+  int storm_connections;
+  _Bool http2; // prior knowledge on plain connection, ALPN h2 with tls
+  int streams; // HTTP/2 requests in flight per connection
+} bench_scenario;
+
+typedef struct bench_stats {
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t non_2xx;
+  uint64_t bytes;
+  uint64_t lat_max;
+  uint64_t lat_hist[LAT_BUCKETS];
+} bench_stats;
+
+struct bench_conn;
+
+typedef struct bench_thread {
+  pthread_t tid;
+  int num;
+  nxe_loop* loop;
+  nxp_pool* nxb_pool;
+  const bench_scenario* sc;
+  struct addrinfo* saddr;
+  struct bench_conn* conns;
+  int num_conns;
+  nxe_timer stop_timer;
+  nxe_time_t measure_start;
+  nxe_time_t measure_end;
+  bench_stats stats;
+  char scratch[BENCH_SCRATCH_SIZE];
+} bench_thread;
+
+typedef struct bench_conn {
+  nxd_http_proxy hpx;
+  nxe_subscriber events_sub;
+  nxe_ostream sink;
+  nxe_timer retry_timer;
+  bench_thread* bt;
+  nxe_time_t start_time;
+  uint64_t bytes;
+  _Bool connected;
+  _Bool in_flight;
+} bench_conn;
+
+static const char* target_host_and_port=0;
+
+// Latency histogram: log-linear buckets (16 sub-buckets per power of two), microseconds.
+
+static int lat_bucket(uint64_t v) {
+  if (v<LAT_SUB_BUCKETS) return (int)v;
+  int shift=63-__builtin_clzll(v)-4;
+  int idx=LAT_SUB_BUCKETS*(shift+1)+(int)((v>>shift)&(LAT_SUB_BUCKETS-1));
+  return idx<LAT_BUCKETS? idx : LAT_BUCKETS-1;
+}
+
+static uint64_t lat_bucket_value(int idx) { // upper bound of bucket
+  if (idx<LAT_SUB_BUCKETS) return (uint64_t)idx;
+  int shift=idx/LAT_SUB_BUCKETS-1;
+  return ((uint64_t)(LAT_SUB_BUCKETS+idx%LAT_SUB_BUCKETS+1)<<shift)-1;
+}
+
+static uint64_t lat_percentile(const bench_stats* st, double pct) {
+  if (!st->requests) return 0;
+  uint64_t threshold=(uint64_t)(st->requests*pct/100.);
+  if (threshold>=st->requests) threshold=st->requests-1;
+  uint64_t cnt=0;
+  int i;
+  for (i=0; i<LAT_BUCKETS; i++) {
+    cnt+=st->lat_hist[i];
+    if (cnt>threshold) {
+      uint64_t v=lat_bucket_value(i);
+      return v<st->lat_max? v : st->lat_max;
+    }
+  }
+  return st->lat_max;
+}
+
+static void conn_start(bench_conn* bc);
+
+static void conn_close(bench_conn* bc, int good) {
+  if (!bc->connected) return;
+  nxd_http_proxy_finalize(&bc->hpx, good);
+  bc->connected=0;
+  bc->in_flight=0;
+}
+
+static void sink_do_read(nxe_ostream* os, nxe_istream* is) {
+  bench_conn* bc=OBJ_PTR_FROM_FLD_PTR(bench_conn, sink, os);
+  nxe_flags_t flags=0;
+  nxe_size_t bytes_received=ISTREAM_CLASS(is)->read(is, os, bc->bt->scratch, BENCH_SCRATCH_SIZE, &flags);
+  bc->bytes+=bytes_received;
+  if (flags&NXEF_EOF) nxe_ostream_unset_ready(os);
+}
+
+static const nxe_ostream_class sink_class={.do_read=sink_do_read};
+
+static void conn_events_on_message(nxe_subscriber* sub, nxe_publisher* pub, nxe_data data) {
+  bench_conn* bc=OBJ_PTR_FROM_FLD_PTR(bench_conn, events_sub, sub);
+  bench_thread* bt=bc->bt;
+  if (data.i==NXD_HCP_REQUEST_COMPLETE) {
+    nxe_time_t now=nxe_get_time_usec();
+    if (bc->start_time>=bt->measure_start && now<=bt->measure_end) {
+      bench_stats* st=&bt->stats;
+      uint64_t lat=now-bc->start_time;
+      st->requests++;
+      st->bytes+=bc->bytes;
+      st->lat_hist[lat_bucket(lat)]++;
+      if (lat>st->lat_max) st->lat_max=lat;
+      int status=bc->hpx.hcp.resp.status_code;
+      if (status<200 || status>=300) st->non_2xx++;
+    }
+    bc->in_flight=0;
+    if (bt->sc->keep_alive && bc->hpx.hcp.resp.keep_alive) {
+      nxd_http_client_proto_rearm(&bc->hpx.hcp);
+    }
+    else {
+      conn_close(bc, 1);
+    }
+    conn_start(bc);
+  }
+  else if (data.i<0) {
+    nxe_time_t now=nxe_get_time_usec();
+    if (bc->in_flight && now>=bt->measure_start && now<=bt->measure_end) bt->stats.errors++;
+    conn_close(bc, 0);
+    nxe_set_timer(bt->loop, BENCH_TIMER_RETRY, &bc->retry_timer);
+  }
+}
+
+static const nxe_subscriber_class conn_events_sub_class={.on_message=conn_events_on_message};
+
+static void conn_retry_on_timeout(nxe_timer* timer, nxe_data data) {
+  bench_conn* bc=OBJ_PTR_FROM_FLD_PTR(bench_conn, retry_timer, timer);
+  conn_start(bc);
+}
+
+static const nxe_timer_class conn_retry_timer_class={.on_timeout=conn_retry_on_timeout};
+
+static void conn_start(bench_conn* bc) {
+  bench_thread* bt=bc->bt;
+  const bench_scenario* sc=bt->sc;
+  if (!bc->connected) {
+    nxd_http_proxy_init(&bc->hpx, bt->nxb_pool);
+    if (nxd_http_proxy_connect(&bc->hpx, bt->loop, sc->host, bt->saddr)) {
+      nxe_time_t now=nxe_get_time_usec();
+      if (now>=bt->measure_start && now<=bt->measure_end) bt->stats.errors++;
+      nxe_set_timer(bt->loop, BENCH_TIMER_RETRY, &bc->retry_timer);
+      return;
+    }
+    bc->connected=1;
+  }
+  nxe_subscribe(bt->loop, &bc->hpx.hcp.events_pub, &bc->events_sub);
+  nxweb_http_request* req=nxd_http_proxy_prepare(&bc->hpx);
+  req->method="GET";
+  req->get_method=1;
+  req->uri=sc->uri;
+  req->host=sc->host;
+  req->http11=1;
+  req->keep_alive=sc->keep_alive;
+  req->user_agent="nxweb_bench";
+  if (sc->gzip) req->accept_encoding="gzip";
+  bc->bytes=0;
+  bc->start_time=nxe_get_time_usec();
+  bc->in_flight=1;
+  nxd_http_proxy_start_request(&bc->hpx, req);
+  bc->sink.ready=1;
+  nxe_connect_streams(bt->loop, &bc->hpx.hcp.resp_body_out, &bc->sink);
+}
+
+static void stop_on_timeout(nxe_timer* timer, nxe_data data) {
+  bench_thread* bt=OBJ_PTR_FROM_FLD_PTR(bench_thread, stop_timer, timer);
+  nxe_break(bt->loop);
+}
+
+static const nxe_timer_class stop_timer_class={.on_timeout=stop_on_timeout};
+
+static void* bench_thread_main(void* ptr) {
+  bench_thread* bt=ptr;
+  const bench_scenario* sc=bt->sc;
+
+  // nxd_http_proxy_connect() generates connection uids from net thread data
+  nxweb_net_thread_data* tdata=nx_calloc(sizeof(nxweb_net_thread_data));
+  tdata->thread_num=bt->num;
+  tdata->loop=bt->loop=nxe_create(128);
+  _nxweb_net_thread_data=tdata;
+
+  nxe_set_timer_queue_timeout(bt->loop, NXWEB_TIMER_KEEP_ALIVE, NXWEB_DEFAULT_KEEP_ALIVE_TIMEOUT);
+  nxe_set_timer_queue_timeout(bt->loop, NXWEB_TIMER_READ, NXWEB_DEFAULT_READ_TIMEOUT);
+  nxe_set_timer_queue_timeout(bt->loop, NXWEB_TIMER_WRITE, NXWEB_DEFAULT_WRITE_TIMEOUT);
+  nxe_set_timer_queue_timeout(bt->loop, NXWEB_TIMER_100CONTINUE, NXWEB_DEFAULT_100CONTINUE_TIMEOUT);
+  nxe_set_timer_queue_timeout(bt->loop, BENCH_TIMER_STOP, (nxe_time_t)(sc->warmup+sc->duration)*1000000);
+  nxe_set_timer_queue_timeout(bt->loop, BENCH_TIMER_RETRY, 100000);
+
+  bt->nxb_pool=nxp_create(NXWEB_CONN_NXB_SIZE, 8);
+  bt->conns=nx_calloc(sizeof(bench_conn)*bt->num_conns);
+
+  nxe_time_t now=nxe_get_time_usec();
+  bt->measure_start=now+(nxe_time_t)sc->warmup*1000000;
+  bt->measure_end=bt->measure_start+(nxe_time_t)sc->duration*1000000;
+  nxe_init_timer(&bt->stop_timer, &stop_timer_class);
+  nxe_set_timer(bt->loop, BENCH_TIMER_STOP, &bt->stop_timer);
+
+  int i;
+  for (i=0; i<bt->num_conns; i++) {
+    bench_conn* bc=&bt->conns[i];
+    bc->bt=bt;
+    nxe_init_subscriber(&bc->events_sub, &conn_events_sub_class);
+    nxe_init_ostream(&bc->sink, &sink_class);
+    nxe_init_timer(&bc->retry_timer, &conn_retry_timer_class);
+    conn_start(bc);
+  }
+
+  nxe_run(bt->loop);
+
+  for (i=0; i<bt->num_conns; i++) {
+    bench_conn* bc=&bt->conns[i];
+    nxe_unset_timer(bt->loop, BENCH_TIMER_RETRY, &bc->retry_timer);
+    conn_close(bc, 0);
+  }
+  nxe_unset_timer(bt->loop, BENCH_TIMER_STOP, &bt->stop_timer);
+  nx_free(bt->conns);
+  nxp_destroy(bt->nxb_pool);
+  nxe_destroy(bt->loop);
+  _nxweb_net_thread_data=0;
+  nx_free(tdata);
+  return 0;
+}
+
+#ifdef WITH_SSL
+
+// TLS scenarios: nxweb's http client has no TLS, so each connection is a thread
+// running blocking gnutls client (certificate is not verified).
+
+typedef struct tls_bench_conn {
+  pthread_t tid;
+  const bench_scenario* sc;
+  struct addrinfo* saddr;
+  nxe_time_t measure_start;
+  nxe_time_t measure_end;
+  bench_stats stats;
+  gnutls_datum_t session_data; // for tls_resume
+} tls_bench_conn;
+
+static gnutls_certificate_credentials_t tls_bench_cred;
+
+static int tls_bench_connect(tls_bench_conn* tc, gnutls_session_t* session) {
+  int fd=socket(tc->saddr->ai_family, SOCK_STREAM, 0);
+  if (fd==-1) return -1;
+  if (connect(fd, tc->saddr->ai_addr, tc->saddr->ai_addrlen)==-1) {
+    close(fd);
+    return -1;
+  }
+  int one=1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  gnutls_init(session, GNUTLS_CLIENT);
+  gnutls_set_default_priority(*session);
+  gnutls_credentials_set(*session, GNUTLS_CRD_CERTIFICATE, tls_bench_cred);
+  gnutls_transport_set_int(*session, fd);
+  if (tc->sc->http2) {
+    static const gnutls_datum_t h2={(unsigned char*)"h2", 2};
+    gnutls_alpn_set_protocols(*session, &h2, 1, 0);
+  }
+  if (tc->session_data.data) gnutls_session_set_data(*session, tc->session_data.data, tc->session_data.size);
+  int ret;
+  do {
+    ret=gnutls_handshake(*session);
+  } while (ret<0 && !gnutls_error_is_fatal(ret));
+  if (ret<0) {
+    nxweb_log_error("tls handshake failed: %s", gnutls_strerror(ret));
+    gnutls_deinit(*session);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static ssize_t tls_bench_recv(gnutls_session_t session, void* buf, size_t size) {
+  ssize_t n;
+  do { // E_AGAIN comes after post-handshake messages (TLS 1.3 session tickets)
+    n=gnutls_record_recv(session, buf, size);
+  } while (n==GNUTLS_E_AGAIN || n==GNUTLS_E_INTERRUPTED);
+  return n;
+}
+
+static void* tls_bench_conn_main(void* ptr) {
+  tls_bench_conn* tc=ptr;
+  const bench_scenario* sc=tc->sc;
+  char req[1024];
+  int req_len=snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\nUser-Agent: nxweb_bench\r\n%s\r\n",
+                       sc->uri, sc->host, sc->keep_alive && !sc->handshakes? "keep-alive":"close", sc->gzip? "Accept-Encoding: gzip\r\n":"");
+  char buf[BENCH_SCRATCH_SIZE];
+  gnutls_session_t session;
+  int fd=-1;
+  nxe_time_t now;
+  while ((now=nxe_get_time_usec())<tc->measure_end) {
+    nxe_time_t start_time=now;
+    if (fd==-1 && (fd=tls_bench_connect(tc, &session))==-1) {
+      if (now>=tc->measure_start) tc->stats.errors++;
+      usleep(100000);
+      continue;
+    }
+    if (!sc->handshakes) start_time=nxe_get_time_usec();
+    if (gnutls_record_send(session, req, req_len)!=req_len) goto fail;
+    int len=0;
+    char* body=0;
+    while (!body) {
+      if (len>=(int)sizeof(buf)-1) goto fail; // headers too large
+      ssize_t n=tls_bench_recv(session, buf+len, sizeof(buf)-1-len);
+      if (n<=0) goto fail;
+      len+=n;
+      buf[len]='\0';
+      body=strstr(buf, "\r\n\r\n");
+    }
+    *body='\0';
+    body+=4;
+    const char* cl=strcasestr(buf, "\ncontent-length:");
+    if (!cl) goto fail; // chunked responses are not supported here
+    int64_t content_length=atoll(cl+16);
+    int status=atoi(buf+9);
+    _Bool keep_alive=sc->keep_alive && !sc->handshakes && !strcasestr(buf, "\nconnection: close");
+    int64_t bytes=len-(body-buf);
+    while (bytes<content_length) {
+      ssize_t n=tls_bench_recv(session, buf, sizeof(buf));
+      if (n<=0) goto fail;
+      bytes+=n;
+    }
+    now=nxe_get_time_usec();
+    if (start_time>=tc->measure_start && now<=tc->measure_end) {
+      bench_stats* st=&tc->stats;
+      uint64_t lat=now-start_time;
+      st->requests++;
+      st->bytes+=bytes;
+      st->lat_hist[lat_bucket(lat)]++;
+      if (lat>st->lat_max) st->lat_max=lat;
+      if (status<200 || status>=300) st->non_2xx++;
+    }
+    if (!keep_alive) {
+      if (sc->tls_resume) { // TLS 1.3 tickets arrive after handshake, so take session data now
+        gnutls_free(tc->session_data.data);
+        tc->session_data.data=0;
+        gnutls_session_get_data2(session, &tc->session_data);
+      }
+      gnutls_deinit(session);
+      close(fd);
+      fd=-1;
+    }
+    continue;
+
+    fail:
+    now=nxe_get_time_usec();
+    if (now>=tc->measure_start && now<=tc->measure_end) tc->stats.errors++;
+    gnutls_deinit(session);
+    close(fd);
+    fd=-1;
+  }
+  if (fd!=-1) {
+    gnutls_deinit(session);
+    close(fd);
+  }
+  gnutls_free(tc->session_data.data);
+  return 0;
+}
+
+#endif // WITH_SSL
+
+// HTTP/2 scenarios: blocking client thread per connection too; responses are
+// read frame by frame while up to sc->streams requests are kept in flight.
+
+#define H2_BENCH_MAX_STREAMS 256
+#define H2_BENCH_WINDOW 0x7fffffff
+
+typedef struct h2_bench_stream {
+  uint32_t id; // 0 = free slot
+  int status;
+  nxe_time_t start_time;
+  int64_t bytes;
+} h2_bench_stream;
+
+typedef struct h2_bench_conn {
+  pthread_t tid;
+  const bench_scenario* sc;
+  struct addrinfo* saddr;
+  nxe_time_t measure_start;
+  nxe_time_t measure_end;
+  bench_stats stats;
+  int fd;
+#ifdef WITH_SSL
+  gnutls_session_t session;
+#endif // WITH_SSL
+  nxd_hpack_table decoder;
+  h2_bench_stream streams[H2_BENCH_MAX_STREAMS];
+  int in_flight;
+  int max_streams; // SETTINGS_MAX_CONCURRENT_STREAMS of server
+  uint32_t next_id;
+  int64_t unacked; // DATA bytes not yet returned by WINDOW_UPDATE
+} h2_bench_conn;
+
+static int h2_bench_send(h2_bench_conn* hc, const void* data, int size) {
+#ifdef WITH_SSL
+  if (hc->sc->tls) return gnutls_record_send(hc->session, data, size)==size? 0 : -1;
+#endif // WITH_SSL
+  const char* p=data;
+  while (size>0) {
+    ssize_t n=write(hc->fd, p, size);
+    if (n<=0) return -1;
+    p+=n;
+    size-=n;
+  }
+  return 0;
+}
+
+static ssize_t h2_bench_recv(h2_bench_conn* hc, void* buf, size_t size) {
+#ifdef WITH_SSL
+  if (hc->sc->tls) return tls_bench_recv(hc->session, buf, size);
+#endif // WITH_SSL
+  return read(hc->fd, buf, size);
+}
+
+static void h2_bench_disconnect(h2_bench_conn* hc) {
+#ifdef WITH_SSL
+  if (hc->sc->tls) gnutls_deinit(hc->session);
+#endif // WITH_SSL
+  close(hc->fd);
+  hc->fd=-1;
+  nxd_hpack_finalize(&hc->decoder);
+}
+
+static void h2_bench_frame_header(char* p, int len, uint8_t type, uint8_t flags, uint32_t id) {
+  p[0]=(char)(len>>16);
+  p[1]=(char)(len>>8);
+  p[2]=(char)len;
+  p[3]=(char)type;
+  p[4]=(char)flags;
+  p[5]=(char)(id>>24);
+  p[6]=(char)(id>>16);
+  p[7]=(char)(id>>8);
+  p[8]=(char)id;
+}
+
+static char* h2_bench_literal(char* p, int name_idx, const char* value) { // literal without indexing, no huffman
+  int len=strlen(value);
+  *p++=(char)name_idx; // name_idx<15
+  if (len<127) *p++=(char)len;
+  else {
+    *p++=(char)127;
+    len-=127;
+    while (len>=128) {
+      *p++=(char)(len%128+128);
+      len/=128;
+    }
+    *p++=(char)len;
+    len=strlen(value);
+  }
+  memcpy(p, value, len);
+  return p+len;
+}
+
+static int h2_bench_connect(h2_bench_conn* hc) {
+#ifdef WITH_SSL
+  if (hc->sc->tls) {
+    tls_bench_conn tc={.sc=hc->sc, .saddr=hc->saddr};
+    hc->fd=tls_bench_connect(&tc, &hc->session);
+    if (hc->fd==-1) return -1;
+    gnutls_datum_t proto;
+    if (gnutls_alpn_get_selected_protocol(hc->session, &proto) || proto.size!=2 || memcmp(proto.data, "h2", 2)) {
+      nxweb_log_error("server did not select h2 via ALPN");
+      gnutls_deinit(hc->session);
+      close(hc->fd);
+      hc->fd=-1;
+      return -1;
+    }
+  }
+  else
+#endif // WITH_SSL
+  {
+    hc->fd=socket(hc->saddr->ai_family, SOCK_STREAM, 0);
+    if (hc->fd==-1) return -1;
+    if (connect(hc->fd, hc->saddr->ai_addr, hc->saddr->ai_addrlen)==-1) {
+      close(hc->fd);
+      hc->fd=-1;
+      return -1;
+    }
+    int one=1;
+    setsockopt(hc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  nxd_hpack_init(&hc->decoder, 4096);
+  memset(hc->streams, 0, sizeof(hc->streams));
+  hc->in_flight=0;
+  hc->max_streams=H2_BENCH_MAX_STREAMS;
+  hc->next_id=1;
+  hc->unacked=0;
+  // preface, SETTINGS(ENABLE_PUSH=0, INITIAL_WINDOW_SIZE=max), connection WINDOW_UPDATE
+  char buf[24+9+12+9+4];
+  char* p=buf;
+  memcpy(p, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+  p+=24;
+  h2_bench_frame_header(p, 12, 4, 0, 0);
+  p+=9;
+  memcpy(p, "\x00\x02\x00\x00\x00\x00\x00\x04\x7f\xff\xff\xff", 12);
+  p+=12;
+  h2_bench_frame_header(p, 4, 8, 0, 0);
+  p+=9;
+  uint32_t increment=H2_BENCH_WINDOW-65535;
+  p[0]=(char)(increment>>24);
+  p[1]=(char)(increment>>16);
+  p[2]=(char)(increment>>8);
+  p[3]=(char)increment;
+  p+=4;
+  if (h2_bench_send(hc, buf, p-buf)) {
+    h2_bench_disconnect(hc);
+    return -1;
+  }
+  return 0;
+}
+
+static void h2_bench_stream_done(h2_bench_conn* hc, h2_bench_stream* hs, nxe_time_t now) {
+  if (hs->start_time>=hc->measure_start && now<=hc->measure_end) {
+    bench_stats* st=&hc->stats;
+    uint64_t lat=now-hs->start_time;
+    st->requests++;
+    st->bytes+=hs->bytes;
+    st->lat_hist[lat_bucket(lat)]++;
+    if (lat>st->lat_max) st->lat_max=lat;
+    if (hs->status<200 || hs->status>=300) st->non_2xx++;
+  }
+  hs->id=0;
+  hc->in_flight--;
+}
+
+static h2_bench_stream* h2_bench_find_stream(h2_bench_conn* hc, uint32_t id) {
+  if (!id) return 0;
+  h2_bench_stream* hs=&hc->streams[(id>>1)%H2_BENCH_MAX_STREAMS]; // ids are odd & sequential
+  return hs->id==id? hs : 0;
+}
+
+// returns -1 on connection failure
+static int h2_bench_process_frame(h2_bench_conn* hc, uint8_t type, uint8_t flags, uint32_t id, const char* payload, int len, nxb_buffer* nxb) {
+  h2_bench_stream* hs=h2_bench_find_stream(hc, id);
+  char out[9+8];
+  switch (type) {
+    case 0: // DATA
+      if (hs) hs->bytes+=len-(flags&0x8? (uint8_t)payload[0]+1 : 0);
+      hc->unacked+=len;
+      if (hc->unacked>=H2_BENCH_WINDOW/2) {
+        h2_bench_frame_header(out, 4, 8, 0, 0);
+        out[9]=(char)(hc->unacked>>24);
+        out[10]=(char)(hc->unacked>>16);
+        out[11]=(char)(hc->unacked>>8);
+        out[12]=(char)hc->unacked;
+        hc->unacked=0;
+        if (h2_bench_send(hc, out, 13)) return -1;
+      }
+      break;
+    case 1: { // HEADERS; server never splits small response headers into CONTINUATION here
+      if (!(flags&0x4)) return -1;
+      if (flags&0x8) {
+        int pad=(uint8_t)*payload++;
+        len-=pad+1;
+      }
+      if (flags&0x20) {
+        payload+=5;
+        len-=5;
+      }
+      nxweb_http_header* headers;
+      int r=nxd_hpack_decode(&hc->decoder, payload, len, nxb, 65536, &headers);
+      if (!r && hs && !hs->status && headers && !strcmp(headers->name, ":status")) hs->status=atoi(headers->value);
+      nxb_empty(nxb);
+      if (r) return -1;
+      break;
+    }
+    case 3: // RST_STREAM
+      if (hs) {
+        if (hc->measure_start<=nxe_get_time_usec()) hc->stats.errors++;
+        hs->id=0;
+        hc->in_flight--;
+      }
+      return 0;
+    case 4: // SETTINGS
+      if (flags&0x1) break;
+      int i;
+      for (i=0; i+6<=len; i+=6) {
+        if (payload[i]==0 && payload[i+1]==3) { // MAX_CONCURRENT_STREAMS
+          uint32_t v=(uint32_t)(uint8_t)payload[i+2]<<24 | (uint32_t)(uint8_t)payload[i+3]<<16 | (uint32_t)(uint8_t)payload[i+4]<<8 | (uint8_t)payload[i+5];
+          hc->max_streams=v<H2_BENCH_MAX_STREAMS? v : H2_BENCH_MAX_STREAMS;
+        }
+      }
+      h2_bench_frame_header(out, 0, 4, 0x1, 0);
+      if (h2_bench_send(hc, out, 9)) return -1;
+      break;
+    case 6: // PING
+      if (flags&0x1 || len!=8) break;
+      h2_bench_frame_header(out, 8, 6, 0x1, 0);
+      memcpy(out+9, payload, 8);
+      if (h2_bench_send(hc, out, 17)) return -1;
+      break;
+    case 7: // GOAWAY
+      return -1;
+  }
+  if (hs && (type==0 || type==1) && (flags&0x1)) h2_bench_stream_done(hc, hs, nxe_get_time_usec());
+  return 0;
+}
+
+static void* h2_bench_conn_main(void* ptr) {
+  h2_bench_conn* hc=ptr;
+  const bench_scenario* sc=hc->sc;
+  // request header block; only :path varies between requests
+  char req[1024+9];
+  char* p=req+9;
+  *p++=(char)0x82; // :method: GET
+  *p++=(char)(sc->tls? 0x87 : 0x86); // :scheme
+  p=h2_bench_literal(p, 4, sc->uri); // :path
+  p=h2_bench_literal(p, 1, sc->host); // :authority
+  if (sc->gzip) *p++=(char)0x90; // accept-encoding: gzip, deflate
+  int req_len=p-req;
+  char buf[BENCH_SCRATCH_SIZE];
+  nxb_buffer* nxb=nxb_create(4096); // decoded response headers
+  int len=0;
+  nxe_time_t now;
+  hc->fd=-1;
+  while ((now=nxe_get_time_usec())<hc->measure_end) {
+    if (hc->fd==-1) {
+      if (h2_bench_connect(hc)) {
+        if (now>=hc->measure_start) hc->stats.errors++;
+        usleep(100000);
+        continue;
+      }
+      len=0;
+    }
+    int limit=sc->streams<hc->max_streams? sc->streams : hc->max_streams;
+    while (hc->in_flight<limit && hc->next_id<0x7fffffff) {
+      h2_bench_stream* hs=&hc->streams[(hc->next_id>>1)%H2_BENCH_MAX_STREAMS];
+      if (hs->id) break; // slot still busy with older stream
+      hs->id=hc->next_id;
+      hs->status=0;
+      hs->bytes=0;
+      hs->start_time=nxe_get_time_usec();
+      h2_bench_frame_header(req, req_len-9, 1, 0x5, hc->next_id); // END_STREAM|END_HEADERS
+      if (h2_bench_send(hc, req, req_len)) goto fail;
+      hc->next_id+=2;
+      hc->in_flight++;
+    }
+    if (hc->next_id>=0x7fffffff && !hc->in_flight) { // stream ids exhausted
+      h2_bench_disconnect(hc);
+      continue;
+    }
+    ssize_t n=h2_bench_recv(hc, buf+len, sizeof(buf)-len);
+    if (n<=0) goto fail;
+    len+=n;
+    char* fp=buf;
+    while (len-(fp-buf)>=9) {
+      int flen=(uint8_t)fp[0]<<16 | (uint8_t)fp[1]<<8 | (uint8_t)fp[2];
+      if (flen>(int)sizeof(buf)-9) goto fail;
+      if (len-(fp-buf)<9+flen) break;
+      uint32_t id=((uint32_t)(uint8_t)fp[5]<<24 | (uint32_t)(uint8_t)fp[6]<<16 | (uint32_t)(uint8_t)fp[7]<<8 | (uint8_t)fp[8])&0x7fffffff;
+      if (h2_bench_process_frame(hc, (uint8_t)fp[3], (uint8_t)fp[4], id, fp+9, flen, nxb)) goto fail;
+      fp+=9+flen;
+    }
+    len-=fp-buf;
+    if (len && fp!=buf) memmove(buf, fp, len);
+    continue;
+
+    fail:
+    now=nxe_get_time_usec();
+    if (now>=hc->measure_start && now<=hc->measure_end) hc->stats.errors++;
+    h2_bench_disconnect(hc);
+  }
+  if (hc->fd!=-1) h2_bench_disconnect(hc);
+  nxb_destroy(nxb);
+  return 0;
+}
+
+static int create_fixture(const bench_scenario* sc) {
+  struct stat st;
+  if (!stat(sc->fixture_path, &st) && st.st_size==sc->fixture_size) return 0;
+  char* dir=strdup(sc->fixture_path);
+  char* p=strrchr(dir, '/');
+  if (p) {
+    *p='\0';
+    mkdir(dir, 0755);
+  }
+  free(dir);
+  int fd=open(sc->fixture_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd==-1) {
+    nxweb_log_error("can't create fixture file %s", sc->fixture_path);
+    return -1;
+  }
+  char buf[4096];
+  long i, remaining=sc->fixture_size;
+  for (i=0; i<(long)sizeof(buf); i++) buf[i]='a'+(i%26);
+  while (remaining>0) {
+    ssize_t n=write(fd, buf, remaining<(long)sizeof(buf)? (size_t)remaining : sizeof(buf));
+    if (n<=0) {
+      nxweb_log_error("can't write fixture file %s", sc->fixture_path);
+      close(fd);
+      return -1;
+    }
+    remaining-=n;
+  }
+  close(fd);
+  return 0;
+}
+
+static void add_stats(bench_stats* total, const bench_stats* st) {
+  total->requests+=st->requests;
+  total->errors+=st->errors;
+  total->non_2xx+=st->non_2xx;
+  total->bytes+=st->bytes;
+  if (st->lat_max>total->lat_max) total->lat_max=st->lat_max;
+  int j;
+  for (j=0; j<LAT_BUCKETS; j++) total->lat_hist[j]+=st->lat_hist[j];
+}
+
+static int run_scenario(const bench_scenario* sc) {
+  if (sc->fixture_path && create_fixture(sc)) return -1;
+
+  const char* server=sc->server? sc->server : target_host_and_port;
+  struct addrinfo* saddr=_nxweb_resolve_host(server, 0);
+  if (!saddr) {
+    nxweb_log_error("can't resolve %s", server);
+    return -1;
+  }
+
+  static bench_stats total;
+  memset(&total, 0, sizeof(total));
+  int i, num_threads;
+
+#ifdef WITH_SSL
+  // background handshake storm runs for warmup+duration of the scenario
+  bench_scenario storm={.name="storm", .uri=sc->uri, .server=sc->storm_server, .host=sc->storm_server,
+                        .connections=sc->storm_connections, .tls=1, .handshakes=1};
+  struct addrinfo* storm_saddr=0;
+  tls_bench_conn* storm_conns=0;
+  if (sc->storm_server && sc->storm_connections>0) {
+    storm_saddr=_nxweb_resolve_host(sc->storm_server, 0);
+    if (!storm_saddr) {
+      nxweb_log_error("can't resolve %s", sc->storm_server);
+      freeaddrinfo(saddr);
+      return -1;
+    }
+    storm_conns=nx_calloc(sizeof(tls_bench_conn)*storm.connections);
+    nxe_time_t measure_start=nxe_get_time_usec()+(nxe_time_t)sc->warmup*1000000;
+    for (i=0; i<storm.connections; i++) {
+      tls_bench_conn* tc=&storm_conns[i];
+      tc->sc=&storm;
+      tc->saddr=storm_saddr;
+      tc->measure_start=measure_start;
+      tc->measure_end=measure_start+(nxe_time_t)sc->duration*1000000;
+      pthread_create(&tc->tid, 0, tls_bench_conn_main, tc);
+    }
+  }
+#endif // WITH_SSL
+
+  if (sc->http2) {
+    num_threads=sc->connections;
+    h2_bench_conn* conns=nx_calloc(sizeof(h2_bench_conn)*num_threads);
+    nxe_time_t measure_start=nxe_get_time_usec()+(nxe_time_t)sc->warmup*1000000;
+    for (i=0; i<num_threads; i++) {
+      h2_bench_conn* hc=&conns[i];
+      hc->sc=sc;
+      hc->saddr=saddr;
+      hc->measure_start=measure_start;
+      hc->measure_end=measure_start+(nxe_time_t)sc->duration*1000000;
+      pthread_create(&hc->tid, 0, h2_bench_conn_main, hc);
+    }
+    for (i=0; i<num_threads; i++) {
+      pthread_join(conns[i].tid, 0);
+      add_stats(&total, &conns[i].stats);
+    }
+    nx_free(conns);
+  }
+  else if (sc->tls) {
+#ifdef WITH_SSL
+    num_threads=sc->connections;
+    tls_bench_conn* conns=nx_calloc(sizeof(tls_bench_conn)*num_threads);
+    nxe_time_t measure_start=nxe_get_time_usec()+(nxe_time_t)sc->warmup*1000000;
+    for (i=0; i<num_threads; i++) {
+      tls_bench_conn* tc=&conns[i];
+      tc->sc=sc;
+      tc->saddr=saddr;
+      tc->measure_start=measure_start;
+      tc->measure_end=measure_start+(nxe_time_t)sc->duration*1000000;
+      pthread_create(&tc->tid, 0, tls_bench_conn_main, tc);
+    }
+    for (i=0; i<num_threads; i++) {
+      pthread_join(conns[i].tid, 0);
+      add_stats(&total, &conns[i].stats);
+    }
+    nx_free(conns);
+#else
+    nxweb_log_error("scenario %s requires TLS; nxweb_bench built without SSL support", sc->name);
+    freeaddrinfo(saddr);
+    return -1;
+#endif // WITH_SSL
+  }
+  else {
+    num_threads=sc->threads;
+    if (num_threads<1) num_threads=1;
+    if (num_threads>BENCH_MAX_THREADS) num_threads=BENCH_MAX_THREADS;
+    if (num_threads>sc->connections) num_threads=sc->connections;
+
+    static bench_thread threads[BENCH_MAX_THREADS];
+    for (i=0; i<num_threads; i++) {
+      bench_thread* bt=&threads[i];
+      memset(bt, 0, sizeof(bench_thread));
+      bt->num=i;
+      bt->sc=sc;
+      bt->saddr=saddr;
+      bt->num_conns=sc->connections/num_threads+(i<sc->connections%num_threads? 1:0);
+      pthread_create(&bt->tid, 0, bench_thread_main, bt);
+    }
+    for (i=0; i<num_threads; i++) {
+      pthread_join(threads[i].tid, 0);
+      add_stats(&total, &threads[i].stats);
+    }
+  }
+  freeaddrinfo(saddr);
+
+  double secs=sc->duration>0? sc->duration : 1;
+#ifdef WITH_SSL
+  static bench_stats storm_total;
+  if (storm_conns) {
+    memset(&storm_total, 0, sizeof(storm_total));
+    for (i=0; i<storm.connections; i++) {
+      pthread_join(storm_conns[i].tid, 0);
+      add_stats(&storm_total, &storm_conns[i].stats);
+    }
+    nx_free(storm_conns);
+    freeaddrinfo(storm_saddr);
+  }
+#endif // WITH_SSL
+  printf("%-20s c=%-4d t=%-2d %-5s %-4s %10.0f req/s %9.2f MB/s  lat(us) p50=%-6lu p90=%-6lu p99=%-6lu p99.9=%-7lu max=%-7lu  req=%lu err=%lu non2xx=%lu\n",
+         sc->name, sc->connections, num_threads, sc->http2? "h2" : sc->handshakes? (sc->tls_resume? "hs+rs":"hs") : sc->keep_alive? "ka":"close",
+         sc->tls? (sc->gzip? "tls+gzip":"tls") : (sc->gzip? "gzip":"-"),
+         total.requests/secs, total.bytes/secs/1048576.,
+         (unsigned long)lat_percentile(&total, 50), (unsigned long)lat_percentile(&total, 90),
+         (unsigned long)lat_percentile(&total, 99), (unsigned long)lat_percentile(&total, 99.9),
+         (unsigned long)total.lat_max,
+         (unsigned long)total.requests, (unsigned long)total.errors, (unsigned long)total.non_2xx);
+#ifdef WITH_SSL
+  if (storm_conns) {
+    printf("  + storm c=%-4d %-13s %10.0f handshakes/s  lat(us) p50=%-6lu p99=%-6lu  err=%lu\n",
+           storm.connections, storm.server, storm_total.requests/secs,
+           (unsigned long)lat_percentile(&storm_total, 50), (unsigned long)lat_percentile(&storm_total, 99),
+           (unsigned long)storm_total.errors);
+  }
+#endif // WITH_SSL
+  fflush(stdout);
+  return 0;
+}
+
+// Stub backend: answers every request with a fixed keep-alive response.
+
+static const char stub_response[]="HTTP/1.1 200 OK\r\n"
+  "Content-Type: text/html\r\n"
+  "Content-Length: 31\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n"
+  "<p>nxweb_bench stub backend</p>";
+
+typedef struct stub_conn {
+  int fd;
+  int matched; // number of chars of "\r\n\r\n" matched so far
+} stub_conn;
+
+static void* stub_backend_main(void* ptr) {
+  int listen_fd=(int)(intptr_t)ptr;
+  int efd=epoll_create1(0);
+  struct epoll_event ev={.events=EPOLLIN, .data.ptr=0};
+  epoll_ctl(efd, EPOLL_CTL_ADD, listen_fd, &ev);
+  struct epoll_event events[64];
+  char buf[16384];
+  for (;;) {
+    int n=epoll_wait(efd, events, 64, -1);
+    int i;
+    for (i=0; i<n; i++) {
+      stub_conn* sc=events[i].data.ptr;
+      if (!sc) {
+        int fd;
+        while ((fd=accept4(listen_fd, 0, 0, SOCK_NONBLOCK))!=-1) {
+          _nxweb_setup_client_socket(fd);
+          sc=calloc(1, sizeof(stub_conn));
+          sc->fd=fd;
+          struct epoll_event cev={.events=EPOLLIN, .data.ptr=sc};
+          epoll_ctl(efd, EPOLL_CTL_ADD, fd, &cev);
+        }
+        continue;
+      }
+      ssize_t len;
+      int responses=0;
+      while ((len=read(sc->fd, buf, sizeof(buf)))>0) {
+        // count request terminators; request bodies are not expected
+        ssize_t j;
+        for (j=0; j<len; j++) {
+          if (buf[j]==("\r\n\r\n")[sc->matched]) {
+            if (++sc->matched==4) {
+              responses++;
+              sc->matched=0;
+            }
+          }
+          else {
+            sc->matched=buf[j]=='\r'? 1 : 0;
+          }
+        }
+      }
+      while (responses-- > 0) {
+        if (write(sc->fd, stub_response, sizeof(stub_response)-1)!=sizeof(stub_response)-1) {
+          len=0;
+          break;
+        }
+      }
+      if (len==0 || (len<0 && errno!=EAGAIN)) {
+        close(sc->fd); // also removes it from epoll set
+        free(sc);
+      }
+    }
+  }
+  return 0;
+}
+
+static int start_stub_backend(const char* host_and_port) {
+  int listen_fd=_nxweb_bind_socket(host_and_port, 1024);
+  if (listen_fd==-1) return -1;
+  pthread_t tid;
+  if (pthread_create(&tid, 0, stub_backend_main, (void*)(intptr_t)listen_fd)) return -1;
+  pthread_detach(tid);
+  nxweb_log_info("stub backend listening on %s", host_and_port);
+  return 0;
+}
+
+static const nx_json* load_scenarios_file(const char* filename) {
+  struct stat st;
+  if (stat(filename, &st)==-1) {
+    nxweb_log_error("can't find scenarios file %s", filename);
+    return 0;
+  }
+  int fd=open(filename, O_RDONLY);
+  if (fd==-1) {
+    nxweb_log_error("can't open scenarios file %s", filename);
+    return 0;
+  }
+  char* text=malloc((size_t)(st.st_size+1)); // this is not going to be freed
+  if (st.st_size!=read(fd, text, (size_t)st.st_size)) {
+    nxweb_log_error("can't read scenarios file %s", filename);
+    close(fd);
+    return 0;
+  }
+  close(fd);
+  text[st.st_size]='\0';
+  const nx_json* json=nx_json_parse(text, 0);
+  if (!json) nxweb_log_error("can't parse scenarios file %s", filename);
+  return json;
+}
+
+static int json_int(const nx_json* js, const char* key, int def) {
+  const nx_json* v=nx_json_get(js, key);
+  return v->type==NX_JSON_INTEGER || v->type==NX_JSON_BOOL? (int)v->int_value : def;
+}
+
+static const char* json_str(const nx_json* js, const char* key, const char* def) {
+  const nx_json* v=nx_json_get(js, key);
+  return v->type==NX_JSON_STRING? v->text_value : def;
+}
+
+static _Bool name_selected(const char* names, const char* name) {
+  if (!names) return 1;
+  int len=strlen(name);
+  const char* p=names;
+  while ((p=strstr(p, name))) {
+    if ((p==names || p[-1]==',') && (p[len]=='\0' || p[len]==',')) return 1;
+    p+=len;
+  }
+  return 0;
+}
+
+// Allocator benchmark: mix of sizes seen on request path
+// (log blocks, nxb chunks, file reader buffers, gzip state/buffers, cache records).
+
+#define ALLOC_BENCH_BATCH 256
+#define ALLOC_BENCH_ROUNDS 4000
+
+static const size_t alloc_bench_sizes[]={48, 64, 96, 200, 512, 1024, 2048, 4096, 5824, 8192, 16384, 32768};
+#define ALLOC_BENCH_NUM_SIZES (sizeof(alloc_bench_sizes)/sizeof(alloc_bench_sizes[0]))
+
+typedef struct alloc_bench_thread {
+  pthread_t tid;
+  int num;
+  int num_threads;
+  _Bool use_memalign;
+  _Bool cross_thread;
+  void* slots[ALLOC_BENCH_BATCH];
+} alloc_bench_thread;
+
+static alloc_bench_thread alloc_bench_threads[BENCH_MAX_THREADS];
+static pthread_barrier_t alloc_bench_barrier;
+
+static inline void* alloc_bench_alloc(_Bool use_memalign, size_t size) {
+  if (use_memalign) return memalign(MEM_GUARD, size+MEM_GUARD); // pre-slab nx_alloc()
+  return nx_alloc(size);
+}
+
+static inline void alloc_bench_free(_Bool use_memalign, void* ptr) {
+  if (use_memalign) free(ptr);
+  else nx_free(ptr);
+}
+
+static void* alloc_bench_thread_main(void* ptr) {
+  alloc_bench_thread* at=ptr;
+  unsigned seed=at->num*7919+1;
+  int r, i;
+  for (r=0; r<ALLOC_BENCH_ROUNDS; r++) {
+    for (i=0; i<ALLOC_BENCH_BATCH; i++) {
+      seed=seed*1103515245+12345;
+      size_t size=alloc_bench_sizes[(seed>>16)%ALLOC_BENCH_NUM_SIZES];
+      char* p=alloc_bench_alloc(at->use_memalign, size);
+      p[0]=p[size-1]=(char)i; // touch
+      at->slots[i]=p;
+    }
+    alloc_bench_thread* ft=at;
+    if (at->cross_thread) {
+      // free objects allocated by neighbour thread (like worker -> net thread handoff)
+      pthread_barrier_wait(&alloc_bench_barrier);
+      ft=&alloc_bench_threads[(at->num+1)%at->num_threads];
+    }
+    for (i=ALLOC_BENCH_BATCH-1; i>=0; i--) alloc_bench_free(at->use_memalign, ft->slots[i]);
+    if (at->cross_thread) pthread_barrier_wait(&alloc_bench_barrier);
+  }
+  return 0;
+}
+
+static void run_alloc_bench(int num_threads, _Bool use_memalign, _Bool cross_thread) {
+  if (num_threads<1) num_threads=1;
+  if (num_threads>BENCH_MAX_THREADS) num_threads=BENCH_MAX_THREADS;
+  pthread_barrier_init(&alloc_bench_barrier, 0, num_threads);
+  nxe_time_t start=nxe_get_time_usec();
+  int i;
+  for (i=0; i<num_threads; i++) {
+    alloc_bench_thread* at=&alloc_bench_threads[i];
+    at->num=i;
+    at->num_threads=num_threads;
+    at->use_memalign=use_memalign;
+    at->cross_thread=cross_thread;
+    pthread_create(&at->tid, 0, alloc_bench_thread_main, at);
+  }
+  for (i=0; i<num_threads; i++) pthread_join(alloc_bench_threads[i].tid, 0);
+  nxe_time_t elapsed=nxe_get_time_usec()-start;
+  pthread_barrier_destroy(&alloc_bench_barrier);
+  double allocs=(double)num_threads*ALLOC_BENCH_ROUNDS*ALLOC_BENCH_BATCH;
+#ifdef WITH_SLAB_ALLOC
+  const char* impl=use_memalign? "memalign" : "nx_alloc(slab)";
+#else
+  const char* impl=use_memalign? "memalign" : "nx_alloc(memalign)";
+#endif
+  printf("%-20s t=%-2d %-5s %12.0f allocs/s  %8.1f ns/alloc+free\n",
+         impl, num_threads, cross_thread? "cross":"local",
+         allocs*1000000./elapsed, elapsed*1000.*num_threads/allocs);
+  fflush(stdout);
+}
+
+// Template engine benchmark: child template overriding every block of its layout.
+
+static nxt_file* tpl_bench_pending_file;
+
+static int tpl_bench_load(nxt_context* ctx, const char* uri, nxt_file* dst_file, nxt_block* dst_block) {
+  if (!dst_file) return -1; // no includes in generated templates
+  tpl_bench_pending_file=dst_file;
+  return 0;
+}
+
+static void run_template_bench(int num_blocks) {
+  nxb_buffer* gen=nxb_create(4096);
+  int i;
+  for (i=0; i<num_blocks; i++) {
+    nxb_printf(gen, "<div>{%% block b%d %%}layout %d{%% endblock %%}</div>\n", i, i);
+  }
+  int layout_len;
+  char* layout=nxb_finish_stream(gen, &layout_len);
+  nxb_append_str(gen, "{% extends \"layout.thtml\" %}\n");
+  for (i=0; i<num_blocks; i++) {
+    nxb_printf(gen, "{%% block b%d %%}page %d {%% parent %%}{%% endblock %%}\n", i, i);
+  }
+  int page_len;
+  char* page=nxb_finish_stream(gen, &page_len);
+
+  // parser modifies its input => work on copies
+  char* layout_copy=malloc(layout_len);
+  char* page_copy=malloc(page_len);
+  nxb_buffer* nxb=nxb_create(65536);
+  nxt_context ctx;
+  int iterations=200000/num_blocks;
+  if (iterations<50) iterations=50;
+  int n, result_len=0;
+  nxe_time_t start=nxe_get_time_usec();
+  for (n=0; n<iterations; n++) {
+    nxb_empty(nxb);
+    memcpy(layout_copy, layout, layout_len);
+    memcpy(page_copy, page, page_len);
+    tpl_bench_pending_file=0;
+    nxt_init(&ctx, nxb, tpl_bench_load, (nxe_data)0);
+    nxt_parse(&ctx, "/page.thtml", page_copy, page_len);
+    if (tpl_bench_pending_file) nxt_parse_file(tpl_bench_pending_file, layout_copy, layout_len);
+    nxt_merge(&ctx);
+  }
+  nxe_time_t elapsed=nxe_get_time_usec()-start;
+  if (!ctx.error && nxt_is_complete(&ctx)) {
+    char* result=nxt_serialize(&ctx);
+    result_len=strlen(result);
+  }
+  printf("templates blocks=%-5d %8d iterations  %10.1f us/parse+merge  output=%d bytes%s\n",
+         num_blocks, iterations, (double)elapsed/iterations, result_len, ctx.error? " (ERROR)":"");
+  fflush(stdout);
+  nxb_destroy(nxb);
+  nxb_destroy(gen);
+  free(layout_copy);
+  free(page_copy);
+}
+
+// Request dispatch benchmark: linear handler_list scan vs compiled router.
+// Routes mix global prefixes, exact vhosts and wildcard vhosts, as in multi-site configs.
+
+static nxweb_handler* dispatch_bench_linear(nxweb_handler* list, const char* host, int host_len, const char* uri, int uri_len) {
+  nxweb_handler* h;
+  for (h=list; h; h=h->next) {
+    if (h->vhost_len && !(host_len && nxweb_vhost_match(host, host_len, h->vhost, h->vhost_len))) continue;
+    if (h->prefix_len && !nxweb_url_prefix_match(uri, uri_len, h->prefix, h->prefix_len)) continue;
+    return h;
+  }
+  return 0;
+}
+
+static void run_dispatch_bench(int num_routes) {
+  nxb_buffer* nxb=nxb_create(65536);
+  nxweb_handler* handlers=calloc(num_routes+1, sizeof(nxweb_handler));
+  char buf[64];
+  int i;
+  for (i=0; i<num_routes; i++) {
+    nxweb_handler* h=&handlers[i];
+    switch (i%4) {
+      case 0:
+      case 1:
+        snprintf(buf, sizeof(buf), "/api/v%d/res%d", i%3+1, i);
+        break;
+      case 2:
+        h->vhost=nxb_copy_str(nxb, (snprintf(buf, sizeof(buf), "host%d.example.com", i), buf));
+        snprintf(buf, sizeof(buf), "/p%d", i);
+        break;
+      case 3:
+        h->vhost=nxb_copy_str(nxb, (snprintf(buf, sizeof(buf), ".site%d.com", i), buf));
+        snprintf(buf, sizeof(buf), "/w/%d", i);
+        break;
+    }
+    h->prefix=nxb_copy_str(nxb, buf);
+    h->prefix_len=strlen(h->prefix);
+    h->vhost_len=h->vhost? strlen(h->vhost) : 0;
+    h->next=h+1;
+  }
+  handlers[num_routes].next=0; // catch-all last, like static files handler
+
+  #define DISPATCH_BENCH_REQUESTS 64
+  const char* hosts[DISPATCH_BENCH_REQUESTS];
+  const char* uris[DISPATCH_BENCH_REQUESTS];
+  int host_lens[DISPATCH_BENCH_REQUESTS];
+  int uri_lens[DISPATCH_BENCH_REQUESTS];
+  for (i=0; i<DISPATCH_BENCH_REQUESTS; i++) {
+    nxweb_handler* h=&handlers[(i*2654435761u)%num_routes]; // spread over routes
+    if (i%8==7) { // miss => falls through to catch-all
+      hosts[i]="www.example.org";
+      uris[i]="/index.html";
+    }
+    else if (!h->vhost) {
+      hosts[i]="www.example.org";
+      uris[i]=nxb_copy_str(nxb, (snprintf(buf, sizeof(buf), "%s/item?id=%d", h->prefix, i), buf));
+    }
+    else {
+      hosts[i]=*h->vhost=='.'? nxb_copy_str(nxb, (snprintf(buf, sizeof(buf), "www%s", h->vhost), buf)) : h->vhost;
+      uris[i]=nxb_copy_str(nxb, (snprintf(buf, sizeof(buf), "%s/x", h->prefix), buf));
+    }
+    host_lens[i]=strlen(hosts[i]);
+    uri_lens[i]=strlen(uris[i]);
+  }
+
+  nxweb_router* router=_nxweb_router_create(handlers);
+  nxweb_route_match m;
+  int n, mismatches=0;
+  for (i=0; i<DISPATCH_BENCH_REQUESTS; i++) {
+    _nxweb_router_match(router, &m, hosts[i], host_lens[i], uris[i], uri_lens[i]);
+    if (_nxweb_router_next(&m, 0)!=dispatch_bench_linear(handlers, hosts[i], host_lens[i], uris[i], uri_lens[i])) mismatches++;
+  }
+  int iterations=20000000/(num_routes+DISPATCH_BENCH_REQUESTS);
+  volatile uintptr_t sink=0;
+  nxe_time_t start=nxe_get_time_usec();
+  for (n=0; n<iterations; n++) {
+    for (i=0; i<DISPATCH_BENCH_REQUESTS; i++) sink+=(uintptr_t)dispatch_bench_linear(handlers, hosts[i], host_lens[i], uris[i], uri_lens[i]);
+  }
+  nxe_time_t linear_elapsed=nxe_get_time_usec()-start;
+  start=nxe_get_time_usec();
+  for (n=0; n<iterations; n++) {
+    for (i=0; i<DISPATCH_BENCH_REQUESTS; i++) {
+      _nxweb_router_match(router, &m, hosts[i], host_lens[i], uris[i], uri_lens[i]);
+      sink+=(uintptr_t)_nxweb_router_next(&m, 0);
+    }
+  }
+  nxe_time_t router_elapsed=nxe_get_time_usec()-start;
+  double requests=(double)iterations*DISPATCH_BENCH_REQUESTS;
+  printf("dispatch routes=%-5d linear %8.1f ns/request  router %6.1f ns/request%s\n",
+         num_routes, linear_elapsed*1000./requests, router_elapsed*1000./requests, mismatches? "  (MISMATCH)" : "");
+  fflush(stdout);
+  _nxweb_router_free(router);
+  free(handlers);
+  nxb_destroy(nxb);
+}
+
+// Query string benchmark: eager parse into nx_simple_map list (previous implementation)
+// vs lazy index, reading two parameters out of long tracking query strings.
+
+static const char* query_bench_uris[]={
+  "/landing?utm_source=google&utm_medium=cpc&utm_campaign=spring_sale_2024_brand_exact&utm_term=running%20shoes&utm_content=ad_variant_b"
+    "&gclid=Cj0KCQjwn7mwBhCiARIsAGoxjaI5mJ8q3Vx2zN0L4b7dYtQwRk9c0oHfE1pMZs6uPZ3Tz8YwQy2aAk8xEALw_wcB&gad_source=1&id=48213&lang=en",
+  "/p/item-1731?fbclid=IwAR2F4oq7pKm0x6T9yJ3c8uWQbZr1sH5dNvLe0aXgMiYkUjOp4tBfRn7wCzEs_aem_AbCdEfGhIjKlMnOpQrStUvWxYz0123456789"
+    "&utm_source=facebook&utm_medium=paid_social&utm_campaign=retargeting_q2&utm_content=carousel_3&id=1731&ref=fb_ad",
+  "/news/article?id=90817&mc_cid=4f2a9c81e7&mc_eid=b3d17a0c5e&utm_source=newsletter&utm_medium=email&utm_campaign=weekly_digest_2024_05_13"
+    "&_hsenc=p2ANqtz-8yTb0N3kfL1vXhQmR7c2ZsWp9aJdE4uGiKoYtBnC6MxV5lSeA_hsmi=301245678&lang=de&page=2",
+  "/search?q=nxweb+http+server+benchmark&source=hp&ei=Xy9kZc2nHIqG9u8PjLKg2Ag&iflsig=AO6bgOgAAAAAZWR3b6J0&oq=nxweb+http"
+    "&gs_lp=Egdnd3Mtd2l6IhJueHdlYiBodHRwIHNlcnZlcjIFEAAYgAQyBhAAGBYYHjIGEAAYFhge&sclient=gws-wiz&id=7&lang=en",
+  "/cart?id=5523&lang=fr&session=9a8b7c6d5e4f3a2b1c0d&affiliate_id=AFF-00231&sub_id=camp%2F2024%2Fbanner&click_id=e5f6a7b8-c9d0-1234-5678-9abcdef01234"
+    "&_ga=2.148374928.1738291234.1715612345-1029384756.1715612345&_gl=1*1x2y3z4*_ga*MTAyOTM4NDc1Ni4xNzE1NjEyMzQ1",
+  "/?id=1&lang=en"
+};
+#define QUERY_BENCH_URIS (sizeof(query_bench_uris)/sizeof(query_bench_uris[0]))
+
+static const char* query_bench_eager(nxb_buffer* nxb, const char* uri, const char** lang) {
+  nx_simple_map_entry* map=0;
+  char *name, *value, *next;
+  char* query_string=strchr(uri, '?');
+  if (query_string) query_string=nxb_copy_str(nxb, query_string+1); // NXWEB_PRESERVE_URI
+  for (name=query_string; name; name=next) {
+    next=strchr(name, '&');
+    if (next) *next++='\0';
+    value=strchr(name, '=');
+    if (value) *value++='\0';
+    else value=name+strlen(name);
+    if (*name) {
+      nxweb_url_decode(name, 0);
+      name=nxweb_trunc_space(name);
+      nxweb_url_decode(value, 0);
+      nx_simple_map_entry* param=nxb_calloc_obj(nxb, sizeof(nx_simple_map_entry));
+      param->name=name;
+      param->value=value;
+      map=nx_simple_map_add(map, param);
+    }
+  }
+  *lang=nx_simple_map_get(map, "lang");
+  return nx_simple_map_get(map, "id");
+}
+
+static const char* query_bench_lazy(nxb_buffer* nxb, nxweb_http_request* req, const char* uri, const char** lang) {
+  req->uri=uri;
+  req->param_index=0;
+  *lang=nxweb_get_request_parameter(req, "lang");
+  return nxweb_get_request_parameter(req, "id");
+}
+
+static void run_query_bench() {
+  nxb_buffer* nxb=nxb_create(16384);
+  nxweb_http_request req;
+  const char *v1, *v2, *l1, *l2;
+  int i, n, mismatches=0, total_len=0;
+  memset(&req, 0, sizeof(req));
+  req.nxb=nxb;
+  for (i=0; i<QUERY_BENCH_URIS; i++) {
+    nxb_empty(nxb);
+    v1=query_bench_eager(nxb, query_bench_uris[i], &l1);
+    v2=query_bench_lazy(nxb, &req, query_bench_uris[i], &l2);
+    if (!v1 || !v2 || strcmp(v1, v2) || !l1!=!l2 || (l1 && strcmp(l1, l2))) mismatches++;
+    total_len+=strlen(query_bench_uris[i]);
+  }
+  int iterations=1000000;
+  volatile uintptr_t sink=0;
+  nxe_time_t start=nxe_get_time_usec();
+  for (n=0; n<iterations; n++) {
+    nxb_empty(nxb);
+    sink+=(uintptr_t)query_bench_eager(nxb, query_bench_uris[n%QUERY_BENCH_URIS], &l1);
+  }
+  nxe_time_t eager_elapsed=nxe_get_time_usec()-start;
+  start=nxe_get_time_usec();
+  for (n=0; n<iterations; n++) {
+    nxb_empty(nxb);
+    sink+=(uintptr_t)query_bench_lazy(nxb, &req, query_bench_uris[n%QUERY_BENCH_URIS], &l1);
+  }
+  nxe_time_t lazy_elapsed=nxe_get_time_usec()-start;
+  printf("query avg_len=%-4d 2 lookups  eager %6.1f ns/request  lazy %6.1f ns/request%s\n",
+         (int)(total_len/QUERY_BENCH_URIS), eager_elapsed*1000./iterations, lazy_elapsed*1000./iterations, mismatches? "  (MISMATCH)" : "");
+  fflush(stdout);
+  nxb_destroy(nxb);
+}
+
+static void show_help(void) {
+  printf( "usage:    nxweb_bench <options>\n\n"
+          " -H host:port  target server (default: localhost:8055)\n"
+          " -s file       scenarios file (default: nxweb_bench.json)\n"
+          " -n names      run only scenarios with these comma-separated names\n"
+          " -u uri        run single ad-hoc scenario for uri instead of scenarios file\n"
+          " -c num        number of connections (overrides scenario value)\n"
+          " -t num        number of threads (overrides scenario value)\n"
+          " -d sec        measurement duration (overrides scenario value)\n"
+          " -w sec        warmup time (overrides scenario value)\n"
+          " -K            disable keep-alive for ad-hoc scenario\n"
+          " -z            request gzip encoding for ad-hoc scenario\n"
+          " -S            use TLS for ad-hoc scenario (one thread per connection)\n"
+          " -R            new TLS connection per request for ad-hoc scenario (handshake rate)\n"
+          " -2 streams    use HTTP/2 with this many streams per connection for ad-hoc scenario\n"
+          " -b [ip]:port  run stub backend on this address (for proxy scenarios)\n"
+          " -A            run allocator benchmark (nx_alloc vs memalign) and exit\n"
+          " -T            run template engine benchmark (10/100/1000 blocks) and exit\n"
+          " -D            run request dispatch benchmark (10/20/30/40/60/100/1000 routes) and exit\n"
+          " -Q            run query string parsing benchmark (eager vs lazy) and exit\n"
+          " -h            show this help\n"
+          "\n"
+          "example:  nxweb_bench -b :8000 -s nxweb_bench.json -n memcache-tiny,proxy\n\n"
+         );
+}
+
+int main(int argc, char** argv) {
+  const char* scenarios_file="nxweb_bench.json";
+  const char* names=0;
+  const char* adhoc_uri=0;
+  const char* stub_backend=0;
+  int connections=0, threads=0, duration=-1, warmup=-1;
+  int adhoc_streams=0;
+  _Bool adhoc_keep_alive=1, adhoc_gzip=0, adhoc_tls=0, adhoc_handshakes=0, alloc_bench=0, template_bench=0, dispatch_bench=0, query_bench=0;
+
+  int c;
+  while ((c=getopt(argc, argv, ":hH:s:n:u:c:t:d:w:KzSR2:b:ATDQ"))!=-1) {
+    switch (c) {
+      case 'h':
+        show_help();
+        return 0;
+      case 'H':
+        target_host_and_port=optarg;
+        break;
+      case 's':
+        scenarios_file=optarg;
+        break;
+      case 'n':
+        names=optarg;
+        break;
+      case 'u':
+        adhoc_uri=optarg;
+        break;
+      case 'c':
+        connections=atoi(optarg);
+        break;
+      case 't':
+        threads=atoi(optarg);
+        break;
+      case 'd':
+        duration=atoi(optarg);
+        break;
+      case 'w':
+        warmup=atoi(optarg);
+        break;
+      case 'K':
+        adhoc_keep_alive=0;
+        break;
+      case 'z':
+        adhoc_gzip=1;
+        break;
+      case 'S':
+        adhoc_tls=1;
+        break;
+      case 'R':
+        adhoc_tls=1;
+        adhoc_handshakes=1;
+        break;
+      case '2':
+        adhoc_streams=atoi(optarg);
+        break;
+      case 'b':
+        stub_backend=optarg;
+        break;
+      case 'A':
+        alloc_bench=1;
+        break;
+      case 'T':
+        template_bench=1;
+        break;
+      case 'D':
+        dispatch_bench=1;
+        break;
+      case 'Q':
+        query_bench=1;
+        break;
+      case '?':
+        fprintf(stderr, "unkown option: -%c\n\n", optopt);
+        show_help();
+        return EXIT_FAILURE;
+      case ':':
+        fprintf(stderr, "missing argument for option: -%c\n\n", optopt);
+        show_help();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (alloc_bench) {
+    int t, max_threads=threads>0? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (t=1; t<=max_threads; t=t<max_threads && t*2>max_threads? max_threads : t*2) {
+      run_alloc_bench(t, 1, 0);
+      run_alloc_bench(t, 0, 0);
+      if (t>1) {
+        run_alloc_bench(t, 1, 1);
+        run_alloc_bench(t, 0, 1);
+      }
+      if (t==max_threads) break;
+    }
+    return 0;
+  }
+
+  if (template_bench) {
+    run_template_bench(10);
+    run_template_bench(100);
+    run_template_bench(1000);
+    return 0;
+  }
+
+  if (dispatch_bench) {
+    static const int route_counts[]={10, 20, 30, 40, 60, 100, 1000};
+    int i;
+    for (i=0; i<sizeof(route_counts)/sizeof(route_counts[0]); i++) run_dispatch_bench(route_counts[i]);
+    return 0;
+  }
+
+  if (query_bench) {
+    run_query_bench();
+    return 0;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (stub_backend && start_stub_backend(stub_backend)) {
+    nxweb_log_error("can't start stub backend on %s", stub_backend);
+    return EXIT_FAILURE;
+  }
+
+  static bench_scenario scenarios[BENCH_MAX_SCENARIOS];
+  int num_scenarios=0;
+  bench_scenario defaults={.connections=64, .threads=2, .duration=10, .warmup=1, .keep_alive=1};
+
+  if (adhoc_uri) {
+    bench_scenario* sc=&scenarios[num_scenarios++];
+    *sc=defaults;
+    sc->name="adhoc";
+    sc->uri=adhoc_uri;
+    sc->keep_alive=adhoc_keep_alive;
+    sc->gzip=adhoc_gzip;
+    sc->tls=adhoc_tls;
+    sc->handshakes=adhoc_handshakes;
+    sc->http2=adhoc_streams>0;
+    sc->streams=adhoc_streams;
+  }
+  else if (optind>=argc && stub_backend && !names && access(scenarios_file, R_OK)) {
+    // stub backend only mode
+    pause();
+    return 0;
+  }
+  else {
+    const nx_json* json=load_scenarios_file(scenarios_file);
+    if (!json) return EXIT_FAILURE;
+    const char* server=json_str(json, "server", 0);
+    if (!target_host_and_port) target_host_and_port=server;
+    const nx_json* djs=nx_json_get(json, "defaults");
+    defaults.connections=json_int(djs, "connections", defaults.connections);
+    defaults.threads=json_int(djs, "threads", defaults.threads);
+    defaults.duration=json_int(djs, "duration", defaults.duration);
+    defaults.warmup=json_int(djs, "warmup", defaults.warmup);
+    defaults.keep_alive=json_int(djs, "keep_alive", defaults.keep_alive);
+    const nx_json* sjs=nx_json_get(json, "scenarios");
+    int i;
+    for (i=0; i<sjs->length && num_scenarios<BENCH_MAX_SCENARIOS; i++) {
+      const nx_json* js=nx_json_item(sjs, i);
+      const char* name=json_str(js, "name", "unnamed");
+      if (!name_selected(names, name)) continue;
+      bench_scenario* sc=&scenarios[num_scenarios++];
+      *sc=defaults;
+      sc->name=name;
+      sc->uri=json_str(js, "uri", "/");
+      sc->server=json_str(js, "server", 0);
+      sc->host=json_str(js, "host", 0);
+      sc->connections=json_int(js, "connections", defaults.connections);
+      sc->threads=json_int(js, "threads", defaults.threads);
+      sc->duration=json_int(js, "duration", defaults.duration);
+      sc->warmup=json_int(js, "warmup", defaults.warmup);
+      sc->keep_alive=json_int(js, "keep_alive", defaults.keep_alive);
+      sc->gzip=json_int(js, "gzip", 0);
+      sc->handshakes=json_int(js, "handshakes", 0);
+      sc->tls_resume=json_int(js, "tls_resume", 0);
+      sc->tls=json_int(js, "tls", 0) || sc->handshakes;
+      sc->http2=json_int(js, "http2", 0);
+      sc->streams=json_int(js, "streams", 16);
+      const nx_json* stjs=nx_json_get(js, "storm");
+      sc->storm_server=json_str(stjs, "server", 0);
+      sc->storm_connections=json_int(stjs, "connections", 16);
+      const nx_json* fjs=nx_json_get(js, "fixture");
+      sc->fixture_path=json_str(fjs, "path", 0);
+      sc->fixture_size=json_int(fjs, "size", 0);
+    }
+  }
+
+  if (!target_host_and_port) target_host_and_port="localhost:8055";
+
+  int i, failed=0;
+#ifdef WITH_SSL
+  gnutls_certificate_allocate_credentials(&tls_bench_cred);
+#endif
+  for (i=0; i<num_scenarios; i++) {
+    bench_scenario* sc=&scenarios[i];
+    if (!sc->host) sc->host=sc->server? sc->server : target_host_and_port;
+    if (connections>0) sc->connections=connections;
+    if (threads>0) sc->threads=threads;
+    if (duration>=0) sc->duration=duration;
+    if (warmup>=0) sc->warmup=warmup;
+    if (sc->connections<1) sc->connections=1;
+    if (run_scenario(sc)) failed++;
+  }
+
+#ifdef WITH_SSL
+  gnutls_certificate_free_credentials(tls_bench_cred);
+#endif
+  return failed? EXIT_FAILURE : EXIT_SUCCESS;
+}
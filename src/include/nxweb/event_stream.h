@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NXWEB_EVENT_STREAM_H
+#define	NXWEB_EVENT_STREAM_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Server-Sent Events (text/event-stream) and long-poll responses. Handler
+ * calls nxweb_event_stream_start() and returns NXWEB_OK; response body is
+ * then kept open as chunked (or HTTP/2 DATA) stream and events are pushed
+ * into it later, from the net thread of the stream or from any thread via
+ * topics and nxweb_event_stream_post().
+ *
+ * Events are refcounted preformatted frames, same as websocket messages.
+ * Idle streams are pinged with comment frames so that neither peers nor
+ * write timeout drop them. Stream that does not keep up is ended; client
+ * reconnects with Last-Event-ID header to resume.
+ *
+ * Named topics are refcounted: one that nobody holds, subscribes to or
+ * has events in flight for is removed, so names taken from requests do not
+ * pile up.
+ */
+
+typedef nxweb_frame nxweb_sse_event; // complete event frame terminated by empty line
+
+typedef struct nxweb_event_stream {
+  nxe_istream data_out; // response content_out
+  nxe_timer timer_ping;
+  struct nxweb_http_server_connection* conn; // 0 once request is over
+  nxweb_net_thread_data* tdata;
+  nxe_data data; // for application use
+  void (*on_close)(struct nxweb_event_stream* es); // optional; called in net thread when stream ends for any reason
+  int refcount;
+  struct nxweb_event_stream* prev; // in list of this net thread's streams
+  struct nxweb_event_stream* next;
+  nxweb_frame_queue out; // up to NXWEB_EVENT_STREAM_MAX_QUEUED_EVENTS
+  nxweb_subscription* subscriptions;
+  _Bool long_poll:1; // end after first event
+  _Bool closing:1; // end once queue is sent
+  _Bool eof_sent:1;
+  _Bool got_output:1; // event queued since last ping timeout
+} nxweb_event_stream;
+
+typedef struct nxweb_sse_topic {
+  const char* name;
+  nxweb_subscriber_list subscribers;
+  struct nxweb_sse_topic* next; // in registry of nxweb_sse_topic_get()
+  int refcount; // registry topics only: callers, subscriptions and inbox items in flight
+  _Bool registered:1; // freed once unreferenced; static topics are never freed
+} nxweb_sse_topic; // zero-initialize, e.g. static nxweb_sse_topic news={.name="news"};
+
+// net thread of connection/stream only:
+nxweb_event_stream* nxweb_event_stream_start(nxweb_http_server_connection* conn, nxweb_http_response* resp, _Bool long_poll);
+int nxweb_event_stream_send(nxweb_event_stream* es, const char* event, const char* id, const void* data, nxe_size_t size); // 0 = queued
+int nxweb_event_stream_send_event(nxweb_event_stream* es, nxweb_sse_event* evt); // takes own reference
+void nxweb_event_stream_close(nxweb_event_stream* es); // sends remaining queued events first
+int nxweb_sse_topic_subscribe(nxweb_sse_topic* topic, nxweb_event_stream* es);
+void nxweb_sse_topic_unsubscribe(nxweb_sse_topic* topic, nxweb_event_stream* es);
+
+// any thread:
+nxweb_sse_event* nxweb_sse_event_create(const char* event, const char* id, const void* data, nxe_size_t size); // event & id optional
+void nxweb_event_stream_ref(nxweb_event_stream* es); // keeps struct (not connection) alive for use in other threads
+void nxweb_event_stream_unref(nxweb_event_stream* es);
+int nxweb_event_stream_post(nxweb_event_stream* es, const char* event, const char* id, const void* data, nxe_size_t size); // 0 = posted to its net thread
+nxweb_sse_topic* nxweb_sse_topic_get(const char* name); // finds or creates named topic; returns referenced topic
+nxweb_sse_topic* nxweb_sse_topic_find(const char* name); // never creates; returns referenced topic or 0
+void nxweb_sse_topic_unref(nxweb_sse_topic* topic); // topic is dropped once it has no references left
+int nxweb_sse_topic_publish(nxweb_sse_topic* topic, const char* event, const char* id, const void* data, nxe_size_t size); // returns number of net threads reached
+
+static inline void nxweb_sse_event_ref(nxweb_sse_event* evt) {
+  nxweb_frame_ref(evt);
+}
+
+static inline void nxweb_sse_event_unref(nxweb_sse_event* evt) {
+  nxweb_frame_unref(evt);
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* NXWEB_EVENT_STREAM_H */
@@ -47,9 +47,9 @@ typedef enum nxweb_result {
 typedef enum nxweb_handler_flags {
   NXWEB_INPROCESS=0, // execute handler in network thread (must be fast and non-blocking!)
   NXWEB_INWORKER=1, // execute handler in worker thread (for lengthy or blocking operations)
-  NXWEB_PARSE_PARAMETERS=2, // parse query string and (url-encoded) post data before calling this handler
-  NXWEB_PRESERVE_URI=4, // modifier for NXWEB_PARSE_PARAMETERS; preserver conn->uri string while parsing (allocate copy)
-  NXWEB_PARSE_COOKIES=8, // parse cookie header before calling this handler
+  NXWEB_PARSE_PARAMETERS=2, // build req->parameters list before calling this handler (not needed for nxweb_get_request_parameter())
+  NXWEB_PRESERVE_URI=4, // modifier for NXWEB_PARSE_PARAMETERS; req->uri is always preserved (query string is indexed in place)
+  NXWEB_PARSE_COOKIES=8, // build req->cookies list before calling this handler (not needed for nxweb_get_request_cookie())
   NXWEB_HANDLE_GET=0x10,
   NXWEB_HANDLE_POST=0x20, // implies NXWEB_ACCEPT_CONTENT
   NXWEB_HANDLE_OTHER=0x40,
@@ -60,8 +60,10 @@ typedef enum nxweb_handler_flags {
 } nxweb_handler_flags;
 
 struct nxweb_http_server_connection;
+struct nxweb_websocket;
 
 typedef nxweb_result (*nxweb_handler_callback)(struct nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp);
+typedef nxweb_result (*nxweb_file_op_callback)(struct nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, void* param);
 
 struct fc_filter_data;
 
@@ -89,6 +91,26 @@ void _nxweb_fc_finalize(struct fc_filter_data* fcdata);
 nxweb_result _nxweb_fc_serve_from_cache(struct nxweb_http_server_connection* conn, struct nxweb_http_request* req, struct nxweb_http_response* resp, const char* cache_key, struct fc_filter_data* fcdata, time_t check_time);
 nxweb_result _nxweb_fc_do_filter(struct nxweb_http_server_connection* conn, struct nxweb_http_request* req, struct nxweb_http_response* resp, struct fc_filter_data* fcdata);
 
+// append-only segment store behind file_cache filter (see fc_segment_store.c):
+struct nxweb_fc_segment_store;
+
+typedef struct nxweb_fc_segment_rec {
+  const char* payload; // mmapped; valid until _nxweb_fc_segment_release()
+  uint32_t payload_size;
+  off_t payload_offset; // position of payload within segment file
+  int fd; // segment file; dup() it to use after release
+  time_t expires;
+  uint32_t seg_id; // seg_id & offset identify the record for _nxweb_fc_segment_touch()
+  uint32_t offset;
+} nxweb_fc_segment_rec;
+
+struct nxweb_fc_segment_store* _nxweb_fc_segment_store_get(const char* cache_dir, int segment_size_mb, int max_size_mb);
+uint32_t _nxweb_fc_segment_max_payload(struct nxweb_fc_segment_store* st);
+int _nxweb_fc_segment_acquire(struct nxweb_fc_segment_store* st, const char* key, nxweb_fc_segment_rec* rec); // 0 = found & read-locked
+void _nxweb_fc_segment_release(struct nxweb_fc_segment_store* st);
+int _nxweb_fc_segment_put(struct nxweb_fc_segment_store* st, const char* key, const void* payload, uint32_t payload_size, time_t expires);
+void _nxweb_fc_segment_touch(struct nxweb_fc_segment_store* st, const char* key, uint32_t seg_id, uint32_t offset, time_t expires);
+
 typedef struct nxweb_handler {
   const char* name;
   const char* prefix;
@@ -111,8 +133,10 @@ typedef struct nxweb_handler {
   _Bool secure_only:1;
   _Bool insecure_only:1;
   int idx;
+  nxe_size_t max_body_size; // request body limit (0 = server default)
 
   struct nxweb_handler* next; // next in routing list
+  int route_order; // position in routing list; set by nxweb_run()
   nxweb_filter* filters[NXWEB_MAX_FILTERS];
   int num_filters;
   nxweb_handler_callback on_generate_cache_key;
@@ -120,7 +144,13 @@ typedef struct nxweb_handler {
   nxweb_handler_callback on_headers;
   nxweb_handler_callback on_post_data;
   nxweb_handler_callback on_post_data_complete;
+  // receives request body piece by piece instead of buffering it (in worker thread if NXWEB_INWORKER):
+  nxweb_result (*on_post_data_chunk)(struct nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, const char* data, nxe_size_t size);
   nxweb_handler_callback on_request;
+  // WebSocket endpoint (see websocket.h); connection upgrades when on_ws_message is set:
+  void (*on_ws_open)(struct nxweb_websocket* ws, nxweb_http_request* req);
+  void (*on_ws_message)(struct nxweb_websocket* ws, const char* data, nxe_size_t size, _Bool binary);
+  void (*on_ws_close)(struct nxweb_websocket* ws, int code);
   nxweb_handler_callback on_complete;
   nxweb_handler_callback on_error;
 
@@ -157,6 +187,7 @@ typedef struct nxweb_http_server_listening_socket {
 typedef struct nxweb_net_thread_data {
   pthread_t thread_id;
   uint8_t thread_num; // up to 256 net threads
+  nx_cpu_placement placement;
   uint64_t unique_num;
   nxe_loop* loop;
   nxe_eventfd_source shutdown_efs;
@@ -167,6 +198,7 @@ typedef struct nxweb_net_thread_data {
   nxp_pool* free_conn_pool;
   nxp_pool* free_conn_nxb_pool;
   nxp_pool* free_rbuf_pool;
+  nxp_pool* free_cs_node_pool; // composite stream nodes
 
   char* access_log_block;
   int access_log_block_avail;
@@ -176,6 +208,19 @@ typedef struct nxweb_net_thread_data {
 
   nxe_eventfd_source diagnostics_efs;
   nxe_subscriber diagnostics_sub;
+
+  int num_connections; // client connections (not subrequests)
+  int jobs_in_worker;
+  _Bool accept_paused:1;
+  uint64_t accept_pauses; // times accepting paused by connection limits
+  uint64_t requests_shed;
+
+  nxw_completion_queue inbox; // websocket & event stream messages posted to this thread by other threads
+
+#ifdef WITH_SSL
+  nxw_completion_queue ssl_handshakes_done; // crypto threads => this thread
+  int ssl_handshakes_in_crypto;
+#endif // WITH_SSL
 } nxweb_net_thread_data __attribute__ ((aligned(64)));
 
 typedef struct nxweb_http_server_connection {
@@ -186,11 +231,17 @@ typedef struct nxweb_http_server_connection {
   nxd_socket sock;
 #endif // WITH_SSL
   nxe_subscriber events_sub;
-  nxe_subscriber worker_complete;
-  volatile int worker_job_done;
+  nxw_completion worker_complete;
+  nxweb_file_op_callback file_op_complete; // set while offloaded file operation is pending
+  void* file_op_param;
   char remote_addr[16]; // 255.255.255.255
   nxweb_handler* handler;
   nxe_data handler_param;
+  // handler selection state kept to resume it after NXWEB_ASYNC:
+  const char* select_uri_original;
+  time_t select_ims_original;
+  time_t select_check_time;
+  int select_filter_idx; // filter which serve_from_cache() is pending; -1 = on_select() pending
   nxweb_net_thread_data* tdata;
   int lconf_idx;
   _Bool secure:1;
@@ -198,6 +249,7 @@ typedef struct nxweb_http_server_connection {
   _Bool subrequest_failed:1;
   _Bool in_worker:1;
   _Bool connection_closing:1;
+  _Bool body_in_worker:1; // worker is writing request body to temp file
   uint64_t uid; // unique connection id
   nxe_time_t connected_time;
   struct nxweb_http_server_connection* parent;
@@ -206,6 +258,13 @@ typedef struct nxweb_http_server_connection {
   void (*on_response_ready)(struct nxweb_http_server_connection* conn, nxe_data data);
   nxe_data on_response_ready_data;
   nxd_ibuffer ib;
+  struct nxweb_request_body* body; // streamed/spilled request body (see http_request_body.c)
+  struct nxd_http2_server_proto* h2; // set once client connection switched to HTTP/2
+  struct nxweb_http_server_connection* h2_conn; // HTTP/2 stream: client connection it belongs to
+  struct nxweb_websocket* ws; // set once connection upgraded to WebSocket
+#ifdef WITH_SSL
+  nxw_completion ssl_handshake_step; // links crypto thread queue, then returns conn to its net thread
+#endif // WITH_SSL
 } nxweb_http_server_connection;
 
 typedef struct nxweb_http_proxy_pool_config {
@@ -216,11 +275,21 @@ typedef struct nxweb_http_proxy_pool_config {
 typedef struct nxweb_server_listen_config {
   int listen_fd;
   _Bool secure:1;
+  _Bool ktls:1; // hand TLS record encryption to kernel when possible
+  _Bool http2:1; // accept HTTP/2 (ALPN h2 on secure listener, prior knowledge on plain one)
 #ifdef WITH_SSL
   gnutls_certificate_credentials_t x509_cred;
   gnutls_priority_t priority_cache;
   gnutls_dh_params_t dh_params;
   gnutls_datum_t session_ticket_key;
+  gnutls_datum_t prev_session_ticket_key; // still accepted until prev_ticket_key_expires
+  time_t ticket_key_time; // when session_ticket_key was generated
+  time_t prev_ticket_key_expires;
+  unsigned ticket_key_gen; // incremented on each rotation
+  unsigned char ticket_key_names[NXWEB_SSL_TICKET_KEY_NAMES][16]; // key_name fields of tickets issued under session_ticket_key
+  unsigned char prev_ticket_key_names[NXWEB_SSL_TICKET_KEY_NAMES][16];
+  int num_ticket_key_names;
+  int num_prev_ticket_key_names;
 #endif // WITH_SSL
 } nxweb_server_listen_config;
 
@@ -230,10 +299,36 @@ struct nxweb_server_config {
   nxweb_http_proxy_pool_config http_proxy_pool_config[NXWEB_MAX_PROXY_POOLS];
   nxweb_handler_callback request_dispatcher;
   nxweb_handler* handler_list;
+  struct nxweb_router* router; // compiled handler_list used by default dispatcher
   nxweb_handler* handlers_defined;
   nxweb_filter* filters_defined;
   nxweb_module* module_list;
   int shutdown_timeout; // time in secs to close up after SIGTERM
+  nx_placement_policy net_thread_placement;
+  _Bool numa_bind_memory; // prefer local node for net thread allocations (pools, memcache records)
+  _Bool pin_workers; // keep worker threads on their net thread's node
+  _Bool offload_file_io; // run blocking stat/open of static & cached files in worker threads
+  int ssl_handshake_threads; // crypto threads running TLS handshakes (0 = handshake in net threads)
+  int fd_cache_size; // max static files with cached stat & open fd (0 = off)
+  nxe_time_t fd_cache_ttl;
+  const char* memcache_snapshot_file; // memcache is saved here on shutdown & warm-loaded on startup
+  _Bool memcache_snapshot_contents; // save contents too (otherwise files are re-read on load)
+  nxe_size_t request_body_max_size; // for handlers without own max_body_size
+  nxe_size_t request_body_memory_limit; // larger bodies are spilled to temp file
+  const char* request_body_temp_dir;
+  int ssl_session_cache_size; // TLS sessions kept for session id resumption (0 = off)
+  int ssl_session_timeout; // seconds
+  int ssl_ticket_key_rotation; // seconds (0 = never rotate)
+  int conn_pool_size; // initial capacity of per-thread connection pools
+  int rbuf_pool_size; // initial capacity of per-thread read buffer pool
+  int pool_arena_flags; // NXP_ARENA_* for the above
+  nxe_time_t pool_gc_hold_time;
+  // admission control (0 = no limit):
+  int max_connections; // stop accepting above this many client connections
+  int max_thread_connections; // same per net thread
+  nxe_time_t shed_loop_lag; // answer new requests with 503 while net thread loop lag exceeds this
+  int shed_worker_jobs; // answer new requests with 503 while this many worker jobs are in flight
+  int max_ssl_handshakes; // stop accepting on secure listeners while this many handshake steps wait for crypto threads
   char* work_dir;
   const char* access_log_fpath;
   const char* error_log_fpath;
@@ -267,6 +362,38 @@ extern __thread struct nxweb_net_thread_data* _nxweb_net_thread_data;
 extern __thread struct nxw_worker* _nxweb_worker_thread_data;
 
 void _nxweb_register_module(nxweb_module* module);
+#ifdef WITH_SSL
+void _nxweb_ssl_session_setup(gnutls_session_t session, nxweb_server_listen_config* lconf); // session cache & ticket key
+void _nxweb_ssl_count_handshake(_Bool resumed);
+int _nxweb_ssl_handshake_offload(nxd_ssl_socket* ss); // queue handshake step to crypto thread; 0 = queued
+_Bool _nxweb_ssl_handshake_limit_reached(void);
+#endif // WITH_SSL
+// request body streaming (see http_request_body.c):
+nxweb_result _nxweb_request_body_start(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxe_size_t max_size);
+nxweb_result _nxweb_request_body_received(nxweb_http_server_connection* conn); // NXWEB_ASYNC = still being written or consumed by worker
+nxweb_result _nxweb_request_body_job_done(nxweb_http_server_connection* conn); // temp file write finished
+void _nxweb_request_body_abort(nxweb_http_server_connection* conn);
+void _nxweb_request_body_shutdown_thread(void); // close connections with in-worker body consumers
+nxd_http_server_proto* _nxweb_http2_stream_start(nxweb_http_server_connection* conn, nxd_http2_stream* st); // 0 = conn is closing
+nxweb_result _nxweb_websocket_upgrade(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp);
+void _nxweb_websocket_finalize(struct nxweb_websocket* ws);
+void _nxweb_websocket_shutdown_thread(void); // close this thread's websockets (1001 going away)
+void _nxweb_event_stream_shutdown_thread(void); // end this thread's event streams
+
+typedef struct nxweb_router nxweb_router;
+
+typedef struct nxweb_route_match { // handler lists of matching router nodes
+  int num_lists;
+  nxweb_handler* const* list[NXWEB_ROUTER_MAX_MATCHES];
+  int list_len[NXWEB_ROUTER_MAX_MATCHES];
+} nxweb_route_match;
+
+nxweb_router* _nxweb_router_create(nxweb_handler* handler_list); // also sets route_order of handlers
+void _nxweb_router_free(nxweb_router* r);
+void _nxweb_router_stats(const nxweb_router* r, int* num_vhosts, int* num_nodes);
+int _nxweb_router_match(const nxweb_router* r, nxweb_route_match* m, const char* host, int host_len, const char* uri, int uri_len); // -1 = too many matches, scan handler_list
+nxweb_handler* _nxweb_router_next(nxweb_route_match* m, int min_order); // matching handlers in routing list order; 0 = no more
+int _nxweb_net_thread_post(nxweb_net_thread_data* tdata, nxw_completion* c); // to tdata->inbox; -1 = inbox closed by shutting down net thread
 void _nxweb_define_handler_base(nxweb_handler* handler);
 void _nxweb_define_filter(nxweb_filter* filter);
 void _nxweb_register_handler(nxweb_handler* handler, nxweb_handler* base);
@@ -274,6 +401,7 @@ nxweb_result _nxweb_default_request_dispatcher(nxweb_http_server_connection* con
 void _nxweb_launch_diagnostics(void);
 
 int nxweb_select_handler(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxweb_handler* handler, nxe_data handler_param);
+nxweb_result nxweb_offload_file_op(nxweb_http_server_connection* conn, void (*job)(void* param), nxweb_file_op_callback on_complete, void* param);
 
 #define NXWEB_MODULE(_name, ...) \
         static nxweb_module _nxweb_ ## _name ## _module={.name=#_name, ## __VA_ARGS__}; \
@@ -341,6 +469,9 @@ static inline uint64_t nxweb_generate_unique_id() {
 
 nxweb_result nxweb_cache_try(nxweb_http_server_connection* conn, nxweb_http_response* resp, const char* key, time_t if_modified_since, time_t revalidated_mtime);
 nxweb_result nxweb_cache_store_response(nxweb_http_server_connection* conn, nxweb_http_response* resp);
+const char* nxweb_cache_response_key(nxweb_http_server_connection* conn, nxweb_http_response* resp);
+struct nxweb_cache_rec* nxweb_cache_acquire(const char* key, nxe_time_t loop_time, const char** content, nxe_ssize_t* content_length);
+void nxweb_cache_release(struct nxweb_cache_rec* rec);
 
 #ifdef	__cplusplus
 }
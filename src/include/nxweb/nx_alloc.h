@@ -25,11 +25,55 @@ extern "C" {
 #endif
 
 #include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
 
 #define MEM_GUARD 64
+#define NX_CACHE_LINE_SIZE 64
+
+#ifdef WITH_SLAB_ALLOC
+
+// Thread-caching slab allocator (see nx_alloc.c).
+// Small objects come from size-classed 256KB spans through per-thread magazines;
+// sizes above NX_SLAB_MAX_SIZE go to memalign(). Any thread may free any object.
+
+#define NX_SLAB_MAX_SIZE 32768
+
+typedef struct nx_alloc_stats {
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t refills; // magazine refills from shared depot
+  uint64_t flushes; // magazine flushes to shared depot
+  uint64_t large_allocs;
+  uint64_t large_frees;
+  uint64_t spans; // spans allocated (never returned to system)
+  uint64_t large_bytes; // bytes currently held by large allocations
+} nx_alloc_stats;
+
+void* nx_slab_alloc(size_t size);
+void* nx_slab_calloc(size_t size);
+void nx_slab_free(void* ptr);
+void nx_alloc_get_stats(nx_alloc_stats* st);
+void nx_alloc_get_thread_stats(nx_alloc_stats* st);
+
+#define nx_alloc(size) nx_slab_alloc(size)
+#define nx_calloc(size) nx_slab_calloc(size)
+#define nx_free(ptr) nx_slab_free(ptr)
+// cache-line aligned allocation: size classes that are multiples of 64 are always 64-byte aligned
+#define nx_alloc_cl(size) nx_slab_alloc(((size)+NX_CACHE_LINE_SIZE-1)&~(NX_CACHE_LINE_SIZE-1))
+#define nx_calloc_cl(size) nx_slab_calloc(((size)+NX_CACHE_LINE_SIZE-1)&~(NX_CACHE_LINE_SIZE-1))
+
+#else
+
 #define nx_alloc(size) memalign(MEM_GUARD, (size)+MEM_GUARD)
 #define nx_calloc(size) ({void* _pTr=memalign(MEM_GUARD, (size)+MEM_GUARD); memset(_pTr, 0, (size)); _pTr;})
 #define nx_free(ptr) free(ptr)
+#define nx_alloc_cl(size) nx_alloc(size)
+#define nx_calloc_cl(size) nx_calloc(size)
+
+#endif
 
 
 #ifdef	__cplusplus
@@ -277,6 +277,8 @@ typedef struct nxe_timer_queue {
 
 typedef struct nxe_loop {
   nxe_time_t current_time;
+  nxe_time_t lag; // smoothed time from epoll wakeup to end of event processing
+  nxe_time_t lag_max;
   nxe_time_t last_http_time;
   char http_time_str[32];
   char iso8601_time_str[24];
@@ -48,8 +48,16 @@ typedef struct nxp_pool {
   nxp_object* free_first;
   nxp_object* free_last;
   int object_size;
+  int capacity; // total items in all chunks
+  int chunk_in_use; // objects in use from last chunk
+  size_t arena_size; // non-zero if pool & initial chunk are mmap'ed (see nxp_create_arena())
+  uint64_t gc_hold_time; // last chunk must stay unused that long before nxp_gc_at() frees it
+  uint64_t gc_idle_since;
 } nxp_pool;
 
+#define NXP_ARENA_HUGEPAGES 1 // back initial chunk by 2MB pages (hugetlbfs or THP)
+#define NXP_ARENA_MLOCK 2 // lock initial chunk in RAM
+
 typedef struct nxp_pool_iterator {
   nxp_pool* pool;
   nxp_chunk* chunk;
@@ -57,12 +65,14 @@ typedef struct nxp_pool_iterator {
 } nxp_pool_iterator;
 
 nxp_pool* nxp_create(int object_size, int initial_chunk_size);
+nxp_pool* nxp_create_arena(int object_size, int initial_chunk_size, int arena_flags);
 void nxp_destroy(nxp_pool* pool);
 void nxp_init(nxp_pool* pool, int object_size, nxp_chunk* initial_chunk, int chunk_allocated_size);
 void nxp_finalize(nxp_pool* pool);
 void* nxp_alloc(nxp_pool* pool);
 void nxp_free(nxp_pool* pool, void* ptr);
 void nxp_gc(nxp_pool* pool);
+void nxp_gc_at(nxp_pool* pool, uint64_t now);
 void* nxp_iterate_allocated_objects(nxp_pool* pool, nxp_pool_iterator* itr);
 
 #endif // NX_POOL_H_INCLUDED
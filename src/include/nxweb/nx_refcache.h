@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NX_REFCACHE_H_INCLUDED
+#define NX_REFCACHE_H_INCLUDED
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Process-wide LRU of immutable refcounted objects keyed by string
+ * (compiled templates, scanned SSI documents). Payload struct starts with
+ * nx_refcache_entry. Cache itself holds no reference: entry is freed by
+ * free_entry() once it is both unlinked from cache and unreferenced.
+ */
+
+typedef struct nx_refcache_entry {
+  const char* key; // owned by payload
+  time_t mtime; // source file mtime; entry is dropped on mismatch
+  nxe_time_t expires_time;
+  int ref_count;
+  struct nx_refcache_entry* prev;
+  struct nx_refcache_entry* next;
+} nx_refcache_entry;
+
+typedef struct nx_refcache {
+  const char* name; // for diagnostics
+  int max_entries;
+  nxe_time_t ttl;
+  void (*free_entry)(nx_refcache_entry* e);
+  // optional; called on hit outside of mutex: 1 = valid, -1 = stale (drop it), 0 = unknown (miss, keep it)
+  int (*revalidate)(nx_refcache_entry* e);
+  void* hash;
+  nx_refcache_entry* head;
+  nx_refcache_entry* tail;
+  pthread_mutex_t mutex;
+  uint64_t hits, misses, stores;
+} nx_refcache;
+
+void nx_refcache_init(nx_refcache* rc);
+void nx_refcache_finalize(nx_refcache* rc);
+nx_refcache_entry* nx_refcache_get(nx_refcache* rc, const char* key, time_t mtime, nxe_time_t loop_time); // returns referenced entry
+void nx_refcache_store(nx_refcache* rc, nx_refcache_entry* e, nxe_time_t loop_time); // caller keeps its reference
+void nx_refcache_unref(nx_refcache* rc, nx_refcache_entry* e);
+void nx_refcache_diagnostics(nx_refcache* rc);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* NX_REFCACHE_H_INCLUDED */
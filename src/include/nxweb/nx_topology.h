@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NX_TOPOLOGY_H
+#define	NX_TOPOLOGY_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+// CPU/NUMA topology is read from /sys/devices/system; no libnuma required.
+
+typedef struct nx_cpu_placement {
+  int cpu;        // -1 = not pinned
+  int numa_node;  // -1 = unknown
+} nx_cpu_placement;
+
+typedef struct nx_placement_policy {
+  const char* cpu_list; // e.g. "0-7,16-23"; null = all CPUs allowed for this process (minus isolcpus)
+  _Bool skip_smt;       // one thread per physical core
+  _Bool spread_nodes;   // round-robin threads across NUMA nodes
+} nx_placement_policy;
+
+int nx_topology_num_nodes(void);
+int nx_topology_cpu_node(int cpu);
+// fills placement[0..max_threads-1]; returns number of threads to run
+int nx_topology_place_threads(const nx_placement_policy* policy, nx_cpu_placement* placement, int max_threads);
+int nx_topology_set_affinity(pthread_attr_t* attr, int cpu);
+// allow CPUs on cpu's node not taken by placed threads (or whole node if none left)
+int nx_topology_set_affinity_near(pthread_attr_t* attr, int cpu);
+// prefer node for memory subsequently allocated (first-touched) by calling thread
+int nx_topology_bind_memory(int numa_node);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* NX_TOPOLOGY_H */
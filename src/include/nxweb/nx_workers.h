@@ -31,12 +31,38 @@ extern "C" {
 #define NXWEB_MAX_WORKERS_IN_QUEUE 128
 #define NXWEB_START_WORKERS_IN_QUEUE 0
 
+// Embedded into job owner; pushed to completion queue when job is done.
+typedef struct nxw_completion {
+  struct nxw_completion* next;
+  void (*on_complete)(struct nxw_completion* c); // runs in the thread owning the queue
+} nxw_completion;
+
+// Multi-producer single-consumer queue of completions with one eventfd.
+// Any thread may push; eventfd is only triggered when queue turns non-empty,
+// owning thread drains whole queue per wakeup.
+typedef struct nxw_completion_queue {
+  nxw_completion* volatile head; // most recent first; NXW_QUEUE_CLOSED once closed
+  volatile int pushers; // nxw_try_complete() calls in flight
+  nxe_eventfd_source efs;
+  nxe_subscriber sub;
+  uint64_t completions;
+  uint64_t wakeups;
+} nxw_completion_queue;
+
+void nxw_init_completion_queue(nxw_completion_queue* q, nxe_loop* loop);
+void nxw_finalize_completion_queue(nxw_completion_queue* q);
+#define NXW_QUEUE_CLOSED ((nxw_completion*)1)
+
+void nxw_complete(nxw_completion_queue* q, nxw_completion* c); // thread-safe
+int nxw_try_complete(nxw_completion_queue* q, nxw_completion* c); // thread-safe; -1 = queue closed, c not queued
+void nxw_drain_completions(nxw_completion_queue* q); // owning thread only
+void nxw_close_completion_queue(nxw_completion_queue* q); // owning thread only; runs queued completions, refuses later ones
+
 typedef struct nxw_worker {
   struct nxw_factory* factory;
   pthread_t tid;
   pthread_cond_t start_cond;
   pthread_mutex_t start_mux;
-  nxe_eventfd_source complete_efs;
   struct nxw_worker* prev;
   struct nxw_worker* next;
   volatile _Bool shutdown_in_progress;
@@ -44,7 +70,7 @@ typedef struct nxw_worker {
   // job spec:
   void (*do_job)(void* job_param);
   void* job_param;
-  volatile int* job_done;
+  nxw_completion* job_complete;
 } nxw_worker;
 
 NX_QUEUE_DECLARE(workers, nxw_worker*, NXWEB_MAX_WORKERS_IN_QUEUE)
@@ -52,17 +78,19 @@ NX_QUEUE_DECLARE(workers, nxw_worker*, NXWEB_MAX_WORKERS_IN_QUEUE)
 typedef struct nxw_factory {
   volatile _Bool shutdown_in_progress;
   int worker_count;
+  int near_cpu; // -1 = don't pin workers
   nxe_loop* loop;
   pthread_mutex_t queue_mux;
   nx_queue_workers queue;
   nxw_worker* list;
+  nxw_completion_queue complete_queue; // shared by all workers of the factory
 } nxw_factory;
 
 void nxw_init_factory(nxw_factory* f, nxe_loop* loop);
 void nxw_finalize_factory(nxw_factory* f);
 void nxw_gc_factory(nxw_factory* f);
 nxw_worker* nxw_get_worker(nxw_factory* f);
-void nxw_start_worker(nxw_worker* w, void (*job_func)(void* job_param), void* job_param, volatile int* job_done);
+void nxw_start_worker(nxw_worker* w, void (*job_func)(void* job_param), void* job_param, nxw_completion* job_complete);
 
 #ifdef	__cplusplus
 }
@@ -60,11 +60,19 @@ typedef struct nxd_ssl_socket { // extends nxd_socket
   _Bool handshake_started:1;
   _Bool handshake_complete:1;
   _Bool handshake_failed:1;
+  _Bool ktls:1; // try kernel TLS after handshake
+  _Bool ktls_tx:1; // kernel encrypts outgoing records
+  _Bool handshake_in_crypto:1; // handshake step runs in crypto thread; session must not be touched
+  _Bool handshake_retry:1; // socket got ready while handshake_in_crypto
+  int handshake_ret; // gnutls_handshake() result of offloaded step
+  int (*offload_handshake)(struct nxd_ssl_socket* ss); // returns 0 if handshake step has been queued
 } nxd_ssl_socket;
 
 void nxd_ssl_server_socket_init(nxd_ssl_socket* ss, gnutls_certificate_credentials_t x509_cred,
         gnutls_priority_t priority_cache, gnutls_datum_t* session_ticket_key);
 void nxd_ssl_server_socket_finalize(nxd_ssl_socket* ss, int good);
+void nxd_ssl_socket_handshake_step_complete(nxd_ssl_socket* ss); // call in net thread when offloaded step is done
+void nxd_ssl_server_socket_enable_http2(nxd_ssl_socket* ss); // offer h2 via ALPN
 
 int nxd_ssl_socket_init_server_parameters(gnutls_certificate_credentials_t* x509_cred,
         gnutls_dh_params_t* dh_params, gnutls_priority_t* priority_cache, gnutls_datum_t* session_ticket_key,
@@ -100,6 +108,7 @@ typedef struct nxd_obuffer {
 } nxd_obuffer;
 
 void nxd_obuffer_init(nxd_obuffer* ob, const void* data_ptr, int data_size);
+nxd_obuffer* nxd_obuffer_from_stream(nxe_istream* is); // null if is is not obuffer's data_out
 
 
 typedef struct nxd_rbuffer {
@@ -158,6 +167,7 @@ typedef struct nxd_fbuffer {
 
 void nxd_fbuffer_init(nxd_fbuffer* fb, int fd, off_t offset, off_t end);
 void nxd_fbuffer_finalize(nxd_fbuffer* fb);
+nxd_fbuffer* nxd_fbuffer_from_stream(nxe_istream* is); // null if is is not fbuffer's data_out
 
 
 typedef struct nxd_fwbuffer {
@@ -183,6 +193,7 @@ typedef struct nxd_streamer_node {
 typedef struct nxd_streamer {
   nxe_istream data_out;
   nxd_streamer_node* head;
+  nxd_streamer_node* tail;
   nxd_streamer_node* current;
   unsigned running:1;
   unsigned force_eof:1;
@@ -199,6 +210,7 @@ void nxd_streamer_close(nxd_streamer* strm);
 
 
 struct nxd_http_server_proto;
+struct nxd_http2_stream;
 
 typedef struct nxd_http_server_proto_class {
   void (*finalize)(struct nxd_http_server_proto* hsp);
@@ -237,6 +249,8 @@ typedef struct nxd_http_server_proto {
   int request_count;
   int headers_bytes_received;
   //unsigned keep_alive:1;
+  unsigned detect_http2:1; // hand connection over to HTTP/2 if it starts with HTTP/2 preface
+  struct nxd_http2_stream* h2s; // HTTP/2 stream this request came from
   nxweb_http_request req;
   nxweb_http_response _resp; // embedded response
   nxweb_http_response* resp;
@@ -254,11 +268,15 @@ enum nxd_http_server_proto_error_code {
   NXD_HSP_READ_TIMEOUT=-27002,
   NXD_HSP_WRITE_TIMEOUT=-27003,
   NXD_HSP_REQUEST_CHUNKED_ENCODING_ERROR=-27004,
+  NXD_HSP_HTTP2_PROTOCOL_ERROR=-27005,
+  NXD_HSP_HTTP2_STREAM_RESET=-27006,
+  NXD_HSP_WEBSOCKET_CLOSED=-27007, // close handshake done
   NXD_HSP_SHUTDOWN_CONNECTION=-27109,
   NXD_HSP_REQUEST_RECEIVED=27101,
   NXD_HSP_REQUEST_BODY_RECEIVED=27102,
   NXD_HSP_RESPONSE_READY=27103,
   NXD_HSP_SUBREQUEST_READY=27104,
+  NXD_HSP_HTTP2_PREFACE=27105,
   NXD_HSP_REQUEST_COMPLETE=27109
 };
 
@@ -269,6 +287,109 @@ void nxweb_http_server_proto_subrequest_execute(nxd_http_server_proto* hsp, cons
 void nxd_http_server_proto_finish_response(nxweb_http_response* resp);
 void nxd_http_server_proto_setup_content_out(nxd_http_server_proto* hsp, nxweb_http_response* resp);
 void nxweb_reset_content_out(nxd_http_server_proto* hsp, nxweb_http_response* resp);
+void nxd_http_server_proto_apply_range(nxd_http_server_proto* hsp, nxweb_http_request* req, nxweb_http_response* resp);
+
+
+// HPACK header compression (RFC 7541); one table per direction of HTTP/2 connection
+
+#define NXD_HPACK_MAX_ENTRIES 128 // each entry takes at least 32 bytes of NXWEB_HTTP2_HEADER_TABLE_SIZE
+
+typedef struct nxd_hpack_entry {
+  char* name; // name & value share one allocation
+  char* value;
+  int name_len;
+  int value_len;
+} nxd_hpack_entry;
+
+typedef struct nxd_hpack_table {
+  nxd_hpack_entry entries[NXD_HPACK_MAX_ENTRIES]; // ring; entries[first] is the newest
+  int first;
+  int count;
+  int size; // sum of name_len+value_len+32
+  int max_size; // set by table size update
+  int max_size_limit; // SETTINGS_HEADER_TABLE_SIZE
+  _Bool size_update_pending:1; // encoder must signal max_size at start of next header block
+} nxd_hpack_table;
+
+void nxd_hpack_init(nxd_hpack_table* t, int max_size);
+void nxd_hpack_finalize(nxd_hpack_table* t);
+int nxd_hpack_decode(nxd_hpack_table* t, const char* block, int size, nxb_buffer* nxb, int max_list_size, nxweb_http_header** headers); // 0 = ok
+void nxd_hpack_set_max_size_limit(nxd_hpack_table* t, int max_size_limit);
+void nxd_hpack_encode_start(nxd_hpack_table* t, nxb_buffer* nxb); // nxb stream must be started
+void nxd_hpack_encode_header(nxd_hpack_table* t, nxb_buffer* nxb, const char* name, int name_len, const char* value, int value_len, _Bool add_to_table);
+
+
+// HTTP/2 server connection (RFC 7540); streams are fed to handlers as separate connections
+
+typedef struct nxd_http2_server_proto {
+  nxe_ostream data_in;
+  nxe_istream data_out;
+  nxe_timer timer_keep_alive;
+  nxe_timer timer_write;
+  nxe_publisher* events_pub; // connection errors & timeouts go here
+  struct nxweb_http_server_connection* conn;
+  nxp_pool* nxb_pool;
+  char* ibuf; // incoming frames; holds at least one whole frame
+  int ibuf_len;
+  char* obuf; // outgoing frames not yet taken by socket
+  int obuf_start;
+  int obuf_len;
+  int obuf_size;
+  int obuf_retry_size; // write that returned nothing must be repeated as is (gnutls)
+  char* hblock; // header block assembled from HEADERS & CONTINUATION
+  int hblock_len;
+  int hblock_size;
+  uint32_t hblock_stream_id;
+  uint8_t hblock_flags;
+  uint8_t hblock_weight;
+  uint32_t hblock_depends_on;
+  nxd_hpack_table decoder;
+  nxd_hpack_table encoder;
+  struct nxd_http2_stream* first_stream; // open streams in scheduling order
+  struct nxd_http2_stream* last_stream;
+  int num_streams;
+  uint32_t last_stream_id;
+  int32_t send_window;
+  int32_t recv_unacked; // DATA bytes not yet returned by connection WINDOW_UPDATE
+  int32_t peer_initial_window;
+  int peer_max_frame_size;
+  _Bool preface_received:1;
+  _Bool settings_received:1;
+  _Bool scheduling:1; // response content is being pulled by scheduler
+  _Bool input_paused:1; // too much output pending
+  _Bool goaway_sent:1;
+  _Bool goaway_received:1;
+  _Bool finalizing:1;
+} nxd_http2_server_proto;
+
+typedef struct nxd_http2_stream {
+  nxd_http2_server_proto* h2;
+  struct nxd_http_server_proto* hsp;
+  struct nxd_http2_stream* prev;
+  struct nxd_http2_stream* next;
+  uint32_t id;
+  uint32_t depends_on;
+  int weight; // 1..256
+  int deficit; // bytes stream may still send in current scheduling round
+  int32_t send_window;
+  int32_t recv_window; // DATA bytes peer may send before our WINDOW_UPDATE
+  int32_t recv_consumed; // read by request body consumer, not yet returned
+  char* body_buf; // received request body not yet read
+  int body_start;
+  int body_end;
+  int64_t body_received;
+  _Bool end_stream_received:1;
+  _Bool progress:1; // scheduler pull produced DATA
+  _Bool response_started:1;
+  _Bool end_stream_sent:1;
+  _Bool reset:1;
+} nxd_http2_stream;
+
+void nxd_http2_server_proto_init(nxd_http2_server_proto* h2, nxp_pool* nxb_pool);
+void nxd_http2_server_proto_connect(nxd_http2_server_proto* h2, nxe_loop* loop, nxe_istream* is, nxe_ostream* os, const char* data, int size);
+void nxd_http2_server_proto_finalize(nxd_http2_server_proto* h2);
+void nxd_http2_stream_proto_init(nxd_http_server_proto* hsp, nxp_pool* nxb_pool, nxd_http2_stream* st);
+void nxd_http_server_proto_upgrade_http2(nxd_http_server_proto* hsp, nxd_http2_server_proto* h2);
 
 enum nxd_http_client_proto_state {
   HCP_CONNECTING=0,
@@ -25,9 +25,6 @@
 #endif
 #define _FILE_OFFSET_BITS 64
 
-#define MEM_GUARD 64
-#define nx_alloc(size) memalign(MEM_GUARD, (size)+MEM_GUARD)
-
 #define REVISION VERSION
 
 #include "nxweb_config.h"
@@ -39,8 +36,10 @@
 #include "nx_buffer.h"
 #include "nx_file_reader.h"
 #include "nx_event.h"
+#include "nx_refcache.h"
 #include "misc.h"
 #include "nx_workers.h"
+#include "nx_topology.h"
 #include "nxjson.h"
 
 #ifdef	__cplusplus
@@ -55,7 +54,8 @@ enum nxweb_timers {
   NXWEB_TIMER_WRITE,
   NXWEB_TIMER_BACKEND,
   NXWEB_TIMER_100CONTINUE,
-  NXWEB_TIMER_ACCEPT_RETRY
+  NXWEB_TIMER_ACCEPT_RETRY,
+  NXWEB_TIMER_EVENT_STREAM_PING
 };
 
 typedef struct nx_simple_map_entry {
@@ -117,6 +117,7 @@ typedef struct nxweb_http_request {
   unsigned chunked_encoding:1;
   unsigned chunked_content_complete:1;
   unsigned keep_alive:1;
+  unsigned connection_upgrade:1; // Connection: Upgrade (WebSocket handshake)
   unsigned sending_100_continue:1;
   unsigned x_forwarded_ssl:1;
   unsigned templates_no_parse:1;
@@ -134,9 +135,11 @@ typedef struct nxweb_http_request {
   const char* content;
   nxe_ssize_t content_length; // -1 = unspecified: chunked or until close
   nxe_size_t content_received;
+  int content_fd; // unlinked temp file holding spilled body (content is mmapped from it); 0 = in memory
   const char* transfer_encoding;
   const char* accept_encoding;
   const char* range;
+  const char* if_range;
   const char* path_info; // points right after uri_handler's prefix
 
   time_t if_modified_since;
@@ -147,6 +150,8 @@ typedef struct nxweb_http_request {
   nxweb_http_header* headers;
   nxweb_http_parameter* parameters;
   nxweb_http_cookie* cookies;
+  struct nxweb_param_index* param_index; // lazy index of query string & url-encoded post data
+  struct nxweb_param_index* cookie_index; // lazy index of cookie header
 
   struct nxweb_http_request* parent_req; // for subrequests
   uint64_t uid; // unique request id
@@ -179,6 +184,7 @@ typedef struct nxweb_http_response {
   unsigned templates_on:1;
   unsigned no_cache:1;
   unsigned cache_private:1;
+  unsigned accept_ranges:1;
 
   int run_filter_idx;
 
@@ -357,21 +363,15 @@ int nxweb_setup_http_proxy_pool(int idx, const char* host_and_port);
 void nxweb_set_timeout(enum nxweb_timers timer_idx, nxe_time_t timeout);
 void nxweb_run(uint16_t max_net_threads);
 
-void nxweb_parse_request_parameters(nxweb_http_request *req, int preserve_uri); // Modifies conn->uri and request_body content (does url_decode inplace)
-void nxweb_parse_request_cookies(nxweb_http_request *req); // Modifies conn->cookie content (does url_decode inplace)
+void nxweb_parse_request_parameters(nxweb_http_request *req, int preserve_uri); // Builds req->parameters list; cuts query string off req->uri unless preserve_uri
+void nxweb_parse_request_cookies(nxweb_http_request *req); // Builds req->cookies list
+const char* nxweb_get_request_parameter(nxweb_http_request *req, const char* name); // indexes parameters on first call; decodes only requested value
+const char* nxweb_get_request_cookie(nxweb_http_request *req, const char* name);
 
 static inline const char* nxweb_get_request_header(nxweb_http_request *req, const char* name) {
   return req->headers? nx_simple_map_get_nocase(req->headers, name) : 0;
 }
 
-static inline const char* nxweb_get_request_parameter(nxweb_http_request *req, const char* name) {
-  return req->parameters? nx_simple_map_get(req->parameters, name) : 0;
-}
-
-static inline const char* nxweb_get_request_cookie(nxweb_http_request *req, const char* name) {
-  return req->cookies? nx_simple_map_get(req->cookies, name) : 0;
-}
-
 static inline int nxweb_url_prefix_match(const char* url, int url_len, const char* prefix, int prefix_len) {
   if (url_len<prefix_len) return 0;
   char endc=url[prefix_len];
@@ -434,9 +434,20 @@ int nxweb_send_file(nxweb_http_response *resp, char* fpath, const struct stat* f
         off_t offset, size_t size, const nxweb_mime_type* mtype, const char* charset); // finfo and mtype could be null => autodetect
 void nxweb_send_data(nxweb_http_response *resp, const void* data, size_t size, const char* content_type);
 
+int nxweb_fd_cache_stat(const char* fpath, struct stat* finfo, int cached_only); // returns -2 if cached_only and not in cache
+int nxweb_fd_cache_open(const char* fpath, int cached_only); // O_RDONLY|O_NONBLOCK; release fd by nxweb_fd_cache_close(); returns -2 if cached_only and no open fd in cache
+void nxweb_fd_cache_close(int fd); // closes fds not owned by the cache as well
+
 int nxweb_format_http_time(char* buf, struct tm* tm); // eg. Tue, 24 Jan 2012 13:05:54 GMT
 int nxweb_format_iso8601_time(char* buf, struct tm* tm); // YYYY-MM-DDTHH:MM:SS
 time_t nxweb_parse_http_time(const char* str);
+
+typedef struct nxweb_http_range {
+  off_t start;
+  off_t end; // exclusive
+} nxweb_http_range;
+
+int nxweb_parse_http_range(const char* range, off_t length, nxweb_http_range* ranges, int max_ranges); // returns number of satisfiable ranges or -1 if Range header must be ignored
 int nxweb_remove_dots_from_uri_path(char* path);
 
 void nxweb_set_request_data(nxweb_http_request* req, nxe_data key, nxe_data value, nxweb_http_request_data_finalizer finalize);
@@ -446,8 +457,14 @@ nxe_data nxweb_get_request_data(nxweb_http_request* req, nxe_data key);
 typedef struct nxweb_composite_stream_node {
   nxd_streamer_node snode;
   struct nxweb_composite_stream_node* next;
+  struct nxweb_composite_stream* cs;
   int fd;
   nxweb_http_server_connection* subconn;
+  _Bool bytes:1;
+  _Bool fd_cached:1; // fd is released by nxweb_fd_cache_close()
+  char* coalesce_buf; // small adjacent byte nodes get merged here (NXWEB_CS_COALESCE_SIZE)
+  struct nxweb_cache_rec* cache_rec; // memcache record referenced by fast path node
+  const char* fragment_key; // subrequest key for fast path lookups
   union {
     nxd_obuffer ob;
     nxd_fbuffer fb;
@@ -459,6 +476,7 @@ typedef struct nxweb_composite_stream {
   nxweb_http_server_connection* conn;
   nxweb_http_request* req;
   nxweb_composite_stream_node* first_node;
+  nxweb_composite_stream_node* last_node;
 } nxweb_composite_stream;
 
 nxweb_composite_stream* nxweb_composite_stream_init(nxweb_http_server_connection* conn, nxweb_http_request* req);
@@ -518,6 +536,9 @@ extern nxweb_filter ssi_filter;
 extern nxweb_filter templates_filter;
 
 #include "templates.h"
+#include "pubsub.h"
+#include "websocket.h"
+#include "event_stream.h"
 
 #ifdef	__cplusplus
 }
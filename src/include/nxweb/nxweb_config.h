@@ -31,14 +31,52 @@ extern "C" {
 #define NXWEB_MAX_LISTEN_SOCKETS 4
 #define NXWEB_MAX_PROXY_POOLS 4
 #define NXWEB_MAX_REQUEST_HEADERS_SIZE 4096
-#define NXWEB_MAX_REQUEST_BODY_SIZE 512000
+#define NXWEB_MAX_REQUEST_BODY_SIZE 512000 // default limit; handler's max_body_size overrides
+#define NXWEB_REQUEST_BODY_MEMORY_LIMIT 512000 // larger bodies are spilled to temp file (see http_request_body.c)
+#define NXWEB_REQUEST_BODY_BLOCK_SIZE 131072 // temp file write unit; one block is filled while other is written
+#define NXWEB_REQUEST_BODY_RING_SIZE 65536 // net thread => worker ring for in-worker on_post_data_chunk()
+#define NXWEB_DEFAULT_REQUEST_BODY_TEMP_DIR "/tmp"
 #define NXWEB_RBUF_SIZE 16384
 #define NXWEB_PROXY_RETRY_COUNT 4
 #define NXWEB_CONN_NXB_SIZE (NXWEB_MAX_REQUEST_HEADERS_SIZE+1024)
+#define NXWEB_DEFAULT_CONN_POOL_SIZE 8 // initial per-thread capacity; can be overriden in config
+#define NXWEB_DEFAULT_RBUF_POOL_SIZE 2
+#define NXWEB_CS_NODE_POOL_SIZE 64 // initial per-thread capacity of composite stream node pool
+#define NXWEB_CS_COALESCE_SIZE 2048 // adjacent byte nodes of composite stream are merged up to this size
+#define NXWEB_SHED_RETRY_AFTER "1" // Retry-After header value for shed requests (seconds)
+#define NXWEB_DEFAULT_POOL_GC_HOLD_TIME 2000000 // micro-seconds a spare pool chunk is kept before release
 #define NXWEB_MAX_FILTERS 16
 #define NXWEB_DEFAULT_CACHED_TIME 30000000
+#define NXWEB_MAX_RANGES 16 // more ranges in Range header => send whole entity
 #define NXWEB_MAX_CACHED_ITEMS 500
 #define NXWEB_MAX_CACHED_ITEM_SIZE 32768
+#define NXWEB_MAX_SUBREQUEST_FAST_PATHS 1000 // remembered static subrequest targets (see http_subrequest.c)
+#define NXWEB_DEFAULT_FD_CACHE_SIZE 4096 // stat results & open fds of static files kept (see fd_cache.c)
+#define NXWEB_DEFAULT_FD_CACHE_TTL 1000000 // micro-seconds before fd cache entry is rechecked by stat()
+#define NXWEB_FC_SEGMENT_SIZE 64 // MB; segment file size of file_cache "segments" store (see fc_segment_store.c)
+#define NXWEB_FC_SEGMENT_STORE_MAX_SIZE 1024 // MB; oldest segments are evicted beyond this
+#define NXWEB_FC_SEGMENT_COMPACT_PERCENT 50 // sealed segments with less live data are compacted
+#define NXWEB_FC_SEGMENT_MAINTENANCE_INTERVAL 10 // seconds between background compaction runs
+#define NXWEB_DEFAULT_SSL_SESSION_CACHE_SIZE 20480 // TLS sessions kept for session id resumption (see ssl_session_cache.c)
+#define NXWEB_SSL_SESSION_CACHE_SHARDS 16 // power of 2; each shard has own lock & LRU
+#define NXWEB_MAX_SSL_HANDSHAKE_THREADS 64
+#define NXWEB_DEFAULT_SSL_SESSION_TIMEOUT 3600 // seconds; session & ticket lifetime
+#define NXWEB_DEFAULT_SSL_TICKET_KEY_ROTATION 43200 // seconds between session ticket key changes (0 = never)
+#define NXWEB_SSL_TICKET_KEY_NAMES 8 // ticket key_names remembered per master key (gnutls derives new one every few hours)
+#define NXWEB_HTTP2_MAX_STREAMS 128 // SETTINGS_MAX_CONCURRENT_STREAMS
+#define NXWEB_HTTP2_STREAM_WINDOW 131072 // request body bytes buffered per stream (SETTINGS_INITIAL_WINDOW_SIZE)
+#define NXWEB_HTTP2_CONN_WINDOW 1048576 // request body bytes in flight per connection
+#define NXWEB_HTTP2_MAX_FRAME_SIZE 16384 // largest frame we accept; responses use peer's SETTINGS_MAX_FRAME_SIZE
+#define NXWEB_HTTP2_HEADER_TABLE_SIZE 4096 // HPACK dynamic table size in both directions
+#define NXWEB_HTTP2_MAX_HEADER_LIST_SIZE 16384 // decoded request headers per stream
+#define NXWEB_HTTP2_OUTPUT_BUFFER_SIZE 65536 // frames queued ahead of socket; scheduler stops filling beyond this
+#define NXWEB_HTTP2_PRIORITY_QUANTUM 1024 // bytes per unit of stream weight per scheduling round
+#define NXWEB_WEBSOCKET_MAX_MESSAGE_SIZE 1048576 // larger incoming messages are refused with close code 1009
+#define NXWEB_WEBSOCKET_IBUF_SIZE 4096 // initial input buffer; grows up to whole frame
+#define NXWEB_WEBSOCKET_MAX_QUEUED_MESSAGES 256 // per connection; slow consumer beyond this is closed with 1008
+#define NXWEB_EVENT_STREAM_MAX_QUEUED_EVENTS 256 // per stream; slow consumer beyond this gets its stream ended
+#define NXWEB_ROUTER_MAX_MATCHES 32 // router nodes matching one request; dispatcher scans handler list beyond this
+#define NXWEB_ROUTER_MIN_HANDLERS 32 // shorter handler lists are scanned linearly (faster than router below ~30 routes)
 
 #ifdef NX_DEBUG
 #define NXWEB_MAX_NET_THREADS 1
@@ -54,6 +92,7 @@ extern "C" {
 #define NXWEB_DEFAULT_BACKEND_TIMEOUT 2000000
 #define NXWEB_DEFAULT_100CONTINUE_TIMEOUT 1500000
 #define NXWEB_DEFAULT_ACCEPT_RETRY_TIMEOUT 500000
+#define NXWEB_DEFAULT_EVENT_STREAM_PING_TIMEOUT 10000000 // idle event streams; capped at third of write timeout
 
 
 #ifdef	__cplusplus
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NXWEB_PUBSUB_H
+#define	NXWEB_PUBSUB_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Subscriber lists, cross-thread delivery and outgoing frame queues shared
+ * by websocket channels and event stream topics. Endpoint (websocket, event
+ * stream) lives in one net thread; list keeps one sublist per net thread,
+ * touched by that thread only. Payload is refcounted prebuilt frame queued
+ * by pointer. Other threads reach an endpoint or a thread's sublist through
+ * the inbox of that net thread.
+ */
+
+typedef struct nxweb_frame {
+  int refcount;
+  int size;
+  char data[]; // ready to write as is
+} nxweb_frame;
+
+typedef struct nxweb_frame_queue {
+  nxweb_frame** ring; // allocated on first push; grows up to limit given to push
+  int size;
+  int first;
+  int count;
+  int offset; // bytes of ring[first] already written
+  int retry_size; // write that returned nothing must be repeated as is (gnutls)
+} nxweb_frame_queue;
+
+typedef struct nxweb_subscriber_list {
+  struct nxweb_subscription* first[NXWEB_MAX_NET_THREADS]; // each list is touched by its net thread only
+  int count[NXWEB_MAX_NET_THREADS];
+} nxweb_subscriber_list;
+
+typedef struct nxweb_subscription {
+  nxweb_subscriber_list* list;
+  void* endpoint;
+  int thread_num;
+  struct nxweb_subscription* prev; // in list's sublist
+  struct nxweb_subscription* next;
+  struct nxweb_subscription* next_of_endpoint;
+} nxweb_subscription;
+
+typedef struct nxweb_pubsub_class {
+  const char* name; // for debug log
+  int (*send)(void* endpoint, nxweb_frame* frame); // net thread of endpoint; 0 = queued (takes own frame reference)
+  void (*endpoint_ref)(void* endpoint);
+  void (*endpoint_unref)(void* endpoint);
+  void (*list_ref)(nxweb_subscriber_list* list); // optional; keeps list alive while inbox items refer to it
+  void (*list_unref)(nxweb_subscriber_list* list);
+} nxweb_pubsub_class;
+
+// any thread:
+nxweb_frame* _nxweb_frame_alloc(int size); // refcount=1
+void nxweb_frame_unref(nxweb_frame* frame);
+
+static inline void nxweb_frame_ref(nxweb_frame* frame) {
+  __sync_add_and_fetch(&frame->refcount, 1);
+}
+
+// net thread of endpoint only:
+int _nxweb_frame_queue_push(nxweb_frame_queue* q, nxweb_frame* frame, int limit); // takes own reference; -1 = limit reached
+void _nxweb_frame_queue_drop(nxweb_frame_queue* q); // drops all but partially written frame
+void _nxweb_frame_queue_clear(nxweb_frame_queue* q); // drops all and frees ring
+nxe_size_t _nxweb_frame_queue_write(nxweb_frame_queue* q, nxe_istream* is, nxe_ostream* os); // returns bytes written
+int _nxweb_pubsub_subscribe(nxweb_subscription** subscriptions, nxweb_subscriber_list* list, void* endpoint, int thread_num); // 1 = new subscription
+int _nxweb_pubsub_unsubscribe(nxweb_subscription** subscriptions, nxweb_subscriber_list* list); // 1 = was subscribed
+void _nxweb_pubsub_unsubscribe_all(nxweb_subscription** subscriptions);
+
+// any thread:
+int _nxweb_pubsub_post(const nxweb_pubsub_class* cls, nxweb_net_thread_data* tdata, void* endpoint, nxweb_frame* frame); // 0 = posted to endpoint's net thread
+int _nxweb_pubsub_publish(const nxweb_pubsub_class* cls, nxweb_subscriber_list* list, nxweb_frame* frame); // returns number of net threads reached
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* NXWEB_PUBSUB_H */
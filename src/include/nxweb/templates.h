@@ -27,11 +27,17 @@ extern "C" {
 // max number of directive arguments:
 #define NXT_MAX_ARGS 32
 // max number of block names in template tree:
-#define NXT_MAX_BLOCKS 2048
+#define NXT_MAX_BLOCKS 65536
+// initial size of block names array (grows by doubling):
+#define NXT_INITIAL_BLOCKS 16
 // max nesting level of blocks inside blocks:
 #define NXT_MAX_BLOCK_NESTING 64
 // max inheritance (extends/use) level (to prevent recursion):
 #define NXT_MAX_INHERITANCE_LEVEL 32
+// max number of compiled templates kept in memory:
+#define NXT_MAX_COMPILED_TEMPLATES 500
+// compiled template is rebuilt (dependencies rechecked) after this time (usec):
+#define NXT_COMPILED_TEMPLATE_TTL NXWEB_DEFAULT_CACHED_TIME
 
 enum nxt_cmd {
   NXT_EOF=-1,
@@ -46,12 +52,11 @@ enum nxt_cmd {
 };
 
 typedef struct nxt_block_name {
-//  union {
-//    uint64_t h;
-//    char pfx[8];
-//  } name_hash;
+  uint32_t name_hash;
   const char* name;
   struct nxt_block* block; // assigned on merge
+  struct nxt_file* last_file; // file being parsed when block was last created
+  struct nxt_block* last_file_block; // its block with this name
 } nxt_block_name;
 
 struct nxt_context;
@@ -60,15 +65,28 @@ struct nxt_block;
 
 typedef int (*nxt_loader)(struct nxt_context* ctx, const char* uri, struct nxt_file* dst_file, struct nxt_block* dst_block); // function to make subrequests
 
+typedef struct nxt_dependency { // file the compiled template was built from
+  const char* fpath;
+  time_t mtime;
+  struct nxt_dependency* next;
+} nxt_dependency;
+
 typedef struct nxt_context {
   struct nxt_file* start_file;
   nxt_loader load; // function to make subrequests
   nxe_data loader_data;
   nxb_buffer* nxb;
-  nxt_block_name block_names[NXT_MAX_BLOCKS];
+  nxt_block_name* block_names;
+  int block_names_size;
   int next_free_block_id;
+  int* name_index; // open addressing hash of block ids by name; -1 = empty slot
+  int name_index_mask;
   int files_pending;
+  nxt_dependency* deps; // every template & static include file of the tree
+  int num_deps;
+  int deps_size; // bytes needed to copy fpaths
   unsigned error:1;
+  unsigned uncacheable:1; // some template in the tree has no mtime
 } nxt_context;
 
 typedef struct nxt_file {
@@ -78,6 +96,7 @@ typedef struct nxt_file {
   struct nxt_file* next_parent; // sibling
   //struct nxt_file* next; // within context
   struct nxt_block* first_block;
+  struct nxt_block* last_block;
   char* content;
   int content_length;
   int inheritance_level;
@@ -93,7 +112,10 @@ typedef struct nxt_value_part {
 typedef struct nxt_block {
   int id;
   _Bool clear_on_append:1;
+  _Bool dynamic:1; // included content has no mtime => fetch it on every request
+  const char* include_uri; // for included blocks
   nxt_value_part* value;
+  nxt_value_part* last_value;
   struct nxt_block* parent; // assigned on merge
   struct nxt_block* next; // within file
 } nxt_block;
@@ -104,11 +126,36 @@ nxt_file* nxt_file_create(nxt_context* ctx, const char* uri);
 int nxt_parse_file(nxt_file* file, char* buf, int buf_len);
 nxt_value_part* nxt_block_append_value(nxt_context* ctx, nxt_block* blk, const char* text, int text_len, int insert_after_text_id);
 void nxt_merge(nxt_context* ctx);
+void nxt_add_dependency(nxt_context* ctx, const char* fpath, time_t mtime);
 char* nxt_serialize(nxt_context* ctx);
 void nxt_serialize_to_cs(nxt_context* ctx, nxweb_composite_stream* cs);
 
 static inline int nxt_is_complete(nxt_context* ctx) { return !ctx->files_pending; }
 
+// Compiled template: merged template tree flattened into text segments,
+// each optionally followed by dynamic include. Immutable once stored in cache.
+
+typedef struct nxt_compiled_node {
+  const char* text;
+  int text_len;
+  const char* include_uri; // dynamic include to insert after text (or null)
+} nxt_compiled_node;
+
+typedef struct nxt_compiled {
+  nx_refcache_entry entry; // must be first; entry.mtime is start template mtime
+  time_t last_modified; // max mtime of the whole tree; 0 if it has dynamic includes
+  int num_nodes;
+  nxt_compiled_node* nodes;
+  int num_deps;
+  nxt_dependency* deps; // revalidated on each cache hit
+} nxt_compiled;
+
+nxt_compiled* nxt_compile(nxt_context* ctx, const char* key, time_t mtime, time_t last_modified); // call after nxt_merge()
+nxt_compiled* nxt_cache_get(const char* key, time_t mtime, nxe_time_t loop_time);
+void nxt_cache_store(nxt_compiled* tc, nxe_time_t loop_time);
+void nxt_compiled_unref(nxt_compiled* tc);
+void nxt_compiled_to_cs(nxt_compiled* tc, nxweb_composite_stream* cs);
+
 #ifdef	__cplusplus
 }
 #endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NXWEB_WEBSOCKET_H
+#define	NXWEB_WEBSOCKET_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * WebSocket (RFC 6455) endpoints. Handler with on_ws_message upgrades GET
+ * requests carrying WebSocket handshake; frames are then parsed in the net
+ * thread of the connection and whole messages are passed to on_ws_message.
+ *
+ * Outgoing messages are refcounted prebuilt frames queued to connections by
+ * pointer, so the same message can be sent to any number of connections
+ * without copying. Channels fan a message out to all their subscribers:
+ * each net thread having subscribers receives one reference to it.
+ */
+
+enum nxweb_ws_close_code {
+  NXWEB_WS_CLOSE_NORMAL=1000,
+  NXWEB_WS_CLOSE_GOING_AWAY=1001,
+  NXWEB_WS_CLOSE_PROTOCOL_ERROR=1002,
+  NXWEB_WS_CLOSE_UNSUPPORTED_DATA=1003,
+  NXWEB_WS_CLOSE_NO_STATUS=1005, // close frame had no code
+  NXWEB_WS_CLOSE_ABNORMAL=1006, // connection dropped without close frame
+  NXWEB_WS_CLOSE_INVALID_DATA=1007,
+  NXWEB_WS_CLOSE_POLICY_VIOLATION=1008,
+  NXWEB_WS_CLOSE_MESSAGE_TOO_BIG=1009,
+  NXWEB_WS_CLOSE_INTERNAL_ERROR=1011
+};
+
+typedef nxweb_frame nxweb_ws_message; // complete unmasked frame
+
+typedef struct nxweb_websocket {
+  nxe_ostream data_in;
+  nxe_istream data_out;
+  nxe_timer timer_keep_alive; // idle: ping, then close if still idle
+  nxe_timer timer_close; // waiting for peer's close frame
+  nxe_timer timer_write;
+  struct nxweb_http_server_connection* conn; // 0 once connection is closed
+  nxweb_handler* handler;
+  nxweb_net_thread_data* tdata;
+  nxe_data data; // for application use
+  int refcount;
+  struct nxweb_websocket* prev; // in list of this net thread's websockets
+  struct nxweb_websocket* next;
+  char* ibuf; // incoming frames; grows to hold whole frame
+  int ibuf_len;
+  int ibuf_size;
+  char* msg; // fragmented message being assembled
+  int msg_len;
+  int msg_size;
+  uint8_t msg_opcode; // 0 = no fragmented message in progress
+  nxweb_frame_queue out; // up to NXWEB_WEBSOCKET_MAX_QUEUED_MESSAGES+2 for pong & close
+  nxweb_subscription* subscriptions;
+  int close_code; // received from peer
+  _Bool close_sent:1;
+  _Bool close_received:1;
+  _Bool closed:1; // close handshake done, connection is going away
+  _Bool got_input:1; // since last keep-alive timeout
+  _Bool ping_sent:1;
+} nxweb_websocket;
+
+typedef struct nxweb_ws_channel {
+  const char* name;
+  nxweb_subscriber_list subscribers;
+} nxweb_ws_channel; // zero-initialize, e.g. static nxweb_ws_channel chat={.name="chat"};
+
+// net thread of websocket only:
+int nxweb_websocket_send(nxweb_websocket* ws, const void* data, nxe_size_t size, _Bool binary); // 0 = queued
+int nxweb_websocket_send_message(nxweb_websocket* ws, nxweb_ws_message* msg); // takes own reference
+void nxweb_websocket_close(nxweb_websocket* ws, int code); // sends remaining queued messages first
+int nxweb_ws_channel_subscribe(nxweb_ws_channel* ch, nxweb_websocket* ws);
+void nxweb_ws_channel_unsubscribe(nxweb_ws_channel* ch, nxweb_websocket* ws);
+
+// any thread:
+nxweb_ws_message* nxweb_ws_message_create(const void* data, nxe_size_t size, _Bool binary);
+void nxweb_websocket_ref(nxweb_websocket* ws); // keeps ws struct (not connection) alive for use in other threads
+void nxweb_websocket_unref(nxweb_websocket* ws);
+int nxweb_websocket_post(nxweb_websocket* ws, const void* data, nxe_size_t size, _Bool binary); // 0 = posted to its net thread
+int nxweb_ws_channel_publish(nxweb_ws_channel* ch, const void* data, nxe_size_t size, _Bool binary); // returns number of net threads reached
+
+static inline void nxweb_ws_message_ref(nxweb_ws_message* msg) {
+  nxweb_frame_ref(msg);
+}
+
+static inline void nxweb_ws_message_unref(nxweb_ws_message* msg) {
+  nxweb_frame_unref(msg);
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* NXWEB_WEBSOCKET_H */
@@ -19,7 +19,10 @@
 
 #include "nxweb.h"
 #include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <sys/fcntl.h>
 
 #include "deps/ulib/alignhash_tpl.h"
@@ -31,13 +34,37 @@ typedef struct nxweb_cache_rec {
   const char* content_charset;
   nxe_time_t expires_time;
   time_t last_modified;
+  time_t file_mtime; // of the file content was read from (to validate snapshot on load)
+  off_t file_size;
   uint32_t ref_count;
   struct nxweb_cache_rec* prev;
   struct nxweb_cache_rec* next;
   _Bool gzip_encoded:1;
-  char content[];
+  char content[]; // followed by '\0', key, '\0', file path, '\0'
 } nxweb_cache_rec;
 
+#define NXWEB_CACHE_SNAPSHOT_SIGNATURE (0x736d786e)
+#define NXWEB_CACHE_SNAPSHOT_VERSION 1
+
+typedef struct nxweb_cache_snapshot_item {
+  int64_t content_length;
+  int64_t last_modified;
+  int64_t file_mtime;
+  int64_t file_size;
+  uint16_t key_len;
+  uint16_t fpath_len;
+  uint16_t content_type_len;
+  uint16_t content_charset_len;
+  uint8_t gzip_encoded;
+  uint8_t has_content;
+  uint8_t reserved[6];
+} nxweb_cache_snapshot_item; // followed by key, fpath, content_type, content_charset, [content]
+
+typedef struct nxweb_cache_string { // interned content types & charsets of warm-loaded records
+  struct nxweb_cache_string* next;
+  char str[];
+} nxweb_cache_string;
+
 #define nxweb_cache_hash_fn(key) hash_sdbm((const unsigned char*)(key))
 #define nxweb_cache_eq_fn(a, b) (!strcmp((a), (b)))
 
@@ -47,9 +74,22 @@ static alignhash_t(nxweb_cache) *_nxweb_cache;
 static nxweb_cache_rec* _nxweb_cache_head;
 static nxweb_cache_rec* _nxweb_cache_tail;
 static pthread_mutex_t _nxweb_cache_mutex;
+static nxweb_cache_string* _nxweb_cache_strings;
+static pthread_t _nxweb_cache_loader;
+static _Bool _nxweb_cache_loader_started;
+static volatile _Bool _nxweb_cache_loader_stop;
 
 #define IS_LINKED(rec) ((rec)->prev || _nxweb_cache_head==(rec))
 
+static inline const char* cache_rec_key(nxweb_cache_rec* rec) {
+  return rec->content+rec->content_length+1;
+}
+
+static inline const char* cache_rec_fpath(nxweb_cache_rec* rec) {
+  const char* key=cache_rec_key(rec);
+  return key+strlen(key)+1;
+}
+
 static inline void cache_rec_link(nxweb_cache_rec* rec) {
   // add to head
   rec->prev=0;
@@ -68,13 +108,175 @@ static inline void cache_rec_unlink(nxweb_cache_rec* rec) {
   rec->prev=0;
 }
 
+static void cache_check_size();
+
+static const char* cache_intern_string(const char* str, int len) { // call under mutex
+  nxweb_cache_string* cs;
+  for (cs=_nxweb_cache_strings; cs; cs=cs->next) {
+    if (!strncmp(cs->str, str, len) && !cs->str[len]) return cs->str;
+  }
+  cs=malloc(sizeof(nxweb_cache_string)+len+1);
+  memcpy(cs->str, str, len);
+  cs->str[len]='\0';
+  cs->next=_nxweb_cache_strings;
+  _nxweb_cache_strings=cs;
+  return cs->str;
+}
+
+static int cache_write_string(FILE* f, const char* str) {
+  return !str || fwrite(str, strlen(str), 1, f)==1? 0 : -1;
+}
+
+static void cache_save_snapshot(const char* fpath) {
+  char tmp_fpath[1024];
+  snprintf(tmp_fpath, sizeof(tmp_fpath), "%s.tmp", fpath);
+  if (nxweb_mkpath(tmp_fpath, 0755)==-1) {
+    nxweb_log_error("can't create path to memcache snapshot %s; check permissions", tmp_fpath);
+    return;
+  }
+  FILE* f=fopen(tmp_fpath, "w");
+  if (!f) {
+    nxweb_log_error("can't create memcache snapshot %s; errno=%d", tmp_fpath, errno);
+    return;
+  }
+  uint32_t hdr[2]={NXWEB_CACHE_SNAPSHOT_SIGNATURE, NXWEB_CACHE_SNAPSHOT_VERSION};
+  int count=0, err=fwrite(hdr, sizeof(hdr), 1, f)!=1;
+  nxweb_cache_rec* rec;
+  for (rec=_nxweb_cache_tail; rec && !err; rec=rec->prev) { // oldest first => loader restores LRU order
+    if (!rec->file_mtime) continue; // can't validate
+    const char* key=cache_rec_key(rec);
+    const char* fpath=cache_rec_fpath(rec);
+    nxweb_cache_snapshot_item item={
+      .content_length=rec->content_length, .last_modified=rec->last_modified,
+      .file_mtime=rec->file_mtime, .file_size=rec->file_size,
+      .key_len=strlen(key), .fpath_len=strlen(fpath),
+      .content_type_len=rec->content_type? strlen(rec->content_type) : 0,
+      .content_charset_len=rec->content_charset? strlen(rec->content_charset) : 0,
+      .gzip_encoded=rec->gzip_encoded, .has_content=nxweb_server_config.memcache_snapshot_contents
+    };
+    err=fwrite(&item, sizeof(item), 1, f)!=1
+        || cache_write_string(f, key) || cache_write_string(f, fpath)
+        || cache_write_string(f, rec->content_type) || cache_write_string(f, rec->content_charset)
+        || (item.has_content && rec->content_length && fwrite(rec->content, rec->content_length, 1, f)!=1);
+    count++;
+  }
+  if (fclose(f) || err) {
+    nxweb_log_error("can't write memcache snapshot %s", tmp_fpath);
+    unlink(tmp_fpath);
+    return;
+  }
+  if (rename(tmp_fpath, fpath)==-1) {
+    nxweb_log_error("can't rename memcache snapshot %s into %s", tmp_fpath, fpath);
+    unlink(tmp_fpath);
+    return;
+  }
+  nxweb_log_error("memcache snapshot: %d items saved to %s", count, fpath);
+}
+
+#define CACHE_SNAPSHOT_TYPES_SIZE (2*65536) // content_type_len & content_charset_len are 16-bit
+
+static nxweb_cache_rec* cache_load_item(FILE* f, const nxweb_cache_snapshot_item* item, char* types) {
+  nxweb_cache_rec* rec=nx_calloc(sizeof(nxweb_cache_rec)+item->content_length+1+item->key_len+1+item->fpath_len+1);
+  char* key=rec->content+item->content_length+1;
+  char* fpath=key+item->key_len+1;
+  if (fread(key, item->key_len, 1, f)!=1 || fread(fpath, item->fpath_len, 1, f)!=1
+      || (item->content_type_len+item->content_charset_len
+          && fread(types, item->content_type_len+item->content_charset_len, 1, f)!=1)
+      || (item->has_content && item->content_length && fread(rec->content, item->content_length, 1, f)!=1)) {
+    nx_free(rec);
+    return 0;
+  }
+  rec->content_length=item->content_length;
+  rec->last_modified=item->last_modified;
+  rec->file_mtime=item->file_mtime;
+  rec->file_size=item->file_size;
+  rec->gzip_encoded=item->gzip_encoded;
+  struct stat finfo;
+  if (stat(fpath, &finfo)==-1 || !S_ISREG(finfo.st_mode) || finfo.st_mtime!=rec->file_mtime || finfo.st_size!=rec->file_size) {
+    nx_free(rec); // file changed since snapshot
+    return (nxweb_cache_rec*)-1;
+  }
+  if (!item->has_content) {
+    int fd=open(fpath, O_RDONLY);
+    if (fd==-1 || pread(fd, rec->content, rec->content_length, 0)!=rec->content_length) {
+      if (fd!=-1) close(fd);
+      nx_free(rec);
+      return (nxweb_cache_rec*)-1;
+    }
+    close(fd);
+  }
+  pthread_mutex_lock(&_nxweb_cache_mutex);
+  rec->content_type=item->content_type_len? cache_intern_string(types, item->content_type_len) : 0;
+  rec->content_charset=item->content_charset_len? cache_intern_string(types+item->content_type_len, item->content_charset_len) : 0;
+  pthread_mutex_unlock(&_nxweb_cache_mutex);
+  return rec;
+}
+
+static void cache_load_snapshot(const char* fpath) {
+  FILE* f=fopen(fpath, "r");
+  if (!f) return; // no snapshot yet
+  uint32_t hdr[2];
+  if (fread(hdr, sizeof(hdr), 1, f)!=1 || hdr[0]!=NXWEB_CACHE_SNAPSHOT_SIGNATURE || hdr[1]!=NXWEB_CACHE_SNAPSHOT_VERSION) {
+    nxweb_log_error("invalid memcache snapshot %s", fpath);
+    fclose(f);
+    return;
+  }
+  nxe_time_t expires_time=nxe_get_time_usec()+NXWEB_DEFAULT_CACHED_TIME;
+  int loaded=0, stale=0;
+  nxweb_cache_snapshot_item item;
+  char* types=nx_alloc(CACHE_SNAPSHOT_TYPES_SIZE); // reused for all items
+  while (!_nxweb_cache_loader_stop && fread(&item, sizeof(item), 1, f)==1) {
+    if (item.content_length<0 || item.content_length>NXWEB_MAX_CACHED_ITEM_SIZE) break; // corrupt
+    nxweb_cache_rec* rec=cache_load_item(f, &item, types);
+    if (!rec) break; // truncated
+    if (rec==(nxweb_cache_rec*)-1) {
+      stale++;
+      continue;
+    }
+    rec->expires_time=expires_time;
+    int ret=0;
+    pthread_mutex_lock(&_nxweb_cache_mutex);
+    ah_iter_t ci=alignhash_set(nxweb_cache, _nxweb_cache, cache_rec_key(rec), &ret);
+    if (ci!=alignhash_end(_nxweb_cache) && ret!=AH_INS_ERR) {
+      alignhash_value(_nxweb_cache, ci)=rec;
+      cache_rec_link(rec);
+      cache_check_size();
+      loaded++;
+      rec=0;
+    }
+    pthread_mutex_unlock(&_nxweb_cache_mutex);
+    if (rec) nx_free(rec); // already cached by live request
+  }
+  nx_free(types);
+  fclose(f);
+  nxweb_log_error("memcache warm-load: %d items loaded from %s (%d stale)", loaded, fpath, stale);
+}
+
+static void* cache_loader_main(void* param) {
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, 0); // signals are handled by main thread
+  cache_load_snapshot(param);
+  return 0;
+}
+
 static int cache_init() {
   pthread_mutex_init(&_nxweb_cache_mutex, 0);
   _nxweb_cache=alignhash_init(nxweb_cache);
+  if (nxweb_server_config.memcache_snapshot_file) { // load in background; server starts serving meanwhile
+    _nxweb_cache_loader_stop=0;
+    _nxweb_cache_loader_started=!pthread_create(&_nxweb_cache_loader, 0, cache_loader_main, (void*)nxweb_server_config.memcache_snapshot_file);
+  }
   return 0;
 }
 
 static void cache_finalize() {
+  if (_nxweb_cache_loader_started) {
+    _nxweb_cache_loader_stop=1;
+    pthread_join(_nxweb_cache_loader, 0);
+    _nxweb_cache_loader_started=0;
+  }
+  if (nxweb_server_config.memcache_snapshot_file) cache_save_snapshot(nxweb_server_config.memcache_snapshot_file);
   ah_iter_t ci;
   for (ci=alignhash_begin(_nxweb_cache); ci!=alignhash_end(_nxweb_cache); ci++) {
     if (alignhash_exist(_nxweb_cache, ci)) {
@@ -85,12 +287,17 @@ static void cache_finalize() {
     }
   }
   alignhash_destroy(nxweb_cache, _nxweb_cache);
+  while (_nxweb_cache_strings) {
+    nxweb_cache_string* cs=_nxweb_cache_strings;
+    _nxweb_cache_strings=cs->next;
+    free(cs);
+  }
   pthread_mutex_destroy(&_nxweb_cache_mutex);
 }
 
 NXWEB_MODULE(cache, .on_server_startup=cache_init, .on_server_shutdown=cache_finalize);
 
-static inline void cache_check_size() {
+static void cache_check_size() {
   while (alignhash_size(_nxweb_cache)>NXWEB_MAX_CACHED_ITEMS) {
     nxweb_cache_rec* rec=_nxweb_cache_tail;
     while (rec && rec->ref_count) rec=rec->prev;
@@ -200,7 +407,7 @@ nxweb_result nxweb_cache_store_response(nxweb_http_server_connection* conn, nxwe
     const char* key=resp->cache_key;
     if (nxweb_cache_try(conn, resp, key, 0, resp->last_modified)!=NXWEB_MISS) return NXWEB_OK;
 
-    nxweb_cache_rec* rec=nx_calloc(sizeof(nxweb_cache_rec)+resp->content_length+1+strlen(key)+1);
+    nxweb_cache_rec* rec=nx_calloc(sizeof(nxweb_cache_rec)+resp->content_length+1+strlen(key)+1+strlen(fpath)+1);
 
     rec->expires_time=loop_time+NXWEB_DEFAULT_CACHED_TIME;
     rec->last_modified=resp->last_modified;
@@ -208,6 +415,8 @@ nxweb_result nxweb_cache_store_response(nxweb_http_server_connection* conn, nxwe
     rec->content_charset=resp->content_charset; // from statically allocated memory, which won't go away
     rec->content_length=resp->content_length;
     rec->gzip_encoded=resp->gzip_encoded;
+    rec->file_mtime=resp->sendfile_info.st_mtime;
+    rec->file_size=resp->sendfile_info.st_size;
     char* ptr=((char*)rec)+offsetof(nxweb_cache_rec, content);
     int fd;
     if ((fd=open(fpath, O_RDONLY))<0 || read(fd, ptr, resp->content_length)!=resp->content_length) {
@@ -223,6 +432,7 @@ nxweb_result nxweb_cache_store_response(nxweb_http_server_connection* conn, nxwe
     *ptr++='\0';
     strcpy(ptr, key);
     key=ptr;
+    strcpy(ptr+strlen(ptr)+1, fpath);
 
     int ret=0;
     ah_iter_t ci;
@@ -264,4 +474,35 @@ nxweb_result nxweb_cache_store_response(nxweb_http_server_connection* conn, nxwe
     nx_free(rec);
   }
   return NXWEB_OK;
-}
\ No newline at end of file
+}
+
+const char* nxweb_cache_response_key(nxweb_http_server_connection* conn, nxweb_http_response* resp) {
+  // key of memcache record the response content is served from (or null)
+  if (conn->hsp.req_finalize!=cache_rec_unref) return 0;
+  nxweb_cache_rec* rec=conn->hsp.req_data;
+  if (resp->content!=rec->content || resp->content_length!=rec->content_length) return 0;
+  return rec->content+rec->content_length+1;
+}
+
+struct nxweb_cache_rec* nxweb_cache_acquire(const char* key, nxe_time_t loop_time, const char** content, nxe_ssize_t* content_length) {
+  nxweb_cache_rec* rec=0;
+  pthread_mutex_lock(&_nxweb_cache_mutex);
+  ah_iter_t ci=alignhash_get(nxweb_cache, _nxweb_cache, key);
+  if (ci!=alignhash_end(_nxweb_cache)) {
+    rec=alignhash_value(_nxweb_cache, ci);
+    if (loop_time <= rec->expires_time) {
+      rec->ref_count++;
+      *content=rec->content;
+      *content_length=rec->content_length;
+    }
+    else {
+      rec=0; // stale => let the handler revalidate
+    }
+  }
+  pthread_mutex_unlock(&_nxweb_cache_mutex);
+  return rec;
+}
+
+void nxweb_cache_release(struct nxweb_cache_rec* rec) {
+  cache_rec_unref(0, rec);
+}
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#include <pthread.h>
+
+/*
+ * Event stream is the content_out of a response that never reaches EOF
+ * until closed. Each net thread keeps its streams in own lists; topics and
+ * cross-thread posts go through pubsub.c, same as websocket channels.
+ * Nothing is allocated per idle stream beyond the stream
+ * itself: queue ring appears with the first event, pings share one frame,
+ * and ping timers sit in a fixed-timeout loop queue (O(1) to rearm).
+ */
+
+#define MAX_QUEUED NXWEB_EVENT_STREAM_MAX_QUEUED_EVENTS
+#define TOPIC_HASH_SIZE 256
+
+static const char event_stream_key; // variable's address only matters
+#define EVENT_STREAM_KEY ((nxe_data)&event_stream_key)
+
+static __thread nxweb_event_stream* thread_streams; // open streams of this net thread
+static nxweb_sse_event* ping_event;
+
+static pthread_mutex_t topics_mux=PTHREAD_MUTEX_INITIALIZER;
+static nxweb_sse_topic* topics[TOPIC_HASH_SIZE];
+static int topics_count; // guarded by topics_mux
+
+static int streams_open;
+static uint64_t streams_total;
+static uint64_t events_sent; // queued to streams, counting each fan-out recipient
+static uint64_t events_published;
+static uint64_t pings_sent;
+static uint64_t slow_consumers;
+
+static char* put_field(char* p, const char* name, int name_len, const char* value, int value_len) {
+  memcpy(p, name, name_len);
+  p+=name_len;
+  memcpy(p, value, value_len);
+  p+=value_len;
+  *p++='\n';
+  return p;
+}
+
+nxweb_sse_event* nxweb_sse_event_create(const char* event, const char* id, const void* data, nxe_size_t size) {
+  // field values can't span lines; data gets one "data:" field per line
+  int event_len=event? strcspn(event, "\r\n") : 0;
+  int id_len=id? strcspn(id, "\r\n") : 0;
+  const char* d=data;
+  const char* end=d+size;
+  const char* q;
+  int num_lines=1;
+  for (q=d; q<end; q++) {
+    if (*q=='\n' || (*q=='\r' && (q+1==end || q[1]!='\n'))) num_lines++;
+  }
+  int max_size=(event_len? 7+event_len+1 : 0)+(id_len? 4+id_len+1 : 0)+num_lines*7+size+1;
+  nxweb_sse_event* evt=_nxweb_frame_alloc(max_size);
+  char* p=evt->data;
+  if (event_len) p=put_field(p, "event: ", 7, event, event_len);
+  if (id_len) p=put_field(p, "id: ", 4, id, id_len);
+  const char* line=d;
+  for (q=d; q<=end; q++) {
+    if (q==end || *q=='\n' || *q=='\r') {
+      p=put_field(p, "data: ", 6, line, q-line);
+      if (q<end && *q=='\r' && q+1<end && q[1]=='\n') q++;
+      line=q+1;
+    }
+  }
+  *p++='\n';
+  evt->size=p-evt->data;
+  return evt;
+}
+
+void nxweb_event_stream_ref(nxweb_event_stream* es) {
+  __sync_add_and_fetch(&es->refcount, 1);
+}
+
+void nxweb_event_stream_unref(nxweb_event_stream* es) {
+  if (!__sync_sub_and_fetch(&es->refcount, 1)) nx_free(es);
+}
+
+static void wake_output(nxweb_event_stream* es) {
+  nxe_istream_set_ready(es->tdata->loop, &es->data_out); // also fine before response connects it
+}
+
+static int out_push(nxweb_event_stream* es, nxweb_sse_event* evt) {
+  if (_nxweb_frame_queue_push(&es->out, evt, MAX_QUEUED)) return -1;
+  wake_output(es);
+  return 0;
+}
+
+int nxweb_event_stream_send_event(nxweb_event_stream* es, nxweb_sse_event* evt) {
+  if (!es->conn || es->closing) return -1;
+  if (out_push(es, evt)) {
+    // client does not read fast enough; it will reconnect and resume from Last-Event-ID
+    nxweb_log_info("event stream %p slow consumer", es);
+    __sync_add_and_fetch(&slow_consumers, 1);
+    _nxweb_frame_queue_drop(&es->out);
+    nxweb_event_stream_close(es);
+    return -1;
+  }
+  es->got_output=1;
+  if (es->long_poll) es->closing=1;
+  __sync_add_and_fetch(&events_sent, 1);
+  return 0;
+}
+
+int nxweb_event_stream_send(nxweb_event_stream* es, const char* event, const char* id, const void* data, nxe_size_t size) {
+  if (!es->conn || es->closing) return -1;
+  nxweb_sse_event* evt=nxweb_sse_event_create(event, id, data, size);
+  int res=nxweb_event_stream_send_event(es, evt);
+  nxweb_sse_event_unref(evt);
+  return res;
+}
+
+void nxweb_event_stream_close(nxweb_event_stream* es) {
+  if (!es->conn) return;
+  es->closing=1;
+  wake_output(es);
+}
+
+static int pubsub_send(void* es, nxweb_frame* evt) {
+  return nxweb_event_stream_send_event(es, evt);
+}
+
+static void pubsub_es_ref(void* es) {
+  nxweb_event_stream_ref(es);
+}
+
+static void pubsub_es_unref(void* es) {
+  nxweb_event_stream_unref(es);
+}
+
+static void topic_ref(nxweb_sse_topic* topic) {
+  if (topic->registered) __sync_add_and_fetch(&topic->refcount, 1);
+}
+
+static void pubsub_topic_ref(nxweb_subscriber_list* list) {
+  topic_ref(OBJ_PTR_FROM_FLD_PTR(nxweb_sse_topic, subscribers, list));
+}
+
+static void pubsub_topic_unref(nxweb_subscriber_list* list) {
+  nxweb_sse_topic_unref(OBJ_PTR_FROM_FLD_PTR(nxweb_sse_topic, subscribers, list));
+}
+
+static const nxweb_pubsub_class sse_pubsub_class={.name="event topic", .send=pubsub_send,
+        .endpoint_ref=pubsub_es_ref, .endpoint_unref=pubsub_es_unref,
+        .list_ref=pubsub_topic_ref, .list_unref=pubsub_topic_unref};
+
+int nxweb_event_stream_post(nxweb_event_stream* es, const char* event, const char* id, const void* data, nxe_size_t size) {
+  if (!es->conn) return -1; // racy, but saves building event for closed stream
+  nxweb_sse_event* evt=nxweb_sse_event_create(event, id, data, size);
+  int res=_nxweb_pubsub_post(&sse_pubsub_class, es->tdata, es, evt);
+  nxweb_sse_event_unref(evt);
+  return res;
+}
+
+static nxweb_sse_topic** topic_slot(const char* name) {
+  uint32_t h=2166136261u; // FNV-1a
+  const unsigned char* p;
+  for (p=(const unsigned char*)name; *p; p++) h=(h^*p)*16777619u;
+  return &topics[h%TOPIC_HASH_SIZE];
+}
+
+static nxweb_sse_topic* topic_lookup(const char* name, _Bool create) {
+  nxweb_sse_topic** pt=topic_slot(name);
+  pthread_mutex_lock(&topics_mux);
+  nxweb_sse_topic* topic;
+  for (topic=*pt; topic; topic=topic->next) {
+    if (!strcmp(topic->name, name)) break;
+  }
+  if (topic) {
+    topic->refcount++; // can't be 0 here: last unref unlinks it under the same mutex
+  }
+  else if (create) {
+    int len=strlen(name);
+    topic=nx_calloc(sizeof(nxweb_sse_topic)+len+1);
+    topic->name=memcpy((char*)(topic+1), name, len+1);
+    topic->refcount=1;
+    topic->registered=1;
+    topic->next=*pt;
+    *pt=topic;
+    topics_count++;
+  }
+  pthread_mutex_unlock(&topics_mux);
+  return topic;
+}
+
+nxweb_sse_topic* nxweb_sse_topic_get(const char* name) {
+  return topic_lookup(name, 1);
+}
+
+nxweb_sse_topic* nxweb_sse_topic_find(const char* name) {
+  return topic_lookup(name, 0);
+}
+
+void nxweb_sse_topic_unref(nxweb_sse_topic* topic) {
+  if (!topic->registered) return;
+  int n=topic->refcount;
+  while (n>1) { // not the last one; skip the mutex
+    int prev=__sync_val_compare_and_swap(&topic->refcount, n, n-1);
+    if (prev==n) return;
+    n=prev;
+  }
+  pthread_mutex_lock(&topics_mux);
+  if (__sync_sub_and_fetch(&topic->refcount, 1)) { // got referenced meanwhile
+    pthread_mutex_unlock(&topics_mux);
+    return;
+  }
+  nxweb_sse_topic** pt;
+  for (pt=topic_slot(topic->name); *pt!=topic; pt=&(*pt)->next) ;
+  *pt=topic->next;
+  topics_count--;
+  pthread_mutex_unlock(&topics_mux);
+  nx_free(topic);
+}
+
+int nxweb_sse_topic_subscribe(nxweb_sse_topic* topic, nxweb_event_stream* es) {
+  if (!es->conn) return -1;
+  if (_nxweb_pubsub_subscribe(&es->subscriptions, &topic->subscribers, es, es->tdata->thread_num)) topic_ref(topic);
+  return 0;
+}
+
+void nxweb_sse_topic_unsubscribe(nxweb_sse_topic* topic, nxweb_event_stream* es) {
+  if (_nxweb_pubsub_unsubscribe(&es->subscriptions, &topic->subscribers)) nxweb_sse_topic_unref(topic);
+}
+
+static void unsubscribe_all(nxweb_event_stream* es) {
+  while (es->subscriptions) {
+    nxweb_sse_topic* topic=OBJ_PTR_FROM_FLD_PTR(nxweb_sse_topic, subscribers, es->subscriptions->list);
+    nxweb_sse_topic_unsubscribe(topic, es);
+  }
+}
+
+int nxweb_sse_topic_publish(nxweb_sse_topic* topic, const char* event, const char* id, const void* data, nxe_size_t size) {
+  nxweb_sse_event* evt=nxweb_sse_event_create(event, id, data, size);
+  __sync_add_and_fetch(&events_published, 1);
+  int n=_nxweb_pubsub_publish(&sse_pubsub_class, &topic->subscribers, evt);
+  nxweb_sse_event_unref(evt);
+  return n;
+}
+
+static void data_out_do_write(nxe_istream* is, nxe_ostream* os) {
+  nxweb_event_stream* es=OBJ_PTR_FROM_FLD_PTR(nxweb_event_stream, data_out, is);
+
+  nxweb_log_debug("event stream data_out_do_write");
+
+  _nxweb_frame_queue_write(&es->out, is, os);
+  if (es->out.count) return; // socket is full; response write timeout watches it
+  if (es->closing && os->ready) {
+    // request completes and stream gets detached once final chunk is out
+    nxe_flags_t flags=NXEF_EOF;
+    OSTREAM_CLASS(os)->write(os, is, 0, 0, (nxe_data)(const char*)0, 0, &flags);
+    return;
+  }
+  if (!es->closing) nxe_istream_unset_ready(is);
+}
+
+static void timer_ping_on_timeout(nxe_timer* timer, nxe_data data) {
+  nxweb_event_stream* es=OBJ_PTR_FROM_FLD_PTR(nxweb_event_stream, timer_ping, timer);
+  if (!es->got_output && !es->out.count && !es->closing) {
+    out_push(es, ping_event);
+    __sync_add_and_fetch(&pings_sent, 1);
+  }
+  es->got_output=0;
+  nxe_set_timer(es->tdata->loop, NXWEB_TIMER_EVENT_STREAM_PING, &es->timer_ping);
+}
+
+static const nxe_istream_class data_out_class={.do_write=data_out_do_write};
+static const nxe_timer_class timer_ping_class={.on_timeout=timer_ping_on_timeout};
+
+static void detach(nxweb_event_stream* es) {
+  if (!es->conn) return;
+  if (es->on_close) es->on_close(es);
+  unsubscribe_all(es);
+  nxe_unset_timer(es->tdata->loop, NXWEB_TIMER_EVENT_STREAM_PING, &es->timer_ping);
+  if (es->data_out.pair) nxe_disconnect_streams(&es->data_out, es->data_out.pair);
+  _nxweb_frame_queue_clear(&es->out);
+  if (es->prev) es->prev->next=es->next;
+  else thread_streams=es->next;
+  if (es->next) es->next->prev=es->prev;
+  es->conn=0;
+  __sync_sub_and_fetch(&streams_open, 1);
+}
+
+static void event_stream_request_finalize(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxe_data data) {
+  nxweb_event_stream* es=data.ptr;
+  detach(es);
+  nxweb_event_stream_unref(es);
+}
+
+nxweb_event_stream* nxweb_event_stream_start(nxweb_http_server_connection* conn, nxweb_http_response* resp, _Bool long_poll) {
+  nxweb_http_request* req=&conn->hsp.req;
+  nxe_loop* loop=conn->tdata->loop;
+  nxweb_event_stream* es=nx_calloc(sizeof(nxweb_event_stream));
+  es->refcount=1; // released by request finalizer
+  es->conn=conn;
+  es->tdata=conn->tdata;
+  es->long_poll=long_poll;
+  es->data_out.super.cls.is_cls=&data_out_class;
+  es->data_out.evt.cls=NXE_EV_STREAM;
+  nxe_init_timer(&es->timer_ping, &timer_ping_class);
+  es->next=thread_streams;
+  if (es->next) es->next->prev=es;
+  thread_streams=es;
+  nxweb_set_request_data(req, EVENT_STREAM_KEY, (nxe_data)(void*)es, event_stream_request_finalize);
+  __sync_add_and_fetch(&streams_open, 1);
+  __sync_add_and_fetch(&streams_total, 1);
+
+  resp->content_type="text/event-stream";
+  resp->no_cache=1;
+  resp->content_length=-1; // chunked
+  resp->chunked_autoencode=1;
+  resp->content_out=&es->data_out;
+  nxe_set_timer(loop, NXWEB_TIMER_EVENT_STREAM_PING, &es->timer_ping);
+  return es;
+}
+
+void _nxweb_event_stream_shutdown_thread() {
+  nxweb_event_stream* es;
+  while ((es=thread_streams)) {
+    nxweb_http_server_connection* conn=es->conn->h2_conn? es->conn->h2_conn : es->conn;
+    nxweb_event_stream_ref(es);
+    nxweb_http_server_connection_finalize(conn, 1);
+    detach(es); // no-op unless connection finalization left it open
+    nxweb_event_stream_unref(es);
+  }
+}
+
+static int event_stream_init() {
+  static const char ping[]=": ping\n\n"; // comment line; ignored by EventSource
+  ping_event=_nxweb_frame_alloc(sizeof(ping)-1);
+  memcpy(ping_event->data, ping, sizeof(ping)-1);
+  return 0;
+}
+
+static void event_stream_finalize() {
+  nxweb_sse_event_unref(ping_event);
+}
+
+static void event_stream_diagnostics() {
+  nxweb_log_error("[diag] event streams: open=%d/%" PRIu64 " topics=%d sent=%" PRIu64 " published=%" PRIu64 " pings=%" PRIu64 " slow_consumers=%" PRIu64,
+                  streams_open, streams_total, topics_count, events_sent, events_published, pings_sent, slow_consumers);
+}
+
+NXWEB_MODULE(event_stream, .on_server_startup=event_stream_init,
+        .on_server_shutdown=event_stream_finalize, .on_server_diagnostics=event_stream_diagnostics);
@@ -0,0 +1,776 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "deps/ulib/alignhash_tpl.h"
+#include "deps/ulib/hash.h"
+
+/*
+ * Append-only segment store for file_cache filter ("store":"segments").
+ * Cached items are appended as records to large segment files mmapped
+ * read-only; in-memory index maps cache key to record position (key string
+ * itself lives in the mapping). Index is persisted into <cache_dir>/index;
+ * records appended after last save are recovered by scanning segment tails.
+ * Background thread evicts oldest segments over size limit and compacts
+ * segments with little live data left.
+ *
+ * Appends reserve space at segment tail under write lock, write records
+ * without holding any lock, then retake it to index them. Reserved space is
+ * marked with filler record before the lock is released, and record header
+ * replaces it only after the body is written, so records finishing out of
+ * order (or never, due to crash or failed write) don't stop tail scans.
+ * Segments with writes in flight are never removed.
+ */
+
+#define FCS_SEGMENT_SIGNATURE (0x7367786e)
+#define FCS_RECORD_SIGNATURE (0x7267786e)
+#define FCS_INDEX_SIGNATURE (0x6967786e)
+#define FCS_VERSION 1
+#define FCS_ALIGN(n) (((n)+7)&~7)
+#define FCS_MAX_SEGMENT_SIZE (1024*1024*1024)
+
+typedef struct fcs_segment_header {
+  uint32_t signature;
+  uint32_t version;
+  uint32_t size;
+  uint32_t id;
+} fcs_segment_header;
+
+typedef struct fcs_record {
+  uint32_t signature;
+  uint32_t key_size; // including null-terminator
+  uint32_t payload_size;
+  uint32_t flags;
+  int64_t expires; // time_t; updated in place by _nxweb_fc_segment_touch()
+} fcs_record;
+
+#define FCS_RECORD_FILLER 1 // reserved space not (yet) holding a record; skipped by scans
+
+typedef struct fcs_index_header {
+  uint32_t signature;
+  uint32_t version;
+  uint32_t num_segments;
+  uint32_t num_entries;
+} fcs_index_header;
+
+typedef struct fcs_index_segment {
+  uint32_t id;
+  uint32_t end;
+} fcs_index_segment;
+
+typedef struct fcs_entry {
+  uint32_t seg_id;
+  uint32_t offset;
+} fcs_entry;
+
+typedef struct fcs_segment {
+  uint32_t id;
+  uint32_t size;
+  uint32_t end; // append position
+  uint32_t live; // bytes taken by indexed records
+  int writers; // reserved records not yet written; segment is not removed meanwhile
+  int fd;
+  char* map;
+} fcs_segment;
+
+#define fcs_hash_fn(key) hash_sdbm((const unsigned char*)(key))
+#define fcs_eq_fn(a, b) (!strcmp((a), (b)))
+
+DECLARE_ALIGNHASH(fcs_index, const char*, fcs_entry, 1, fcs_hash_fn, fcs_eq_fn)
+
+typedef struct nxweb_fc_segment_store {
+  const char* dir;
+  uint32_t segment_size;
+  int max_segments;
+  pthread_rwlock_t lock;
+  alignhash_t(fcs_index) *index;
+  fcs_segment** segments; // ordered by id; last one is open for appends
+  int num_segments;
+  int segments_capacity;
+  uint32_t next_id; // guarded by add_mux
+  pthread_mutex_t add_mux; // one thread opens next segment while others keep appending to current one
+  _Bool opened:1;
+  _Bool thread_started:1;
+  _Bool stop:1;
+  _Bool dirty:1; // index changed since last save
+  pthread_t thread;
+  pthread_mutex_t mux;
+  pthread_cond_t cond;
+  uint64_t puts, hits, misses, compacted, evicted;
+  struct nxweb_fc_segment_store* next;
+} nxweb_fc_segment_store;
+
+static nxweb_fc_segment_store* stores;
+
+static inline fcs_record* fcs_rec_at(fcs_segment* seg, uint32_t offset) {
+  return (fcs_record*)(seg->map+offset);
+}
+
+static inline uint32_t fcs_rec_size(const fcs_record* rec) {
+  return sizeof(fcs_record)+FCS_ALIGN(rec->key_size)+FCS_ALIGN(rec->payload_size);
+}
+
+static inline const char* fcs_rec_key(fcs_record* rec) {
+  return (const char*)(rec+1);
+}
+
+static inline uint32_t fcs_rec_payload_offset(const fcs_record* rec, uint32_t offset) {
+  return offset+sizeof(fcs_record)+FCS_ALIGN(rec->key_size);
+}
+
+// returns record size or 0 if no valid record at offset
+static uint32_t fcs_rec_check(fcs_segment* seg, uint32_t offset) {
+  if (offset<sizeof(fcs_segment_header) || offset+sizeof(fcs_record)>seg->size || (offset&7)) return 0;
+  fcs_record* rec=fcs_rec_at(seg, offset);
+  if (rec->signature!=FCS_RECORD_SIGNATURE || !rec->key_size || rec->key_size>seg->size || rec->payload_size>seg->size) return 0;
+  uint32_t size=fcs_rec_size(rec);
+  if (offset+(uint64_t)size>seg->size) return 0;
+  if (rec->flags&FCS_RECORD_FILLER) return size; // its key might be overwritten by record body already
+  if (fcs_rec_key(rec)[rec->key_size-1]) return 0; // key not terminated
+  return size;
+}
+
+static fcs_segment* fcs_find_segment(nxweb_fc_segment_store* st, uint32_t id) {
+  int lo=0, hi=st->num_segments-1;
+  while (lo<=hi) {
+    int mid=(lo+hi)>>1;
+    fcs_segment* seg=st->segments[mid];
+    if (seg->id==id) return seg;
+    if (seg->id<id) lo=mid+1;
+    else hi=mid-1;
+  }
+  return 0;
+}
+
+static char* fcs_path(nxweb_fc_segment_store* st, char* buf, int buf_size, uint32_t id) {
+  if (id) snprintf(buf, buf_size, "%s/%08x.seg", st->dir, id);
+  else snprintf(buf, buf_size, "%s/index", st->dir);
+  return buf;
+}
+
+static fcs_segment* fcs_map_segment(nxweb_fc_segment_store* st, uint32_t id, _Bool create) {
+  char fpath[1024];
+  fcs_path(st, fpath, sizeof(fpath), id);
+  int fd=create? open(fpath, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR) : open(fpath, O_RDWR);
+  if (fd==-1) {
+    nxweb_log_error("fc segment store: can't open %s; errno=%d", fpath, errno);
+    return 0;
+  }
+  fcs_segment_header sh;
+  if (create) {
+    sh.signature=FCS_SEGMENT_SIGNATURE;
+    sh.version=FCS_VERSION;
+    sh.size=st->segment_size;
+    sh.id=id;
+    if (ftruncate(fd, sh.size)==-1 || pwrite(fd, &sh, sizeof(sh), 0)!=sizeof(sh)) {
+      nxweb_log_error("fc segment store: can't create %s; errno=%d", fpath, errno);
+      close(fd);
+      unlink(fpath);
+      return 0;
+    }
+  }
+  else {
+    struct stat finfo;
+    if (pread(fd, &sh, sizeof(sh), 0)!=sizeof(sh) || sh.signature!=FCS_SEGMENT_SIGNATURE || sh.version!=FCS_VERSION
+        || sh.id!=id || sh.size>FCS_MAX_SEGMENT_SIZE || fstat(fd, &finfo)==-1 || finfo.st_size!=sh.size) {
+      nxweb_log_error("fc segment store: invalid segment file %s; deleting it", fpath);
+      close(fd);
+      unlink(fpath);
+      return 0;
+    }
+  }
+  char* map=mmap(0, sh.size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map==MAP_FAILED) {
+    nxweb_log_error("fc segment store: can't mmap %s; errno=%d", fpath, errno);
+    close(fd);
+    return 0;
+  }
+  fcs_segment* seg=nx_calloc(sizeof(fcs_segment));
+  seg->id=id;
+  seg->size=sh.size;
+  seg->end=sizeof(fcs_segment_header);
+  seg->fd=fd;
+  seg->map=map;
+  return seg;
+}
+
+static void fcs_unmap_segment(nxweb_fc_segment_store* st, fcs_segment* seg, _Bool delete_file) {
+  munmap(seg->map, seg->size);
+  close(seg->fd); // requests still sending from this segment hold their own dup()'ed fds
+  if (delete_file) {
+    char fpath[1024];
+    unlink(fcs_path(st, fpath, sizeof(fpath), seg->id));
+  }
+  nx_free(seg);
+}
+
+// index record at offset; replaces older record with the same key
+static void fcs_index_record(nxweb_fc_segment_store* st, fcs_segment* seg, uint32_t offset, uint32_t size) {
+  fcs_record* rec=fcs_rec_at(seg, offset);
+  const char* key=fcs_rec_key(rec);
+  int ret=0;
+  ah_iter_t ci=alignhash_set(fcs_index, st->index, key, &ret);
+  if (ci==alignhash_end(st->index)) return; // out of memory
+  if (ret==AH_INS_ERR) { // key exists => previous record becomes garbage
+    fcs_entry* e=&alignhash_value(st->index, ci);
+    fcs_segment* old_seg=fcs_find_segment(st, e->seg_id);
+    if (old_seg) old_seg->live-=fcs_rec_size(fcs_rec_at(old_seg, e->offset));
+    alignhash_key(st->index, ci)=key; // old key string could be unmapped soon
+  }
+  alignhash_value(st->index, ci).seg_id=seg->id;
+  alignhash_value(st->index, ci).offset=offset;
+  seg->live+=size;
+  st->dirty=1;
+}
+
+static void fcs_scan_segment(nxweb_fc_segment_store* st, fcs_segment* seg, uint32_t offset) {
+  uint32_t size;
+  while ((size=fcs_rec_check(seg, offset))) {
+    if (!(fcs_rec_at(seg, offset)->flags&FCS_RECORD_FILLER)) fcs_index_record(st, seg, offset, size);
+    offset+=size;
+  }
+  seg->end=offset;
+}
+
+static int fcs_segment_cmp(const void* a, const void* b) {
+  uint32_t ida=(*(fcs_segment**)a)->id, idb=(*(fcs_segment**)b)->id;
+  return ida<idb? -1 : ida>idb? 1 : 0;
+}
+
+static void fcs_remove_segment(nxweb_fc_segment_store* st, fcs_segment* seg) { // call under write lock
+  uint32_t offset=sizeof(fcs_segment_header), size;
+  while (offset<seg->end && (size=fcs_rec_check(seg, offset))) {
+    if (fcs_rec_at(seg, offset)->flags&FCS_RECORD_FILLER) {
+      offset+=size;
+      continue;
+    }
+    ah_iter_t ci=alignhash_get(fcs_index, st->index, fcs_rec_key(fcs_rec_at(seg, offset)));
+    if (ci!=alignhash_end(st->index) && alignhash_value(st->index, ci).seg_id==seg->id && alignhash_value(st->index, ci).offset==offset) {
+      alignhash_del(fcs_index, st->index, ci);
+    }
+    offset+=size;
+  }
+  int i;
+  for (i=0; i<st->num_segments; i++) {
+    if (st->segments[i]==seg) {
+      memmove(st->segments+i, st->segments+i+1, (st->num_segments-i-1)*sizeof(fcs_segment*));
+      st->num_segments--;
+      break;
+    }
+  }
+  st->dirty=1;
+}
+
+static void fcs_grow_segments(nxweb_fc_segment_store* st) {
+  int capacity=st->segments_capacity*2;
+  fcs_segment** segments=nx_alloc(capacity*sizeof(fcs_segment*));
+  memcpy(segments, st->segments, st->num_segments*sizeof(fcs_segment*));
+  nx_free(st->segments);
+  st->segments=segments;
+  st->segments_capacity=capacity;
+}
+
+// opens next segment unless someone else has already done so since tail_id was full;
+// call without lock
+static int fcs_add_segment(nxweb_fc_segment_store* st, uint32_t tail_id) {
+  pthread_mutex_lock(&st->add_mux);
+  pthread_rwlock_rdlock(&st->lock);
+  _Bool added=st->num_segments && st->segments[st->num_segments-1]->id!=tail_id;
+  pthread_rwlock_unlock(&st->lock);
+  if (added) {
+    pthread_mutex_unlock(&st->add_mux);
+    return 0;
+  }
+  fcs_segment* seg=fcs_map_segment(st, st->next_id, 1);
+  if (!seg) {
+    pthread_mutex_unlock(&st->add_mux);
+    return -1;
+  }
+  st->next_id++;
+  fcs_segment* evicted=0;
+  pthread_rwlock_wrlock(&st->lock);
+  if (st->num_segments==st->segments_capacity) { // background eviction lags behind => evict oldest now
+    if (!st->segments[0]->writers) {
+      evicted=st->segments[0];
+      fcs_remove_segment(st, evicted);
+      st->evicted++;
+    }
+    else {
+      fcs_grow_segments(st);
+    }
+  }
+  st->segments[st->num_segments++]=seg;
+  pthread_rwlock_unlock(&st->lock);
+  pthread_mutex_unlock(&st->add_mux);
+  if (evicted) fcs_unmap_segment(st, evicted, 1);
+  return 0;
+}
+
+// marks reserved space so that scans step over it until record is written
+static void fcs_write_filler(fcs_segment* seg, uint32_t offset, uint32_t size) {
+  fcs_record filler={.signature=FCS_RECORD_SIGNATURE, .key_size=1, .payload_size=size-sizeof(fcs_record)-FCS_ALIGN(1), .flags=FCS_RECORD_FILLER};
+  pwrite(seg->fd, &filler, sizeof(filler), offset);
+}
+
+// reserves size bytes at tail; returned segment stays pinned until writers-- under write lock
+static fcs_segment* fcs_reserve(nxweb_fc_segment_store* st, uint32_t size, uint32_t* offset, _Bool* sealed) {
+  for (;;) {
+    pthread_rwlock_wrlock(&st->lock);
+    fcs_segment* tail=st->num_segments? st->segments[st->num_segments-1] : 0;
+    if (tail && tail->end+size<=tail->size) {
+      *offset=tail->end;
+      tail->end+=size;
+      tail->writers++;
+      fcs_write_filler(tail, *offset, size); // before next reservation can get written
+      pthread_rwlock_unlock(&st->lock);
+      return tail;
+    }
+    uint32_t tail_id=tail? tail->id : 0;
+    pthread_rwlock_unlock(&st->lock);
+    if (tail_id) *sealed=1;
+    if (fcs_add_segment(st, tail_id)) return 0;
+  }
+}
+
+static void fcs_save_index(nxweb_fc_segment_store* st) {
+  pthread_rwlock_rdlock(&st->lock);
+  fcs_index_header ih={.signature=FCS_INDEX_SIGNATURE, .version=FCS_VERSION,
+          .num_segments=st->num_segments, .num_entries=alignhash_size(st->index)};
+  size_t size=sizeof(ih)+ih.num_segments*sizeof(fcs_index_segment)+ih.num_entries*sizeof(fcs_entry);
+  char* buf=nx_alloc(size);
+  if (!buf) {
+    pthread_rwlock_unlock(&st->lock);
+    return;
+  }
+  char* p=buf+sizeof(ih);
+  int i;
+  for (i=0; i<st->num_segments; i++) {
+    fcs_index_segment* is=(fcs_index_segment*)p;
+    is->id=st->segments[i]->id;
+    is->end=st->segments[i]->end;
+    p+=sizeof(fcs_index_segment);
+  }
+  ah_iter_t ci;
+  for (ci=alignhash_begin(st->index); ci!=alignhash_end(st->index); ci++) {
+    if (!alignhash_exist(st->index, ci)) continue;
+    memcpy(p, &alignhash_value(st->index, ci), sizeof(fcs_entry));
+    p+=sizeof(fcs_entry);
+  }
+  st->dirty=0;
+  pthread_rwlock_unlock(&st->lock);
+  memcpy(buf, &ih, sizeof(ih));
+
+  char fpath[1024], tmp_fpath[1024+4];
+  fcs_path(st, fpath, sizeof(fpath), 0);
+  strcat(strcpy(tmp_fpath, fpath), ".tmp");
+  int fd=open(tmp_fpath, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+  if (fd==-1 || write(fd, buf, size)!=size) {
+    nxweb_log_error("fc segment store: can't write index file %s; errno=%d", tmp_fpath, errno);
+    if (fd!=-1) close(fd);
+    unlink(tmp_fpath);
+  }
+  else {
+    close(fd);
+    rename(tmp_fpath, fpath);
+  }
+  nx_free(buf);
+}
+
+// segments listed in index are trusted up to their saved end; anything appended later is found by scanning
+static void fcs_load_index(nxweb_fc_segment_store* st) {
+  char fpath[1024];
+  fcs_path(st, fpath, sizeof(fpath), 0);
+  int fd=open(fpath, O_RDONLY);
+  struct stat finfo;
+  char* buf=0;
+  fcs_index_header ih={0};
+  if (fd!=-1 && fstat(fd, &finfo)!=-1 && finfo.st_size>=sizeof(ih) && (buf=nx_alloc(finfo.st_size))
+      && read(fd, buf, finfo.st_size)==finfo.st_size) {
+    memcpy(&ih, buf, sizeof(ih));
+    if (ih.signature!=FCS_INDEX_SIGNATURE || ih.version!=FCS_VERSION
+        || sizeof(ih)+(uint64_t)ih.num_segments*sizeof(fcs_index_segment)+(uint64_t)ih.num_entries*sizeof(fcs_entry)!=finfo.st_size) {
+      nxweb_log_error("fc segment store: invalid index file %s; rebuilding from segments", fpath);
+      ih.num_segments=0;
+      ih.num_entries=0;
+    }
+  }
+  if (fd!=-1) close(fd);
+
+  int i, j;
+  fcs_index_segment* is=(fcs_index_segment*)(buf+sizeof(ih));
+  for (i=0; i<st->num_segments; i++) {
+    fcs_segment* seg=st->segments[i];
+    for (j=0; j<ih.num_segments; j++) { // segments not listed in index are scanned from start
+      if (is[j].id==seg->id && is[j].end>=sizeof(fcs_segment_header) && is[j].end<=seg->size) {
+        seg->end=is[j].end;
+        break;
+      }
+    }
+  }
+  fcs_entry* e=(fcs_entry*)(is+ih.num_segments);
+  for (i=0; i<ih.num_entries; i++, e++) {
+    fcs_segment* seg=fcs_find_segment(st, e->seg_id);
+    if (!seg || e->offset>=seg->end) continue; // segment gone or record not covered by saved end
+    uint32_t size=fcs_rec_check(seg, e->offset);
+    if (size) fcs_index_record(st, seg, e->offset, size);
+  }
+  for (i=0; i<st->num_segments; i++) {
+    fcs_scan_segment(st, st->segments[i], st->segments[i]->end);
+  }
+  if (buf) nx_free(buf);
+}
+
+static int fcs_open(nxweb_fc_segment_store* st) {
+  char fpath[1024];
+  snprintf(fpath, sizeof(fpath), "%s/index", st->dir);
+  if (nxweb_mkpath(fpath, 0755)==-1) {
+    nxweb_log_error("fc segment store: can't create directory %s; check permissions", st->dir);
+    return -1;
+  }
+  DIR* dir=opendir(st->dir);
+  if (!dir) {
+    nxweb_log_error("fc segment store: can't open directory %s", st->dir);
+    return -1;
+  }
+  struct dirent* de;
+  while ((de=readdir(dir))) {
+    unsigned id;
+    char ext[8];
+    if (sscanf(de->d_name, "%8x.%4s", &id, ext)!=2 || strcmp(ext, "seg") || !id) continue;
+    if (st->num_segments==st->segments_capacity) fcs_grow_segments(st);
+    fcs_segment* seg=fcs_map_segment(st, id, 0);
+    if (!seg) continue;
+    st->segments[st->num_segments++]=seg;
+    if (id>=st->next_id) st->next_id=id+1;
+  }
+  closedir(dir);
+  qsort(st->segments, st->num_segments, sizeof(fcs_segment*), fcs_segment_cmp);
+  fcs_load_index(st);
+  nxweb_log_error("fc segment store %s: %d segments, %d items", st->dir, st->num_segments, (int)alignhash_size(st->index));
+  return 0;
+}
+
+static void fcs_close(nxweb_fc_segment_store* st) {
+  if (st->dirty) fcs_save_index(st);
+  int i;
+  for (i=0; i<st->num_segments; i++) fcs_unmap_segment(st, st->segments[i], 0);
+  st->num_segments=0;
+  alignhash_destroy(fcs_index, st->index);
+  st->index=0;
+  nx_free(st->segments);
+  st->segments=0;
+}
+
+// copy next live record of segment id (starting at *offset) to the tail;
+// returns 1 if copied, 0 if segment is done (and removed), -1 on error
+static int fcs_compact_step(nxweb_fc_segment_store* st, uint32_t id, uint32_t* offset) {
+  pthread_rwlock_wrlock(&st->lock);
+  fcs_segment* seg=fcs_find_segment(st, id);
+  if (!seg) { // evicted meanwhile
+    pthread_rwlock_unlock(&st->lock);
+    return 0;
+  }
+  uint32_t size;
+  while (*offset<seg->end && (size=fcs_rec_check(seg, *offset))) {
+    fcs_record* rec=fcs_rec_at(seg, *offset);
+    ah_iter_t ci=(rec->flags&FCS_RECORD_FILLER)? alignhash_end(st->index) : alignhash_get(fcs_index, st->index, fcs_rec_key(rec));
+    if (ci==alignhash_end(st->index) || alignhash_value(st->index, ci).seg_id!=id || alignhash_value(st->index, ci).offset!=*offset) {
+      *offset+=size; // garbage
+      continue;
+    }
+    seg->writers++; // pinned while record is copied from its mapping
+    pthread_rwlock_unlock(&st->lock);
+    _Bool sealed=0;
+    uint32_t new_offset;
+    fcs_segment* tail=fcs_reserve(st, size, &new_offset, &sealed);
+    // body first, then record header, same as _nxweb_fc_segment_put()
+    _Bool ok=tail && pwrite(tail->fd, rec+1, size-sizeof(fcs_record), new_offset+sizeof(fcs_record))==size-sizeof(fcs_record)
+        && pwrite(tail->fd, rec, sizeof(fcs_record), new_offset)==sizeof(fcs_record);
+    if (tail && !ok) fcs_write_filler(tail, new_offset, size);
+    pthread_rwlock_wrlock(&st->lock);
+    seg->writers--;
+    if (tail) tail->writers--;
+    if (ok) {
+      ci=alignhash_get(fcs_index, st->index, fcs_rec_key(rec));
+      if (ci!=alignhash_end(st->index) && alignhash_value(st->index, ci).seg_id==id && alignhash_value(st->index, ci).offset==*offset) {
+        fcs_index_record(st, tail, new_offset, size);
+        st->compacted++;
+      }
+      // otherwise key has been stored anew while copying => copy is garbage
+      *offset+=size;
+    }
+    pthread_rwlock_unlock(&st->lock);
+    return ok? 1 : -1;
+  }
+  if (seg->writers) { // append reserved before segment got sealed is still being written
+    pthread_rwlock_unlock(&st->lock);
+    return 0;
+  }
+  fcs_remove_segment(st, seg);
+  pthread_rwlock_unlock(&st->lock);
+  fcs_unmap_segment(st, seg, 1);
+  return 0;
+}
+
+static void fcs_maintain(nxweb_fc_segment_store* st) {
+  for (;;) { // evict oldest segments beyond size limit
+    pthread_rwlock_wrlock(&st->lock);
+    if (st->num_segments<=st->max_segments || st->segments[0]->writers) { // busy segment is retried next time
+      pthread_rwlock_unlock(&st->lock);
+      break;
+    }
+    fcs_segment* oldest=st->segments[0];
+    fcs_remove_segment(st, oldest);
+    st->evicted++;
+    pthread_rwlock_unlock(&st->lock);
+    fcs_unmap_segment(st, oldest, 1);
+  }
+  uint32_t min_id=0;
+  for (;;) { // compact sealed segments that are mostly garbage
+    uint32_t id=0;
+    pthread_rwlock_rdlock(&st->lock);
+    int i;
+    for (i=0; i<st->num_segments-1; i++) {
+      fcs_segment* seg=st->segments[i];
+      if (seg->id>=min_id && !seg->writers && (uint64_t)seg->live*100 < (uint64_t)seg->end*NXWEB_FC_SEGMENT_COMPACT_PERCENT) {
+        id=seg->id;
+        break;
+      }
+    }
+    pthread_rwlock_unlock(&st->lock);
+    if (!id || st->stop) break;
+    min_id=id+1; // each segment is tried once per pass
+    uint32_t offset=sizeof(fcs_segment_header);
+    int r;
+    while ((r=fcs_compact_step(st, id, &offset))==1 && !st->stop);
+    if (r==-1) nxweb_log_error("fc segment store %s: compaction of segment %08x failed; errno=%d", st->dir, id, errno);
+  }
+  if (st->dirty) fcs_save_index(st);
+}
+
+static void* fcs_thread_main(void* param) {
+  nxweb_fc_segment_store* st=param;
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, 0); // signals are handled by main thread
+  pthread_mutex_lock(&st->mux);
+  while (!st->stop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec+=NXWEB_FC_SEGMENT_MAINTENANCE_INTERVAL;
+    pthread_cond_timedwait(&st->cond, &st->mux, &ts);
+    if (st->stop) break;
+    pthread_mutex_unlock(&st->mux);
+    fcs_maintain(st);
+    pthread_mutex_lock(&st->mux);
+  }
+  pthread_mutex_unlock(&st->mux);
+  return 0;
+}
+
+nxweb_fc_segment_store* _nxweb_fc_segment_store_get(const char* cache_dir, int segment_size_mb, int max_size_mb) {
+  nxweb_fc_segment_store* st;
+  for (st=stores; st; st=st->next) {
+    if (!strcmp(st->dir, cache_dir)) return st; // shared by handlers using the same cache_dir
+  }
+  if (segment_size_mb<=0) segment_size_mb=NXWEB_FC_SEGMENT_SIZE;
+  if (segment_size_mb>FCS_MAX_SEGMENT_SIZE/(1024*1024)) segment_size_mb=FCS_MAX_SEGMENT_SIZE/(1024*1024);
+  if (max_size_mb<=0) max_size_mb=NXWEB_FC_SEGMENT_STORE_MAX_SIZE;
+  st=calloc(1, sizeof(nxweb_fc_segment_store)); // NOTE this will never be freed
+  st->dir=cache_dir;
+  st->segment_size=segment_size_mb*1024*1024;
+  st->max_segments=max_size_mb/segment_size_mb;
+  if (st->max_segments<2) st->max_segments=2;
+  st->segments_capacity=st->max_segments+2;
+  st->next=stores;
+  stores=st;
+  return st;
+}
+
+uint32_t _nxweb_fc_segment_max_payload(nxweb_fc_segment_store* st) {
+  return st->segment_size/4;
+}
+
+int _nxweb_fc_segment_acquire(nxweb_fc_segment_store* st, const char* key, nxweb_fc_segment_rec* rec) {
+  if (!st->opened) return -1;
+  pthread_rwlock_rdlock(&st->lock);
+  ah_iter_t ci=alignhash_get(fcs_index, st->index, key);
+  if (ci!=alignhash_end(st->index)) {
+    fcs_entry* e=&alignhash_value(st->index, ci);
+    fcs_segment* seg=fcs_find_segment(st, e->seg_id);
+    if (seg) {
+      fcs_record* r=fcs_rec_at(seg, e->offset);
+      rec->seg_id=e->seg_id;
+      rec->offset=e->offset;
+      rec->fd=seg->fd;
+      rec->payload_offset=fcs_rec_payload_offset(r, e->offset);
+      rec->payload=seg->map+rec->payload_offset;
+      rec->payload_size=r->payload_size;
+      rec->expires=r->expires;
+      __sync_add_and_fetch(&st->hits, 1);
+      return 0; // keep read lock until _nxweb_fc_segment_release()
+    }
+  }
+  pthread_rwlock_unlock(&st->lock);
+  __sync_add_and_fetch(&st->misses, 1);
+  return -1;
+}
+
+void _nxweb_fc_segment_release(nxweb_fc_segment_store* st) {
+  pthread_rwlock_unlock(&st->lock);
+}
+
+int _nxweb_fc_segment_put(nxweb_fc_segment_store* st, const char* key, const void* payload, uint32_t payload_size, time_t expires) {
+  if (!st->opened || payload_size>_nxweb_fc_segment_max_payload(st)) return -1;
+  uint32_t key_size=strlen(key)+1;
+  if (key_size>st->segment_size/16) return -1;
+  fcs_record rec={.signature=FCS_RECORD_SIGNATURE, .key_size=key_size, .payload_size=payload_size, .expires=expires};
+  uint32_t size=fcs_rec_size(&rec);
+  static const char zeros[8];
+  struct iovec iov[4]={
+    {.iov_base=(void*)key, .iov_len=key_size},
+    {.iov_base=(void*)zeros, .iov_len=FCS_ALIGN(key_size)-key_size},
+    {.iov_base=(void*)payload, .iov_len=payload_size},
+    {.iov_base=(void*)zeros, .iov_len=FCS_ALIGN(payload_size)-payload_size}
+  };
+  _Bool sealed=0;
+  uint32_t offset;
+  fcs_segment* tail=fcs_reserve(st, size, &offset, &sealed);
+  if (!tail) return -1;
+  // body first, then record header over filler => torn write is never taken for valid record
+  _Bool ok=pwritev(tail->fd, iov, 4, offset+sizeof(fcs_record))==size-sizeof(fcs_record)
+      && pwrite(tail->fd, &rec, sizeof(rec), offset)==sizeof(rec);
+  if (!ok) {
+    nxweb_log_error("fc segment store: can't write into segment %08x; errno=%d", tail->id, errno);
+    fcs_write_filler(tail, offset, size);
+  }
+  pthread_rwlock_wrlock(&st->lock);
+  tail->writers--;
+  if (ok) {
+    fcs_index_record(st, tail, offset, size);
+    st->puts++;
+  }
+  pthread_rwlock_unlock(&st->lock);
+  if (!ok) return -1;
+  if (sealed || st->num_segments>st->max_segments) {
+    pthread_mutex_lock(&st->mux);
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->mux);
+  }
+  return 0;
+}
+
+void _nxweb_fc_segment_touch(nxweb_fc_segment_store* st, const char* key, uint32_t seg_id, uint32_t offset, time_t expires) {
+  if (!st->opened) return;
+  pthread_rwlock_rdlock(&st->lock);
+  ah_iter_t ci=alignhash_get(fcs_index, st->index, key);
+  if (ci!=alignhash_end(st->index) && alignhash_value(st->index, ci).seg_id==seg_id && alignhash_value(st->index, ci).offset==offset) {
+    fcs_segment* seg=fcs_find_segment(st, seg_id);
+    int64_t exp=expires;
+    if (seg) pwrite(seg->fd, &exp, sizeof(exp), offset+offsetof(fcs_record, expires));
+  }
+  pthread_rwlock_unlock(&st->lock);
+}
+
+static int fcs_on_startup() {
+  nxweb_fc_segment_store* st;
+  for (st=stores; st; st=st->next) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP); // don't starve appends
+    pthread_rwlock_init(&st->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&st->mux, 0);
+    pthread_mutex_init(&st->add_mux, 0);
+    pthread_cond_init(&st->cond, 0);
+    st->index=alignhash_init(fcs_index);
+    st->segments=nx_calloc(st->segments_capacity*sizeof(fcs_segment*));
+    st->next_id=1;
+    if (fcs_open(st)) { // store disabled; file_cache filter won't cache
+      fcs_close(st);
+      continue;
+    }
+    st->opened=1;
+    fcs_maintain(st);
+    if (pthread_create(&st->thread, 0, fcs_thread_main, st)) {
+      nxweb_log_error("fc segment store %s: can't start maintenance thread", st->dir);
+    }
+    else {
+      st->thread_started=1;
+    }
+  }
+  return 0;
+}
+
+static void fcs_on_shutdown() {
+  nxweb_fc_segment_store* st;
+  for (st=stores; st; st=st->next) {
+    if (st->thread_started) {
+      pthread_mutex_lock(&st->mux);
+      st->stop=1;
+      pthread_cond_signal(&st->cond);
+      pthread_mutex_unlock(&st->mux);
+      pthread_join(st->thread, 0);
+      st->thread_started=0;
+    }
+    if (st->opened) {
+      st->opened=0;
+      fcs_close(st);
+    }
+    pthread_cond_destroy(&st->cond);
+    pthread_mutex_destroy(&st->add_mux);
+    pthread_mutex_destroy(&st->mux);
+    pthread_rwlock_destroy(&st->lock);
+  }
+}
+
+static void fcs_on_diagnostics() {
+  nxweb_fc_segment_store* st;
+  for (st=stores; st; st=st->next) {
+    if (!st->opened) continue;
+    pthread_rwlock_rdlock(&st->lock);
+    uint64_t used=0, live=0;
+    int i;
+    for (i=0; i<st->num_segments; i++) {
+      used+=st->segments[i]->end;
+      live+=st->segments[i]->live;
+    }
+    nxweb_log_error("[diag] fc segment store %s: segments=%d/%d items=%d used=%" PRIu64 "KB live=%" PRIu64 "KB"
+                    " hits=%" PRIu64 " misses=%" PRIu64 " puts=%" PRIu64 " compacted=%" PRIu64 " evicted=%" PRIu64,
+                    st->dir, st->num_segments, st->max_segments, (int)alignhash_size(st->index), used>>10, live>>10,
+                    st->hits, st->misses, st->puts, st->compacted, st->evicted);
+    pthread_rwlock_unlock(&st->lock);
+  }
+}
+
+NXWEB_MODULE(fc_segment_store, .on_server_startup=fcs_on_startup,
+        .on_server_shutdown=fcs_on_shutdown, .on_server_diagnostics=fcs_on_diagnostics);
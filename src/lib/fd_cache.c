@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/fcntl.h>
+#include <sys/resource.h>
+
+#include "deps/ulib/alignhash_tpl.h"
+#include "deps/ulib/hash.h"
+
+/*
+ * Shared cache of stat() results and open file descriptors of static files.
+ * Entries are rechecked by stat() once their TTL expires; open fds are kept
+ * while the file stays the same. Fds handed out by nxweb_fd_cache_open()
+ * are referenced and must be released by nxweb_fd_cache_close().
+ */
+
+// fds above this are never cached (keeps fd => entry table small):
+#define FD_CACHE_MAX_FD_TABLE 262144
+
+typedef struct fd_cache_entry {
+  struct stat finfo;
+  nxe_time_t expires_time;
+  int fd; // 0 = not open yet
+  int stat_errno; // non-zero => file not found (negative entry)
+  uint32_t ref_count;
+  _Bool removed:1; // no longer in hash; free on last release
+  struct fd_cache_entry* prev;
+  struct fd_cache_entry* next;
+  char fpath[];
+} fd_cache_entry;
+
+#define fd_cache_hash_fn(key) hash_sdbm((const unsigned char*)(key))
+#define fd_cache_eq_fn(a, b) (!strcmp((a), (b)))
+
+DECLARE_ALIGNHASH(fd_cache, const char*, fd_cache_entry*, 1, fd_cache_hash_fn, fd_cache_eq_fn)
+
+static alignhash_t(fd_cache) *fd_cache;
+static fd_cache_entry* fd_cache_head;
+static fd_cache_entry* fd_cache_tail;
+static pthread_mutex_t fd_cache_mutex;
+static fd_cache_entry** fd_entries; // open fd => its entry
+static int fd_entries_size;
+static int fd_cache_max; // 0 = cache disabled
+static int fd_cache_open_fds;
+static uint64_t fd_cache_hits, fd_cache_misses, fd_cache_revalidations;
+
+static inline nxe_time_t fd_cache_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // served by vdso, no syscall
+  return (nxe_time_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+static inline _Bool same_file(const struct stat* a, const struct stat* b) {
+  return a->st_ino==b->st_ino && a->st_dev==b->st_dev && a->st_size==b->st_size
+      && a->st_mtime==b->st_mtime && a->st_mode==b->st_mode;
+}
+
+static inline void entry_link(fd_cache_entry* e) {
+  // add to head
+  e->prev=0;
+  e->next=fd_cache_head;
+  if (fd_cache_head) fd_cache_head->prev=e;
+  else fd_cache_tail=e;
+  fd_cache_head=e;
+}
+
+static inline void entry_unlink(fd_cache_entry* e) {
+  if (e->prev) e->prev->next=e->next;
+  else fd_cache_head=e->next;
+  if (e->next) e->next->prev=e->prev;
+  else fd_cache_tail=e->prev;
+  e->next=0;
+  e->prev=0;
+}
+
+static void entry_free(fd_cache_entry* e) { // call under mutex
+  if (e->fd>0) {
+    fd_entries[e->fd]=0;
+    close(e->fd);
+    fd_cache_open_fds--;
+  }
+  nx_free(e);
+}
+
+static void entry_remove(fd_cache_entry* e) { // call under mutex
+  ah_iter_t ci=alignhash_get(fd_cache, fd_cache, e->fpath);
+  if (ci!=alignhash_end(fd_cache) && alignhash_value(fd_cache, ci)==e) alignhash_del(fd_cache, fd_cache, ci);
+  entry_unlink(e);
+  e->removed=1;
+  if (!e->ref_count) entry_free(e);
+}
+
+static void fd_cache_check_size() { // call under mutex
+  while (alignhash_size(fd_cache)>fd_cache_max) {
+    fd_cache_entry* e=fd_cache_tail;
+    while (e && e->ref_count) e=e->prev;
+    if (!e) break;
+    entry_remove(e);
+  }
+}
+
+static fd_cache_entry* entry_create(const char* fpath, const struct stat* finfo, int stat_errno, int fd, nxe_time_t now) { // call under mutex
+  int len=strlen(fpath);
+  fd_cache_entry* e=nx_calloc(sizeof(fd_cache_entry)+len+1);
+  memcpy(e->fpath, fpath, len+1);
+  if (finfo) e->finfo=*finfo;
+  e->stat_errno=stat_errno;
+  e->expires_time=now+nxweb_server_config.fd_cache_ttl;
+  if (fd>0) {
+    e->fd=fd;
+    fd_entries[fd]=e;
+    fd_cache_open_fds++;
+  }
+  int ret=0;
+  ah_iter_t ci=alignhash_set(fd_cache, fd_cache, e->fpath, &ret);
+  if (ci==alignhash_end(fd_cache) || ret==AH_INS_ERR) { // should not happen: caller removed old entry
+    if (fd>0) {
+      fd_entries[fd]=0;
+      fd_cache_open_fds--;
+    }
+    nx_free(e);
+    return 0;
+  }
+  alignhash_value(fd_cache, ci)=e;
+  entry_link(e);
+  return e;
+}
+
+static inline fd_cache_entry* entry_get(const char* fpath) { // call under mutex
+  ah_iter_t ci=alignhash_get(fd_cache, fd_cache, fpath);
+  return ci!=alignhash_end(fd_cache)? alignhash_value(fd_cache, ci) : 0;
+}
+
+int nxweb_fd_cache_stat(const char* fpath, struct stat* finfo, int cached_only) {
+  if (!fd_cache_max) {
+    if (cached_only) return -2;
+    return stat(fpath, finfo);
+  }
+  nxe_time_t now=fd_cache_now();
+  pthread_mutex_lock(&fd_cache_mutex);
+  fd_cache_entry* e=entry_get(fpath);
+  if (e && now<=e->expires_time) {
+    fd_cache_hits++;
+    if (e!=fd_cache_head) {
+      entry_unlink(e);
+      entry_link(e); // relink to head
+    }
+    int stat_errno=e->stat_errno;
+    if (!stat_errno) *finfo=e->finfo;
+    pthread_mutex_unlock(&fd_cache_mutex);
+    if (stat_errno) {
+      errno=stat_errno;
+      return -1;
+    }
+    return 0;
+  }
+  pthread_mutex_unlock(&fd_cache_mutex);
+  if (cached_only) return -2;
+
+  struct stat st;
+  int stat_errno=stat(fpath, &st)==-1? errno : 0;
+
+  pthread_mutex_lock(&fd_cache_mutex);
+  e=entry_get(fpath);
+  if (e && !stat_errno && !e->stat_errno && same_file(&e->finfo, &st)) { // unchanged => keep open fd
+    fd_cache_revalidations++;
+    e->finfo=st;
+    e->expires_time=now+nxweb_server_config.fd_cache_ttl;
+  }
+  else {
+    fd_cache_misses++;
+    if (e) entry_remove(e);
+    entry_create(fpath, stat_errno? 0 : &st, stat_errno, 0, now);
+    fd_cache_check_size();
+  }
+  pthread_mutex_unlock(&fd_cache_mutex);
+  if (stat_errno) {
+    errno=stat_errno;
+    return -1;
+  }
+  *finfo=st;
+  return 0;
+}
+
+int nxweb_fd_cache_open(const char* fpath, int cached_only) {
+  if (!fd_cache_max) {
+    if (cached_only) return -2;
+    return open(fpath, O_RDONLY|O_NONBLOCK);
+  }
+  nxe_time_t now=fd_cache_now();
+  pthread_mutex_lock(&fd_cache_mutex);
+  fd_cache_entry* e=entry_get(fpath);
+  if (e && now<=e->expires_time && e->fd>0) {
+    fd_cache_hits++;
+    e->ref_count++;
+    int fd=e->fd;
+    pthread_mutex_unlock(&fd_cache_mutex);
+    return fd;
+  }
+  pthread_mutex_unlock(&fd_cache_mutex);
+  if (cached_only) return -2;
+
+  int fd=open(fpath, O_RDONLY|O_NONBLOCK);
+  if (fd==-1) return -1;
+  if (fd>=fd_entries_size) return fd; // not cacheable; plain close() on release
+  struct stat st;
+  if (fstat(fd, &st)==-1) {
+    close(fd);
+    return -1;
+  }
+
+  int extra_fd=0;
+  pthread_mutex_lock(&fd_cache_mutex);
+  e=entry_get(fpath);
+  if (e && !e->stat_errno && same_file(&e->finfo, &st)) {
+    if (e->fd>0) { // opened concurrently by other thread
+      extra_fd=fd;
+      fd=e->fd;
+    }
+    else {
+      e->fd=fd;
+      fd_entries[fd]=e;
+      fd_cache_open_fds++;
+    }
+    e->finfo=st;
+    e->expires_time=now+nxweb_server_config.fd_cache_ttl;
+  }
+  else {
+    fd_cache_misses++;
+    if (e) entry_remove(e);
+    e=entry_create(fpath, &st, 0, fd, now);
+  }
+  if (e) e->ref_count++;
+  fd_cache_check_size();
+  pthread_mutex_unlock(&fd_cache_mutex);
+  if (extra_fd) close(extra_fd);
+  return fd;
+}
+
+void nxweb_fd_cache_close(int fd) {
+  if (fd<=0) return;
+  // fd's slot can't change while caller holds the fd: it is either ours & referenced or not ours at all
+  if (fd<fd_entries_size && fd_entries[fd]) {
+    pthread_mutex_lock(&fd_cache_mutex);
+    fd_cache_entry* e=fd_entries[fd];
+    assert(e && e->ref_count>0);
+    if (!--e->ref_count && e->removed) entry_free(e);
+    pthread_mutex_unlock(&fd_cache_mutex);
+    return;
+  }
+  close(fd);
+}
+
+static int fd_cache_init() {
+  pthread_mutex_init(&fd_cache_mutex, 0);
+  fd_cache=alignhash_init(fd_cache);
+  struct rlimit rl;
+  fd_entries_size=FD_CACHE_MAX_FD_TABLE;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur!=RLIM_INFINITY && rl.rlim_cur<fd_entries_size) fd_entries_size=(int)rl.rlim_cur;
+  fd_cache_max=nxweb_server_config.fd_cache_size;
+  if (fd_cache_max>fd_entries_size/2) { // leave room for connections
+    nxweb_log_warning("fd cache size %d reduced to %d due to open files limit", fd_cache_max, fd_entries_size/2);
+    fd_cache_max=fd_entries_size/2;
+  }
+  if (fd_cache_max>0) fd_entries=nx_calloc(fd_entries_size*sizeof(fd_cache_entry*));
+  else fd_cache_max=fd_entries_size=0;
+  return 0;
+}
+
+static void fd_cache_finalize() {
+  if (fd_cache_max) {
+    pthread_mutex_lock(&fd_cache_mutex);
+    fd_cache_entry* e;
+    while ((e=fd_cache_head)) {
+      if (e->ref_count) nxweb_log_error("file %s still in fd cache with ref_count=%d", e->fpath, e->ref_count);
+      e->ref_count=0;
+      entry_remove(e);
+    }
+    fd_cache_max=0;
+    pthread_mutex_unlock(&fd_cache_mutex);
+    fd_entries_size=0;
+    nx_free(fd_entries);
+    fd_entries=0;
+  }
+  alignhash_destroy(fd_cache, fd_cache);
+  pthread_mutex_destroy(&fd_cache_mutex);
+}
+
+static void fd_cache_diagnostics() {
+  pthread_mutex_lock(&fd_cache_mutex);
+  nxweb_log_error("[diag] fd cache: entries=%d/%d open_fds=%d hits=%" PRIu64 " misses=%" PRIu64 " revalidations=%" PRIu64,
+                  (int)alignhash_size(fd_cache), fd_cache_max, fd_cache_open_fds, fd_cache_hits, fd_cache_misses, fd_cache_revalidations);
+  pthread_mutex_unlock(&fd_cache_mutex);
+}
+
+NXWEB_MODULE(fd_cache, .on_server_startup=fd_cache_init,
+        .on_server_shutdown=fd_cache_finalize, .on_server_diagnostics=fd_cache_diagnostics);
@@ -44,7 +44,7 @@ static nxweb_filter_data* cors_init(nxweb_filter* filter, nxweb_http_server_conn
 static void cors_finalize(nxweb_filter* filter, nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxweb_filter_data* fdata) {
   cors_filter_data* cfdata=(cors_filter_data*)fdata;
   if (cfdata->input_fd) {
-    close(cfdata->input_fd);
+    nxweb_fd_cache_close(cfdata->input_fd);
     cfdata->input_fd=0;
   }
 }
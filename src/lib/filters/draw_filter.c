@@ -63,7 +63,7 @@ static void draw_finalize(nxweb_filter* filter, nxweb_http_server_connection* co
     dfdata->blob=0;
   }
   if (dfdata->input_fd) {
-    close(dfdata->input_fd);
+    nxweb_fd_cache_close(dfdata->input_fd);
     dfdata->input_fd=0;
   }
 }
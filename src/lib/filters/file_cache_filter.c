@@ -36,6 +36,7 @@
 typedef struct nxweb_filter_file_cache {
   nxweb_filter base;
   const char* cache_dir;
+  struct nxweb_fc_segment_store* segstore; // null => one file per cache key
 } nxweb_filter_file_cache;
 
 typedef union nxf_data {
@@ -94,17 +95,37 @@ typedef struct fc_filter_data {
   int input_fd;
   nxd_fbuffer fb;
   fc_file_header hdr;
+  struct nxweb_fc_segment_store* segstore;
+  char* seg_data; // header data copied from segment
+  uint32_t seg_id; // location of record being served (for touch)
+  uint32_t seg_offset;
+  char* seg_buf; // item being stored into segment store
+  nxe_size_t seg_buf_len;
+  nxe_size_t seg_buf_size;
 } fc_filter_data;
 
+static inline _Bool fc_store_active(fc_filter_data* fcdata) {
+  return fcdata->segstore? !!fcdata->seg_buf : fcdata->fd && fcdata->fd!=-1;
+}
+
 
 static void fc_store_abort(fc_filter_data* fcdata);
+static int fc_store_append(fc_filter_data* fcdata, const void* ptr, nxe_size_t size);
 
 static int fc_store_begin(fc_filter_data* fcdata) {
   assert(!fcdata->fd || fcdata->fd==-1);
-  fcdata->fd=open(fcdata->tmp_fpath, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
-  if (fcdata->fd==-1) {
-    nxweb_log_error("fc_store_begin(): can't create cache file %s; could be open by another request; errno=%d", fcdata->tmp_fpath, errno);
-    return NXWEB_OK;
+  if (fcdata->segstore) { // item is collected in memory and appended to segment at once
+    fcdata->seg_buf_size=NXWEB_RBUF_SIZE;
+    fcdata->seg_buf_len=0;
+    fcdata->seg_buf=malloc(fcdata->seg_buf_size);
+    if (!fcdata->seg_buf) return -1;
+  }
+  else {
+    fcdata->fd=open(fcdata->tmp_fpath, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fcdata->fd==-1) {
+      nxweb_log_error("fc_store_begin(): can't create cache file %s; could be open by another request; errno=%d", fcdata->tmp_fpath, errno);
+      return NXWEB_OK;
+    }
   }
   nxweb_http_response* resp=fcdata->resp;
   assert(resp);
@@ -156,6 +177,11 @@ static int fc_store_begin(fc_filter_data* fcdata) {
   hdr->data_size=len;
 
   hdr->content_offset.offs=FC_HEADER_SIZE+hdr->data_size;
+  if (fcdata->segstore) {
+    if (fc_store_append(fcdata, hdr, FC_HEADER_SIZE)==-1) return -1;
+    if (fc_store_append(fcdata, data, hdr->data_size)==-1) return -1;
+    return 0;
+  }
   if (write(fcdata->fd, hdr, FC_HEADER_SIZE)!=FC_HEADER_SIZE) {
     nxweb_log_error("fc_store_begin(): can't write header into cache file %s", fcdata->tmp_fpath);
     fc_store_abort(fcdata);
@@ -169,7 +195,40 @@ static int fc_store_begin(fc_filter_data* fcdata) {
   return 0;
 }
 
+static int fc_seg_read_header(fc_filter_data* fcdata, nxb_buffer* nxb) {
+  nxweb_fc_segment_rec rec;
+  if (_nxweb_fc_segment_acquire(fcdata->segstore, fcdata->cache_fpath, &rec)) return -1;
+  fc_file_header* hdr=&fcdata->hdr;
+  if (rec.payload_size<FC_HEADER_SIZE) goto E1;
+  memcpy(hdr, rec.payload, FC_HEADER_SIZE);
+  if (hdr->signature!=NXFC_SIGNATURE || hdr->header_size!=FC_HEADER_SIZE || hdr->data_size<0
+      || FC_HEADER_SIZE+hdr->data_size>rec.payload_size || hdr->content_offset.offs>rec.payload_size) goto E1;
+  fcdata->seg_data=nxb_alloc_obj(nxb, hdr->data_size);
+  memcpy(fcdata->seg_data, rec.payload+FC_HEADER_SIZE, hdr->data_size);
+  fcdata->fd=dup(rec.fd); // segment could be compacted away while we are sending
+  _nxweb_fc_segment_release(fcdata->segstore);
+  if (fcdata->fd==-1) {
+    nxweb_log_error("fc_seg_read_header(): can't dup segment fd for %s; errno=%d", fcdata->cache_fpath, errno);
+    fcdata->fd=0;
+    return -1;
+  }
+  fcdata->seg_id=rec.seg_id;
+  fcdata->seg_offset=rec.offset;
+  hdr->content_offset.offs+=rec.payload_offset;
+  memset(&fcdata->cache_finfo, 0, sizeof(fcdata->cache_finfo));
+  fcdata->cache_finfo.st_mode=S_IFREG;
+  fcdata->cache_finfo.st_size=rec.payload_offset+rec.payload_size;
+  fcdata->cache_finfo.st_mtime=rec.expires; // same as file mtime of file-based store
+  return 0;
+
+  E1:
+  _nxweb_fc_segment_release(fcdata->segstore);
+  nxweb_log_error("fc_seg_read_header(): invalid cached item %s", fcdata->cache_fpath);
+  return -1;
+}
+
 static int fc_read_header(fc_filter_data* fcdata) {
+  if (fcdata->segstore) return fcdata->fd && fcdata->fd!=-1? 0 : -1; // read by fc_seg_read_header()
   if (fcdata->fd && fcdata->fd!=-1) {
     assert(fcdata->hdr.header_size==FC_HEADER_SIZE);
     if (lseek(fcdata->fd, FC_HEADER_SIZE, SEEK_SET)==-1) {
@@ -210,10 +269,13 @@ static int fc_read_data(fc_filter_data* fcdata, nxweb_http_response* resp) {
   fc_file_header* hdr=&fcdata->hdr;
   int fd=fcdata->fd;
   assert(fd && fd!=-1);
-  char* data=nxb_alloc_obj(resp->nxb, hdr->data_size);
-  if (read(fd, data, hdr->data_size)!=hdr->data_size) {
-    nxweb_log_error("fc_read(): can't read data from cache file %s", fcdata->cache_fpath);
-    goto E2;
+  char* data=fcdata->seg_data;
+  if (!data) {
+    data=nxb_alloc_obj(resp->nxb, hdr->data_size);
+    if (read(fd, data, hdr->data_size)!=hdr->data_size) {
+      nxweb_log_error("fc_read(): can't read data from cache file %s", fcdata->cache_fpath);
+      goto E2;
+    }
   }
   hdr->content_type.cptrc=hdr->content_type.u64? data+hdr->content_type.u64 : 0;
   hdr->content_charset.cptrc=hdr->content_charset.u64? data+hdr->content_charset.u64 : 0;
@@ -272,6 +334,27 @@ static int fc_read_data(fc_filter_data* fcdata, nxweb_http_response* resp) {
 }
 
 static int fc_store_append(fc_filter_data* fcdata, const void* ptr, nxe_size_t size) {
+  if (fcdata->segstore) {
+    if (fcdata->seg_buf_len+size>_nxweb_fc_segment_max_payload(fcdata->segstore)) {
+      nxweb_log_info("fc_store_append(): %s is too large for segment store", fcdata->cache_fpath);
+      fc_store_abort(fcdata);
+      return -1;
+    }
+    if (fcdata->seg_buf_len+size>fcdata->seg_buf_size) {
+      nxe_size_t new_size=fcdata->seg_buf_size*2;
+      while (new_size<fcdata->seg_buf_len+size) new_size*=2;
+      char* buf=realloc(fcdata->seg_buf, new_size);
+      if (!buf) {
+        fc_store_abort(fcdata);
+        return -1;
+      }
+      fcdata->seg_buf=buf;
+      fcdata->seg_buf_size=new_size;
+    }
+    memcpy(fcdata->seg_buf+fcdata->seg_buf_len, ptr, size);
+    fcdata->seg_buf_len+=size;
+    return 0;
+  }
   if (write(fcdata->fd, ptr, size)!=size) {
     nxweb_log_error("fc_store_append(): can't write %ld bytes into cache file %s", size, fcdata->tmp_fpath);
     fc_store_abort(fcdata);
@@ -281,6 +364,13 @@ static int fc_store_append(fc_filter_data* fcdata, const void* ptr, nxe_size_t s
 }
 
 static int fc_store_close(fc_filter_data* fcdata) {
+  if (fcdata->segstore) {
+    int r=_nxweb_fc_segment_put(fcdata->segstore, fcdata->cache_fpath, fcdata->seg_buf, fcdata->seg_buf_len, fcdata->expires_time);
+    if (r==-1) nxweb_log_error("fc_store_close(): can't store %s into segment store", fcdata->cache_fpath);
+    free(fcdata->seg_buf);
+    fcdata->seg_buf=0;
+    return r;
+  }
   struct timeval mtimes[2]={
     {.tv_sec=fcdata->expires_time},
     {.tv_sec=fcdata->expires_time}
@@ -301,6 +391,11 @@ static int fc_store_close(fc_filter_data* fcdata) {
 }
 
 static void fc_store_abort(fc_filter_data* fcdata) {
+  if (fcdata->segstore) {
+    free(fcdata->seg_buf);
+    fcdata->seg_buf=0;
+    return;
+  }
   close(fcdata->fd);
   unlink(fcdata->tmp_fpath);
   fcdata->tmp_fpath=0;
@@ -344,9 +439,9 @@ static nxe_ssize_t fc_data_in_write_or_sendfile(nxe_ostream* os, nxe_istream* is
       if (next_os->ready) {
         if (fd) { // invoked as sendfile
           bytes_sent=OSTREAM_CLASS(next_os)->write(next_os, &fcdata->data_out, fd, fr, ptr, size, &wflags);
-          if (bytes_sent>0 && fcdata->fd && fcdata->fd!=-1) {
+          if (bytes_sent>0 && fc_store_active(fcdata)) {
             char* buf=malloc(bytes_sent);
-            if (buf && lseek(fd, ptr.offs, SEEK_SET)!=-1 && read(fd, buf, bytes_sent)==bytes_sent) {
+            if (buf && pread(fd, buf, bytes_sent, ptr.offs)==bytes_sent) {
               fc_store_append(fcdata, buf, bytes_sent);
             }
             else {
@@ -358,7 +453,7 @@ static nxe_ssize_t fc_data_in_write_or_sendfile(nxe_ostream* os, nxe_istream* is
         }
         else {
           bytes_sent=OSTREAM_CLASS(next_os)->write(next_os, &fcdata->data_out, 0, 0, ptr, size, &wflags);
-          if (bytes_sent>0 && fcdata->fd && fcdata->fd!=-1) {
+          if (bytes_sent>0 && fc_store_active(fcdata)) {
             fc_store_append(fcdata, ptr.cptr, bytes_sent);
           }
         }
@@ -376,7 +471,7 @@ static nxe_ssize_t fc_data_in_write_or_sendfile(nxe_ostream* os, nxe_istream* is
   //nxweb_log_error("fc_write %d bytes: %.*s", (int)bytes_sent, (int)bytes_sent, ptr.cptrc);
   if (*flags&NXEF_EOF && bytes_sent==size) {
     // end of stream => close cache file
-    if (fcdata->fd && fcdata->fd!=-1) {
+    if (fc_store_active(fcdata)) {
       fc_store_close(fcdata);
     }
   }
@@ -412,15 +507,17 @@ void _nxweb_fc_finalize(fc_filter_data* fcdata) {
     close(fcdata->fd);
     if (fcdata->tmp_fpath) unlink(fcdata->tmp_fpath);
   }
+  if (fcdata->seg_buf) free(fcdata->seg_buf);
   nxd_fbuffer_finalize(&fcdata->fb);
   if (fcdata->input_fd && fcdata->input_fd!=-1) {
-    close(fcdata->input_fd);
+    nxweb_fd_cache_close(fcdata->input_fd);
   }
 }
 
 static nxweb_filter_data* fc_init(nxweb_filter* filter, nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
   nxweb_filter_data* fdata=nxb_calloc_obj(req->nxb, sizeof(nxweb_filter_data));
   fdata->fcache=_nxweb_fc_create(req->nxb, ((nxweb_filter_file_cache*)filter)->cache_dir);
+  fdata->fcache->segstore=((nxweb_filter_file_cache*)filter)->segstore;
   return fdata;
 }
 
@@ -433,6 +530,10 @@ static nxweb_result fc_translate_cache_key(nxweb_filter* filter, nxweb_http_serv
 }
 
 static void fc_build_cache_fpath(nxb_buffer* nxb, fc_filter_data* fcdata, const char* cache_key) {
+  if (fcdata->segstore) { // cache key is used as is
+    fcdata->cache_fpath=(char*)cache_key;
+    return;
+  }
   nxb_start_stream(nxb);
   nxb_append_str(nxb, fcdata->cache_dir);
   if (cache_key[0]=='.' && cache_key[1]=='.' && cache_key[2]=='/') cache_key+=2; // avoid going up dir tree
@@ -475,13 +576,44 @@ static nxweb_result fc_initiate_revalidation(fc_filter_data* fcdata, nxweb_http_
   return NXWEB_REVALIDATE;
 }
 
+typedef struct fc_file_op {
+  fc_filter_data* fcdata;
+  time_t check_time;
+  int result;
+} fc_file_op;
+
+static void fc_read_header_job(void* param) { // runs in worker thread
+  fc_file_op* op=param;
+  op->result=fc_read_header(op->fcdata);
+}
+
+static nxweb_result fc_check_header(nxweb_http_request* req, nxweb_http_response* resp, fc_filter_data* fcdata, time_t check_time, int read_result);
+
+static nxweb_result fc_read_header_complete(struct nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, void* param) {
+  fc_file_op* op=param;
+  return fc_check_header(req, resp, op->fcdata, op->check_time, op->result);
+}
+
 nxweb_result _nxweb_fc_serve_from_cache(struct nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, const char* cache_key, fc_filter_data* fcdata, time_t check_time) {
   if (!cache_key) return NXWEB_NEXT;
 
   nxweb_log_debug("_nxweb_fc_serve_from_cache");
 
   fc_build_cache_fpath(req->nxb, fcdata, cache_key);
-  if (fc_read_header(fcdata)==-1) {
+  if (fcdata->segstore) { // index lookup is in-memory; nothing to offload
+    return fc_check_header(req, resp, fcdata, check_time, fc_seg_read_header(fcdata, req->nxb));
+  }
+  if (nxweb_server_config.offload_file_io) {
+    fc_file_op* op=nxb_alloc_obj(req->nxb, sizeof(fc_file_op));
+    op->fcdata=fcdata;
+    op->check_time=check_time;
+    return nxweb_offload_file_op(conn, fc_read_header_job, fc_read_header_complete, op);
+  }
+  return fc_check_header(req, resp, fcdata, check_time, fc_read_header(fcdata));
+}
+
+static nxweb_result fc_check_header(nxweb_http_request* req, nxweb_http_response* resp, fc_filter_data* fcdata, time_t check_time, int read_result) {
+  if (read_result==-1) {
     if (req->if_modified_since) {
       // content not cached although it must be
       // remove if_modified_since
@@ -537,8 +669,13 @@ nxweb_result _nxweb_fc_revalidate(struct nxweb_http_server_connection* conn, nxw
       }
     }
     if (expires_time) { // have new expires time
-      struct utimbuf ut={.actime=expires_time, .modtime=expires_time};
-      utime(fcdata->cache_fpath, &ut);
+      if (fcdata->segstore) {
+        _nxweb_fc_segment_touch(fcdata->segstore, fcdata->cache_fpath, fcdata->seg_id, fcdata->seg_offset, expires_time);
+      }
+      else {
+        struct utimbuf ut={.actime=expires_time, .modtime=expires_time};
+        utime(fcdata->cache_fpath, &ut);
+      }
       resp->expires=expires_time;
     }
   }
@@ -586,11 +723,13 @@ nxweb_result _nxweb_fc_store(struct nxweb_http_server_connection* conn, nxweb_ht
     return NXWEB_OK;
   }
 
-  fcdata->tmp_fpath=nxb_alloc_obj(req->nxb, strlen(fcdata->cache_fpath)+4+1);
-  strcat(strcpy(fcdata->tmp_fpath, fcdata->cache_fpath), ".tmp");
-  if (nxweb_mkpath(fcdata->tmp_fpath, 0755)==-1) {
-    nxweb_log_error("can't create path to cache file %s; check permissions", fcdata->tmp_fpath);
-    return NXWEB_OK;
+  if (!fcdata->segstore) {
+    fcdata->tmp_fpath=nxb_alloc_obj(req->nxb, strlen(fcdata->cache_fpath)+4+1);
+    strcat(strcpy(fcdata->tmp_fpath, fcdata->cache_fpath), ".tmp");
+    if (nxweb_mkpath(fcdata->tmp_fpath, 0755)==-1) {
+      nxweb_log_error("can't create path to cache file %s; check permissions", fcdata->tmp_fpath);
+      return NXWEB_OK;
+    }
   }
   fcdata->resp=resp;
   fcdata->expires_time=expires_time;
@@ -615,6 +754,14 @@ static nxweb_filter* fc_config(nxweb_filter* base, const nx_json* json) {
   nxweb_filter_file_cache* f=calloc(1, sizeof(nxweb_filter_file_cache)); // NOTE this will never be freed
   *f=*(nxweb_filter_file_cache*)base;
   f->cache_dir=nx_json_get(json, "cache_dir")->text_value;
+  const char* store=nx_json_get(json, "store")->text_value;
+  if (store && !strcmp(store, "segments")) {
+    f->segstore=_nxweb_fc_segment_store_get(f->cache_dir,
+            (int)nx_json_get(json, "segment_size_mb")->int_value, (int)nx_json_get(json, "max_size_mb")->int_value);
+  }
+  else if (store && strcmp(store, "files")) {
+    nxweb_log_error("file_cache: unknown store type %s; using files", store);
+  }
   return (nxweb_filter*)f;
 }
 
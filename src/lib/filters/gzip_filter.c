@@ -283,7 +283,7 @@ static void gzip_finalize(nxweb_filter* filter, nxweb_http_server_connection* co
     nxe_disconnect_streams(&gdata->rb.data_out, gdata->rb.data_out.pair);
   if (gdata->rb.data_in.pair)
     nxe_disconnect_streams(gdata->rb.data_in.pair, &gdata->rb.data_in);
-  if (gdata->input_fd) close(gdata->input_fd);
+  if (gdata->input_fd) nxweb_fd_cache_close(gdata->input_fd);
   deflateEnd(&gdata->zs); // this is safe to call twice
 }
 
@@ -819,7 +819,7 @@ static nxweb_result img_do_filter(nxweb_filter* filter, nxweb_http_server_connec
   resp->last_modified=resp->sendfile_info.st_mtime;
   resp->content=0;
 
-  if (resp->sendfile_fd>0) close(resp->sendfile_fd);
+  if (resp->sendfile_fd>0) nxweb_fd_cache_close(resp->sendfile_fd);
   resp->sendfile_fd=open(resp->sendfile_path, O_RDONLY|O_NONBLOCK);
   if (resp->sendfile_fd!=-1) {
     nxd_fbuffer_init(&ifdata->fb, resp->sendfile_fd, resp->sendfile_offset, resp->sendfile_end);
@@ -26,6 +26,27 @@
 #include <sys/stat.h>
 #include <utime.h>
 
+// Scanned document: literal text segments each followed by raw directive (or null).
+// Cached per host+uri and validated by mtime; immutable once stored.
+
+typedef struct ssi_node {
+  const char* text;
+  int text_len;
+  const char* directive; // zero-terminated
+  int directive_len;
+} ssi_node;
+
+typedef struct ssi_compiled {
+  nx_refcache_entry entry; // must be first
+  int num_nodes;
+  ssi_node* nodes;
+} ssi_compiled;
+
+typedef struct ssi_node_rec {
+  ssi_node node;
+  struct ssi_node_rec* next;
+} ssi_node_rec;
+
 typedef struct ssi_buffer {
   nxb_buffer* nxb;
   nxe_ostream data_in;
@@ -36,6 +57,12 @@ typedef struct ssi_buffer {
   nxweb_http_request* req;
   nx_simple_map_entry* var_map;
   int parse_start_idx;
+  // scan result being recorded for cache:
+  const char* cache_key; // null if not cacheable
+  time_t mtime;
+  ssi_node_rec* first_rec;
+  ssi_node_rec* last_rec;
+  ssi_compiled* compiled;
 } ssi_buffer;
 
 typedef struct ssi_filter_data {
@@ -45,6 +72,10 @@ typedef struct ssi_filter_data {
 } ssi_filter_data;
 
 #define MAX_SSI_SIZE (20000000)
+// max number of scanned documents kept in memory:
+#define MAX_CACHED_SSI_DOCS 500
+// scanned document is dropped after this time (usec):
+#define SSI_CACHE_TTL NXWEB_DEFAULT_CACHED_TIME
 
 #ifndef max
 #define max(a,b) \
@@ -257,6 +288,27 @@ static int parse_directive(ssi_buffer* ssib, char* str, int len) {
   return -1;
 }
 
+static void run_directive(ssi_buffer* ssib, char* str, int len) {
+  if (parse_directive(ssib, str, len)==-1) {
+    // ssi syntax error
+    nxweb_composite_stream_append_bytes(ssib->cs, "<!--[ssi syntax error]-->", sizeof("<!--[ssi syntax error]-->")-1);
+  }
+}
+
+static void record_node(ssi_buffer* ssib, const char* text, int text_len, const char* directive, int directive_len) {
+  ssi_node_rec* rec=nxb_calloc_obj(ssib->nxb, sizeof(ssi_node_rec));
+  rec->node.text=text;
+  rec->node.text_len=text_len;
+  rec->node.directive=directive;
+  rec->node.directive_len=directive_len;
+  if (ssib->last_rec) ssib->last_rec->next=rec;
+  else ssib->first_rec=rec;
+  ssib->last_rec=rec;
+}
+
+static ssi_compiled* ssi_compile(ssi_buffer* ssib);
+static void ssi_cache_store(ssi_compiled* sc, nxe_time_t loop_time);
+
 static int parse_text(ssi_buffer* ssib) {
   // find all includes & start subrequests
   int size;
@@ -284,10 +336,9 @@ static int parse_text(ssi_buffer* ssib) {
         nxweb_composite_stream_append_bytes(ssib->cs, t, p-t);
       }
       *(p2-2)='\0';
-      if (parse_directive(ssib, p+5, (p2-p)-5-2)==-1) {
-        // ssi syntax error
-        nxweb_composite_stream_append_bytes(ssib->cs, "<!--[ssi syntax error]-->", sizeof("<!--[ssi syntax error]-->")-1);
-      }
+      int directive_len=(p2-p)-5-2;
+      if (ssib->cache_key) record_node(ssib, t, p-t, nxb_copy_obj(ssib->nxb, p+5, directive_len+1), directive_len);
+      run_directive(ssib, p+5, directive_len);
       return 1;
     }
     else {
@@ -335,6 +386,11 @@ static nxe_ssize_t ssi_buffer_data_in_write(nxe_ostream* os, nxe_istream* is, in
       nxweb_composite_stream_append_bytes(ssib->cs, ptr, nbytes);
     }
     nxweb_composite_stream_close(ssib->cs);
+    if (ssib->cache_key && !ssib->overflow) {
+      record_node(ssib, ptr, nbytes, 0, 0);
+      ssib->compiled=ssi_compile(ssib);
+      if (ssib->compiled) ssi_cache_store(ssib->compiled, os->super.loop->current_time);
+    }
   }
   return size;
 }
@@ -365,6 +421,87 @@ char* ssi_buffer_get_result(ssi_buffer* ssib, int* size) {
 }
 
 
+static ssi_compiled* ssi_compile(ssi_buffer* ssib) {
+  int num_nodes=0, text_len=0, directives_len=0, key_len=strlen(ssib->cache_key);
+  ssi_node_rec* rec;
+  for (rec=ssib->first_rec; rec; rec=rec->next) {
+    num_nodes++;
+    text_len+=rec->node.text_len;
+    if (rec->node.directive) directives_len+=rec->node.directive_len+1;
+  }
+  ssi_compiled* sc=nx_calloc(sizeof(ssi_compiled)+num_nodes*sizeof(ssi_node)+text_len+directives_len+key_len+1);
+  if (!sc) return 0;
+  sc->nodes=(ssi_node*)(sc+1);
+  char* p=(char*)(sc->nodes+num_nodes);
+  ssi_node* n=sc->nodes;
+  for (rec=ssib->first_rec; rec; rec=rec->next, n++) {
+    n->text=p;
+    n->text_len=rec->node.text_len;
+    memcpy(p, rec->node.text, n->text_len);
+    p+=n->text_len;
+  }
+  n=sc->nodes;
+  for (rec=ssib->first_rec; rec; rec=rec->next, n++) {
+    if (!rec->node.directive) continue;
+    n->directive=p;
+    n->directive_len=rec->node.directive_len;
+    memcpy(p, rec->node.directive, n->directive_len+1);
+    p+=n->directive_len+1;
+  }
+  memcpy(p, ssib->cache_key, key_len+1);
+  sc->entry.key=p;
+  sc->entry.mtime=ssib->mtime;
+  sc->num_nodes=num_nodes;
+  sc->entry.ref_count=1;
+  return sc;
+}
+
+static void ssi_replay(ssi_buffer* ssib, ssi_compiled* sc) {
+  // all includes get started right away; literal text is ready to send
+  int i;
+  ssi_node* n;
+  for (i=sc->num_nodes, n=sc->nodes; i>0; i--, n++) {
+    if (n->text_len) nxweb_composite_stream_append_bytes(ssib->cs, n->text, n->text_len);
+    if (n->directive) run_directive(ssib, nxb_copy_obj(ssib->nxb, n->directive, n->directive_len+1), n->directive_len);
+  }
+}
+
+static void ssi_compiled_free(nx_refcache_entry* e) {
+  nx_free(e);
+}
+
+static nx_refcache ssi_cache={.name="ssi documents", .max_entries=MAX_CACHED_SSI_DOCS,
+        .ttl=SSI_CACHE_TTL, .free_entry=ssi_compiled_free};
+
+static ssi_compiled* ssi_cache_get(const char* key, time_t mtime, nxe_time_t loop_time) {
+  return (ssi_compiled*)nx_refcache_get(&ssi_cache, key, mtime, loop_time);
+}
+
+static void ssi_cache_store(ssi_compiled* sc, nxe_time_t loop_time) {
+  nx_refcache_store(&ssi_cache, &sc->entry, loop_time);
+}
+
+static void ssi_cache_unref(ssi_compiled* sc) {
+  nx_refcache_unref(&ssi_cache, &sc->entry);
+}
+
+static int ssi_cache_init() {
+  nx_refcache_init(&ssi_cache);
+  return 0;
+}
+
+static void ssi_cache_finalize() {
+  nx_refcache_finalize(&ssi_cache);
+}
+
+static void ssi_cache_diagnostics() {
+  nx_refcache_diagnostics(&ssi_cache);
+}
+
+NXWEB_MODULE(ssi_cache, .on_server_startup=ssi_cache_init,
+        .on_server_shutdown=ssi_cache_finalize, .on_server_diagnostics=ssi_cache_diagnostics);
+
+
 static nxweb_filter_data* ssi_init(nxweb_filter* filter, nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
   nxweb_filter_data* fdata=nxb_calloc_obj(req->nxb, sizeof(ssi_filter_data));
   return fdata;
@@ -374,9 +511,13 @@ static void ssi_finalize(nxweb_filter* filter, nxweb_http_server_connection* con
   ssi_filter_data* sfdata=(ssi_filter_data*)fdata;
   if (sfdata->ssib.data_in.pair) nxe_disconnect_streams(sfdata->ssib.data_in.pair, &sfdata->ssib.data_in);
   if (sfdata->input_fd) {
-    close(sfdata->input_fd);
+    nxweb_fd_cache_close(sfdata->input_fd);
     sfdata->input_fd=0;
   }
+  if (sfdata->ssib.compiled) {
+    ssi_cache_unref(sfdata->ssib.compiled);
+    sfdata->ssib.compiled=0;
+  }
   if (sfdata->ssib.nxb) {
     nxb_empty(sfdata->ssib.nxb);
     nxp_free(conn->hsp.nxb_pool, sfdata->ssib.nxb);
@@ -411,10 +552,24 @@ static nxweb_result ssi_do_filter(nxweb_filter* filter, nxweb_http_server_connec
 
   nxd_http_server_proto_setup_content_out(&conn->hsp, resp);
 
-  // attach content_out to ssi_buffer
   ssi_buffer_init(&sfdata->ssib, conn, req);
-  if (resp->content_length>0) ssi_buffer_make_room(&sfdata->ssib, min(MAX_SSI_SIZE, resp->content_length));
-  nxe_connect_streams(conn->tdata->loop, resp->content_out, &sfdata->ssib.data_in);
+
+  // only documents coming from files (mtime known, content in memory or fd) are cached
+  if (resp->last_modified && (resp->content || resp->sendfile_fd>0)) {
+    const char* host=req->host? req->host : "";
+    char* key=nxb_alloc_obj(req->nxb, strlen(host)+strlen(req->uri)+1);
+    strcpy(key, host);
+    strcat(key, req->uri);
+    sfdata->ssib.cache_key=key;
+    sfdata->ssib.mtime=resp->last_modified;
+    sfdata->ssib.compiled=ssi_cache_get(key, resp->last_modified, conn->tdata->loop->current_time);
+  }
+
+  if (!sfdata->ssib.compiled) {
+    // attach content_out to ssi_buffer
+    if (resp->content_length>0) ssi_buffer_make_room(&sfdata->ssib, min((nxe_ssize_t)MAX_SSI_SIZE, resp->content_length));
+    nxe_connect_streams(conn->tdata->loop, resp->content_out, &sfdata->ssib.data_in);
+  }
 
   nxweb_set_request_data(req, SSIB_REQ_KEY, (nxe_data)(void*)&sfdata->ssib, 0); // will be used for variable lookups in parent requests
 
@@ -435,6 +590,11 @@ static nxweb_result ssi_do_filter(nxweb_filter* filter, nxweb_http_server_connec
 
   sfdata->ssib.cs=cs;
 
+  if (sfdata->ssib.compiled) { // no scanning, all includes start at once
+    ssi_replay(&sfdata->ssib, sfdata->ssib.compiled);
+    nxweb_composite_stream_close(cs);
+  }
+
   return NXWEB_OK;
 }
 
@@ -37,6 +37,9 @@ typedef struct tf_filter_data {
   nxweb_composite_stream* cs;
   int input_fd;
   time_t last_modified;
+  time_t start_mtime;
+  const char* compiled_key; // null if not cacheable
+  nxt_compiled* compiled;
   nxt_context* ctx;
   nxweb_http_server_connection* conn;
 } tf_filter_data;
@@ -59,25 +62,36 @@ typedef struct tf_filter_data {
 
 #define SPACE 32U
 
+static void tf_set_last_modified(tf_filter_data* tfdata) {
+  nxweb_http_request* req=&tfdata->conn->hsp.req;
+  nxweb_http_response* resp=tfdata->conn->hsp.resp;
+
+  resp->last_modified=tfdata->last_modified;
+  if (req->if_modified_since && resp->last_modified && resp->last_modified<=req->if_modified_since) {
+    nxweb_reset_content_out(&tfdata->conn->hsp, resp);
+    resp->status_code=304;
+    resp->status="Not Modified";
+  }
+}
+
 static void tf_check_complete(tf_filter_data* tfdata) {
   nxt_context* ctx=tfdata->ctx;
   if (nxt_is_complete(ctx)) {
     // merge
     nxt_merge(ctx);
-    // serialize
-    nxt_serialize_to_cs(ctx, tfdata->cs);
+    // compile & serialize
+    if (tfdata->compiled_key) tfdata->compiled=nxt_compile(ctx, tfdata->compiled_key, tfdata->start_mtime, tfdata->last_modified);
+    if (tfdata->compiled) {
+      nxt_cache_store(tfdata->compiled, tfdata->conn->tdata->loop->current_time);
+      nxt_compiled_to_cs(tfdata->compiled, tfdata->cs);
+    }
+    else {
+      nxt_serialize_to_cs(ctx, tfdata->cs);
+    }
     nxweb_composite_stream_close(tfdata->cs);
 
-    nxweb_http_request* req=&tfdata->conn->hsp.req;
-    nxweb_http_response* resp=tfdata->conn->hsp.resp;
-
-    resp->last_modified=tfdata->last_modified;
-    if (req->if_modified_since && resp->last_modified && resp->last_modified<=req->if_modified_since) {
-      nxweb_reset_content_out(&tfdata->conn->hsp, resp);
-      resp->status_code=304;
-      resp->status="Not Modified";
-    }
-    nxweb_start_sending_response(tfdata->conn, resp);
+    tf_set_last_modified(tfdata);
+    nxweb_start_sending_response(tfdata->conn, tfdata->conn->hsp.resp);
   }
 }
 
@@ -171,6 +185,13 @@ static void tf_on_subrequest_ready(nxweb_http_server_connection* subconn, nxe_da
 
   int status=resp->status_code;
   if (!subconn->subrequest_failed && (!status || status==200)) {
+    if (resp->last_modified && resp->sendfile_path) { // file; revalidated before cached template is used
+      nxt_add_dependency(tfdata->ctx, resp->sendfile_path, resp->last_modified);
+    }
+    else { // generated content or nothing to revalidate
+      if (tfb->blk) tfb->blk->dynamic=1;
+      else tfdata->ctx->uncacheable=1;
+    }
     if (tfdata->last_modified) {
       if (!resp->last_modified) tfdata->last_modified=0;
       else if (resp->last_modified > tfdata->last_modified) tfdata->last_modified=resp->last_modified;
@@ -189,6 +210,7 @@ static void tf_on_subrequest_ready(nxweb_http_server_connection* subconn, nxe_da
     // this might happen after first successful call to tf_on_subrequest_ready()
     nxweb_log_warning("templates subrequest failed: %s%s ref: %s", subconn->hsp.req.host, subconn->hsp.req.uri, subconn->parent->hsp.req.uri);
     nxb_unfinish_stream(tfb->nxb); // clean up in case we have already started collecting response
+    tfdata->ctx->uncacheable=1; // don't cache incomplete result
     tfdata->ctx->files_pending--;
     tf_check_complete(tfdata);
   }
@@ -229,13 +251,17 @@ static void tf_finalize(nxweb_filter* filter, nxweb_http_server_connection* conn
   tf_filter_data* tfdata=(tf_filter_data*)fdata;
   if (tfdata->tfb && tfdata->tfb->data_in.pair) nxe_disconnect_streams(tfdata->tfb->data_in.pair, &tfdata->tfb->data_in);
   if (tfdata->input_fd) {
-    close(tfdata->input_fd);
+    nxweb_fd_cache_close(tfdata->input_fd);
     tfdata->input_fd=0;
   }
   if (tfdata->ctx && tfdata->ctx->nxb) {
     nxb_empty(tfdata->ctx->nxb);
     nxp_free(conn->hsp.nxb_pool, tfdata->ctx->nxb);
   }
+  if (tfdata->compiled) {
+    nxt_compiled_unref(tfdata->compiled);
+    tfdata->compiled=0;
+  }
 }
 
 static nxweb_result tf_translate_cache_key(nxweb_filter* filter, nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxweb_filter_data* fdata, const char* key) {
@@ -275,10 +301,40 @@ static nxweb_result tf_do_filter(nxweb_filter* filter, nxweb_http_server_connect
 
   tf_filter_data* tfdata=(tf_filter_data*)fdata;
   tfdata->conn=conn;
+
+  // only templates coming from files (mtime known, content in memory or fd) are compiled & cached
+  if (resp->last_modified && (resp->content || resp->sendfile_fd>0)) {
+    const char* host=req->host? req->host : "";
+    char* key=nxb_alloc_obj(req->nxb, strlen(host)+strlen(req->uri)+1);
+    strcpy(key, host);
+    strcat(key, req->uri);
+    tfdata->compiled_key=key;
+    tfdata->start_mtime=resp->last_modified;
+    tfdata->compiled=nxt_cache_get(key, resp->last_modified, conn->tdata->loop->current_time);
+    if (tfdata->compiled) {
+      // hot path: no parsing, no subrequests for static parts
+      nxweb_composite_stream* cs=nxweb_composite_stream_init(conn, req);
+      nxweb_composite_stream_start(cs, resp);
+      resp->content=0;
+      resp->sendfile_path=0;
+      if (resp->sendfile_fd) {
+        tfdata->input_fd=resp->sendfile_fd;
+        resp->sendfile_fd=0;
+      }
+      tfdata->cs=cs;
+      tfdata->last_modified=tfdata->compiled->last_modified;
+      nxt_compiled_to_cs(tfdata->compiled, cs);
+      nxweb_composite_stream_close(cs);
+      tf_set_last_modified(tfdata);
+      return NXWEB_OK;
+    }
+  }
+
   nxb_buffer* nxb=nxp_alloc(conn->hsp.nxb_pool); // allocate separate nxb to not interfere with other filters
   nxb_init(nxb, NXWEB_CONN_NXB_SIZE);
   tfdata->ctx=nxb_alloc_obj(req->nxb, sizeof(nxt_context));
   nxt_init(tfdata->ctx, nxb, tf_load, (nxe_data)(void*)tfdata);
+  if (tfdata->compiled_key && resp->sendfile_path) nxt_add_dependency(tfdata->ctx, resp->sendfile_path, resp->last_modified);
   tfdata->tfb=nxb_calloc_obj(req->nxb, sizeof(tf_buffer));
   tf_buffer_init(tfdata->tfb, nxb, tfdata, nxt_file_create(tfdata->ctx, req->uri), 0);
 
@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/*
+ * Request bodies that bypass connection's in-memory buffer:
+ *  - handler with on_post_data_chunk() gets the body piece by piece as it arrives;
+ *    NXWEB_INWORKER handler's worker is started right away and fed through bounded ring,
+ *    net thread stops reading from socket while ring is full;
+ *  - other bodies above request_body_memory_limit are spilled to unlinked temp file.
+ *    Worker threads write one block while net thread fills the other one;
+ *    complete file is mmapped into req->content (null-terminated as usual).
+ */
+
+typedef enum nxweb_request_body_mode {
+  BODY_SPILL,
+  BODY_CHUNKS,
+  BODY_RING
+} nxweb_request_body_mode;
+
+typedef struct nxweb_request_body {
+  nxe_ostream data_in;
+  nxweb_http_server_connection* conn;
+  nxweb_request_body_mode mode;
+  nxe_size_t max_size;
+  nxe_size_t size; // bytes received
+  _Bool too_large;
+  _Bool rejected; // on_post_data_chunk() failed
+  _Bool eof;
+  // spill mode:
+  _Bool spilled; // going to temp file
+  _Bool writing; // block write job pending
+  _Bool finishing; // body received while writing; last block goes next
+  _Bool map_when_written; // last block is being written
+  char* fill; // block being filled; allocated with extra byte for null-terminator
+  nxe_size_t fill_size;
+  nxe_size_t fill_cap;
+  char* spare;
+  nxe_size_t spare_cap;
+  // touched by worker while writing:
+  char* wr_buf;
+  nxe_size_t wr_cap;
+  nxe_size_t wr_size;
+  int fd;
+  int write_error; // errno
+  off_t file_size;
+  void* map;
+  // ring mode (shared with worker under ring_mux):
+  pthread_mutex_t ring_mux;
+  pthread_cond_t ring_cond;
+  char* ring;
+  nxe_size_t ring_start;
+  nxe_size_t ring_used;
+  _Bool ring_full; // net thread waits for ring_room
+  _Bool ring_eof;
+  _Bool aborted;
+  nxw_completion ring_room;
+  struct nxweb_request_body* ring_prev;
+  struct nxweb_request_body* ring_next;
+} nxweb_request_body;
+
+static const char request_body_key; // variable's address only matters
+#define REQUEST_BODY_KEY ((nxe_data)&request_body_key)
+
+static __thread nxweb_request_body* ring_bodies; // in-worker consumers of this net thread
+
+static uint64_t bodies_streamed;
+static uint64_t bodies_spilled;
+static uint64_t bytes_spilled;
+static uint64_t inline_writes; // no worker available
+static uint64_t ring_stalls;
+
+static void request_body_finalize(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxe_data data) {
+  nxweb_request_body* b=data.ptr;
+  if (b->map) munmap(b->map, b->file_size);
+  if (b->fd) close(b->fd);
+  if (b->fill) nx_free(b->fill);
+  if (b->spare) nx_free(b->spare);
+  if (b->wr_buf) nx_free(b->wr_buf);
+  if (b->ring) {
+    if (b->ring_prev) b->ring_prev->ring_next=b->ring_next;
+    else ring_bodies=b->ring_next;
+    if (b->ring_next) b->ring_next->ring_prev=b->ring_prev;
+    nx_free(b->ring);
+    pthread_cond_destroy(&b->ring_cond);
+    pthread_mutex_destroy(&b->ring_mux);
+  }
+  b->map=0;
+  b->fd=0;
+  b->fill=b->spare=b->wr_buf=b->ring=0;
+  conn->body=0;
+}
+
+static void block_write_job(void* ptr) {
+  nxweb_request_body* b=ptr;
+  if (!b->fd && !b->write_error) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/nxweb_body_XXXXXX", nxweb_server_config.request_body_temp_dir);
+    int fd=mkstemp(path);
+    if (fd==-1) {
+      b->write_error=errno;
+      nxweb_log_error("can't create request body temp file %s: %s", path, strerror(errno));
+    }
+    else {
+      unlink(path);
+      b->fd=fd;
+    }
+  }
+  if (b->fd && !b->write_error) {
+    const char* p=b->wr_buf;
+    nxe_size_t left=b->wr_size;
+    while (left) {
+      ssize_t n=write(b->fd, p, left);
+      if (n<0) {
+        if (errno==EINTR) continue;
+        b->write_error=errno;
+        break;
+      }
+      p+=n;
+      left-=n;
+    }
+    b->file_size+=b->wr_size-left;
+  }
+  if (b->map_when_written && !b->write_error) {
+    // private writable mapping: handlers may modify content in place
+    void* map=mmap(0, b->file_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, b->fd, 0);
+    if (map==MAP_FAILED) b->write_error=errno;
+    else b->map=map;
+  }
+}
+
+static void block_written(nxweb_request_body* b) {
+  __sync_add_and_fetch(&bytes_spilled, b->wr_size);
+  if (!b->spare && b->wr_cap>=NXWEB_REQUEST_BODY_BLOCK_SIZE) {
+    b->spare=b->wr_buf;
+    b->spare_cap=b->wr_cap;
+  }
+  else {
+    nx_free(b->wr_buf);
+  }
+  b->wr_buf=0;
+  b->writing=0;
+}
+
+static void start_block_write(nxweb_request_body* b, _Bool last) {
+  nxweb_http_server_connection* conn=b->conn;
+  b->wr_buf=b->fill;
+  b->wr_cap=b->fill_cap;
+  b->wr_size=b->fill_size;
+  if (last) {
+    b->fill[b->fill_size]='\0'; // file gets null-terminated as in-memory body
+    b->wr_size++;
+    b->map_when_written=1;
+    b->fill=0;
+    b->fill_cap=0;
+  }
+  else if (b->spare) {
+    b->fill=b->spare;
+    b->fill_cap=b->spare_cap;
+    b->spare=0;
+  }
+  else {
+    b->fill=nx_alloc(NXWEB_REQUEST_BODY_BLOCK_SIZE+1);
+    b->fill_cap=NXWEB_REQUEST_BODY_BLOCK_SIZE;
+  }
+  b->fill_size=0;
+  if (!b->spilled) {
+    b->spilled=1;
+    __sync_add_and_fetch(&bodies_spilled, 1);
+  }
+  b->writing=1;
+  nxw_worker* w=nxw_get_worker(&conn->tdata->workers_factory);
+  if (w) {
+    conn->in_worker=1;
+    conn->body_in_worker=1;
+    conn->tdata->jobs_in_worker++;
+    nxw_start_worker(w, block_write_job, b, &conn->worker_complete);
+  }
+  else {
+    __sync_add_and_fetch(&inline_writes, 1);
+    block_write_job(b);
+    block_written(b);
+  }
+}
+
+static _Bool spill_make_room(nxweb_request_body* b) {
+  nxe_size_t memory_limit=nxweb_server_config.request_body_memory_limit;
+  if (!b->spilled && b->fill_cap<memory_limit) {
+    nxe_size_t cap=b->fill_cap*2;
+    if (cap>memory_limit) cap=memory_limit;
+    char* fill=nx_alloc(cap+1);
+    memcpy(fill, b->fill, b->fill_size);
+    nx_free(b->fill);
+    b->fill=fill;
+    b->fill_cap=cap;
+    return 1;
+  }
+  if (b->writing) return 0;
+  start_block_write(b, 0);
+  return 1;
+}
+
+static nxweb_result spill_mapped(nxweb_request_body* b) {
+  nxweb_http_server_connection* conn=b->conn;
+  if (b->write_error) {
+    nxweb_log_error("can't store %lu bytes request body of %s: %s", (unsigned long)b->size, conn->hsp.req.uri, strerror(b->write_error));
+    nxweb_send_http_error(&conn->hsp._resp, 500, "Internal Server Error");
+    return NXWEB_ERROR;
+  }
+  conn->hsp.req.content=b->map;
+  conn->hsp.req.content_fd=b->fd;
+  return NXWEB_OK;
+}
+
+static nxweb_result spill_finish(nxweb_request_body* b) {
+  nxweb_http_server_connection* conn=b->conn;
+  if (b->too_large) {
+    nxweb_send_http_error(&conn->hsp._resp, 413, "Request Entity Too Large");
+    return NXWEB_ERROR;
+  }
+  if (!b->spilled) {
+    b->fill[b->fill_size]='\0';
+    conn->hsp.req.content=b->fill;
+    return NXWEB_OK;
+  }
+  start_block_write(b, 1);
+  if (b->writing) return NXWEB_ASYNC;
+  return spill_mapped(b);
+}
+
+static void spill_data_in_do_read(nxe_ostream* os, nxe_istream* is) {
+  nxweb_request_body* b=OBJ_PTR_FROM_FLD_PTR(nxweb_request_body, data_in, os);
+  if (b->fill_size==b->fill_cap && !b->too_large && !spill_make_room(b)) {
+    nxe_ostream_unset_ready(os); // resumed by _nxweb_request_body_job_done()
+    return;
+  }
+  nxe_flags_t flags=0;
+  // once too large just swallow the rest
+  char* ptr=b->too_large? b->fill : b->fill+b->fill_size;
+  nxe_size_t size=b->too_large? b->fill_cap : b->fill_cap-b->fill_size;
+  nxe_ssize_t bytes_received=ISTREAM_CLASS(is)->read(is, os, ptr, size, &flags);
+  if (bytes_received>0) {
+    b->size+=bytes_received;
+    if (b->size>b->max_size) b->too_large=1;
+    if (!b->too_large) b->fill_size+=bytes_received;
+  }
+  if (flags&NXEF_EOF) {
+    b->eof=1;
+    nxe_ostream_unset_ready(os);
+  }
+}
+
+static void chunks_data_in_do_read(nxe_ostream* os, nxe_istream* is) {
+  nxweb_request_body* b=OBJ_PTR_FROM_FLD_PTR(nxweb_request_body, data_in, os);
+  nxweb_http_server_connection* conn=b->conn;
+  char buf[16384];
+  nxe_flags_t flags=0;
+  nxe_ssize_t bytes_received=ISTREAM_CLASS(is)->read(is, os, buf, sizeof(buf), &flags);
+  if (bytes_received>0) {
+    b->size+=bytes_received;
+    if (b->size>b->max_size) b->too_large=1;
+    if (!b->too_large && !b->rejected
+        && conn->handler->on_post_data_chunk(conn, &conn->hsp.req, &conn->hsp._resp, buf, bytes_received)!=NXWEB_OK) {
+      b->rejected=1; // swallow the rest
+    }
+  }
+  if (flags&NXEF_EOF) {
+    b->eof=1;
+    nxe_ostream_unset_ready(os);
+  }
+}
+
+static void ring_data_in_do_read(nxe_ostream* os, nxe_istream* is) {
+  nxweb_request_body* b=OBJ_PTR_FROM_FLD_PTR(nxweb_request_body, data_in, os);
+  pthread_mutex_lock(&b->ring_mux);
+  nxe_size_t used=b->ring_used;
+  nxe_size_t pos=(b->ring_start+used)%NXWEB_REQUEST_BODY_RING_SIZE;
+  if (used==NXWEB_REQUEST_BODY_RING_SIZE) {
+    b->ring_full=1;
+    pthread_mutex_unlock(&b->ring_mux);
+    __sync_add_and_fetch(&ring_stalls, 1);
+    nxe_ostream_unset_ready(os); // resumed by ring_room completion
+    return;
+  }
+  pthread_mutex_unlock(&b->ring_mux);
+  // worker only reads used part of the ring, free part is ours
+  nxe_size_t size=NXWEB_REQUEST_BODY_RING_SIZE-used;
+  if (size>NXWEB_REQUEST_BODY_RING_SIZE-pos) size=NXWEB_REQUEST_BODY_RING_SIZE-pos;
+  nxe_flags_t flags=0;
+  nxe_ssize_t bytes_received=ISTREAM_CLASS(is)->read(is, os, b->ring+pos, size, &flags);
+  pthread_mutex_lock(&b->ring_mux);
+  if (bytes_received>0) {
+    b->size+=bytes_received;
+    if (b->size>b->max_size) b->too_large=1;
+    if (!b->too_large) b->ring_used+=bytes_received;
+  }
+  if (flags&NXEF_EOF) b->ring_eof=1;
+  pthread_cond_signal(&b->ring_cond);
+  pthread_mutex_unlock(&b->ring_mux);
+  if (flags&NXEF_EOF) {
+    b->eof=1;
+    nxe_ostream_unset_ready(os);
+  }
+}
+
+static void ring_room_on_complete(nxw_completion* c) {
+  nxweb_request_body* b=OBJ_PTR_FROM_FLD_PTR(nxweb_request_body, ring_room, c);
+  if (!b->eof) nxe_ostream_set_ready(b->conn->tdata->loop, &b->data_in);
+}
+
+static void ring_job(void* ptr) {
+  nxweb_request_body* b=ptr;
+  nxweb_http_server_connection* conn=b->conn;
+  nxweb_http_request* req=&conn->hsp.req;
+  nxweb_http_response* resp=&conn->hsp._resp;
+  nxweb_handler* h=conn->handler;
+  _Bool rejected=0;
+  _Bool too_large;
+  while (1) {
+    pthread_mutex_lock(&b->ring_mux);
+    while (!b->ring_used && !b->ring_eof && !b->aborted) pthread_cond_wait(&b->ring_cond, &b->ring_mux);
+    if (b->aborted) {
+      pthread_mutex_unlock(&b->ring_mux);
+      return; // connection is closing
+    }
+    nxe_size_t start=b->ring_start;
+    nxe_size_t size=b->ring_used;
+    too_large=b->too_large;
+    pthread_mutex_unlock(&b->ring_mux);
+    if (!size) break; // eof
+    if (size>NXWEB_REQUEST_BODY_RING_SIZE-start) size=NXWEB_REQUEST_BODY_RING_SIZE-start;
+    if (!rejected && h->on_post_data_chunk(conn, req, resp, b->ring+start, size)!=NXWEB_OK) rejected=1;
+    pthread_mutex_lock(&b->ring_mux);
+    b->ring_start=(start+size)%NXWEB_REQUEST_BODY_RING_SIZE;
+    b->ring_used-=size;
+    _Bool wake=b->ring_full;
+    b->ring_full=0;
+    pthread_mutex_unlock(&b->ring_mux);
+    if (wake) nxw_complete(&conn->tdata->workers_factory.complete_queue, &b->ring_room);
+  }
+  if (too_large) {
+    nxweb_send_http_error(resp, 413, "Request Entity Too Large");
+    return;
+  }
+  if (rejected) {
+    if (!resp->status_code) nxweb_send_http_error(resp, 400, "Bad Request");
+    return;
+  }
+  // same as invoke_request_handler() but body has already been consumed here
+  if (h->on_post_data_complete) h->on_post_data_complete(conn, req, resp);
+  if (h->flags&NXWEB_PARSE_PARAMETERS) nxweb_parse_request_parameters(req, 1);
+  if (h->flags&NXWEB_PARSE_COOKIES) nxweb_parse_request_cookies(req);
+  nxb_start_stream(req->nxb);
+  if (h->on_request) {
+    h->on_request(conn, req, resp);
+    nxd_http_server_proto_finish_response(resp);
+  }
+}
+
+static const nxe_ostream_class spill_data_in_class={.do_read=spill_data_in_do_read};
+static const nxe_ostream_class chunks_data_in_class={.do_read=chunks_data_in_do_read};
+static const nxe_ostream_class ring_data_in_class={.do_read=ring_data_in_do_read};
+
+nxweb_result _nxweb_request_body_start(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxe_size_t max_size) {
+  nxweb_handler* h=conn->handler;
+  nxweb_request_body* b=nxb_calloc_obj(req->nxb, sizeof(nxweb_request_body));
+  b->conn=conn;
+  b->max_size=max_size;
+  b->data_in.ready=1;
+  if (h->on_post_data_chunk && (h->flags&NXWEB_INWORKER)) {
+    nxw_worker* w=nxw_get_worker(&conn->tdata->workers_factory);
+    if (!w) {
+      nxweb_send_http_error(resp, 503, "Service Unavailable");
+      return NXWEB_ERROR;
+    }
+    b->mode=BODY_RING;
+    b->data_in.super.cls.os_cls=&ring_data_in_class;
+    b->ring=nx_alloc(NXWEB_REQUEST_BODY_RING_SIZE);
+    pthread_mutex_init(&b->ring_mux, 0);
+    pthread_cond_init(&b->ring_cond, 0);
+    b->ring_room.on_complete=ring_room_on_complete;
+    b->ring_next=ring_bodies;
+    if (ring_bodies) ring_bodies->ring_prev=b;
+    ring_bodies=b;
+    conn->in_worker=1;
+    conn->tdata->jobs_in_worker++;
+    nxw_start_worker(w, ring_job, b, &conn->worker_complete);
+    __sync_add_and_fetch(&bodies_streamed, 1);
+  }
+  else if (h->on_post_data_chunk) {
+    b->mode=BODY_CHUNKS;
+    b->data_in.super.cls.os_cls=&chunks_data_in_class;
+    __sync_add_and_fetch(&bodies_streamed, 1);
+  }
+  else {
+    b->mode=BODY_SPILL;
+    b->data_in.super.cls.os_cls=&spill_data_in_class;
+    nxe_size_t memory_limit=nxweb_server_config.request_body_memory_limit;
+    nxe_size_t cap=16384; // grows up to memory_limit
+    if (cap>memory_limit) cap=memory_limit;
+    if (!cap || (req->content_length>0 && (nxe_size_t)req->content_length>memory_limit)) {
+      cap=NXWEB_REQUEST_BODY_BLOCK_SIZE;
+      b->spilled=1;
+      __sync_add_and_fetch(&bodies_spilled, 1);
+    }
+    b->fill=nx_alloc(cap+1);
+    b->fill_cap=cap;
+  }
+  conn->body=b;
+  nxweb_set_request_data(req, REQUEST_BODY_KEY, (nxe_data)(void*)b, request_body_finalize);
+  conn->hsp.cls->connect_request_body_out(&conn->hsp, &b->data_in);
+  conn->hsp.cls->start_receiving_request_body(&conn->hsp);
+  return NXWEB_OK;
+}
+
+nxweb_result _nxweb_request_body_received(nxweb_http_server_connection* conn) {
+  nxweb_request_body* b=conn->body;
+  nxweb_http_response* resp=&conn->hsp._resp;
+  switch (b->mode) {
+    case BODY_RING:
+      return NXWEB_ASYNC; // worker proceeds to on_request() by itself
+    case BODY_CHUNKS:
+      if (b->too_large) {
+        nxweb_send_http_error(resp, 413, "Request Entity Too Large");
+        return NXWEB_ERROR;
+      }
+      if (b->rejected) {
+        if (!resp->status_code) nxweb_send_http_error(resp, 400, "Bad Request");
+        return NXWEB_ERROR;
+      }
+      return NXWEB_OK;
+    default:
+      if (b->writing) {
+        b->finishing=1;
+        return NXWEB_ASYNC;
+      }
+      return spill_finish(b);
+  }
+}
+
+nxweb_result _nxweb_request_body_job_done(nxweb_http_server_connection* conn) {
+  nxweb_request_body* b=conn->body;
+  block_written(b);
+  if (b->map_when_written) return spill_mapped(b);
+  if (b->finishing) return spill_finish(b);
+  if (!b->eof) nxe_ostream_set_ready(conn->tdata->loop, &b->data_in);
+  return NXWEB_ASYNC;
+}
+
+void _nxweb_request_body_abort(nxweb_http_server_connection* conn) {
+  nxweb_request_body* b=conn->body;
+  if (b->mode!=BODY_RING) return;
+  pthread_mutex_lock(&b->ring_mux);
+  b->aborted=1;
+  pthread_cond_signal(&b->ring_cond);
+  pthread_mutex_unlock(&b->ring_mux);
+}
+
+void _nxweb_request_body_shutdown_thread() {
+  // workers would wait for body forever; closing connection lets them go
+  nxweb_request_body* b;
+  nxweb_request_body* next;
+  for (b=ring_bodies; b; b=next) {
+    next=b->ring_next;
+    nxweb_http_server_connection_finalize(b->conn, 0);
+  }
+}
+
+static void request_body_diagnostics() {
+  nxweb_log_error("[diag] request bodies: streamed=%" PRIu64 " spilled=%" PRIu64 " spilled_bytes=%" PRIu64 " inline_writes=%" PRIu64 " ring_stalls=%" PRIu64,
+                  bodies_streamed, bodies_spilled, bytes_spilled, inline_writes, ring_stalls);
+}
+
+NXWEB_MODULE(request_body, .on_server_diagnostics=request_body_diagnostics);
@@ -39,6 +39,20 @@
 
 struct nxweb_server_config nxweb_server_config={
   .shutdown_timeout=5,
+  .net_thread_placement={.spread_nodes=1},
+  .numa_bind_memory=1,
+  .pin_workers=1,
+  .conn_pool_size=NXWEB_DEFAULT_CONN_POOL_SIZE,
+  .rbuf_pool_size=NXWEB_DEFAULT_RBUF_POOL_SIZE,
+  .pool_gc_hold_time=NXWEB_DEFAULT_POOL_GC_HOLD_TIME,
+  .fd_cache_size=NXWEB_DEFAULT_FD_CACHE_SIZE,
+  .fd_cache_ttl=NXWEB_DEFAULT_FD_CACHE_TTL,
+  .request_body_max_size=NXWEB_MAX_REQUEST_BODY_SIZE,
+  .request_body_memory_limit=NXWEB_REQUEST_BODY_MEMORY_LIMIT,
+  .request_body_temp_dir=NXWEB_DEFAULT_REQUEST_BODY_TEMP_DIR,
+  .ssl_session_cache_size=NXWEB_DEFAULT_SSL_SESSION_CACHE_SIZE,
+  .ssl_session_timeout=NXWEB_DEFAULT_SSL_SESSION_TIMEOUT,
+  .ssl_ticket_key_rotation=NXWEB_DEFAULT_SSL_TICKET_KEY_ROTATION,
   .access_log_on_request_received=nxweb_access_log_on_request_received,
   .access_log_on_request_complete=nxweb_access_log_on_request_complete,
   .access_log_on_proxy_response=nxweb_access_log_on_proxy_response
@@ -47,7 +61,7 @@ struct nxweb_server_config nxweb_server_config={
 static pthread_t main_thread_id=0;
 
 static volatile int shutdown_in_progress=0;
-static volatile int num_connections=0;
+static volatile int num_connections=0; // client connections in all net threads
 
 uint16_t _nxweb_max_net_threads;
 nxweb_net_thread_data* _nxweb_net_threads=NULL;
@@ -60,7 +74,8 @@ static nxe_time_t _nxe_timeouts[NXE_NUMBER_OF_TIMER_QUEUES] = {
   [NXWEB_TIMER_WRITE]=NXWEB_DEFAULT_WRITE_TIMEOUT,
   [NXWEB_TIMER_BACKEND]=NXWEB_DEFAULT_BACKEND_TIMEOUT,
   [NXWEB_TIMER_100CONTINUE]=NXWEB_DEFAULT_100CONTINUE_TIMEOUT,
-  [NXWEB_TIMER_ACCEPT_RETRY]=NXWEB_DEFAULT_ACCEPT_RETRY_TIMEOUT
+  [NXWEB_TIMER_ACCEPT_RETRY]=NXWEB_DEFAULT_ACCEPT_RETRY_TIMEOUT,
+  [NXWEB_TIMER_EVENT_STREAM_PING]=NXWEB_DEFAULT_EVENT_STREAM_PING_TIMEOUT
 };
 
 static nxweb_result default_on_headers(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
@@ -71,13 +86,105 @@ static nxweb_result default_on_headers(nxweb_http_server_connection* conn, nxweb
 // nxweb_handler _nxweb_default_handler={.priority=999999999, .on_headers=default_on_headers};
 NXWEB_DEFINE_HANDLER(default, .prefix=0, .priority=999999999, .on_headers=default_on_headers);
 
+static void cancel_select(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
+  nxweb_handler* handler=conn->handler;
+  const int num_filters=handler->num_filters;
+  if (num_filters) {
+    // filters have been initialized => finalize them
+    nxweb_filter** filters=handler->filters;
+    int i;
+    nxweb_filter* filter;
+    nxweb_filter_data* fdata;
+    for (i=0; i<num_filters; i++) {
+      filter=filters[i];
+      fdata=req->filter_data[i];
+      if (fdata && filter->finalize)
+        filter->finalize(filter, conn, req, resp, fdata);
+      req->filter_data[i]=0; // call no more
+    }
+  }
+  // restore saved fields
+  req->uri=conn->select_uri_original;
+  req->if_modified_since=conn->select_ims_original;
+  // reset changed fields
+  conn->handler=0;
+  conn->handler_param=(nxe_data)0;
+  resp->cache_key=0;
+  resp->last_modified=0;
+  resp->mtype=0;
+  resp->content_type=0;
+  resp->content_charset=0;
+  resp->sendfile_path=0;
+  if (resp->sendfile_fd>0) {
+    nxweb_fd_cache_close(resp->sendfile_fd);
+  }
+  resp->sendfile_fd=0;
+  if (resp->sendfile_info.st_ino) memset(&resp->sendfile_info, 0, sizeof(resp->sendfile_info));
+}
+
+// continue handler selection after serve_from_cache() of filter idx returned r
+static nxweb_result continue_select(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, int idx, nxweb_result r) {
+  nxweb_handler* handler=conn->handler;
+  const int num_filters=handler->num_filters;
+  nxweb_filter** filters=handler->filters;
+  int i=idx;
+  nxweb_filter* filter;
+  nxweb_filter_data* fdata;
+  for (;;) {
+    if (r==NXWEB_ASYNC) { // filter is reading its cache in worker thread
+      conn->select_filter_idx=i;
+      return NXWEB_ASYNC;
+    }
+    if (r==NXWEB_OK) { // filter has served content (which has not expired by check_time)
+      // process it through filters & send to client
+      for (i++; i<num_filters; i++) {
+        filter=filters[i];
+        fdata=req->filter_data[i];
+        if (fdata && !fdata->bypass && filter->do_filter) {
+          if (filter->do_filter(filter, conn, req, resp, fdata)==NXWEB_DELAY) {
+            resp->run_filter_idx=i+1; // resume from next filter
+            return NXWEB_OK;
+          }
+        }
+      }
+      if (handler->memcache) {
+        nxweb_cache_store_response(conn, resp);
+      }
+      conn->hsp.cls->start_sending_response(&conn->hsp, resp);
+      return NXWEB_OK;
+    }
+    /*
+    else if (r==NXWEB_REVALIDATE) { // filter has content but it has expired
+      // the filter has already set if_modified_since field in request (revalidation mode)
+      // it must be ready to process 304 Not Modified response
+      // on the way back in its do_filter()
+    }
+    else { // no cached content OR cached content's last_modified is older than req->if_modified_since
+    }
+    */
+    for (i--; i>=0; i--) {
+      filter=filters[i];
+      fdata=req->filter_data[i];
+      if (filter->serve_from_cache && fdata && !fdata->bypass) break;
+    }
+    if (i<0) break;
+    r=filter->serve_from_cache(filter, conn, req, resp, fdata, conn->select_check_time);
+  }
+
+  conn->select_filter_idx=-1;
+  r=NXWEB_OK;
+  if (handler->on_select) r=handler->on_select(conn, req, resp);
+  if (r!=NXWEB_OK && r!=NXWEB_ASYNC) cancel_select(conn, req, resp);
+  return r;
+}
+
 int nxweb_select_handler(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxweb_handler* handler, nxe_data handler_param) {
   conn->handler=handler;
   conn->handler_param=handler_param;
   // since nxweb_select_handler() could be called several times
   // make sure all changed fields returned to initial state
-  time_t if_modified_since_original=req->if_modified_since; // save original value
-  const char* uri_original=req->uri;
+  conn->select_ims_original=req->if_modified_since; // save original value
+  conn->select_uri_original=req->uri;
 
   const int num_filters=handler->num_filters;
   nxweb_filter** filters=handler->filters;
@@ -164,83 +271,13 @@ int nxweb_select_handler(nxweb_http_server_connection* conn, nxweb_http_request*
         }
       }
       if (num_filters) {
-        time_t check_time=resp->last_modified? resp->last_modified : nxe_get_current_http_time(conn->tdata->loop);
-        int i;
-        nxweb_filter* filter;
-        nxweb_filter_data* fdata;
-        for (i=num_filters-1; i>=0; i--) {
-          filter=filters[i];
-          fdata=req->filter_data[i];
-          if (filter->serve_from_cache && fdata && !fdata->bypass) {
-            nxweb_result r=filter->serve_from_cache(filter, conn, req, resp, fdata, check_time);
-            if (r==NXWEB_OK) { // filter has served content (which has not expired by check_time)
-              // process it through filters & send to client
-              for (i++; i<num_filters; i++) {
-                filter=filters[i];
-                nxweb_filter_data* fdata1=req->filter_data[i];
-                if (fdata1 && !fdata1->bypass && filter->do_filter) {
-                  if (filter->do_filter(filter, conn, req, resp, fdata1)==NXWEB_DELAY) {
-                    resp->run_filter_idx=i+1; // resume from next filter
-                    return NXWEB_OK;
-                  }
-                }
-              }
-              if (handler->memcache) {
-                nxweb_cache_store_response(conn, resp);
-              }
-              conn->hsp.cls->start_sending_response(&conn->hsp, resp);
-              return NXWEB_OK;
-            }
-            /*
-            else if (r==NXWEB_REVALIDATE) { // filter has content but it has expired
-              // the filter has already set if_modified_since field in request (revalidation mode)
-              // it must be ready to process 304 Not Modified response
-              // on the way back in its do_filter()
-            }
-            else { // no cached content OR cached content's last_modified is older than req->if_modified_since
-            }
-            */
-          }
-        }
+        conn->select_check_time=resp->last_modified? resp->last_modified : nxe_get_current_http_time(conn->tdata->loop);
+        return continue_select(conn, req, resp, num_filters, NXWEB_NEXT);
       }
     }
   }
 
-  nxweb_result r=NXWEB_OK;
-  if (handler->on_select) r=handler->on_select(conn, req, resp);
-  if (r!=NXWEB_OK) {
-    if (num_filters) {
-      // filters have been initialized => finalize them
-      int i;
-      nxweb_filter* filter;
-      nxweb_filter_data* fdata;
-      for (i=0; i<num_filters; i++) {
-        filter=filters[i];
-        fdata=req->filter_data[i];
-        if (fdata && filter->finalize)
-          filter->finalize(filter, conn, req, resp, fdata);
-        req->filter_data[i]=0; // call no more
-      }
-    }
-    // restore saved fields
-    req->uri=uri_original;
-    req->if_modified_since=if_modified_since_original;
-    // reset changed fields
-    conn->handler=0;
-    conn->handler_param=(nxe_data)0;
-    resp->cache_key=0;
-    resp->last_modified=0;
-    resp->mtype=0;
-    resp->content_type=0;
-    resp->content_charset=0;
-    resp->sendfile_path=0;
-    if (resp->sendfile_fd>0) {
-      close(resp->sendfile_fd);
-    }
-    resp->sendfile_fd=0;
-    if (resp->sendfile_info.st_ino) memset(&resp->sendfile_info, 0, sizeof(resp->sendfile_info));
-  }
-  return r;
+  return continue_select(conn, req, resp, 0, NXWEB_NEXT);
 }
 
 static inline _Bool is_method_allowed(nxweb_http_request* req, nxweb_handler_flags flags) {
@@ -251,8 +288,7 @@ static inline _Bool is_method_allowed(nxweb_http_request* req, nxweb_handler_fla
   return 0;
 }
 
-nxweb_result _nxweb_default_request_dispatcher(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
-  nxweb_handler* h=nxweb_server_config.handler_list;
+static nxweb_result dispatch_from(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, int from_order) {
   const char* uri=req->uri;
   const char* host=req->host;
   _Bool secure=conn->secure;
@@ -266,11 +302,17 @@ nxweb_result _nxweb_default_request_dispatcher(nxweb_http_server_connection* con
     host_len=0;
   }
   int uri_len=strlen(uri);
+  // router yields only handlers matching vhost & prefix, in routing list order
+  nxweb_route_match m;
+  _Bool routed=nxweb_server_config.router && !_nxweb_router_match(nxweb_server_config.router, &m, host, host_len, uri, uri_len);
+  nxweb_handler* h;
+  if (routed) h=_nxweb_router_next(&m, from_order);
+  else for (h=nxweb_server_config.handler_list; h && h->route_order<from_order; h=h->next);
   while (h) {
     if ((secure && !h->insecure_only) || (!secure && !h->secure_only)) {
       if (is_method_allowed(req, h->flags)) {
-        if (!h->vhost_len || (host_len && nxweb_vhost_match(host, host_len, h->vhost, h->vhost_len))) {
-          if (!h->prefix_len || nxweb_url_prefix_match(uri, uri_len, h->prefix, h->prefix_len)) {
+        if (routed || !h->vhost_len || (host_len && nxweb_vhost_match(host, host_len, h->vhost, h->vhost_len))) {
+          if (routed || !h->prefix_len || nxweb_url_prefix_match(uri, uri_len, h->prefix, h->prefix_len)) {
             nxweb_result res=nxweb_select_handler(conn, req, resp, h, h->param);
             if (res!=NXWEB_NEXT) {
               if (res==NXWEB_ERROR) {
@@ -279,6 +321,7 @@ nxweb_result _nxweb_default_request_dispatcher(nxweb_http_server_connection* con
                 nxweb_start_sending_response(conn, resp);
                 return NXWEB_ERROR;
               }
+              if (res==NXWEB_ASYNC) return NXWEB_ASYNC; // resumed by nxweb_resume_select()
               if (res!=NXWEB_OK) {
                 nxweb_log_error("handler %s on_select() returned error %d", h->name, res);
                 break;
@@ -289,7 +332,7 @@ nxweb_result _nxweb_default_request_dispatcher(nxweb_http_server_connection* con
         }
       }
     }
-    h=h->next;
+    h=routed? _nxweb_router_next(&m, 0) : h->next;
   }
 
   req->path_info=0;
@@ -297,6 +340,10 @@ nxweb_result _nxweb_default_request_dispatcher(nxweb_http_server_connection* con
   return NXWEB_OK;
 }
 
+nxweb_result _nxweb_default_request_dispatcher(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
+  return dispatch_from(conn, req, resp, 0);
+}
+
 void _nxweb_register_module(nxweb_module* module) {
   if (!nxweb_server_config.module_list) {
     nxweb_server_config.module_list=module;
@@ -346,10 +393,15 @@ void _nxweb_register_handler(nxweb_handler* handler, nxweb_handler* base) {
     if (!handler->on_headers) handler->on_headers=base->on_headers;
     if (!handler->on_post_data) handler->on_post_data=base->on_post_data;
     if (!handler->on_post_data_complete) handler->on_post_data_complete=base->on_post_data_complete;
+    if (!handler->on_post_data_chunk) handler->on_post_data_chunk=base->on_post_data_chunk;
     if (!handler->on_request) handler->on_request=base->on_request;
+    if (!handler->on_ws_open) handler->on_ws_open=base->on_ws_open;
+    if (!handler->on_ws_message) handler->on_ws_message=base->on_ws_message;
+    if (!handler->on_ws_close) handler->on_ws_close=base->on_ws_close;
     if (!handler->on_complete) handler->on_complete=base->on_complete;
     if (!handler->on_error) handler->on_error=base->on_error;
     if (!handler->flags) handler->flags=base->flags;
+    if (!handler->max_body_size) handler->max_body_size=base->max_body_size;
   }
   int i;
   nxweb_filter* filter;
@@ -391,27 +443,64 @@ static void invoke_request_handler_in_worker(void* ptr) {
   }
 }
 
-static void nxweb_http_server_connection_worker_complete_on_message(nxe_subscriber* sub, nxe_publisher* pub, nxe_data data) {
-  nxweb_http_server_connection* conn=OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_connection, worker_complete, sub);
-  nxe_unsubscribe(conn->worker_complete.pub, &conn->worker_complete);
-  __sync_synchronize(); // full memory barrier
+static void nxweb_resume_select(nxweb_http_server_connection* conn, nxweb_result r);
+static void request_body_complete(nxweb_http_server_connection* conn, nxweb_result r);
+#ifdef WITH_SSL
+static void nxweb_http_server_connection_ssl_handshake_step_done(nxw_completion* c);
+#endif // WITH_SSL
+
+static void nxweb_http_server_connection_worker_complete(nxw_completion* c) {
+  nxweb_http_server_connection* conn=OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_connection, worker_complete, c);
   conn->in_worker=0;
-  long cnt=0;
-  while (!conn->worker_job_done) cnt++;
-  if (cnt) nxweb_log_warning("job not done in %ld steps", cnt);
+  conn->tdata->jobs_in_worker--;
   if (conn->connection_closing) {
+    conn->file_op_complete=0;
+    while (conn->parent) conn=conn->parent; // subrequests get finalized with their parent
+    if (conn->h2_conn && conn->h2_conn->connection_closing) conn=conn->h2_conn; // so do HTTP/2 streams
     nxweb_http_server_connection_finalize(conn, 0);
   }
+  else if (conn->file_op_complete) {
+    nxweb_file_op_callback on_complete=conn->file_op_complete;
+    conn->file_op_complete=0;
+    nxweb_resume_select(conn, on_complete(conn, &conn->hsp.req, &conn->hsp._resp, conn->file_op_param));
+  }
+  else if (conn->body_in_worker) {
+    conn->body_in_worker=0;
+    request_body_complete(conn, _nxweb_request_body_job_done(conn));
+  }
   else {
     nxweb_start_sending_response(conn, &conn->hsp._resp);
   }
 }
 
+/*
+ * Run blocking file operation job(param) in worker thread, then on_complete() in net thread.
+ * To be called from on_select() or serve_from_cache(); returns NXWEB_ASYNC when job has been offloaded,
+ * on_complete()'s result is then fed back into handler selection.
+ * When offloading is off or no worker available runs both in place and returns on_complete()'s result.
+ */
+nxweb_result nxweb_offload_file_op(nxweb_http_server_connection* conn, void (*job)(void* param), nxweb_file_op_callback on_complete, void* param) {
+  if (nxweb_server_config.offload_file_io && !conn->in_worker) {
+    nxw_worker* w=nxw_get_worker(&conn->tdata->workers_factory);
+    if (w) {
+      conn->file_op_complete=on_complete;
+      conn->file_op_param=param;
+      nxw_start_worker(w, job, param, &conn->worker_complete);
+      conn->in_worker=1;
+      conn->tdata->jobs_in_worker++;
+      return NXWEB_ASYNC;
+    }
+  }
+  job(param);
+  return on_complete(conn, &conn->hsp.req, &conn->hsp._resp, param);
+}
+
 static inline nxweb_result invoke_request_handler(nxweb_http_server_connection* conn, nxweb_http_request* req,
         nxweb_http_response* resp, nxweb_handler* h, nxweb_handler_flags flags) {
   if (conn->connection_closing) return; // do not process if already closing
   if (flags&NXWEB_PARSE_PARAMETERS) nxweb_parse_request_parameters(req, 1); // !!(flags&NXWEB_PRESERVE_URI)
   if (flags&NXWEB_PARSE_COOKIES) nxweb_parse_request_cookies(req);
+  if (h->on_ws_message && (req->connection_upgrade || !h->on_request)) return _nxweb_websocket_upgrade(conn, req, resp);
   nxb_start_stream(req->nxb);
   nxweb_result res=NXWEB_OK;
   if (h->on_request) {
@@ -422,9 +511,9 @@ static inline nxweb_result invoke_request_handler(nxweb_http_server_connection*
         nxweb_start_sending_response(conn, resp);
         return NXWEB_ERROR;
       }
-      nxe_subscribe(conn->tdata->loop, &w->complete_efs.data_notify, &conn->worker_complete);
-      nxw_start_worker(w, invoke_request_handler_in_worker, conn, &conn->worker_job_done);
+      nxw_start_worker(w, invoke_request_handler_in_worker, conn, &conn->worker_complete);
       conn->in_worker=1;
+      conn->tdata->jobs_in_worker++;
     }
     else {
       res=h->on_request(conn, req, resp);
@@ -435,84 +524,154 @@ static inline nxweb_result invoke_request_handler(nxweb_http_server_connection*
   return res;
 }
 
-static void nxweb_http_server_connection_events_sub_on_message(nxe_subscriber* sub, nxe_publisher* pub, nxe_data data) {
-  nxweb_http_server_connection* conn=(nxweb_http_server_connection*)((char*)sub-offsetof(nxweb_http_server_connection, events_sub));
-  //nxe_loop* loop=sub->super.loop;
-  nxweb_http_request* req=&conn->hsp.req;
-  nxweb_http_response* resp=&conn->hsp._resp;
-  if (data.i==NXD_HSP_REQUEST_RECEIVED) {
-    assert(nxweb_server_config.request_dispatcher);
-    assert(nxweb_server_config.access_log_on_request_received);
-
-    nxweb_log_debug("nxweb_http_server_connection_events_sub_on_message NXD_HSP_REQUEST_RECEIVED");
-
-    req->received_time=nxweb_get_loop_time(conn);
-    nxweb_server_config.access_log_on_request_received(conn, req);
-    nxweb_server_config.request_dispatcher(conn, req, resp);
-    if (!conn->handler) conn->handler=&nxweb_default_handler;
+static inline _Bool shed_new_requests(nxweb_net_thread_data* tdata) {
+  return (nxweb_server_config.shed_loop_lag && tdata->loop->lag > nxweb_server_config.shed_loop_lag)
+      || (nxweb_server_config.shed_worker_jobs && tdata->jobs_in_worker >= nxweb_server_config.shed_worker_jobs);
+}
 
-    if (conn->hsp.state==HSP_SENDING_HEADERS || resp->run_filter_idx) return; // one of callbacks has already started sending response
+static void process_selected_request(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
+  if (!conn->handler) conn->handler=&nxweb_default_handler;
 
-    nxweb_handler* h=conn->handler;
-    nxweb_handler_flags flags=h->flags;
+  if (conn->in_worker) return; // selection continues in nxweb_resume_select()
+  if (conn->hsp.state==HSP_SENDING_HEADERS || resp->run_filter_idx) return; // one of callbacks has already started sending response
 
-    if (flags&_NXWEB_HANDLE_MASK) {
-      if (((!(flags&NXWEB_HANDLE_GET) || !req->get_method)
-        && (!(flags&NXWEB_HANDLE_POST) || !req->post_method)
-        && (!(flags&NXWEB_HANDLE_OTHER) || !req->other_method))
-        || (req->content_length && !(flags&(NXWEB_HANDLE_POST|NXWEB_ACCEPT_CONTENT)))) {
-          nxweb_send_http_error(resp, 405, "Method Not Allowed");
-          if (req->content_length) resp->keep_alive=0; // close connection if there is body pending
-          nxweb_start_sending_response(conn, resp);
-          return;
-      }
-    }
+  nxweb_handler* h=conn->handler;
+  nxweb_handler_flags flags=h->flags;
 
-    if (h->on_headers) {
-      if (NXWEB_OK!=h->on_headers(conn, req, resp)) {
-        // request processing terminated by http error response
+  if (flags&_NXWEB_HANDLE_MASK) {
+    if (((!(flags&NXWEB_HANDLE_GET) || !req->get_method)
+      && (!(flags&NXWEB_HANDLE_POST) || !req->post_method)
+      && (!(flags&NXWEB_HANDLE_OTHER) || !req->other_method))
+      || (req->content_length && !(flags&(NXWEB_HANDLE_POST|NXWEB_ACCEPT_CONTENT)))) {
+        nxweb_send_http_error(resp, 405, "Method Not Allowed");
         if (req->content_length) resp->keep_alive=0; // close connection if there is body pending
         nxweb_start_sending_response(conn, resp);
         return;
-      }
     }
+  }
 
-    if (conn->hsp.state==HSP_SENDING_HEADERS) return; // one of callbacks has already started sending headers
+  if (h->on_headers) {
+    if (NXWEB_OK!=h->on_headers(conn, req, resp)) {
+      // request processing terminated by http error response
+      if (req->content_length) resp->keep_alive=0; // close connection if there is body pending
+      nxweb_start_sending_response(conn, resp);
+      return;
+    }
+  }
+
+  if (conn->hsp.state==HSP_SENDING_HEADERS) return; // one of callbacks has already started sending headers
 
-    if (req->content_length) {
-      if (h->on_post_data) h->on_post_data(conn, req, resp);
-      if (conn->hsp.state!=HSP_SENDING_HEADERS && !conn->hsp.cls->get_request_body_out_pair(&conn->hsp)) { // stream still not connected
-        if (req->content_length>NXWEB_MAX_REQUEST_BODY_SIZE) {
-          nxweb_send_http_error(resp, 413, "Request Entity Too Large");
+  if (req->content_length) {
+    if (h->on_post_data) h->on_post_data(conn, req, resp);
+    if (conn->hsp.state!=HSP_SENDING_HEADERS && !conn->hsp.cls->get_request_body_out_pair(&conn->hsp)) { // stream still not connected
+      nxe_size_t max_size=h->max_body_size? h->max_body_size : nxweb_server_config.request_body_max_size;
+      if (req->content_length>0 && (nxe_size_t)req->content_length>max_size) {
+        nxweb_send_http_error(resp, 413, "Request Entity Too Large");
+        resp->keep_alive=0; // close connection
+        nxweb_start_sending_response(conn, resp);
+        return;
+      }
+      nxe_size_t memory_limit=nxweb_server_config.request_body_memory_limit;
+      if (h->on_post_data_chunk || (max_size>memory_limit && (req->content_length<0 || (nxe_size_t)req->content_length>memory_limit))) {
+        if (_nxweb_request_body_start(conn, req, resp, max_size)!=NXWEB_OK) {
           resp->keep_alive=0; // close connection
           nxweb_start_sending_response(conn, resp);
-          return;
         }
-        nxe_loop* loop=conn->tdata->loop;
-        nxd_ibuffer_init(&conn->ib, conn->hsp.nxb, req->content_length>0? req->content_length+1 : NXWEB_MAX_REQUEST_BODY_SIZE);
-        conn->hsp.cls->connect_request_body_out(&conn->hsp, &conn->ib.data_in);
-        conn->hsp.cls->start_receiving_request_body(&conn->hsp);
-        req->buffering_to_memory=1;
+        return;
       }
+      nxd_ibuffer_init(&conn->ib, conn->hsp.nxb, req->content_length>0? req->content_length+1 : max_size);
+      conn->hsp.cls->connect_request_body_out(&conn->hsp, &conn->ib.data_in);
+      conn->hsp.cls->start_receiving_request_body(&conn->hsp);
+      req->buffering_to_memory=1;
     }
-    else {
-      invoke_request_handler(conn, req, resp, h, flags);
+  }
+  else {
+    invoke_request_handler(conn, req, resp, h, flags);
+  }
+}
+
+static void nxweb_resume_select(nxweb_http_server_connection* conn, nxweb_result r) {
+  nxweb_http_request* req=&conn->hsp.req;
+  nxweb_http_response* resp=&conn->hsp._resp;
+  nxweb_handler* h=conn->handler;
+  if (conn->select_filter_idx>=0) r=continue_select(conn, req, resp, conn->select_filter_idx, r);
+  else if (r!=NXWEB_OK && r!=NXWEB_ASYNC) cancel_select(conn, req, resp);
+  if (r==NXWEB_NEXT) {
+    if (nxweb_server_config.request_dispatcher==_nxweb_default_request_dispatcher) {
+      r=dispatch_from(conn, req, resp, h->route_order+1);
     }
+    else { // can't resume custom dispatcher
+      req->path_info=0;
+      r=nxweb_select_handler(conn, req, resp, &nxweb_default_handler, (nxe_data)0);
+    }
+  }
+  else if (r==NXWEB_ERROR) {
+    // request processing terminated by http error response
+    if (req->content_length) resp->keep_alive=0; // close connection if there is body pending
+    nxweb_start_sending_response(conn, resp);
+    return;
+  }
+  else if (r!=NXWEB_OK && r!=NXWEB_ASYNC) {
+    nxweb_log_error("handler %s on_select() returned error %d", h->name, r);
+    req->path_info=0;
+    r=nxweb_select_handler(conn, req, resp, &nxweb_default_handler, (nxe_data)0);
+  }
+  if (r==NXWEB_ASYNC || r==NXWEB_ERROR) return;
+  process_selected_request(conn, req, resp);
+}
+
+static void request_body_complete(nxweb_http_server_connection* conn, nxweb_result r) {
+  nxweb_http_request* req=&conn->hsp.req;
+  nxweb_http_response* resp=&conn->hsp._resp;
+  if (r==NXWEB_ASYNC) return; // resumed when body is on disk; in-worker chunk consumer calls handler itself
+  if (r==NXWEB_ERROR) {
+    nxweb_start_sending_response(conn, resp);
+    return;
+  }
+  nxweb_handler* h=conn->handler;
+  nxweb_handler_flags flags=h->flags;
+  if (h->on_post_data_complete) h->on_post_data_complete(conn, req, resp);
+  if (req->buffering_to_memory && conn->hsp.cls->get_request_body_out_pair(&conn->hsp)==&conn->ib.data_in) {
+    int size;
+    req->content=nxd_ibuffer_get_result(&conn->ib, &size);
+    assert(req->content_received==size);
+  }
+  invoke_request_handler(conn, req, resp, h, flags);
+}
+
+static void nxweb_http_server_connection_events_sub_on_message(nxe_subscriber* sub, nxe_publisher* pub, nxe_data data) {
+  nxweb_http_server_connection* conn=(nxweb_http_server_connection*)((char*)sub-offsetof(nxweb_http_server_connection, events_sub));
+  //nxe_loop* loop=sub->super.loop;
+  nxweb_http_request* req=&conn->hsp.req;
+  nxweb_http_response* resp=&conn->hsp._resp;
+  if (data.i==NXD_HSP_REQUEST_RECEIVED) {
+    assert(nxweb_server_config.request_dispatcher);
+    assert(nxweb_server_config.access_log_on_request_received);
+
+    nxweb_log_debug("nxweb_http_server_connection_events_sub_on_message NXD_HSP_REQUEST_RECEIVED");
+
+    req->received_time=nxweb_get_loop_time(conn);
+    nxweb_server_config.access_log_on_request_received(conn, req);
+
+    if (!conn->parent && shed_new_requests(conn->tdata)) {
+      // overloaded: fail fast instead of queuing behind slow requests
+      conn->tdata->requests_shed++;
+      nxweb_send_http_error(resp, 503, "Service Unavailable");
+      nxweb_add_response_header(resp, "Retry-After", NXWEB_SHED_RETRY_AFTER);
+      resp->keep_alive=0;
+      nxweb_start_sending_response(conn, resp);
+      return;
+    }
+
+    nxweb_server_config.request_dispatcher(conn, req, resp);
+    process_selected_request(conn, req, resp);
   }
   else if (data.i==NXD_HSP_REQUEST_BODY_RECEIVED) {
     assert(conn->handler);
 
     nxweb_log_debug("nxweb_http_server_connection_events_sub_on_message NXD_HSP_REQUEST_BODY_RECEIVED");
 
-    nxweb_handler* h=conn->handler;
-    nxweb_handler_flags flags=h->flags;
-    if (h->on_post_data_complete) h->on_post_data_complete(conn, req, resp);
-    if (req->buffering_to_memory && conn->hsp.cls->get_request_body_out_pair(&conn->hsp)==&conn->ib.data_in) {
-      int size;
-      req->content=nxd_ibuffer_get_result(&conn->ib, &size);
-      assert(req->content_received==size);
-    }
-    invoke_request_handler(conn, req, resp, h, flags);
+    request_body_complete(conn, conn->body? _nxweb_request_body_received(conn) : NXWEB_OK);
   }
   else if (data.i==NXD_HSP_REQUEST_COMPLETE) {
 
@@ -520,6 +679,17 @@ static void nxweb_http_server_connection_events_sub_on_message(nxe_subscriber* s
 
     conn->hsp.cls->request_cleanup(sub->super.loop, &conn->hsp);
     assert(!conn->handler);
+    if (conn->h2_conn) nxweb_http_server_connection_finalize(conn, 1); // HTTP/2 stream is done
+  }
+  else if (data.i==NXD_HSP_HTTP2_PREFACE) {
+
+    nxweb_log_debug("nxweb_http_server_connection_events_sub_on_message NXD_HSP_HTTP2_PREFACE");
+
+    conn->h2=nx_calloc(sizeof(nxd_http2_server_proto));
+    nxd_http2_server_proto_init(conn->h2, conn->tdata->free_conn_nxb_pool);
+    conn->h2->conn=conn;
+    conn->h2->events_pub=&conn->hsp.events_pub;
+    nxd_http_server_proto_upgrade_http2(&conn->hsp, conn->h2);
   }
   else if (data.i==NXD_HSP_RESPONSE_READY) {
 
@@ -538,13 +708,13 @@ static void nxweb_http_server_connection_events_sub_on_message(nxe_subscriber* s
     if (conn->hsp.headers_bytes_received) {
       nxweb_log_warning("conn %p error: i=%d errno=%d state=%d rc=%d br=%d", conn, data.i, errno, conn->hsp.state, conn->hsp.request_count, conn->hsp.headers_bytes_received);
     }
-    int good=(!conn->hsp.headers_bytes_received && (data.i==NXE_RDHUP || data.i==NXE_HUP || data.i==NXE_RDCLOSED)); // normal close
+    int good=(!conn->hsp.headers_bytes_received && (data.i==NXE_RDHUP || data.i==NXE_HUP || data.i==NXE_RDCLOSED))
+            || data.i==NXD_HSP_WEBSOCKET_CLOSED; // normal close
     nxweb_http_server_connection_finalize(conn, good); // bad connections get RST'd
   }
 }
 
 static const nxe_subscriber_class nxweb_http_server_connection_events_sub_class={.on_message=nxweb_http_server_connection_events_sub_on_message};
-static const nxe_subscriber_class nxweb_http_server_connection_worker_complete_class={.on_message=nxweb_http_server_connection_worker_complete_on_message};
 
 void nxweb_start_sending_response(nxweb_http_server_connection* conn, nxweb_http_response* resp) {
 
@@ -581,11 +751,19 @@ static void nxweb_http_server_connection_init(nxweb_http_server_connection* conn
   conn->tdata=tdata;
   conn->lconf_idx=lconf_idx;
   nxd_http_server_proto_init(&conn->hsp, tdata->free_conn_nxb_pool);
-#ifdef WITH_SSL
   nxweb_server_listen_config* lconf=&nxweb_server_config.listen_config[conn->lconf_idx];
+  conn->hsp.detect_http2=lconf->http2;
+#ifdef WITH_SSL
   if (lconf->secure) {
     conn->secure=1;
-    nxd_ssl_server_socket_init(&conn->sock, lconf->x509_cred, lconf->priority_cache, &lconf->session_ticket_key);
+    nxd_ssl_server_socket_init(&conn->sock, lconf->x509_cred, lconf->priority_cache, 0);
+    _nxweb_ssl_session_setup(conn->sock.session, lconf);
+    if (lconf->http2) nxd_ssl_server_socket_enable_http2(&conn->sock);
+    conn->sock.ktls=lconf->ktls;
+    if (nxweb_server_config.ssl_handshake_threads) {
+      conn->sock.offload_handshake=_nxweb_ssl_handshake_offload;
+      conn->ssl_handshake_step.on_complete=nxweb_http_server_connection_ssl_handshake_step_done;
+    }
   }
   else {
     nxd_socket_init((nxd_socket*)&conn->sock);
@@ -594,7 +772,7 @@ static void nxweb_http_server_connection_init(nxweb_http_server_connection* conn
   nxd_socket_init(&conn->sock);
 #endif // WITH_SSL
   conn->events_sub.super.cls.sub_cls=&nxweb_http_server_connection_events_sub_class;
-  conn->worker_complete.super.cls.sub_cls=&nxweb_http_server_connection_worker_complete_class;
+  conn->worker_complete.on_complete=nxweb_http_server_connection_worker_complete;
 }
 
 static void nxweb_http_server_connection_connect(nxweb_http_server_connection* conn, nxe_loop* loop, int fd) {
@@ -607,17 +785,48 @@ static void nxweb_http_server_connection_connect(nxweb_http_server_connection* c
   conn->uid=nxweb_generate_unique_id();
   conn->connected_time=loop->current_time;
   nxd_http_server_proto_connect(&conn->hsp, loop);
-  //__sync_add_and_fetch(&num_connections, 1);
+  conn->tdata->num_connections++;
+  __sync_add_and_fetch(&num_connections, 1);
+}
+
+static void resume_accepting(nxweb_net_thread_data* tdata);
+
+static inline _Bool connection_limit_reached(nxweb_net_thread_data* tdata) {
+  return (nxweb_server_config.max_thread_connections && tdata->num_connections >= nxweb_server_config.max_thread_connections)
+      || (nxweb_server_config.max_connections && num_connections >= nxweb_server_config.max_connections);
+}
+
+static inline _Bool connection_limit_relieved(nxweb_net_thread_data* tdata) { // low watermark to avoid pause/resume churn
+  int max=nxweb_server_config.max_thread_connections;
+  if (max && tdata->num_connections > max-max/8) return 0;
+  max=nxweb_server_config.max_connections;
+  if (max && num_connections > max-max/8) return 0;
+  return 1;
 }
 
 static void nxweb_http_server_connection_do_finalize(nxweb_http_server_connection* conn, int good) {
   //nxe_loop* loop=conn->sock.fs.data_is.super.loop;
   nxweb_http_server_connection_finalize_subrequests(conn, good);
-  if (conn->worker_complete.pub) nxe_unsubscribe(conn->worker_complete.pub, &conn->worker_complete);
+  if (conn->h2) {
+    conn->h2->finalizing=1; // streams go away silently
+    while (conn->h2->first_stream) {
+      nxweb_http_server_connection_do_finalize(OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_connection, hsp, conn->h2->first_stream->hsp), good);
+    }
+    nxd_http2_server_proto_finalize(conn->h2);
+    nx_free(conn->h2);
+    conn->h2=0;
+  }
+  if (conn->ws) _nxweb_websocket_finalize(conn->ws);
   conn->hsp.cls->finalize(&conn->hsp);
   if (conn->sock.cls) conn->sock.cls->finalize((nxd_socket*)&conn->sock, good);
-  nxp_free(conn->tdata->free_conn_pool, conn);
-  //if (!__sync_sub_and_fetch(&num_connections, 1)) nxweb_log_info("all connections closed");
+  nxweb_net_thread_data* tdata=conn->tdata;
+  _Bool client_conn=!conn->parent && !conn->h2_conn;
+  nxp_free(tdata->free_conn_pool, conn);
+  if (client_conn) {
+    tdata->num_connections--;
+    __sync_sub_and_fetch(&num_connections, 1);
+    if (tdata->accept_paused && connection_limit_relieved(tdata)) resume_accepting(tdata);
+  }
 }
 
 void nxweb_http_server_connection_finalize_subrequests(nxweb_http_server_connection* conn, int good) {
@@ -634,12 +843,22 @@ void nxweb_http_server_connection_finalize_subrequests(nxweb_http_server_connect
 static _Bool nxweb_http_server_connection_check_if_can_close(nxweb_http_server_connection* conn) {
   conn->connection_closing=1; // mark for closing
   _Bool can_close=!conn->in_worker; // can't close while worker is running
+  if (!can_close && conn->body) _nxweb_request_body_abort(conn); // wake up worker waiting for more body
+#ifdef WITH_SSL
+  if (conn->secure && conn->sock.handshake_in_crypto) can_close=0; // nor while crypto thread uses the session
+#endif // WITH_SSL
   if (!can_close) nxweb_log_info("trying to close connection while in worker");
   nxweb_http_server_connection* sub=conn->subrequests;
   while (sub) {
     if (!nxweb_http_server_connection_check_if_can_close(sub)) can_close=0;
     sub=sub->next;
   }
+  if (conn->h2) {
+    nxd_http2_stream* st;
+    for (st=conn->h2->first_stream; st; st=st->next) {
+      if (!nxweb_http_server_connection_check_if_can_close(OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_connection, hsp, st->hsp))) can_close=0;
+    }
+  }
   return can_close;
 }
 
@@ -679,7 +898,7 @@ nxweb_http_server_connection* nxweb_http_server_subrequest_start(nxweb_http_serv
   conn->on_response_ready_data=on_response_ready_data;
   nxd_http_server_proto_subrequest_init(&conn->hsp, tdata->free_conn_nxb_pool);
   conn->events_sub.super.cls.sub_cls=&nxweb_http_server_connection_events_sub_class;
-  conn->worker_complete.super.cls.sub_cls=&nxweb_http_server_connection_worker_complete_class;
+  conn->worker_complete.on_complete=nxweb_http_server_connection_worker_complete;
   memcpy(conn->remote_addr, parent_conn->remote_addr, sizeof(conn->remote_addr));
   //nxweb_http_server_connection_connect(conn, loop, client_fd);
   nxe_subscribe(loop, &conn->hsp.events_pub, &conn->events_sub);
@@ -688,6 +907,51 @@ nxweb_http_server_connection* nxweb_http_server_subrequest_start(nxweb_http_serv
   return conn;
 }
 
+nxd_http_server_proto* _nxweb_http2_stream_start(nxweb_http_server_connection* client_conn, nxd_http2_stream* st) {
+  if (client_conn->connection_closing) return 0;
+  nxweb_net_thread_data* tdata=client_conn->tdata;
+  nxe_loop* loop=tdata->loop;
+  nxweb_http_server_connection* conn=nxp_alloc(tdata->free_conn_pool);
+  memset(conn, 0, sizeof(nxweb_http_server_connection));
+  conn->uid=nxweb_generate_unique_id();
+  conn->connected_time=loop->current_time;
+  conn->secure=client_conn->secure;
+  conn->lconf_idx=client_conn->lconf_idx;
+  conn->tdata=tdata;
+  conn->h2_conn=client_conn;
+  nxd_http2_stream_proto_init(&conn->hsp, tdata->free_conn_nxb_pool, st);
+  conn->events_sub.super.cls.sub_cls=&nxweb_http_server_connection_events_sub_class;
+  conn->worker_complete.on_complete=nxweb_http_server_connection_worker_complete;
+  memcpy(conn->remote_addr, client_conn->remote_addr, sizeof(conn->remote_addr));
+  nxe_subscribe(loop, &conn->hsp.events_pub, &conn->events_sub);
+  return &conn->hsp;
+}
+
+#ifdef WITH_SSL
+static void nxweb_http_server_connection_ssl_handshake_step_done(nxw_completion* c) {
+  nxweb_http_server_connection* conn=OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_connection, ssl_handshake_step, c);
+  nxweb_net_thread_data* tdata=conn->tdata;
+  tdata->ssl_handshakes_in_crypto--;
+  if (conn->connection_closing) {
+    conn->sock.handshake_in_crypto=0;
+    nxweb_http_server_connection_finalize(conn, 0);
+  }
+  else {
+    nxd_ssl_socket_handshake_step_complete(&conn->sock);
+  }
+  if (shutdown_in_progress) {
+    if (!tdata->ssl_handshakes_in_crypto) nxw_finalize_completion_queue(&tdata->ssl_handshakes_done);
+  }
+  else if (tdata->accept_paused && !_nxweb_ssl_handshake_limit_reached()) {
+    resume_accepting(tdata);
+  }
+}
+#endif // WITH_SSL
+
+int _nxweb_net_thread_post(nxweb_net_thread_data* tdata, nxw_completion* c) {
+  return nxw_try_complete(&tdata->inbox, c); // fails once net thread has closed its inbox
+}
+
 static void on_net_thread_shutdown(nxe_subscriber* sub, nxe_publisher* pub, nxe_data data) {
   int i;
   nxweb_net_thread_data* tdata=(nxweb_net_thread_data*)((char*)sub-offsetof(nxweb_net_thread_data, shutdown_sub));
@@ -710,8 +974,17 @@ static void on_net_thread_shutdown(nxe_subscriber* sub, nxe_publisher* pub, nxe_
   nxe_finalize_eventfd_source(&tdata->shutdown_efs);
   nxe_unregister_eventfd_source(&tdata->diagnostics_efs);
   nxe_finalize_eventfd_source(&tdata->diagnostics_efs);
+#ifdef WITH_SSL
+  // otherwise done when last handshake step returns from crypto thread
+  if (nxweb_server_config.ssl_handshake_threads && !tdata->ssl_handshakes_in_crypto) nxw_finalize_completion_queue(&tdata->ssl_handshakes_done);
+#endif // WITH_SSL
 
+  _nxweb_request_body_shutdown_thread();
   nxw_finalize_factory(&tdata->workers_factory);
+  _nxweb_websocket_shutdown_thread(); // after workers are gone: they might post to websockets
+  _nxweb_event_stream_shutdown_thread();
+  nxw_close_completion_queue(&tdata->inbox);
+  nxw_finalize_completion_queue(&tdata->inbox);
 
   // close keep-alive connections to backends
   for (i=0; i<NXWEB_MAX_PROXY_POOLS; i++) {
@@ -725,6 +998,23 @@ static void on_net_thread_diagnostics(nxe_subscriber* sub, nxe_publisher* pub, n
 
   nxweb_log_error("net thread diagnostics begin");
 
+  nxweb_net_thread_data* tdata=_nxweb_net_thread_data;
+  nxweb_log_error("[diag] net thread %d: cpu=%d numa_node=%d running_on=%d workers=%d", (int)tdata->thread_num,
+                  tdata->placement.cpu, tdata->placement.numa_node, sched_getcpu(), tdata->workers_factory.worker_count);
+  nxweb_log_error("[diag] net thread %d pools: conn=%d nxb=%d rbuf=%d cs_node=%d arena_flags=%d", (int)tdata->thread_num,
+                  tdata->free_conn_pool->capacity, tdata->free_conn_nxb_pool->capacity, tdata->free_rbuf_pool->capacity,
+                  tdata->free_cs_node_pool->capacity, nxweb_server_config.pool_arena_flags);
+  nxweb_log_error("[diag] net thread %d load: conns=%d/%d jobs_in_worker=%d/%d lag=%dus/%dus lag_max=%dus accept_paused=%d accept_pauses=%llu shed=%llu",
+                  (int)tdata->thread_num, tdata->num_connections, nxweb_server_config.max_thread_connections,
+                  tdata->jobs_in_worker, nxweb_server_config.shed_worker_jobs,
+                  (int)tdata->loop->lag, (int)nxweb_server_config.shed_loop_lag, (int)tdata->loop->lag_max,
+                  (int)tdata->accept_paused, (unsigned long long)tdata->accept_pauses, (unsigned long long)tdata->requests_shed);
+  tdata->loop->lag_max=0;
+  nxweb_log_error("[diag] net thread %d workers: count=%d completions=%llu wakeups=%llu",
+                  (int)tdata->thread_num, tdata->workers_factory.worker_count,
+                  (unsigned long long)tdata->workers_factory.complete_queue.completions,
+                  (unsigned long long)tdata->workers_factory.complete_queue.wakeups);
+
   nxweb_module* mod=nxweb_server_config.module_list;
   while (mod) {
     if (mod->on_thread_diagnostics)
@@ -737,9 +1027,11 @@ static void on_net_thread_diagnostics(nxe_subscriber* sub, nxe_publisher* pub, n
 
 static void on_net_thread_gc(nxe_subscriber* sub, nxe_publisher* pub, nxe_data data) {
   nxweb_net_thread_data* tdata=(nxweb_net_thread_data*)((char*)sub-offsetof(nxweb_net_thread_data, gc_sub));
-  nxp_gc(tdata->free_conn_pool);
-  nxp_gc(tdata->free_conn_nxb_pool);
-  nxp_gc(tdata->free_rbuf_pool);
+  nxe_time_t now=tdata->loop->current_time;
+  nxp_gc_at(tdata->free_conn_pool, now);
+  nxp_gc_at(tdata->free_conn_nxb_pool, now);
+  nxp_gc_at(tdata->free_rbuf_pool, now);
+  nxp_gc_at(tdata->free_cs_node_pool, now);
   nxw_gc_factory(&tdata->workers_factory);
   nxweb_access_log_thread_flush();
 }
@@ -750,8 +1042,25 @@ static void accept_connection(nxe_loop* loop, nxweb_http_server_listening_socket
   int client_fd;
   struct sockaddr_in client_addr;
   socklen_t client_len=sizeof(client_addr);
+  int lconf_idx=lsock->idx;
+  nxweb_net_thread_data* tdata=(nxweb_net_thread_data*)((char*)(lsock-lconf_idx)-offsetof(nxweb_net_thread_data, listening_sock));
   nxe_unset_timer(loop, NXWEB_TIMER_ACCEPT_RETRY, &lsock->accept_retry_timer);
   while (!shutdown_in_progress) {
+    if (connection_limit_reached(tdata)
+#ifdef WITH_SSL
+        || (nxweb_server_config.listen_config[lconf_idx].secure && _nxweb_ssl_handshake_limit_reached())
+#endif // WITH_SSL
+        ) {
+      // leave connections in backlog for other net threads;
+      // resume when own connection closes or by retry timer (global limit)
+      if (!tdata->accept_paused) {
+        tdata->accept_paused=1;
+        tdata->accept_pauses++;
+      }
+      nxe_set_timer(loop, NXWEB_TIMER_ACCEPT_RETRY, &lsock->accept_retry_timer);
+      break;
+    }
+    tdata->accept_paused=0;
     client_fd=accept4(lsock->listen_source.fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
     if (client_fd!=-1) {
       if (/*_nxweb_set_non_block(client_fd) ||*/ _nxweb_setup_client_socket(client_fd)) {
@@ -759,8 +1068,6 @@ static void accept_connection(nxe_loop* loop, nxweb_http_server_listening_socket
         nxweb_log_error("failed to setup client socket");
         continue;
       }
-      int lconf_idx=lsock->idx;
-      nxweb_net_thread_data* tdata=(nxweb_net_thread_data*)((char*)(lsock-lconf_idx)-offsetof(nxweb_net_thread_data, listening_sock));
       nxweb_http_server_connection* conn=nxp_alloc(tdata->free_conn_pool);
       nxweb_http_server_connection_init(conn, tdata, lconf_idx);
       inet_ntop(AF_INET, &client_addr.sin_addr, conn->remote_addr, sizeof(conn->remote_addr));
@@ -777,6 +1084,17 @@ static void accept_connection(nxe_loop* loop, nxweb_http_server_listening_socket
   }
 }
 
+static void resume_accepting(nxweb_net_thread_data* tdata) {
+  tdata->accept_paused=0;
+  int i;
+  nxweb_http_server_listening_socket* lsock;
+  for (i=0, lsock=tdata->listening_sock; i<NXWEB_MAX_LISTEN_SOCKETS; i++, lsock++) {
+    if (nxweb_server_config.listen_config[i].listen_fd && lsock->listen_source.data_notify.super.loop) {
+      accept_connection(tdata->loop, lsock);
+    }
+  }
+}
+
 static void on_listen_event(nxe_subscriber* sub, nxe_publisher* pub, nxe_data data) {
   if (data.i) {
     nxweb_log_error("listening socket error %d", data.i);
@@ -788,7 +1106,8 @@ static void on_listen_event(nxe_subscriber* sub, nxe_publisher* pub, nxe_data da
 
 static void accept_retry_on_timeout(nxe_timer* timer, nxe_data data) {
   nxweb_http_server_listening_socket* lsock=OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_listening_socket, accept_retry_timer, timer);
-  nxweb_log_info("retrying accept after an error");
+  nxweb_net_thread_data* tdata=(nxweb_net_thread_data*)((char*)(lsock-lsock->idx)-offsetof(nxweb_net_thread_data, listening_sock));
+  if (!tdata->accept_paused) nxweb_log_info("retrying accept after an error");
   accept_connection(timer->super.loop, lsock);
 }
 
@@ -802,6 +1121,10 @@ static void* net_thread_main(void* ptr) {
   nxweb_net_thread_data* tdata=ptr;
   _nxweb_net_thread_data=tdata;
 
+  // all per-thread structures (loop, connection & buffer pools, memcache records
+  // stored by this thread) get first-touched below; keep them on our node
+  if (nxweb_server_config.numa_bind_memory) nx_topology_bind_memory(tdata->placement.numa_node);
+
   nxe_loop* loop=nxe_create(128);
   tdata->loop=loop;
 
@@ -811,6 +1134,9 @@ static void* net_thread_main(void* ptr) {
   nxe_set_timer_queue_timeout(loop, NXWEB_TIMER_BACKEND, _nxe_timeouts[NXWEB_TIMER_BACKEND]);
   nxe_set_timer_queue_timeout(loop, NXWEB_TIMER_100CONTINUE, _nxe_timeouts[NXWEB_TIMER_100CONTINUE]);
   nxe_set_timer_queue_timeout(loop, NXWEB_TIMER_ACCEPT_RETRY, _nxe_timeouts[NXWEB_TIMER_ACCEPT_RETRY]);
+  nxe_time_t ping_timeout=_nxe_timeouts[NXWEB_TIMER_EVENT_STREAM_PING];
+  if (ping_timeout>_nxe_timeouts[NXWEB_TIMER_WRITE]/3) ping_timeout=_nxe_timeouts[NXWEB_TIMER_WRITE]/3; // stream idle for two pings must still beat write timeout
+  nxe_set_timer_queue_timeout(loop, NXWEB_TIMER_EVENT_STREAM_PING, ping_timeout);
 
   nxweb_server_listen_config* lconf;
   nxweb_http_server_listening_socket* lsock;
@@ -836,12 +1162,23 @@ static void* net_thread_main(void* ptr) {
   nxe_subscribe(loop, &tdata->diagnostics_efs.data_notify, &tdata->diagnostics_sub);
   nxe_init_subscriber(&tdata->gc_sub, &gc_sub_class);
   nxe_subscribe(loop, &loop->gc_pub, &tdata->gc_sub);
+  nxw_init_completion_queue(&tdata->inbox, loop);
+#ifdef WITH_SSL
+  if (nxweb_server_config.ssl_handshake_threads) nxw_init_completion_queue(&tdata->ssl_handshakes_done, loop);
+#endif // WITH_SSL
 
-  tdata->free_conn_pool=nxp_create(sizeof(nxweb_http_server_connection), 8);
-  tdata->free_conn_nxb_pool=nxp_create(NXWEB_CONN_NXB_SIZE, 8);
-  tdata->free_rbuf_pool=nxp_create(NXWEB_RBUF_SIZE, 2);
+  int arena_flags=nxweb_server_config.pool_arena_flags;
+  tdata->free_conn_pool=nxp_create_arena(sizeof(nxweb_http_server_connection), nxweb_server_config.conn_pool_size, arena_flags);
+  tdata->free_conn_nxb_pool=nxp_create_arena(NXWEB_CONN_NXB_SIZE, nxweb_server_config.conn_pool_size, arena_flags);
+  tdata->free_rbuf_pool=nxp_create_arena(NXWEB_RBUF_SIZE, nxweb_server_config.rbuf_pool_size, arena_flags);
+  tdata->free_cs_node_pool=nxp_create(sizeof(nxweb_composite_stream_node), NXWEB_CS_NODE_POOL_SIZE);
+  tdata->free_conn_pool->gc_hold_time=
+  tdata->free_conn_nxb_pool->gc_hold_time=
+  tdata->free_rbuf_pool->gc_hold_time=
+  tdata->free_cs_node_pool->gc_hold_time=nxweb_server_config.pool_gc_hold_time;
 
   nxw_init_factory(&tdata->workers_factory, loop);
+  if (nxweb_server_config.pin_workers) tdata->workers_factory.near_cpu=tdata->placement.cpu;
 
   // initialize proxy pools:
   for (i=0; i<NXWEB_MAX_PROXY_POOLS; i++) {
@@ -877,6 +1214,7 @@ static void* net_thread_main(void* ptr) {
   nxp_destroy(tdata->free_conn_pool);
   nxp_destroy(tdata->free_conn_nxb_pool);
   nxp_destroy(tdata->free_rbuf_pool);
+  nxp_destroy(tdata->free_cs_node_pool);
 /*
   for (i=0; i<NXWEB_NUM_PROXY_POOLS; i++) {
     if (nxweb_server_config.http_proxy_pool_config[i].host)
@@ -913,6 +1251,7 @@ static void on_sigterm(int sig) {
 
 void _nxweb_launch_diagnostics() {
   nxweb_log_error("server diagnostics begin");
+  nxweb_log_error("[diag] connections=%d/%d", num_connections, nxweb_server_config.max_connections);
 
   nxweb_module* mod=nxweb_server_config.module_list;
   while (mod) {
@@ -996,14 +1335,16 @@ void nxweb_run(uint16_t max_net_threads) {
   int i;
 
   _nxweb_max_net_threads=max_net_threads;
-  _nxweb_net_threads=malloc(_nxweb_max_net_threads*sizeof(nxweb_net_thread_data));
+  _nxweb_net_threads=calloc(_nxweb_max_net_threads, sizeof(nxweb_net_thread_data));
 
   nxweb_server_config.work_dir=getcwd(0, 0);
 
   pid_t pid=getpid();
   main_thread_id=pthread_self();
-  _nxweb_num_net_threads=(int)sysconf(_SC_NPROCESSORS_ONLN);
-  if (_nxweb_num_net_threads>_nxweb_max_net_threads) _nxweb_num_net_threads=_nxweb_max_net_threads;
+  nx_cpu_placement* placement=calloc(_nxweb_max_net_threads, sizeof(nx_cpu_placement));
+  _nxweb_num_net_threads=nx_topology_place_threads(&nxweb_server_config.net_thread_placement, placement, _nxweb_max_net_threads);
+  for (i=0; i<_nxweb_num_net_threads; i++) _nxweb_net_threads[i].placement=placement[i];
+  free(placement);
 
   pthread_mutex_init(&nxweb_server_config.access_log_start_mux, 0);
   nxweb_access_log_restart();
@@ -1020,6 +1361,10 @@ void nxweb_run(uint16_t max_net_threads) {
                   (int)sizeof(nxe_event), (int)sizeof(nxweb_http_server_connection), (int)sizeof(nxweb_http_request),
                   (int)sizeof(nxweb_net_thread_data), (int)rl_fildes.rlim_cur, (int)rl_core.rlim_cur);
 
+  for (i=0; i<_nxweb_num_net_threads; i++) {
+    nxweb_log_error("net thread %d: cpu=%d numa_node=%d", i, _nxweb_net_threads[i].placement.cpu, _nxweb_net_threads[i].placement.numa_node);
+  }
+
   nxweb_handler* h=nxweb_server_config.handler_list;
   while (h) {
     nxweb_log_error("handler %s [%d] registered for url: %s", h->name, h->priority, h->prefix);
@@ -1048,6 +1393,20 @@ void nxweb_run(uint16_t max_net_threads) {
     nxweb_server_config.request_dispatcher=_nxweb_default_request_dispatcher;
     nxweb_log_error("using default request dispatcher");
   }
+  if (nxweb_server_config.request_dispatcher==_nxweb_default_request_dispatcher) {
+    nxweb_handler* h;
+    int num_handlers=0;
+    for (h=nxweb_server_config.handler_list; h; h=h->next) h->route_order=num_handlers++;
+    if (num_handlers>=NXWEB_ROUTER_MIN_HANDLERS) {
+      int num_vhosts, num_nodes;
+      nxweb_server_config.router=_nxweb_router_create(nxweb_server_config.handler_list);
+      _nxweb_router_stats(nxweb_server_config.router, &num_vhosts, &num_nodes);
+      nxweb_log_error("router built: handlers=%d vhosts=%d nodes=%d", num_handlers, num_vhosts, num_nodes);
+    }
+    else {
+      nxweb_log_error("router not built: %d handlers scanned linearly", num_handlers);
+    }
+  }
 
   // Block signals for all threads
   sigset_t set;
@@ -1068,11 +1427,8 @@ void nxweb_run(uint16_t max_net_threads) {
   for (i=0, tdata=_nxweb_net_threads; i<_nxweb_num_net_threads; i++, tdata++) {
     tdata->thread_num=i;
     pthread_attr_t tattr;
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(i, &cpuset);
     pthread_attr_init(&tattr);
-    pthread_attr_setaffinity_np(&tattr, sizeof(cpu_set_t), &cpuset);
+    nx_topology_set_affinity(&tattr, tdata->placement.cpu);
     if (pthread_create(&tdata->thread_id, &tattr, net_thread_main, tdata)) {
       nxweb_log_error("can't start network thread %d", i);
       exit(EXIT_SUCCESS); // simulate normal exit so nxweb is not respawned
@@ -1124,6 +1480,10 @@ void nxweb_run(uint16_t max_net_threads) {
   nxweb_access_log_stop();
   pthread_mutex_destroy(&nxweb_server_config.access_log_start_mux);
 
+  if (nxweb_server_config.router) {
+    _nxweb_router_free(nxweb_server_config.router);
+    nxweb_server_config.router=0;
+  }
   free(nxweb_server_config.work_dir);
   free(_nxweb_net_threads);
   _nxweb_net_threads=NULL;
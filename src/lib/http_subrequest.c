@@ -20,9 +20,14 @@
 #include "nxweb/nxweb.h"
 
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
+#include "deps/ulib/alignhash_tpl.h"
+#include "deps/ulib/hash.h"
+
 static void nxweb_composite_stream_finalize(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, nxe_data data);
 
 nxweb_composite_stream* nxweb_composite_stream_init(nxweb_http_server_connection* conn, nxweb_http_request* req) {
@@ -30,30 +35,48 @@ nxweb_composite_stream* nxweb_composite_stream_init(nxweb_http_server_connection
   cs->req=req;
   cs->conn=conn;
   nxd_streamer_init(&cs->strm);
-  nxweb_set_request_data(req, (nxe_data)0, (nxe_data)(void*)cs, nxweb_composite_stream_finalize);
+  // keyed by cs itself: request might have several composite streams (filter chain)
+  nxweb_set_request_data(req, (nxe_data)(void*)cs, (nxe_data)(void*)cs, nxweb_composite_stream_finalize);
   return cs;
 }
 
 static nxweb_composite_stream_node* nxweb_composite_stream_append_node(nxweb_composite_stream* cs) {
-  nxweb_composite_stream_node* csn=cs->first_node;
-  if (csn) {
-    while (csn->next) csn=csn->next;
-    csn->snode.final=0; // not final anymore
-    csn->next=nxb_calloc_obj(cs->req->nxb, sizeof(nxweb_composite_stream_node));;
-    csn=csn->next;
+  nxweb_composite_stream_node* csn=nxp_alloc(cs->conn->tdata->free_cs_node_pool);
+  memset(csn, 0, sizeof(nxweb_composite_stream_node));
+  csn->cs=cs;
+  if (cs->last_node) {
+    cs->last_node->snode.final=0; // not final anymore
+    cs->last_node->next=csn;
   }
   else {
-    cs->first_node=nxb_calloc_obj(cs->req->nxb, sizeof(nxweb_composite_stream_node));;
-    csn=cs->first_node;
+    cs->first_node=csn;
   }
+  cs->last_node=csn;
   nxd_streamer_node_init(&csn->snode);
   nxd_streamer_add_node(&cs->strm, &csn->snode, 0);
   return csn;
 }
 
+static int nxweb_composite_stream_coalesce(nxweb_composite_stream* cs, const char* bytes, int length) {
+  nxweb_composite_stream_node* csn=cs->last_node;
+  // merge into previous byte node unless it has already started streaming
+  if (!csn || !csn->bytes || cs->strm.current==&csn->snode
+      || csn->buffer.ob.data_size+length > NXWEB_CS_COALESCE_SIZE) return 0;
+  if (!csn->coalesce_buf) {
+    csn->coalesce_buf=nxb_alloc_obj(cs->req->nxb, NXWEB_CS_COALESCE_SIZE);
+    memcpy(csn->coalesce_buf, csn->buffer.ob.data_ptr, csn->buffer.ob.data_size);
+    csn->buffer.ob.data_ptr=csn->coalesce_buf;
+  }
+  memcpy(csn->coalesce_buf+csn->buffer.ob.data_size, bytes, length);
+  csn->buffer.ob.data_size+=length;
+  return 1;
+}
+
 void nxweb_composite_stream_append_bytes(nxweb_composite_stream* cs, const char* bytes, int length) {
   if (length) {
+    if (nxweb_composite_stream_coalesce(cs, bytes, length)) return;
     nxweb_composite_stream_node* csn=nxweb_composite_stream_append_node(cs);
+    csn->bytes=1;
     nxd_obuffer_init(&csn->buffer.ob, bytes, length);
     nxe_connect_streams(cs->conn->tdata->loop, &csn->buffer.ob.data_out, &csn->snode.data_in);
   }
@@ -71,16 +94,182 @@ void nxweb_composite_stream_append_fd(nxweb_composite_stream* cs, int fd, off_t
   }
 }
 
+// Subrequest fast path. Subrequests carry nothing but host & uri, so once a fragment
+// has been served from memcache or straight from a file, following subrequests for it
+// go directly to that record or file, without connection, dispatcher and filters.
+
+typedef struct cs_fragment {
+  const char* cache_key; // memcache record key; or
+  const char* fpath;     // plain file
+  time_t mtime;
+  off_t size;
+  nxe_time_t expires_time;
+  char key[]; // followed by cache_key or fpath
+} cs_fragment;
+
+#define cs_fragments_hash_fn(key) hash_sdbm((const unsigned char*)(key))
+#define cs_fragments_eq_fn(a, b) (!strcmp((a), (b)))
+
+DECLARE_ALIGNHASH(cs_fragments, const char*, cs_fragment*, 1, cs_fragments_hash_fn, cs_fragments_eq_fn)
+
+static alignhash_t(cs_fragments) *cs_fragments;
+static pthread_mutex_t cs_fragments_mutex;
+static uint64_t cs_fast_path_hits, cs_fast_path_misses;
+
+static void cs_fragments_clear() { // must be called within mutex
+  ah_iter_t ci;
+  for (ci=alignhash_begin(cs_fragments); ci!=alignhash_end(cs_fragments); ci++) {
+    if (alignhash_exist(cs_fragments, ci)) nx_free(alignhash_value(cs_fragments, ci));
+  }
+  alignhash_clear(cs_fragments, cs_fragments);
+}
+
+static void cs_fragments_remember(const char* key, const char* cache_key, const char* fpath, time_t mtime, off_t size, nxe_time_t loop_time) {
+  const char* target=cache_key? cache_key : fpath;
+  int key_len=strlen(key);
+  cs_fragment* fr=nx_calloc(sizeof(cs_fragment)+key_len+1+strlen(target)+1);
+  memcpy(fr->key, key, key_len+1);
+  char* t=fr->key+key_len+1;
+  strcpy(t, target);
+  if (cache_key) fr->cache_key=t;
+  else fr->fpath=t;
+  fr->mtime=mtime;
+  fr->size=size;
+  fr->expires_time=loop_time+NXWEB_DEFAULT_CACHED_TIME;
+  int ret=0;
+  pthread_mutex_lock(&cs_fragments_mutex);
+  if (alignhash_size(cs_fragments)>=NXWEB_MAX_SUBREQUEST_FAST_PATHS) cs_fragments_clear(); // rare; simply start over
+  ah_iter_t ci=alignhash_set(cs_fragments, cs_fragments, fr->key, &ret);
+  if (ci!=alignhash_end(cs_fragments)) {
+    if (ret==AH_INS_ERR) { // replace existing
+      nx_free(alignhash_value(cs_fragments, ci));
+      alignhash_key(cs_fragments, ci)=fr->key;
+    }
+    alignhash_value(cs_fragments, ci)=fr;
+    fr=0;
+  }
+  pthread_mutex_unlock(&cs_fragments_mutex);
+  if (fr) nx_free(fr);
+}
+
+static void cs_fragments_forget(const char* key) {
+  pthread_mutex_lock(&cs_fragments_mutex);
+  ah_iter_t ci=alignhash_get(cs_fragments, cs_fragments, key);
+  if (ci!=alignhash_end(cs_fragments)) {
+    nx_free(alignhash_value(cs_fragments, ci));
+    alignhash_del(cs_fragments, cs_fragments, ci);
+  }
+  pthread_mutex_unlock(&cs_fragments_mutex);
+}
+
+static int nxweb_composite_stream_append_fast(nxweb_composite_stream* cs, const char* key) {
+  nxe_time_t loop_time=cs->conn->tdata->loop->current_time;
+  char target[1024];
+  const char* cache_key=0;
+  const char* fpath=0;
+  time_t mtime=0;
+  off_t size=0;
+  pthread_mutex_lock(&cs_fragments_mutex);
+  ah_iter_t ci=alignhash_get(cs_fragments, cs_fragments, key);
+  if (ci!=alignhash_end(cs_fragments)) {
+    cs_fragment* fr=alignhash_value(cs_fragments, ci);
+    const char* t=fr->cache_key? fr->cache_key : fr->fpath;
+    if (loop_time <= fr->expires_time && strlen(t)<sizeof(target)) {
+      strcpy(target, t);
+      if (fr->cache_key) cache_key=target;
+      else fpath=target;
+      mtime=fr->mtime;
+      size=fr->size;
+    }
+  }
+  pthread_mutex_unlock(&cs_fragments_mutex);
+
+  if (cache_key) {
+    const char* content;
+    nxe_ssize_t content_length;
+    struct nxweb_cache_rec* rec=nxweb_cache_acquire(cache_key, loop_time, &content, &content_length);
+    if (rec) {
+      if (!content_length || nxweb_composite_stream_coalesce(cs, content, content_length)) {
+        nxweb_cache_release(rec); // bytes copied (or nothing to copy)
+      }
+      else {
+        nxweb_composite_stream_node* csn=nxweb_composite_stream_append_node(cs);
+        csn->bytes=1;
+        csn->cache_rec=rec;
+        nxd_obuffer_init(&csn->buffer.ob, content, content_length);
+        nxe_connect_streams(cs->conn->tdata->loop, &csn->buffer.ob.data_out, &csn->snode.data_in);
+      }
+      __sync_add_and_fetch(&cs_fast_path_hits, 1);
+      return 1;
+    }
+  }
+  else if (fpath) {
+    // net thread must not touch disk: only stat & fd already in fd cache will do
+    struct stat finfo;
+    int r=nxweb_fd_cache_stat(fpath, &finfo, 1);
+    if (!r && S_ISREG(finfo.st_mode) && finfo.st_mtime==mtime && finfo.st_size==size) {
+      int fd=nxweb_fd_cache_open(fpath, 1);
+      if (fd>0) {
+        nxweb_composite_stream_append_fd(cs, fd, 0, size);
+        cs->last_node->fd_cached=1;
+        __sync_add_and_fetch(&cs_fast_path_hits, 1);
+        return 1;
+      }
+    }
+    else if (r!=-2) {
+      cs_fragments_forget(key); // file changed => go through handler
+    }
+    // not in fd cache => regular subrequest; its handler gets the file into cache
+  }
+  __sync_add_and_fetch(&cs_fast_path_misses, 1);
+  return 0;
+}
+
+static void nxweb_composite_stream_remember_fragment(nxweb_composite_stream_node* csn, nxweb_http_server_connection* subconn) {
+  nxweb_http_response* resp=subconn->hsp.resp;
+  if (!resp->last_modified || resp->content_length<0) return; // not static
+  const char* cache_key=nxweb_cache_response_key(subconn, resp);
+  nxe_time_t loop_time=subconn->tdata->loop->current_time;
+  if (cache_key) {
+    cs_fragments_remember(csn->fragment_key, cache_key, 0, resp->last_modified, resp->content_length, loop_time);
+  }
+  else if (resp->sendfile_path && resp->sendfile_fd>0 && !resp->content
+      && resp->sendfile_offset==0 && resp->sendfile_end==resp->content_length) {
+    cs_fragments_remember(csn->fragment_key, 0, resp->sendfile_path, resp->last_modified, resp->content_length, loop_time);
+  }
+}
+
+static int cs_fragments_init() {
+  pthread_mutex_init(&cs_fragments_mutex, 0);
+  cs_fragments=alignhash_init(cs_fragments);
+  return 0;
+}
+
+static void cs_fragments_finalize() {
+  cs_fragments_clear();
+  alignhash_destroy(cs_fragments, cs_fragments);
+  pthread_mutex_destroy(&cs_fragments_mutex);
+}
+
+static void cs_fragments_diagnostics() {
+  pthread_mutex_lock(&cs_fragments_mutex);
+  nxweb_log_error("[diag] subrequest fast path: fragments=%d hits=%" PRIu64 " misses=%" PRIu64,
+                  (int)alignhash_size(cs_fragments), cs_fast_path_hits, cs_fast_path_misses);
+  pthread_mutex_unlock(&cs_fragments_mutex);
+}
+
+NXWEB_MODULE(subrequest_fast_path, .on_server_startup=cs_fragments_init,
+        .on_server_shutdown=cs_fragments_finalize, .on_server_diagnostics=cs_fragments_diagnostics);
+
 static void nxweb_composite_stream_subrequest_on_response_ready(nxweb_http_server_connection* subconn, nxe_data data) {
   nxweb_http_server_connection* conn=subconn->parent;
   nxweb_http_request* req=&conn->hsp.req;
-  nxweb_composite_stream* cs=data.ptr;
-  assert(cs);
-  nxweb_composite_stream_node* csn=cs->first_node;
-  while (csn && csn->subconn!=subconn) csn=csn->next; // find corresponding node
-  assert(csn);
+  nxweb_composite_stream_node* csn=data.ptr;
+  assert(csn && csn->subconn==subconn);
+  nxweb_composite_stream* cs=csn->cs;
   int status=subconn->hsp.resp->status_code;
   if (!subconn->subrequest_failed && (!status || status==200)) {
+    if (csn->fragment_key) nxweb_composite_stream_remember_fragment(csn, subconn);
     if (!subconn->hsp.resp->content_length) {
       // connect zero-length stream
       nxd_obuffer_init(&csn->buffer.ob, "", 0);
@@ -106,9 +295,20 @@ static void nxweb_composite_stream_subrequest_on_response_ready(nxweb_http_serve
 }
 
 void nxweb_composite_stream_append_subrequest(nxweb_composite_stream* cs, const char* host, const char* url) {
+  if (!host) host=cs->req->host;
+  if (!host) host="";
+  // key: secure flag + host + uri (handlers could be selected by either)
+  int host_len=strlen(host);
+  char* key=nxb_alloc_obj(cs->req->nxb, 1+host_len+strlen(url)+1);
+  key[0]=cs->conn->secure? 'S':'P';
+  memcpy(key+1, host, host_len);
+  strcpy(key+1+host_len, url);
+  if (nxweb_composite_stream_append_fast(cs, key)) return;
+
   nxweb_composite_stream_node* csn=nxweb_composite_stream_append_node(cs);
+  csn->fragment_key=key;
 
-  csn->subconn=nxweb_http_server_subrequest_start(cs->conn, nxweb_composite_stream_subrequest_on_response_ready, (nxe_data)(void*)cs, host, url);
+  csn->subconn=nxweb_http_server_subrequest_start(cs->conn, nxweb_composite_stream_subrequest_on_response_ready, (nxe_data)(void*)csn, host, url);
   if (!csn->subconn) {
     nxweb_log_error("nxweb_http_server_subrequest_start failed: %s %s %d", host, url, (int)cs->conn->connection_closing);
     // append bytes instead
@@ -133,10 +333,20 @@ static void nxweb_composite_stream_finalize(nxweb_http_server_connection* conn,
   nxweb_composite_stream_node* csn=cs->first_node;
   while (csn) {
     if (csn->fd) {
-      close(csn->fd);
+      if (csn->fd_cached) nxweb_fd_cache_close(csn->fd);
+      else close(csn->fd);
       nxd_fbuffer_finalize(&csn->buffer.fb);
     }
     csn=csn->next;
   }
   nxd_streamer_finalize(&cs->strm);
+  nxp_pool* pool=cs->conn->tdata->free_cs_node_pool;
+  nxweb_composite_stream_node* next;
+  for (csn=cs->first_node; csn; csn=next) {
+    next=csn->next;
+    if (csn->cache_rec) nxweb_cache_release(csn->cache_rec);
+    nxp_free(pool, csn);
+  }
+  cs->first_node=0;
+  cs->last_node=0;
 }
@@ -25,6 +25,7 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
 #include <printf.h>
 #include <fcntl.h>
 #include <time.h>
@@ -164,6 +165,59 @@ time_t nxweb_parse_http_time(const char* str) { // must be GMT
   return t;
 }
 
+static const char* parse_range_offset(const char* p, off_t* value) {
+  if (*p<'0' || *p>'9') return 0;
+  off_t v=0;
+  while (*p>='0' && *p<='9') {
+    if (v > (INT64_MAX-9)/10) return 0; // overflow
+    v=v*10+(*p++-'0');
+  }
+  *value=v;
+  return p;
+}
+
+int nxweb_parse_http_range(const char* range, off_t length, nxweb_http_range* ranges, int max_ranges) {
+  // eg. bytes=0-499,1000-,-500
+  if (strncasecmp(range, "bytes=", 6)) return -1;
+  const char* p=range+6;
+  int n=0, num_specs=0;
+  off_t total=0;
+  for (;;) {
+    off_t start, end;
+    while (*p==' ' || *p=='\t') p++;
+    if (*p=='-') { // suffix range
+      if (!(p=parse_range_offset(p+1, &end))) return -1;
+      start=end<length? length-end : 0;
+      end=length;
+    }
+    else {
+      if (!(p=parse_range_offset(p, &start))) return -1;
+      if (*p++!='-') return -1;
+      if (*p>='0' && *p<='9') {
+        if (!(p=parse_range_offset(p, &end))) return -1;
+        if (end<start) return -1;
+        end++;
+        if (end>length) end=length;
+      }
+      else {
+        end=length;
+      }
+    }
+    if (++num_specs>max_ranges) return -1;
+    if (start<end) { // satisfiable
+      ranges[n].start=start;
+      ranges[n].end=end;
+      n++;
+      total+=end-start;
+      if (total>length) return -1; // overlapping ranges; send whole entity instead
+    }
+    while (*p==' ' || *p=='\t') p++;
+    if (!*p) break;
+    if (*p++!=',') return -1;
+  }
+  return n;
+}
+
 int nxweb_format_iso8601_time(char* buf, struct tm* tm) { // ISO 8601
   // eg. 2012-01-24T13:05:54 (19 chars)
   char* p=buf;
@@ -190,96 +244,207 @@ int nxweb_format_iso8601_time(char* buf, struct tm* tm) { // ISO 8601
 }
 
 
-// Modifies req->uri and req->request_body content (does url_decode inplace)
-// uri could be preserved if requested by preserve_uri
-void nxweb_parse_request_parameters(nxweb_http_request *req, int preserve_uri) {
+/*
+ * Query string, url-encoded post data and cookie header are indexed lazily on first lookup.
+ * Index entries point into original strings (which stay intact); names are hashed for O(1) lookup.
+ * Value gets url-decoded into req->nxb only when requested. Names with escapes are decoded
+ * while indexing (rare).
+ */
 
-  if (req->parameters) return; // already parsed
+typedef struct nxweb_param_entry {
+  const char* name; // not null-terminated (unless decoded)
+  const char* raw_value; // 0 = cookie without '='
+  const char* value; // decoded value; 0 = not requested yet
+  uint32_t hash;
+  int name_len;
+  int value_len;
+} nxweb_param_entry;
+
+typedef struct nxweb_param_index {
+  const char* content; // post data indexed (could arrive after first lookup)
+  int num_entries;
+  int mask;
+  int* slots; // entry number + 1; 0 = empty
+  nxweb_param_entry entries[];
+} nxweb_param_index;
+
+static inline uint32_t param_name_hash(const char* name, int len) {
+  uint32_t h=2166136261u; // FNV-1a
+  const unsigned char* p=(const unsigned char*)name;
+  const unsigned char* end=p+len;
+  while (p<end) h=(h^*p++)*16777619u;
+  return h;
+}
 
-  nxb_buffer* nxb=req->nxb;
-  char *name, *value, *next;
-  char* query_string=strchr(req->uri, '?');
-  if (query_string) {
-    if (preserve_uri) {
-      query_string++;
-      query_string=nxb_copy_obj(nxb, query_string, strlen(query_string)+1);
+static nxweb_param_entry* param_index_find(nxweb_param_index* idx, const char* name, int len, uint32_t hash, int** slot) {
+  int i=hash&idx->mask;
+  int n;
+  while ((n=idx->slots[i])) {
+    nxweb_param_entry* pe=&idx->entries[n-1];
+    if (pe->hash==hash && pe->name_len==len && !memcmp(pe->name, name, len)) break;
+    i=(i+1)&idx->mask;
+  }
+  if (slot) *slot=&idx->slots[i];
+  return n? &idx->entries[n-1] : 0;
+}
+
+static int param_count_pairs(const char* s, const char* end, char sep) {
+  int n=1;
+  while ((s=memchr(s, sep, end-s))) n++, s++;
+  return n;
+}
+
+static void param_index_add_pairs(nxb_buffer* nxb, nxweb_param_index* idx, const char* s, const char* end, char sep, _Bool cookie) {
+  const char *name, *name_end, *eq, *pair_end;
+  for (; s<end; s=pair_end+1) {
+    while (s<end && (unsigned char)*s<=' ') s++;
+    // single pass over name: find its end and hash it
+    uint32_t hash=2166136261u;
+    _Bool escaped=0;
+    for (name=s; s<end && *s!=sep && *s!='='; s++) {
+      if (*s=='%' || *s=='+') escaped=1;
+      hash=(hash^(unsigned char)*s)*16777619u;
     }
-    else {
-      *query_string++='\0';
+    name_end=s;
+    eq=s<end && *s=='='? s : 0;
+    pair_end=eq? memchr(eq, sep, end-eq) : s;
+    if (!pair_end) pair_end=end;
+    int name_len=name_end-name;
+    if (name_len && (unsigned char)name_end[-1]<=' ') escaped=1; // trailing space
+    if (escaped) {
+      char* decoded=nxb_alloc_obj(nxb, name_len+1);
+      memcpy(decoded, name, name_len);
+      decoded[name_len]='\0';
+      nxweb_url_decode(decoded, 0);
+      name=nxweb_trunc_space(decoded);
+      name_len=strlen(name);
+      hash=param_name_hash(name, name_len);
     }
+    if (!name_len) continue;
+    nxweb_param_entry* pe=&idx->entries[idx->num_entries];
+    pe->name=name;
+    pe->name_len=name_len;
+    pe->hash=hash;
+    pe->raw_value=eq? eq+1 : (cookie? 0 : "");
+    pe->value_len=eq? pair_end-eq-1 : 0;
+    pe->value=0;
+    int* slot;
+    param_index_find(idx, name, name_len, pe->hash, &slot);
+    *slot=++idx->num_entries; // last of duplicate names wins
   }
-  // last param must be nulled (nx_buffer allocates objects in reverse direction)
-  nxweb_http_parameter* param_map=0;
-  nxweb_http_parameter* param;
-  if (query_string) {
-    for (name=query_string; name; name=next) {
-      next=strchr(name, '&');
-      if (next) *next++='\0';
-      value=strchr(name, '=');
-      if (value) *value++='\0';
-      else value=name+strlen(name); // ""
-      if (*name) {
-        nxweb_url_decode(name, 0);
-        name=nxweb_trunc_space(name);
-        nxweb_url_decode(value, 0);
-        param=nxb_calloc_obj(nxb, sizeof(nxweb_http_parameter));
-        param->name=name;
-        param->value=value;
-        param_map=nx_simple_map_add(param_map, param);
-      }
-    }
+}
+
+static nxweb_param_index* param_index_create(nxb_buffer* nxb, const char* s1, const char* end1, const char* s2, const char* end2, char sep, _Bool cookie) {
+  int max_entries=(s1? param_count_pairs(s1, end1, sep) : 0)+(s2? param_count_pairs(s2, end2, sep) : 0);
+  int size=8;
+  while (size<max_entries*2) size<<=1;
+  nxweb_param_index* idx=nxb_alloc_obj(nxb, offsetof(nxweb_param_index, entries)+max_entries*sizeof(nxweb_param_entry));
+  idx->slots=nxb_calloc_obj(nxb, size*sizeof(int));
+  idx->mask=size-1;
+  idx->num_entries=0;
+  idx->content=0;
+  if (s1) param_index_add_pairs(nxb, idx, s1, end1, sep, cookie);
+  if (s2) param_index_add_pairs(nxb, idx, s2, end2, sep, cookie);
+  return idx;
+}
+
+static const char* param_value(nxb_buffer* nxb, nxweb_param_entry* pe) {
+  if (!pe->value && pe->raw_value) {
+    if (!pe->value_len) return pe->value="";
+    char* value=nxb_alloc_obj(nxb, pe->value_len+1);
+    memcpy(value, pe->raw_value, pe->value_len);
+    value[pe->value_len]='\0';
+    nxweb_url_decode(value, 0);
+    pe->value=value;
   }
-  if (req->content && req->content_type && nx_strcasecmp(req->content_type, "application/x-www-form-urlencoded")==0) {
-    for (name=(char*)req->content; name; name=next) {
-      next=strchr(name, '&');
-      if (next) *next++='\0';
-      value=strchr(name, '=');
-      if (value) *value++='\0';
-      else value=name+strlen(name); // ""
-      if (*name) {
-        nxweb_url_decode(name, 0);
-        name=nxweb_trunc_space(name);
-        nxweb_url_decode(value, 0);
-        param=nxb_calloc_obj(nxb, sizeof(nxweb_http_parameter));
-        param->name=name;
-        param->value=value;
-        param_map=nx_simple_map_add(param_map, param);
-      }
+  return pe->value;
+}
+
+static inline _Bool has_form_content(nxweb_http_request* req) {
+  return req->content && req->content_type && nx_strcasecmp(req->content_type, "application/x-www-form-urlencoded")==0;
+}
+
+static nxweb_param_index* request_param_index(nxweb_http_request* req) {
+  if (req->param_index && (req->param_index->content==req->content || !has_form_content(req))) return req->param_index;
+  const char* query=req->uri? strchr(req->uri, '?') : 0;
+  const char* content=has_form_content(req)? req->content : 0;
+  if (!query && !content) return 0;
+  if (query) query++;
+  nxe_size_t content_len=0;
+  if (content) content_len=req->content_received>0? strnlen(content, req->content_received) : strlen(content); // mmapped content is not null-terminated
+  req->param_index=param_index_create(req->nxb, query, query? query+strlen(query) : 0, content, content+content_len, '&', 0);
+  req->param_index->content=content;
+  return req->param_index;
+}
+
+static nxweb_param_index* request_cookie_index(nxweb_http_request* req) {
+  if (!req->cookie_index && req->cookie) {
+    req->cookie_index=param_index_create(req->nxb, req->cookie, req->cookie+strlen(req->cookie), 0, 0, ';', 1);
+  }
+  return req->cookie_index;
+}
+
+static nx_simple_map_entry* param_index_to_map(nxb_buffer* nxb, nxweb_param_index* idx) {
+  // same order as nx_simple_map_add() would give: last entry first
+  nx_simple_map_entry* map=0;
+  int i;
+  for (i=0; i<idx->num_entries; i++) {
+    nxweb_param_entry* pe=&idx->entries[i];
+    nx_simple_map_entry* e=nxb_calloc_obj(nxb, sizeof(nx_simple_map_entry));
+    if (pe->name[pe->name_len]) {
+      char* name=nxb_alloc_obj(nxb, pe->name_len+1);
+      memcpy(name, pe->name, pe->name_len);
+      name[pe->name_len]='\0';
+      e->name=name;
+    }
+    else {
+      e->name=pe->name;
     }
-    req->content=0;
+    e->value=param_value(nxb, pe);
+    map=nx_simple_map_add(map, e);
+  }
+  return map;
+}
+
+const char* nxweb_get_request_parameter(nxweb_http_request *req, const char* name) {
+  nxweb_param_index* idx=request_param_index(req);
+  if (!idx) return 0;
+  int len=strlen(name);
+  nxweb_param_entry* pe=param_index_find(idx, name, len, param_name_hash(name, len), 0);
+  return pe? param_value(req->nxb, pe) : 0;
+}
+
+const char* nxweb_get_request_cookie(nxweb_http_request *req, const char* name) {
+  nxweb_param_index* idx=request_cookie_index(req);
+  if (!idx) return 0;
+  int len=strlen(name);
+  nxweb_param_entry* pe=param_index_find(idx, name, len, param_name_hash(name, len), 0);
+  return pe? param_value(req->nxb, pe) : 0;
+}
+
+// Builds req->parameters list for handlers that need to iterate over all parameters.
+// Url-encoded post data is consumed (req->content=0).
+// Unless preserve_uri is set query string gets cut off req->uri (and path_info).
+void nxweb_parse_request_parameters(nxweb_http_request *req, int preserve_uri) {
+
+  if (req->parameters) return; // already parsed
+
+  nxweb_param_index* idx=request_param_index(req);
+  if (idx) req->parameters=param_index_to_map(req->nxb, idx);
+  if (has_form_content(req)) req->content=0;
+  if (!preserve_uri && req->uri) {
+    char* query_string=strchr(req->uri, '?');
+    if (query_string) *query_string='\0';
   }
-  req->parameters=param_map;
 }
 
-// Modifies conn->cookie content (does url_decode inplace)
+// Builds req->cookies list; req->cookie header stays intact
 void nxweb_parse_request_cookies(nxweb_http_request *req) {
 
   if (req->cookies) return; // already parsed
 
-  nxb_buffer* nxb=req->nxb;
-  char *name, *value, *next;
-  // last cookie must be nulled (nx_buffer allocates objects in reverse direction)
-  nxweb_http_cookie* cookie_map=0;
-  nxweb_http_cookie* cookie;
-  if (req->cookie) {
-    for (name=(char*)req->cookie; name; name=next) {
-      next=strchr(name, ';');
-      if (next) *next++='\0';
-      value=strchr(name, '=');
-      if (value) *value++='\0';
-      if (*name) {
-        nxweb_url_decode(name, 0);
-        name=nxweb_trunc_space(name);
-        if (value) nxweb_url_decode(value, 0);
-        cookie=nxb_calloc_obj(nxb, sizeof(nxweb_http_cookie));
-        cookie->name=name;
-        cookie->value=value;
-        cookie_map=nx_simple_map_add(cookie_map, cookie);
-      }
-    }
-    req->cookie=0;
-  }
-  req->cookies=cookie_map;
+  nxweb_param_index* idx=request_cookie_index(req);
+  if (idx) req->cookies=param_index_to_map(req->nxb, idx);
 }
 
 char* _nxweb_find_end_of_http_headers(char* buf, int len, char** start_of_body) {
@@ -305,6 +470,7 @@ enum nxweb_http_header_name {
   NXWEB_HTTP_SERVER,
   NXWEB_HTTP_EXPIRES,
   NXWEB_HTTP_TRAILER,
+  NXWEB_HTTP_IF_RANGE,
   NXWEB_HTTP_CONNECTION,
   NXWEB_HTTP_KEEP_ALIVE,
   NXWEB_HTTP_USER_AGENT,
@@ -341,6 +507,9 @@ static int identify_http_header(const char* name, int name_len) {
       if (first_char=='t') return nx_strcasecmp(name, "Trailer")? NXWEB_HTTP_UNKNOWN : NXWEB_HTTP_TRAILER;
       if (first_char=='e') return nx_strcasecmp(name, "Expires")? NXWEB_HTTP_UNKNOWN : NXWEB_HTTP_EXPIRES;
       return NXWEB_HTTP_UNKNOWN;
+    case 8:
+      if (first_char=='i') return nx_strcasecmp(name, "If-Range")? NXWEB_HTTP_UNKNOWN : NXWEB_HTTP_IF_RANGE;
+      return NXWEB_HTTP_UNKNOWN;
     case 10:
       if (first_char=='c') return nx_strcasecmp(name, "Connection")? NXWEB_HTTP_UNKNOWN : NXWEB_HTTP_CONNECTION;
       if (first_char=='k') return nx_strcasecmp(name, "Keep-Alive")? NXWEB_HTTP_UNKNOWN : NXWEB_HTTP_KEEP_ALIVE;
@@ -458,8 +627,12 @@ int _nxweb_parse_http_request(nxweb_http_request* req, char* headers, char* end_
       case NXWEB_HTTP_ACCEPT_ENCODING: req->accept_encoding=value; break;
       case NXWEB_HTTP_TRANSFER_ENCODING: req->transfer_encoding=value; break;
       case NXWEB_HTTP_IF_MODIFIED_SINCE: req->if_modified_since=nxweb_parse_http_time(value); break;
-      case NXWEB_HTTP_CONNECTION: req->keep_alive=!nx_strcasecmp(value, "keep-alive"); break;
+      case NXWEB_HTTP_CONNECTION:
+        req->keep_alive=!nx_strcasecmp(value, "keep-alive");
+        req->connection_upgrade=!!strcasestr(value, "upgrade");
+        break;
       case NXWEB_HTTP_RANGE: req->range=value; break;
+      case NXWEB_HTTP_IF_RANGE: req->if_range=value; break;
       case NXWEB_HTTP_TRAILER: return -2; // not implemented
       default:
         header=nxb_calloc_obj(nxb, sizeof(nxweb_http_header));
@@ -878,6 +1051,9 @@ void _nxweb_prepare_response_headers(nxe_loop* loop, nxweb_http_response *resp)
     if (resp->gzip_encoded) {
       nxb_append_str(nxb, "Content-Encoding: gzip\r\n");
     }
+    if (resp->accept_ranges) {
+      nxb_append_str(nxb, "Accept-Ranges: bytes\r\n");
+    }
   }
   if (resp->last_modified) {
     gmtime_r(&resp->last_modified, &tm);
@@ -965,7 +1141,7 @@ void nxweb_send_redirect2(nxweb_http_response *resp, int code, const char* locat
   resp->content_length=0;
   resp->sendfile_path=0;
   if (resp->sendfile_fd>0) {
-    close(resp->sendfile_fd);
+    nxweb_fd_cache_close(resp->sendfile_fd);
   }
   resp->sendfile_fd=0;
   resp->content_out=0;
@@ -1019,7 +1195,7 @@ void nxweb_send_http_error(nxweb_http_response *resp, int code, const char* mess
   resp->content_type="text/html";
   resp->sendfile_path=0;
   if (resp->sendfile_fd>0) {
-    close(resp->sendfile_fd);
+    nxweb_fd_cache_close(resp->sendfile_fd);
   }
   resp->sendfile_fd=0;
   resp->content_out=0;
@@ -1028,7 +1204,7 @@ void nxweb_send_http_error(nxweb_http_response *resp, int code, const char* mess
 
 int nxweb_send_file(nxweb_http_response *resp, char* fpath, const struct stat* finfo, int gzip_encoded, off_t offset, size_t size, const nxweb_mime_type* mtype, const char* charset) {
   if (fpath==0) { // cancel sendfile
-    if (resp->sendfile_fd) close(resp->sendfile_fd);
+    if (resp->sendfile_fd) nxweb_fd_cache_close(resp->sendfile_fd);
     resp->sendfile_fd=0;
     resp->sendfile_offset=0;
     resp->sendfile_end=0;
@@ -1039,7 +1215,7 @@ int nxweb_send_file(nxweb_http_response *resp, char* fpath, const struct stat* f
 
   // if no finfo provided by the caller, get it here
   if (!finfo || !finfo->st_ino) {
-    if (stat(fpath, &resp->sendfile_info)==-1) return -1;
+    if (nxweb_fd_cache_stat(fpath, &resp->sendfile_info, 0)==-1) return -1;
     finfo=&resp->sendfile_info;
   }
   if (S_ISDIR(finfo->st_mode)) {
@@ -112,6 +112,7 @@ int nxweb_load_config(const char* filename) {
       if (itf) {
         if (!secure) {
           if (nxweb_listen(itf, backlog)) return -1;
+          nxweb_server_config.listen_config[nxweb_server_config.listen_config_idx-1].http2=!!nx_json_get(l, "http2")->int_value;
           listen_http=1;
         }
 #ifdef WITH_SSL
@@ -119,6 +120,8 @@ int nxweb_load_config(const char* filename) {
           const char* priorities=nx_json_get(l, "priorities")->text_value;
           if (!priorities) priorities=DEFAULT_SSL_PRIORITIES;
           if (nxweb_listen_ssl(itf, backlog, 1, nx_json_get(l, "cert")->text_value, nx_json_get(l, "key")->text_value, nx_json_get(l, "dh")->text_value, priorities)) return -1;
+          nxweb_server_config.listen_config[nxweb_server_config.listen_config_idx-1].ktls=!!nx_json_get(l, "ktls")->int_value;
+          nxweb_server_config.listen_config[nxweb_server_config.listen_config_idx-1].http2=!!nx_json_get(l, "http2")->int_value;
           listen_https=1;
         }
 #endif // WITH_SSL
@@ -186,6 +189,67 @@ int nxweb_load_config(const char* filename) {
     }
   }
 
+  const nx_json* threads=nx_json_get(json, "threads");
+  if (threads->type!=NX_JSON_NULL) {
+    nx_placement_policy* pp=&nxweb_server_config.net_thread_placement;
+    const nx_json* js;
+    if (!pp->cpu_list) pp->cpu_list=nx_json_get(threads, "cpus")->text_value; // command-line value takes precedence
+    if ((js=nx_json_get(threads, "skip_smt"))->type!=NX_JSON_NULL) pp->skip_smt=!!js->int_value;
+    if ((js=nx_json_get(threads, "spread_nodes"))->type!=NX_JSON_NULL) pp->spread_nodes=!!js->int_value;
+    if ((js=nx_json_get(threads, "bind_memory"))->type!=NX_JSON_NULL) nxweb_server_config.numa_bind_memory=!!js->int_value;
+    if ((js=nx_json_get(threads, "pin_workers"))->type!=NX_JSON_NULL) nxweb_server_config.pin_workers=!!js->int_value;
+    if ((js=nx_json_get(threads, "offload_file_io"))->type!=NX_JSON_NULL) nxweb_server_config.offload_file_io=!!js->int_value;
+    if ((js=nx_json_get(threads, "ssl_handshake_threads"))->int_value>0) nxweb_server_config.ssl_handshake_threads=(int)js->int_value;
+  }
+
+  const nx_json* pools=nx_json_get(json, "pools");
+  if (pools->type!=NX_JSON_NULL) {
+    const nx_json* js;
+    if ((js=nx_json_get(pools, "connections"))->int_value>0) nxweb_server_config.conn_pool_size=(int)js->int_value;
+    if ((js=nx_json_get(pools, "read_buffers"))->int_value>0) nxweb_server_config.rbuf_pool_size=(int)js->int_value;
+    if (nx_json_get(pools, "hugepages")->int_value) nxweb_server_config.pool_arena_flags|=NXP_ARENA_HUGEPAGES;
+    if (nx_json_get(pools, "mlock")->int_value) nxweb_server_config.pool_arena_flags|=NXP_ARENA_MLOCK;
+    if ((js=nx_json_get(pools, "gc_hold_ms"))->type!=NX_JSON_NULL) nxweb_server_config.pool_gc_hold_time=js->int_value*1000;
+  }
+
+  const nx_json* fd_cache=nx_json_get(json, "fd_cache");
+  if (fd_cache->type!=NX_JSON_NULL) {
+    const nx_json* js;
+    if ((js=nx_json_get(fd_cache, "size"))->type!=NX_JSON_NULL) nxweb_server_config.fd_cache_size=(int)js->int_value;
+    if ((js=nx_json_get(fd_cache, "ttl_ms"))->int_value>0) nxweb_server_config.fd_cache_ttl=js->int_value*1000;
+  }
+
+  const nx_json* ssl_sessions=nx_json_get(json, "ssl_sessions");
+  if (ssl_sessions->type!=NX_JSON_NULL) {
+    const nx_json* js;
+    if ((js=nx_json_get(ssl_sessions, "cache_size"))->type!=NX_JSON_NULL) nxweb_server_config.ssl_session_cache_size=(int)js->int_value;
+    if ((js=nx_json_get(ssl_sessions, "timeout"))->int_value>0) nxweb_server_config.ssl_session_timeout=(int)js->int_value;
+    if ((js=nx_json_get(ssl_sessions, "ticket_key_rotation"))->type!=NX_JSON_NULL) nxweb_server_config.ssl_ticket_key_rotation=(int)js->int_value;
+  }
+
+  const nx_json* request_body=nx_json_get(json, "request_body");
+  if (request_body->type!=NX_JSON_NULL) {
+    const nx_json* js;
+    if ((js=nx_json_get(request_body, "max_size"))->int_value>0) nxweb_server_config.request_body_max_size=js->int_value;
+    if ((js=nx_json_get(request_body, "memory_limit"))->type!=NX_JSON_NULL) nxweb_server_config.request_body_memory_limit=js->int_value;
+    if ((js=nx_json_get(request_body, "temp_dir"))->text_value) nxweb_server_config.request_body_temp_dir=js->text_value;
+  }
+
+  const nx_json* memcache=nx_json_get(json, "memcache");
+  if (memcache->type!=NX_JSON_NULL) {
+    nxweb_server_config.memcache_snapshot_file=nx_json_get(memcache, "snapshot_file")->text_value;
+    nxweb_server_config.memcache_snapshot_contents=!!nx_json_get(memcache, "snapshot_contents")->int_value;
+  }
+
+  const nx_json* admission=nx_json_get(json, "admission");
+  if (admission->type!=NX_JSON_NULL) {
+    nxweb_server_config.max_connections=(int)nx_json_get(admission, "max_connections")->int_value;
+    nxweb_server_config.max_thread_connections=(int)nx_json_get(admission, "max_thread_connections")->int_value;
+    nxweb_server_config.shed_loop_lag=nx_json_get(admission, "shed_loop_lag_ms")->int_value*1000;
+    nxweb_server_config.shed_worker_jobs=(int)nx_json_get(admission, "shed_worker_jobs")->int_value;
+    nxweb_server_config.max_ssl_handshakes=(int)nx_json_get(admission, "max_ssl_handshakes")->int_value;
+  }
+
   const nx_json* backends=nx_json_get(json, "backends");
   if (backends->type!=NX_JSON_NULL) {
     for (i=0; i<backends->length; i++) {
@@ -317,6 +381,7 @@ int nxweb_load_config(const char* filename) {
       new_handler->index_file=nx_json_get(js, "index_file")->text_value;
       new_handler->proxy_copy_host=!!nx_json_get(js, "proxy_copy_host")->int_value;
       new_handler->size=nx_json_get(js, "size")->int_value;
+      new_handler->max_body_size=nx_json_get(js, "max_body_size")->int_value;
       new_handler->priority=(int)nx_json_get(js, "priority")->int_value;
       if (!new_handler->priority) new_handler->priority=(i+1)*1000;
       if (base_handler->on_config) {
@@ -42,6 +42,7 @@ static void show_help(void) {
           " -c file  load configuration file (default: nxweb_config.json)\n"
           " -T targ  set configuration target\n"
           " -t num   set max number of threads\n"
+          " -C cpus  place net threads on given CPUs (eg. 0-7,16-23)\n"
           " -P dir   set python root dir\n"
           " -W name  set python WSGI app fully qualified name\n"
           " -V path  set python virtualenv path\n"
@@ -93,7 +94,7 @@ int nxweb_main_stub(int argc, char** argv, void (*server_main)()) {
 
   nxweb_main_args.max_net_threads = NXWEB_MAX_NET_THREADS;
   int c;
-  while ((c=getopt(argc, argv, ":hvdsw:l:a:p:u:g:H:S:c:T:t:P:W:V:L:M:"))!=-1) {
+  while ((c=getopt(argc, argv, ":hvdsw:l:a:p:u:g:H:S:c:T:t:C:P:W:V:L:M:"))!=-1) {
     switch (c) {
       case 'h':
         show_help();
@@ -173,6 +174,9 @@ int nxweb_main_stub(int argc, char** argv, void (*server_main)()) {
           nxweb_main_args.max_net_threads = val;
 	}
         break;
+      case 'C':
+        nxweb_server_config.net_thread_placement.cpu_list=optarg;
+        break;
       case 'P':
         nxweb_main_args.python_root=optarg;
         break;
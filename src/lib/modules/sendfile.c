@@ -81,6 +81,31 @@ static nxweb_result sendfile_generate_cache_key(nxweb_http_server_connection* co
   return NXWEB_OK;
 }
 
+typedef struct sendfile_file_op {
+  const char* fpath;
+  struct stat finfo;
+  int stat_result;
+  int fd;
+} sendfile_file_op;
+
+static nxweb_result sendfile_send(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, int fd);
+
+static void sendfile_stat_open(void* param) { // runs in worker thread
+  sendfile_file_op* op=param;
+  op->stat_result=nxweb_fd_cache_stat(op->fpath, &op->finfo, 0);
+  if (op->stat_result!=-1 && S_ISREG(op->finfo.st_mode)) op->fd=nxweb_fd_cache_open(op->fpath, 0);
+}
+
+static nxweb_result sendfile_stat_open_complete(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, void* param) {
+  sendfile_file_op* op=param;
+  if (op->stat_result==-1) {
+    // file not found => let other handlers pick up this request
+    return NXWEB_NEXT;
+  }
+  resp->sendfile_info=op->finfo;
+  return sendfile_send(conn, req, resp, op->fd);
+}
+
 static nxweb_result sendfile_on_select(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
   if (!req->get_method || req->content_length) return NXWEB_NEXT; // do not respond to POST requests, etc.
 
@@ -88,10 +113,26 @@ static nxweb_result sendfile_on_select(nxweb_http_server_connection* conn, nxweb
   assert(fpath);
   struct stat* finfo=&resp->sendfile_info;
 
-  if (!finfo->st_ino && stat(fpath, finfo)==-1) {
-    // file not found => let other handlers pick up this request
-    return NXWEB_NEXT;
+  if (!finfo->st_ino) {
+    // with offloading only fresh fd cache entries are served on net thread
+    int r=nxweb_fd_cache_stat(fpath, finfo, nxweb_server_config.offload_file_io);
+    if (r==-2) {
+      sendfile_file_op* op=nxb_calloc_obj(req->nxb, sizeof(sendfile_file_op));
+      op->fpath=fpath;
+      return nxweb_offload_file_op(conn, sendfile_stat_open, sendfile_stat_open_complete, op);
+    }
+    if (r==-1) {
+      // file not found => let other handlers pick up this request
+      return NXWEB_NEXT;
+    }
   }
+  return sendfile_send(conn, req, resp, 0);
+}
+
+// fd is file already open by worker (or 0); it is either passed to resp or closed
+static nxweb_result sendfile_send(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp, int fd) {
+  const char* fpath=resp->sendfile_path;
+  struct stat* finfo=&resp->sendfile_info;
 
   if (S_ISDIR(finfo->st_mode)) {
     // this is directory but no trailing slash in uri => append '/' to the end of path and redirect
@@ -123,6 +164,7 @@ static nxweb_result sendfile_on_select(nxweb_http_server_connection* conn, nxweb
 
   if (req->if_modified_since && finfo->st_mtime<=req->if_modified_since
       && resp->mtype && !resp->mtype->ssi_on && !resp->mtype->templates_on) {
+    if (fd>0) nxweb_fd_cache_close(fd);
     resp->status_code=304;
     resp->status="Not Modified";
     nxweb_start_sending_response(conn, resp);
@@ -130,11 +172,13 @@ static nxweb_result sendfile_on_select(nxweb_http_server_connection* conn, nxweb
   }
 
   int result=nxweb_send_file(resp, (char*)fpath, finfo, 0, 0, 0, resp->mtype, conn->handler->charset);
-  if (result!=0) { // should not happen
+  if (result!=0 || fd==-1) { // should not happen
+    if (fd>0) nxweb_fd_cache_close(fd);
     nxweb_log_error("sendfile: [%s] stat() was OK, but open() failed", fpath);
     nxweb_send_http_error(resp, 500, "Internal Server Error");
     return NXWEB_ERROR;
   }
+  if (fd>0) resp->sendfile_fd=fd;
 
   if (S_ISVTX & finfo->st_mode) { // sTicky bit (use chmod +t filename to set)
     resp->templates_on=1; // activate templates processing
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#ifdef WITH_SLAB_ALLOC
+
+#include <pthread.h>
+#include <assert.h>
+
+/*
+ * Memory is carved from NX_SLAB_SPAN_SIZE-aligned spans of single size class.
+ * Span map (two-level radix table indexed by address>>16) tells size class
+ * of the span any pointer belongs to; pointers not found there are large
+ * allocations made with memalign().
+ *
+ * Each thread keeps a magazine (LIFO list) per size class. Empty magazine is
+ * refilled from the class's shared depot; overflowing magazine gives half of
+ * its objects back to the depot. Objects freed by a thread other than
+ * the allocating one simply land in the freeing thread's magazine.
+ */
+
+#define NX_SLAB_SPAN_SIZE 262144
+#define NX_SLAB_MAP_SHIFT 16 // span map granularity
+#define NX_SLAB_MAP_L2_BITS 16
+#define NX_SLAB_MAP_L1_SIZE (1<<(47-NX_SLAB_MAP_SHIFT-NX_SLAB_MAP_L2_BITS)) // 47-bit user address space
+#define NX_SLAB_NUM_CLASSES 40
+#define NX_SLAB_MAGAZINE_BYTES 131072 // max bytes cached per class per thread
+#define NX_SLAB_MAGAZINE_MAX 256 // max objects cached per class per thread
+#define NX_SLAB_MAGAZINE_MIN 4
+
+typedef struct nx_slab_object {
+  struct nx_slab_object* next;
+} nx_slab_object;
+
+typedef struct nx_slab_depot {
+  pthread_mutex_t mux;
+  nx_slab_object* free_list;
+  size_t free_count;
+} __attribute__ ((aligned(64))) nx_slab_depot;
+
+typedef struct nx_slab_magazine {
+  nx_slab_object* top;
+  int count;
+} nx_slab_magazine;
+
+typedef struct nx_slab_thread_cache {
+  nx_slab_magazine mags[NX_SLAB_NUM_CLASSES];
+  nx_alloc_stats stats;
+  struct nx_slab_thread_cache* prev;
+  struct nx_slab_thread_cache* next;
+} nx_slab_thread_cache;
+
+static uint8_t* span_map[NX_SLAB_MAP_L1_SIZE]; // size class+1 for each span; 0 = not a slab span
+static pthread_mutex_t span_map_mux=PTHREAD_MUTEX_INITIALIZER;
+
+static nx_slab_depot depots[NX_SLAB_NUM_CLASSES];
+static int magazine_capacity[NX_SLAB_NUM_CLASSES];
+
+static __thread nx_slab_thread_cache* _nx_slab_tc;
+static pthread_key_t tc_key;
+static pthread_mutex_t tc_list_mux=PTHREAD_MUTEX_INITIALIZER;
+static nx_slab_thread_cache* tc_list;
+static nx_alloc_stats exited_threads_stats; // protected by tc_list_mux
+static uint64_t spans_allocated;
+static uint64_t large_bytes;
+
+static inline int size_to_class(size_t size) {
+  // 16, 32, 48, 64, then four classes per power of two: 80, 96, 112, 128, 160, ... 32768
+  if (size<=64) return size? (int)((size-1)>>4) : 0;
+  size_t s=size-1;
+  int msb=63-__builtin_clzl(s);
+  return 4+(msb-6)*4+(int)((s>>(msb-2))&3);
+}
+
+static inline size_t class_to_size(int cls) {
+  if (cls<4) return (size_t)16*(cls+1);
+  size_t base=(size_t)64<<((cls-4)/4);
+  return base+((cls-4)%4+1)*(base/4);
+}
+
+static inline int span_map_get(const void* ptr) { // returns size class or -1
+  uintptr_t idx=(uintptr_t)ptr>>NX_SLAB_MAP_SHIFT;
+  uintptr_t l1=idx>>NX_SLAB_MAP_L2_BITS;
+  if (l1>=NX_SLAB_MAP_L1_SIZE) return -1;
+  const uint8_t* l2=span_map[l1];
+  if (!l2) return -1;
+  return (int)l2[idx&((1<<NX_SLAB_MAP_L2_BITS)-1)]-1;
+}
+
+static int span_map_set_granule(uintptr_t idx, int cls) {
+  uintptr_t l1=idx>>NX_SLAB_MAP_L2_BITS;
+  if (l1>=NX_SLAB_MAP_L1_SIZE) return -1;
+  uint8_t* l2=span_map[l1];
+  if (!l2) {
+    pthread_mutex_lock(&span_map_mux);
+    l2=span_map[l1];
+    if (!l2) {
+      l2=calloc(1, 1<<NX_SLAB_MAP_L2_BITS);
+      if (l2) __sync_synchronize(), span_map[l1]=l2;
+    }
+    pthread_mutex_unlock(&span_map_mux);
+    if (!l2) return -1;
+  }
+  l2[idx&((1<<NX_SLAB_MAP_L2_BITS)-1)]=(uint8_t)(cls+1);
+  return 0;
+}
+
+static int span_map_set(const void* span, int cls) {
+  uintptr_t idx=(uintptr_t)span>>NX_SLAB_MAP_SHIFT;
+  uintptr_t last_idx=idx+(NX_SLAB_SPAN_SIZE>>NX_SLAB_MAP_SHIFT)-1;
+  for (; idx<=last_idx; idx++) {
+    if (span_map_set_granule(idx, cls)) return -1;
+  }
+  return 0;
+}
+
+static void tc_add_stats(nx_alloc_stats* dst, const nx_alloc_stats* src) {
+  dst->allocs+=src->allocs;
+  dst->frees+=src->frees;
+  dst->refills+=src->refills;
+  dst->flushes+=src->flushes;
+  dst->large_allocs+=src->large_allocs;
+  dst->large_frees+=src->large_frees;
+}
+
+static void depot_put(int cls, nx_slab_object* first, nx_slab_object* last, int count) {
+  nx_slab_depot* d=&depots[cls];
+  pthread_mutex_lock(&d->mux);
+  last->next=d->free_list;
+  d->free_list=first;
+  d->free_count+=count;
+  pthread_mutex_unlock(&d->mux);
+}
+
+static void tc_destroy(void* ptr) {
+  nx_slab_thread_cache* tc=ptr;
+  int cls;
+  for (cls=0; cls<NX_SLAB_NUM_CLASSES; cls++) {
+    nx_slab_magazine* mag=&tc->mags[cls];
+    if (!mag->count) continue;
+    nx_slab_object* last=mag->top;
+    while (last->next) last=last->next;
+    depot_put(cls, mag->top, last, mag->count);
+    mag->top=0;
+    mag->count=0;
+  }
+  pthread_mutex_lock(&tc_list_mux);
+  if (tc->prev) tc->prev->next=tc->next;
+  else tc_list=tc->next;
+  if (tc->next) tc->next->prev=tc->prev;
+  tc_add_stats(&exited_threads_stats, &tc->stats);
+  pthread_mutex_unlock(&tc_list_mux);
+  _nx_slab_tc=0;
+  free(tc);
+}
+
+static void nx_slab_init() __attribute__ ((constructor(101))); // before any module constructors
+static void nx_slab_init() {
+  int cls;
+  for (cls=0; cls<NX_SLAB_NUM_CLASSES; cls++) {
+    pthread_mutex_init(&depots[cls].mux, 0);
+    int cap=NX_SLAB_MAGAZINE_BYTES/class_to_size(cls);
+    if (cap>NX_SLAB_MAGAZINE_MAX) cap=NX_SLAB_MAGAZINE_MAX;
+    if (cap<NX_SLAB_MAGAZINE_MIN) cap=NX_SLAB_MAGAZINE_MIN;
+    magazine_capacity[cls]=cap;
+  }
+  assert(class_to_size(NX_SLAB_NUM_CLASSES-1)==NX_SLAB_MAX_SIZE);
+  pthread_key_create(&tc_key, tc_destroy);
+}
+
+static nx_slab_thread_cache* tc_create() {
+  nx_slab_thread_cache* tc=calloc(1, sizeof(nx_slab_thread_cache));
+  if (!tc) return 0;
+  pthread_mutex_lock(&tc_list_mux);
+  tc->next=tc_list;
+  if (tc_list) tc_list->prev=tc;
+  tc_list=tc;
+  pthread_mutex_unlock(&tc_list_mux);
+  pthread_setspecific(tc_key, tc);
+  _nx_slab_tc=tc;
+  return tc;
+}
+
+static int tc_refill(nx_slab_thread_cache* tc, int cls) {
+  nx_slab_depot* d=&depots[cls];
+  nx_slab_magazine* mag=&tc->mags[cls];
+  int want=magazine_capacity[cls]/2;
+  if (!want) want=1;
+  pthread_mutex_lock(&d->mux);
+  if (!d->free_list) {
+    // carve new span
+    char* span=memalign(NX_SLAB_SPAN_SIZE, NX_SLAB_SPAN_SIZE);
+    if (!span || span_map_set(span, cls)) {
+      free(span);
+      pthread_mutex_unlock(&d->mux);
+      return -1;
+    }
+    size_t size=class_to_size(cls);
+    char* p=span;
+    char* end=span+NX_SLAB_SPAN_SIZE-size;
+    nx_slab_object* prev=0;
+    for (; p<=end; p+=size) {
+      nx_slab_object* obj=(nx_slab_object*)p;
+      obj->next=prev;
+      prev=obj;
+      d->free_count++;
+    }
+    d->free_list=prev;
+    __sync_add_and_fetch(&spans_allocated, 1);
+  }
+  nx_slab_object* first=d->free_list;
+  nx_slab_object* last=first;
+  int n=1;
+  while (n<want && last->next) {
+    last=last->next;
+    n++;
+  }
+  d->free_list=last->next;
+  d->free_count-=n;
+  pthread_mutex_unlock(&d->mux);
+  last->next=mag->top;
+  mag->top=first;
+  mag->count+=n;
+  tc->stats.refills++;
+  return 0;
+}
+
+static void tc_flush(nx_slab_thread_cache* tc, int cls) {
+  nx_slab_magazine* mag=&tc->mags[cls];
+  int n=mag->count/2;
+  if (!n) n=1;
+  nx_slab_object* first=mag->top;
+  nx_slab_object* last=first;
+  int i;
+  for (i=1; i<n; i++) last=last->next;
+  mag->top=last->next;
+  mag->count-=n;
+  depot_put(cls, first, last, n);
+  tc->stats.flushes++;
+}
+
+static void* large_alloc(size_t size) {
+  void* ptr=memalign(NX_CACHE_LINE_SIZE, size);
+  if (!ptr) return 0;
+  __sync_add_and_fetch(&large_bytes, malloc_usable_size(ptr));
+  nx_slab_thread_cache* tc=_nx_slab_tc;
+  if (tc) tc->stats.large_allocs++;
+  return ptr;
+}
+
+void* nx_slab_alloc(size_t size) {
+  if (size>NX_SLAB_MAX_SIZE) return large_alloc(size);
+  nx_slab_thread_cache* tc=_nx_slab_tc;
+  if (!tc && !(tc=tc_create())) return 0;
+  int cls=size_to_class(size);
+  nx_slab_magazine* mag=&tc->mags[cls];
+  if (!mag->top && tc_refill(tc, cls)) return 0;
+  nx_slab_object* obj=mag->top;
+  mag->top=obj->next;
+  mag->count--;
+  tc->stats.allocs++;
+  return obj;
+}
+
+void* nx_slab_calloc(size_t size) {
+  void* ptr=nx_slab_alloc(size);
+  if (ptr) memset(ptr, 0, size);
+  return ptr;
+}
+
+void nx_slab_free(void* ptr) {
+  if (!ptr) return;
+  int cls=span_map_get(ptr);
+  nx_slab_thread_cache* tc=_nx_slab_tc;
+  if (cls<0) {
+    __sync_sub_and_fetch(&large_bytes, malloc_usable_size(ptr));
+    if (tc) tc->stats.large_frees++;
+    free(ptr);
+    return;
+  }
+  if (!tc && !(tc=tc_create())) {
+    // can't get thread cache => return object directly to depot
+    nx_slab_object* obj=ptr;
+    depot_put(cls, obj, obj, 1);
+    return;
+  }
+  nx_slab_magazine* mag=&tc->mags[cls];
+  nx_slab_object* obj=ptr;
+  obj->next=mag->top;
+  mag->top=obj;
+  tc->stats.frees++;
+  if (++mag->count > magazine_capacity[cls]) tc_flush(tc, cls);
+}
+
+void nx_alloc_get_thread_stats(nx_alloc_stats* st) {
+  memset(st, 0, sizeof(nx_alloc_stats));
+  if (_nx_slab_tc) tc_add_stats(st, &_nx_slab_tc->stats);
+  st->spans=spans_allocated;
+  st->large_bytes=large_bytes;
+}
+
+void nx_alloc_get_stats(nx_alloc_stats* st) {
+  memset(st, 0, sizeof(nx_alloc_stats));
+  pthread_mutex_lock(&tc_list_mux);
+  nx_slab_thread_cache* tc;
+  for (tc=tc_list; tc; tc=tc->next) tc_add_stats(st, &tc->stats); // other threads' counters read without sync
+  tc_add_stats(st, &exited_threads_stats);
+  pthread_mutex_unlock(&tc_list_mux);
+  st->spans=spans_allocated;
+  st->large_bytes=large_bytes;
+}
+
+static void nx_alloc_on_server_diagnostics() {
+  nx_alloc_stats st;
+  nx_alloc_get_stats(&st);
+  nxweb_log_error("[diag] nx_alloc: allocs=%" PRIu64 " frees=%" PRIu64 " refills=%" PRIu64 " flushes=%" PRIu64
+                  " large_allocs=%" PRIu64 " large_frees=%" PRIu64 " spans=%" PRIu64 " (%" PRIu64 "KB) large_bytes=%" PRIu64,
+                  st.allocs, st.frees, st.refills, st.flushes, st.large_allocs, st.large_frees,
+                  st.spans, st.spans*(NX_SLAB_SPAN_SIZE/1024), st.large_bytes);
+  int cls;
+  for (cls=0; cls<NX_SLAB_NUM_CLASSES; cls++) {
+    size_t free_count=depots[cls].free_count;
+    if (free_count) nxweb_log_error("[diag] nx_alloc: class %d bytes depot_free=%d", (int)class_to_size(cls), (int)free_count);
+  }
+}
+
+static void nx_alloc_on_thread_diagnostics() {
+  nx_alloc_stats st;
+  nx_alloc_get_thread_stats(&st);
+  nxweb_log_error("[diag] nx_alloc thread %d: allocs=%" PRIu64 " frees=%" PRIu64 " refills=%" PRIu64 " flushes=%" PRIu64
+                  " large_allocs=%" PRIu64 " large_frees=%" PRIu64,
+                  _nxweb_net_thread_data->thread_num, st.allocs, st.frees, st.refills, st.flushes, st.large_allocs, st.large_frees);
+}
+
+NXWEB_MODULE(nx_alloc, .on_server_diagnostics=nx_alloc_on_server_diagnostics, .on_thread_diagnostics=nx_alloc_on_thread_diagnostics);
+
+#endif // WITH_SLAB_ALLOC
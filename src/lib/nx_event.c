@@ -199,6 +199,11 @@ void nxe_run(nxe_loop* loop) {
     closest_tq=nxe_closest_tq(loop);
     if (!loop->first && !closest_tq && loop->ref_count<=0) break;
 
+    // measure how long events waited since wakeup
+    nxe_time_t lag=nxe_get_time_usec()-loop->current_time;
+    loop->lag=(loop->lag*7+lag)/8;
+    if (lag>loop->lag_max) loop->lag_max=lag;
+
     // now do epoll_wait
     time_to_wait=closest_tq? (int)((closest_tq->timer_first->abs_time - loop->current_time)/1000) : 1000;
     if (time_to_wait>1000) time_to_wait=1000; // for gc
@@ -379,7 +384,9 @@ static void stream_event_deliver(nxe_event* evt) {
     while (is->ready && os->ready && is==os->pair) {
       if (!count--) { // protect against dead loops
         nxweb_log_info("possible dead loop");
-        nxe_link(os->super.loop, evt); // relink to the end of queue, let other events being processed
+        // relink to the end of queue, let other events being processed
+        // (might have been relinked already by set_ready() during delivery)
+        if (!IS_IN_LOOP(evt)) nxe_link(os->super.loop, evt);
         break;
       }
       ISTREAM_CLASS(is)->do_write(is, os);
@@ -389,7 +396,9 @@ static void stream_event_deliver(nxe_event* evt) {
     while (is->ready && os->ready && is==os->pair) {
       if (!count--) { // protect against dead loops
         nxweb_log_info("possible dead loop");
-        nxe_link(os->super.loop, evt); // relink to the end of queue, let other events being processed
+        // relink to the end of queue, let other events being processed
+        // (might have been relinked already by set_ready() during delivery)
+        if (!IS_IN_LOOP(evt)) nxe_link(os->super.loop, evt);
         break;
       }
       OSTREAM_CLASS(os)->do_read(os, is);
@@ -546,7 +555,7 @@ nxe_loop* nxe_create(int max_epoll_events) {
   int s=4;
   while (s<max_epoll_events) s<<=1; // align to power of 2
   max_epoll_events=s;
-  nxe_loop* loop=nx_alloc(sizeof(nxe_loop)+sizeof(struct epoll_event)*max_epoll_events);
+  nxe_loop* loop=nx_alloc_cl(sizeof(nxe_loop)+sizeof(struct epoll_event)*max_epoll_events);
   if (!loop) return 0;
   memset(loop, 0, sizeof(nxe_loop));
   nxp_init(&loop->free_event_pool, sizeof(nxe_event), &loop->free_event_pool_initial_chunk, sizeof(nxp_chunk)+sizeof(loop->free_events));
@@ -68,8 +68,7 @@ static inline int load_page(nx_file_reader* fr, nxfr_size_t offset) {
     fr->mbuf_offset=offset;
     fr->mbuf_size=min(NX_FILE_READER_MALLOC_SIZE, fr->file_size - fr->mbuf_offset);
     fr->mbuf=nx_alloc(fr->mbuf_size);
-    if ( (lseek(fr->fd, fr->mbuf_offset, SEEK_SET)!=fr->mbuf_offset)
-      || (read(fr->fd, fr->mbuf, fr->mbuf_size) < fr->mbuf_size) ) {
+    if (pread(fr->fd, fr->mbuf, fr->mbuf_size, fr->mbuf_offset) < fr->mbuf_size) {
       // file read failed: file content disappeared, concurrent modification, etc.
       // fill in mbuf with spaces to be on a safe side
       memset(fr->mbuf, ' ', fr->mbuf_size);
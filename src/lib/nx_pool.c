@@ -21,6 +21,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "nx_pool.h"
 #include "misc.h"
@@ -54,6 +56,11 @@ void nxp_init(nxp_pool* pool, int object_size, nxp_chunk* initial_chunk, int chu
   pool->free_first=
   pool->free_last=0;
   pool->object_size=object_size;
+  pool->capacity=pool->chunk->nitems;
+  pool->chunk_in_use=0;
+  pool->arena_size=0;
+  pool->gc_hold_time=0;
+  pool->gc_idle_since=0;
   nxp_init_chunk(pool);
 }
 
@@ -75,9 +82,45 @@ nxp_pool* nxp_create(int object_size, int initial_chunk_size) {
   return pool;
 }
 
+#define NXP_HUGEPAGE_SIZE (2*1024*1024)
+
+nxp_pool* nxp_create_arena(int object_size, int initial_chunk_size, int arena_flags) {
+  if (!arena_flags) return nxp_create(object_size, initial_chunk_size);
+  object_size=(object_size+7)&~0x7; // align to 8 bytes
+  size_t size=sizeof(nxp_pool)+sizeof(nxp_chunk)+(sizeof(nxp_object)+object_size)*initial_chunk_size;
+  size_t page_size=(arena_flags&NXP_ARENA_HUGEPAGES)? NXP_HUGEPAGE_SIZE : (size_t)sysconf(_SC_PAGE_SIZE);
+  size=(size+page_size-1)&~(page_size-1); // whole pages; tail becomes extra items
+  void* mem=MAP_FAILED;
+  if (arena_flags&NXP_ARENA_HUGEPAGES) {
+    mem=mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+    if (mem==MAP_FAILED) { // no hugetlbfs pages reserved => try transparent huge pages
+      mem=mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (mem!=MAP_FAILED) {
+        madvise(mem, size, MADV_HUGEPAGE);
+        memset(mem, 0, size); // fault in now, not under load
+      }
+    }
+  }
+  else {
+    mem=mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  }
+  if (mem==MAP_FAILED) {
+    nxweb_log_error("nx_pool: mmap arena of %lu bytes failed; using heap", (unsigned long)size);
+    return nxp_create(object_size, initial_chunk_size);
+  }
+  if ((arena_flags&NXP_ARENA_MLOCK) && mlock(mem, size)) {
+    nxweb_log_warning("nx_pool: mlock arena of %lu bytes failed (check RLIMIT_MEMLOCK)", (unsigned long)size);
+  }
+  nxp_pool* pool=mem;
+  nxp_init(pool, object_size, (void*)(pool+1), size-sizeof(nxp_pool));
+  pool->arena_size=size;
+  return pool;
+}
+
 void nxp_destroy(nxp_pool* pool) {
   nxp_finalize(pool);
-  nx_free(pool);
+  if (pool->arena_size) munmap(pool, pool->arena_size);
+  else nx_free(pool);
 }
 
 void* nxp_alloc(nxp_pool* pool) {
@@ -94,9 +137,13 @@ void* nxp_alloc(nxp_pool* pool) {
     chunk->prev=pool->chunk;
     chunk->id=chunk->prev? chunk->prev->id+1 : 1;
     pool->chunk=chunk;
+    pool->capacity+=nitems;
+    pool->chunk_in_use=0;
+    pool->gc_idle_since=0;
     nxp_init_chunk(pool);
     obj=pool->free_first;
   }
+  if (obj->chunk_id==pool->chunk->id) pool->chunk_in_use++;
   if (obj->next) {
     pool->free_first=obj->next;
     obj->next->prev=0;
@@ -118,6 +165,7 @@ void nxp_free(nxp_pool* pool, void* ptr) {
   assert(obj->in_use==1);
   obj->in_use=0;
   if (obj->chunk_id==pool->chunk->id) {
+    pool->chunk_in_use--;
     // belongs to last chunk => put at the end of free list
     if (pool->free_last) {
       pool->free_last->next=obj;
@@ -149,15 +197,10 @@ void nxp_free(nxp_pool* pool, void* ptr) {
   // memset(ptr, 0xff, pool->object_size-sizeof(nxp_object)); // DEBUG ONLY - wipe freed data
 }
 
-void nxp_gc(nxp_pool* pool) {
-  if (!pool->chunk->prev) return; // can't free the very first chunk
-
+static void nxp_free_last_chunk(nxp_pool* pool) {
   nxp_object *obj;
   int object_size=pool->object_size;
   int i;
-  for (obj=pool->chunk->pool, i=pool->chunk->nitems; i>0; i--, obj=(nxp_object*)((char*)obj+object_size)) {
-    if (obj->in_use) return;
-  }
   // all objects in last chunk are not in use
   // => remove them from free list and free the chunk
   for (obj=pool->chunk->pool, i=pool->chunk->nitems; i>0; i--, obj=(nxp_object*)((char*)obj+object_size)) {
@@ -168,7 +211,37 @@ void nxp_gc(nxp_pool* pool) {
   }
   nxp_chunk* c=pool->chunk;
   pool->chunk=pool->chunk->prev;
+  pool->capacity-=c->nitems;
   nx_free(c);
+  // recount objects in use in new last chunk
+  int in_use=0;
+  for (obj=pool->chunk->pool, i=pool->chunk->nitems; i>0; i--, obj=(nxp_object*)((char*)obj+object_size)) {
+    if (obj->in_use) in_use++;
+  }
+  pool->chunk_in_use=in_use;
+  pool->gc_idle_since=0;
+}
+
+void nxp_gc(nxp_pool* pool) {
+  if (!pool->chunk->prev) return; // can't free the very first chunk
+  if (pool->chunk_in_use) return;
+  nxp_free_last_chunk(pool);
+}
+
+// same as nxp_gc() but last chunk has to stay unused for gc_hold_time
+// so pools do not oscillate between grow and shrink under bursty load
+void nxp_gc_at(nxp_pool* pool, uint64_t now) {
+  if (!pool->chunk->prev) return; // can't free the very first chunk
+  if (pool->chunk_in_use) {
+    pool->gc_idle_since=0;
+    return;
+  }
+  if (!pool->gc_idle_since) {
+    pool->gc_idle_since=now;
+    if (pool->gc_hold_time) return;
+  }
+  if (now - pool->gc_idle_since < pool->gc_hold_time) return;
+  nxp_free_last_chunk(pool);
 }
 
 void* nxp_iterate_allocated_objects(nxp_pool* pool, nxp_pool_iterator* itr) {
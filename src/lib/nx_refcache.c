@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#include <pthread.h>
+
+#include "deps/ulib/alignhash_tpl.h"
+#include "deps/ulib/hash.h"
+
+#define rc_hash_fn(key) hash_sdbm((const unsigned char*)(key))
+#define rc_eq_fn(a, b) (!strcmp((a), (b)))
+
+DECLARE_ALIGNHASH(rc_map, const char*, nx_refcache_entry*, 1, rc_hash_fn, rc_eq_fn)
+
+#define RC_HASH(c) ((alignhash_t(rc_map)*)(c)->hash)
+#define IS_LINKED(rc, e) ((e)->prev || (rc)->head==(e))
+
+static inline void rc_link(nx_refcache* rc, nx_refcache_entry* e) {
+  e->prev=0;
+  e->next=rc->head;
+  if (rc->head) rc->head->prev=e;
+  else rc->tail=e;
+  rc->head=e;
+}
+
+static inline void rc_unlink(nx_refcache* rc, nx_refcache_entry* e) {
+  if (e->prev) e->prev->next=e->next;
+  else rc->head=e->next;
+  if (e->next) e->next->prev=e->prev;
+  else rc->tail=e->prev;
+  e->next=0;
+  e->prev=0;
+}
+
+static void rc_remove(nx_refcache* rc, nx_refcache_entry* e, ah_iter_t ci) { // must be called within mutex
+  alignhash_del(rc_map, RC_HASH(rc), ci);
+  rc_unlink(rc, e);
+  if (!e->ref_count) rc->free_entry(e);
+  // otherwise freed by last nx_refcache_unref()
+}
+
+nx_refcache_entry* nx_refcache_get(nx_refcache* rc, const char* key, time_t mtime, nxe_time_t loop_time) {
+  nx_refcache_entry* e=0;
+  pthread_mutex_lock(&rc->mutex);
+  ah_iter_t ci=alignhash_get(rc_map, RC_HASH(rc), key);
+  if (ci!=alignhash_end(RC_HASH(rc))) {
+    e=alignhash_value(RC_HASH(rc), ci);
+    if (e->mtime!=mtime || loop_time > e->expires_time) {
+      rc_remove(rc, e, ci);
+      e=0;
+    }
+    else {
+      if (e!=rc->head) {
+        rc_unlink(rc, e);
+        rc_link(rc, e);
+      }
+      e->ref_count++;
+    }
+  }
+  pthread_mutex_unlock(&rc->mutex);
+  if (e && rc->revalidate) {
+    // entry is immutable; whatever revalidate() stats is done outside of mutex
+    int valid=rc->revalidate(e);
+    if (valid<=0) {
+      pthread_mutex_lock(&rc->mutex);
+      if (valid<0) {
+        ci=alignhash_get(rc_map, RC_HASH(rc), key);
+        if (ci!=alignhash_end(RC_HASH(rc)) && alignhash_value(RC_HASH(rc), ci)==e) rc_remove(rc, e, ci);
+      }
+      if (!--e->ref_count && !IS_LINKED(rc, e)) rc->free_entry(e);
+      pthread_mutex_unlock(&rc->mutex);
+      e=0;
+    }
+  }
+  if (e) __sync_add_and_fetch(&rc->hits, 1);
+  else __sync_add_and_fetch(&rc->misses, 1);
+  return e;
+}
+
+void nx_refcache_store(nx_refcache* rc, nx_refcache_entry* e, nxe_time_t loop_time) {
+  e->expires_time=loop_time+rc->ttl;
+  int ret=0;
+  pthread_mutex_lock(&rc->mutex);
+  ah_iter_t ci=alignhash_get(rc_map, RC_HASH(rc), e->key);
+  if (ci!=alignhash_end(RC_HASH(rc))) rc_remove(rc, alignhash_value(RC_HASH(rc), ci), ci); // replace older version
+  ci=alignhash_set(rc_map, RC_HASH(rc), e->key, &ret);
+  if (ci!=alignhash_end(RC_HASH(rc)) && ret!=AH_INS_ERR) {
+    alignhash_value(RC_HASH(rc), ci)=e;
+    rc_link(rc, e);
+    rc->stores++;
+    while (alignhash_size(RC_HASH(rc))>rc->max_entries) {
+      nx_refcache_entry* old=rc->tail;
+      ci=alignhash_get(rc_map, RC_HASH(rc), old->key);
+      assert(ci!=alignhash_end(RC_HASH(rc)));
+      rc_remove(rc, old, ci);
+    }
+  }
+  pthread_mutex_unlock(&rc->mutex);
+}
+
+void nx_refcache_unref(nx_refcache* rc, nx_refcache_entry* e) {
+  pthread_mutex_lock(&rc->mutex);
+  assert(e->ref_count>0);
+  if (!--e->ref_count && !IS_LINKED(rc, e)) rc->free_entry(e);
+  pthread_mutex_unlock(&rc->mutex);
+}
+
+void nx_refcache_init(nx_refcache* rc) {
+  pthread_mutex_init(&rc->mutex, 0);
+  rc->hash=alignhash_init(rc_map);
+}
+
+void nx_refcache_finalize(nx_refcache* rc) {
+  ah_iter_t ci;
+  for (ci=alignhash_begin(RC_HASH(rc)); ci!=alignhash_end(RC_HASH(rc)); ci++) {
+    if (alignhash_exist(RC_HASH(rc), ci)) {
+      nx_refcache_entry* e=alignhash_value(RC_HASH(rc), ci);
+      if (e->ref_count) nxweb_log_error("%s: %s still in cache with ref_count=%d", rc->name, e->key, e->ref_count);
+      rc_unlink(rc, e);
+      rc->free_entry(e);
+    }
+  }
+  alignhash_destroy(rc_map, RC_HASH(rc));
+  rc->hash=0;
+  pthread_mutex_destroy(&rc->mutex);
+}
+
+void nx_refcache_diagnostics(nx_refcache* rc) {
+  pthread_mutex_lock(&rc->mutex);
+  nxweb_log_error("[diag] %s: cached=%d hits=%" PRIu64 " misses=%" PRIu64 " stores=%" PRIu64, rc->name,
+                  (int)alignhash_size(RC_HASH(rc)), rc->hits, rc->misses, rc->stores);
+  pthread_mutex_unlock(&rc->mutex);
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1 // from <linux/mempolicy.h>
+#endif
+
+#define NX_TOPOLOGY_MAX_NODES 64
+
+static pthread_once_t topology_once=PTHREAD_ONCE_INIT;
+static int num_nodes;
+static cpu_set_t node_cpus[NX_TOPOLOGY_MAX_NODES];
+static cpu_set_t allowed_cpus; // process affinity mask at startup
+static cpu_set_t placed_cpus;  // CPUs taken by nx_topology_place_threads()
+
+static int parse_cpu_list(const char* list, cpu_set_t* set) {
+  CPU_ZERO(set);
+  const char* p=list;
+  char* end;
+  for (;;) {
+    while (*p==',' || *p==' ' || *p=='\n') p++;
+    if (!*p) return 0;
+    long from=strtol(p, &end, 10);
+    if (end==p) return -1;
+    long to=from;
+    p=end;
+    if (*p=='-') {
+      p++;
+      to=strtol(p, &end, 10);
+      if (end==p) return -1;
+      p=end;
+    }
+    if (from<0 || to<from || to>=CPU_SETSIZE) return -1;
+    for (; from<=to; from++) CPU_SET(from, set);
+  }
+}
+
+static int read_cpu_list_file(const char* fpath, cpu_set_t* set) {
+  char buf[4096];
+  FILE* f=fopen(fpath, "r");
+  if (!f) return -1;
+  if (!fgets(buf, sizeof(buf), f)) *buf='\0'; // empty list
+  fclose(f);
+  return parse_cpu_list(buf, set);
+}
+
+static void topology_init() {
+  if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus)) {
+    int i, n=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    CPU_ZERO(&allowed_cpus);
+    for (i=0; i<n && i<CPU_SETSIZE; i++) CPU_SET(i, &allowed_cpus);
+  }
+  DIR* dir=opendir("/sys/devices/system/node");
+  if (dir) {
+    struct dirent* de;
+    char fpath[128];
+    while ((de=readdir(dir))) {
+      if (strncmp(de->d_name, "node", 4)) continue;
+      char* end;
+      long node=strtol(de->d_name+4, &end, 10);
+      if (end==de->d_name+4 || *end || node<0 || node>=NX_TOPOLOGY_MAX_NODES) continue;
+      snprintf(fpath, sizeof(fpath), "/sys/devices/system/node/%s/cpulist", de->d_name);
+      if (read_cpu_list_file(fpath, &node_cpus[node])) continue;
+      if (node>=num_nodes) num_nodes=node+1;
+    }
+    closedir(dir);
+  }
+  if (!num_nodes) { // kernel without NUMA support
+    num_nodes=1;
+    node_cpus[0]=allowed_cpus;
+  }
+}
+
+int nx_topology_num_nodes() {
+  pthread_once(&topology_once, topology_init);
+  return num_nodes;
+}
+
+int nx_topology_cpu_node(int cpu) {
+  pthread_once(&topology_once, topology_init);
+  if (cpu<0 || cpu>=CPU_SETSIZE) return -1;
+  int node;
+  for (node=0; node<num_nodes; node++) {
+    if (CPU_ISSET(cpu, &node_cpus[node])) return node;
+  }
+  return -1;
+}
+
+static int is_smt_sibling_taken(int cpu, const cpu_set_t* cand) {
+  char fpath[128];
+  cpu_set_t siblings;
+  snprintf(fpath, sizeof(fpath), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  if (read_cpu_list_file(fpath, &siblings)) return 0;
+  int i;
+  for (i=0; i<cpu; i++) {
+    if (CPU_ISSET(i, &siblings) && CPU_ISSET(i, cand)) return 1;
+  }
+  return 0;
+}
+
+int nx_topology_place_threads(const nx_placement_policy* policy, nx_cpu_placement* placement, int max_threads) {
+  pthread_once(&topology_once, topology_init);
+  cpu_set_t cand=allowed_cpus, set;
+  if (policy->cpu_list) {
+    if (parse_cpu_list(policy->cpu_list, &set)) nxweb_log_error("invalid cpu list '%s' ignored", policy->cpu_list);
+    else CPU_AND(&cand, &cand, &set);
+  }
+  else if (!read_cpu_list_file("/sys/devices/system/cpu/isolated", &set)) {
+    cpu_set_t rest;
+    CPU_XOR(&rest, &cand, &set);
+    CPU_AND(&rest, &rest, &cand);
+    if (CPU_COUNT(&rest)) cand=rest; // keep isolcpus for dedicated tasks
+  }
+  int cpu, node;
+  if (policy->skip_smt) {
+    for (cpu=CPU_SETSIZE-1; cpu>=0; cpu--) {
+      if (CPU_ISSET(cpu, &cand) && is_smt_sibling_taken(cpu, &cand)) CPU_CLR(cpu, &cand);
+    }
+  }
+
+  int n=0;
+  CPU_ZERO(&placed_cpus);
+  if (policy->spread_nodes && num_nodes>1) {
+    int next_cpu[NX_TOPOLOGY_MAX_NODES]={0};
+    int progress=1;
+    while (n<max_threads && progress) {
+      progress=0;
+      for (node=0; node<num_nodes && n<max_threads; node++) {
+        for (cpu=next_cpu[node]; cpu<CPU_SETSIZE; cpu++) {
+          if (CPU_ISSET(cpu, &cand) && CPU_ISSET(cpu, &node_cpus[node])) break;
+        }
+        next_cpu[node]=cpu+1;
+        if (cpu>=CPU_SETSIZE) continue;
+        placement[n].cpu=cpu;
+        placement[n].numa_node=node;
+        CPU_SET(cpu, &placed_cpus);
+        n++;
+        progress=1;
+      }
+    }
+  }
+  else {
+    for (cpu=0; cpu<CPU_SETSIZE && n<max_threads; cpu++) {
+      if (!CPU_ISSET(cpu, &cand)) continue;
+      placement[n].cpu=cpu;
+      placement[n].numa_node=nx_topology_cpu_node(cpu);
+      CPU_SET(cpu, &placed_cpus);
+      n++;
+    }
+  }
+
+  if (!n) { // nothing usable => run unpinned
+    n=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n>max_threads) n=max_threads;
+    int i;
+    for (i=0; i<n; i++) {
+      placement[i].cpu=-1;
+      placement[i].numa_node=-1;
+    }
+  }
+  return n;
+}
+
+int nx_topology_set_affinity(pthread_attr_t* attr, int cpu) {
+  if (cpu<0 || cpu>=CPU_SETSIZE) return -1;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int nx_topology_set_affinity_near(pthread_attr_t* attr, int cpu) {
+  int node=nx_topology_cpu_node(cpu);
+  if (node<0) return -1;
+  cpu_set_t set, free_set;
+  CPU_AND(&set, &node_cpus[node], &allowed_cpus);
+  CPU_XOR(&free_set, &set, &placed_cpus);
+  CPU_AND(&free_set, &free_set, &set);
+  if (CPU_COUNT(&free_set)) set=free_set;
+  if (!CPU_COUNT(&set)) return -1;
+  return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int nx_topology_bind_memory(int numa_node) {
+  if (numa_node<0 || numa_node>=NX_TOPOLOGY_MAX_NODES || nx_topology_num_nodes()<=1) return 0;
+  unsigned long nodemask[2]={0, 0}; // kernel wants maxnode one bit larger than highest node
+  nodemask[0]=1UL<<numa_node;
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, (unsigned long)(sizeof(nodemask)*8))) {
+    nxweb_log_warning("set_mempolicy(node %d) failed: %d", numa_node, errno);
+    return -1;
+  }
+  return 0;
+}
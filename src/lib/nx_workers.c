@@ -21,12 +21,14 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/eventfd.h>
 
 #include "misc.h"
 #include "nx_alloc.h"
 #include "nx_event.h"
 #include "nx_workers.h"
+#include "nx_topology.h"
 
 __thread nxw_worker* _nxweb_worker_thread_data;
 
@@ -49,8 +51,89 @@ static inline void unlink_worker(nxw_worker* w) {
   w->prev=0;
 }
 
+static void completion_queue_on_message(nxe_subscriber* sub, nxe_publisher* pub, nxe_data data) {
+  nxw_completion_queue* q=OBJ_PTR_FROM_FLD_PTR(nxw_completion_queue, sub, sub);
+  nxw_drain_completions(q);
+}
+
+static const nxe_subscriber_class completion_queue_sub_class={.on_message=completion_queue_on_message};
+
+void nxw_init_completion_queue(nxw_completion_queue* q, nxe_loop* loop) {
+  q->head=0;
+  q->pushers=0;
+  nxe_init_eventfd_source(&q->efs, NXE_PUB_DEFAULT);
+  nxe_register_eventfd_source(loop, &q->efs);
+  nxe_init_subscriber(&q->sub, &completion_queue_sub_class);
+  nxe_subscribe(loop, &q->efs.data_notify, &q->sub);
+}
+
+void nxw_finalize_completion_queue(nxw_completion_queue* q) {
+  nxe_unsubscribe(&q->efs.data_notify, &q->sub);
+  nxe_unregister_eventfd_source(&q->efs);
+  nxe_finalize_eventfd_source(&q->efs);
+}
+
+void nxw_complete(nxw_completion_queue* q, nxw_completion* c) {
+  nxw_completion* head;
+  do {
+    head=q->head;
+    c->next=head;
+  } while (!__sync_bool_compare_and_swap(&q->head, head, c)); // full barrier: job results are visible to consumer
+  if (!head) nxe_trigger_eventfd(&q->efs); // consumer has taken everything before; wake it up
+}
+
+int nxw_try_complete(nxw_completion_queue* q, nxw_completion* c) {
+  nxw_completion* head;
+  __sync_add_and_fetch(&q->pushers, 1); // keeps eventfd alive until trigger below
+  do {
+    head=q->head;
+    if (head==NXW_QUEUE_CLOSED) {
+      __sync_sub_and_fetch(&q->pushers, 1);
+      return -1;
+    }
+    c->next=head;
+  } while (!__sync_bool_compare_and_swap(&q->head, head, c));
+  if (!head) nxe_trigger_eventfd(&q->efs);
+  __sync_sub_and_fetch(&q->pushers, 1);
+  return 0;
+}
+
+static void run_completions(nxw_completion_queue* q, nxw_completion* c) {
+  if (!c) return;
+  q->wakeups++;
+  nxw_completion* list=0;
+  nxw_completion* next;
+  for (; c; c=next) { // restore completion order
+    next=c->next;
+    c->next=list;
+    list=c;
+  }
+  for (c=list; c; c=next) {
+    next=c->next; // on_complete() might free or requeue c
+    q->completions++;
+    c->on_complete(c);
+  }
+}
+
+void nxw_drain_completions(nxw_completion_queue* q) {
+  if (q->head==NXW_QUEUE_CLOSED) return; // only owner closes
+  run_completions(q, __sync_lock_test_and_set(&q->head, 0));
+}
+
+void nxw_close_completion_queue(nxw_completion_queue* q) {
+  nxw_completion* c;
+  do {
+    c=q->head;
+  } while (!__sync_bool_compare_and_swap(&q->head, c, NXW_QUEUE_CLOSED));
+  // producer that got in before close might not have triggered eventfd yet
+  while (__sync_add_and_fetch(&q->pushers, 0)) sched_yield();
+  if (c!=NXW_QUEUE_CLOSED) run_completions(q, c);
+}
+
 void nxw_init_factory(nxw_factory* f, nxe_loop* loop) {
   f->loop=loop;
+  f->near_cpu=-1;
+  nxw_init_completion_queue(&f->complete_queue, loop);
   nx_queue_workers_init(&f->queue);
   pthread_mutex_init(&f->queue_mux, 0);
   int i;
@@ -79,6 +162,8 @@ void nxw_finalize_factory(nxw_factory* f) {
     nxw_destroy_worker(w);
   }
 
+  nxw_drain_completions(&f->complete_queue); // jobs finished while joining
+  nxw_finalize_completion_queue(&f->complete_queue);
   pthread_mutex_destroy(&f->queue_mux);
 }
 
@@ -117,26 +202,28 @@ nxw_worker* nxw_get_worker(nxw_factory* f) {
   return w;
 }
 
-void nxw_start_worker(nxw_worker* w, void (*job_func)(void* job_param), void* job_param, volatile int* job_done) {
+void nxw_start_worker(nxw_worker* w, void (*job_func)(void* job_param), void* job_param, nxw_completion* job_complete) {
   pthread_mutex_lock(&w->start_mux);
   w->do_job=job_func;
   w->job_param=job_param;
-  w->job_done=job_done;
-  *job_done=0;
+  w->job_complete=job_complete;
   pthread_cond_signal(&w->start_cond);
   pthread_mutex_unlock(&w->start_mux);
 }
 
 static nxw_worker* nxw_create_worker(nxw_factory* f) {
-  nxw_worker* w=nx_calloc(sizeof(nxw_worker));
+  nxw_worker* w=nx_calloc_cl(sizeof(nxw_worker)); // shared between net thread and worker thread
   w->factory=f;
   pthread_cond_init(&w->start_cond, 0);
   pthread_mutex_init(&w->start_mux, 0);
-  nxe_init_eventfd_source(&w->complete_efs, NXE_PUB_DEFAULT);
-  nxe_register_eventfd_source(f->loop, &w->complete_efs);
   link_worker(w);
   f->worker_count++;
-  if (pthread_create(&w->tid, 0, nxw_worker_main, w)) {
+  pthread_attr_t tattr;
+  pthread_attr_init(&tattr);
+  if (f->near_cpu>=0) nx_topology_set_affinity_near(&tattr, f->near_cpu);
+  int rc=pthread_create(&w->tid, &tattr, nxw_worker_main, w);
+  pthread_attr_destroy(&tattr);
+  if (rc) {
     nxweb_log_error("can't create worker thread");
     nxw_destroy_worker(w);
     return 0;
@@ -144,9 +231,7 @@ static nxw_worker* nxw_create_worker(nxw_factory* f) {
   return w;
 }
 
-static void nxw_destroy_worker(nxw_worker* w) { // must be called from factory thread (which runs the loop)!!!
-  nxe_unregister_eventfd_source(&w->complete_efs);
-  nxe_finalize_eventfd_source(&w->complete_efs);
+static void nxw_destroy_worker(nxw_worker* w) { // must be called from factory thread!!!
   pthread_cond_destroy(&w->start_cond);
   pthread_mutex_destroy(&w->start_mux);
   unlink_worker(w);
@@ -170,10 +255,7 @@ static void* nxw_worker_main(void* ptr) {
 
     w->do_job(w->job_param);
     w->do_job=0;
-    __sync_synchronize(); // full memory barrier
-    *w->job_done=1;
-    __sync_synchronize(); // full memory barrier
-    nxe_trigger_eventfd(&w->complete_efs);
+    nxw_complete(&w->factory->complete_queue, w->job_complete);
 
     // put itself into queue
     pthread_mutex_lock(&w->factory->queue_mux);
@@ -116,6 +116,10 @@ void nxd_obuffer_init(nxd_obuffer* ob, const void* data_ptr, int data_size) {
   ob->data_out.ready=1;
 }
 
+nxd_obuffer* nxd_obuffer_from_stream(nxe_istream* is) {
+  return is && is->super.cls.is_cls==&obuffer_data_out_class? OBJ_PTR_FROM_FLD_PTR(nxd_obuffer, data_out, is) : 0;
+}
+
 
 static void rbuffer_data_in_do_read(nxe_ostream* os, nxe_istream* is) {
   nxd_rbuffer* rb=(nxd_rbuffer*)((char*)os-offsetof(nxd_rbuffer, data_in));
@@ -249,6 +253,10 @@ void nxd_fbuffer_finalize(nxd_fbuffer* fb) {
   fb->fd=0;
 }
 
+nxd_fbuffer* nxd_fbuffer_from_stream(nxe_istream* is) {
+  return is && is->super.cls.is_cls==&fbuffer_data_out_class? OBJ_PTR_FROM_FLD_PTR(nxd_fbuffer, data_out, is) : 0;
+}
+
 
 static void fwbuffer_data_in_do_read(nxe_ostream* os, nxe_istream* is) {
   nxd_fwbuffer* fwb=OBJ_PTR_FROM_FLD_PTR(nxd_fwbuffer, data_in, os);
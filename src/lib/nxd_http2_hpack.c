@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+/*
+ * HPACK (RFC 7541). Decoded strings are placed into request's nxb;
+ * dynamic table entries are malloc'ed. Huffman strings are decoded
+ * bit by bit walking a tree built at startup; header blocks are small
+ * enough for that to be of no concern.
+ */
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_MAX_INT (1<<28)
+
+typedef struct hpack_static_entry {
+  const char* name;
+  const char* value;
+} hpack_static_entry;
+
+static const hpack_static_entry static_table[HPACK_STATIC_ENTRIES]={
+  {":authority", ""}, // 1
+  {":method", "GET"}, // 2
+  {":method", "POST"}, // 3
+  {":path", "/"}, // 4
+  {":path", "/index.html"}, // 5
+  {":scheme", "http"}, // 6
+  {":scheme", "https"}, // 7
+  {":status", "200"}, // 8
+  {":status", "204"}, // 9
+  {":status", "206"}, // 10
+  {":status", "304"}, // 11
+  {":status", "400"}, // 12
+  {":status", "404"}, // 13
+  {":status", "500"}, // 14
+  {"accept-charset", ""}, // 15
+  {"accept-encoding", "gzip, deflate"}, // 16
+  {"accept-language", ""}, // 17
+  {"accept-ranges", ""}, // 18
+  {"accept", ""}, // 19
+  {"access-control-allow-origin", ""}, // 20
+  {"age", ""}, // 21
+  {"allow", ""}, // 22
+  {"authorization", ""}, // 23
+  {"cache-control", ""}, // 24
+  {"content-disposition", ""}, // 25
+  {"content-encoding", ""}, // 26
+  {"content-language", ""}, // 27
+  {"content-length", ""}, // 28
+  {"content-location", ""}, // 29
+  {"content-range", ""}, // 30
+  {"content-type", ""}, // 31
+  {"cookie", ""}, // 32
+  {"date", ""}, // 33
+  {"etag", ""}, // 34
+  {"expect", ""}, // 35
+  {"expires", ""}, // 36
+  {"from", ""}, // 37
+  {"host", ""}, // 38
+  {"if-match", ""}, // 39
+  {"if-modified-since", ""}, // 40
+  {"if-none-match", ""}, // 41
+  {"if-range", ""}, // 42
+  {"if-unmodified-since", ""}, // 43
+  {"last-modified", ""}, // 44
+  {"link", ""}, // 45
+  {"location", ""}, // 46
+  {"max-forwards", ""}, // 47
+  {"proxy-authenticate", ""}, // 48
+  {"proxy-authorization", ""}, // 49
+  {"range", ""}, // 50
+  {"referer", ""}, // 51
+  {"refresh", ""}, // 52
+  {"retry-after", ""}, // 53
+  {"server", ""}, // 54
+  {"set-cookie", ""}, // 55
+  {"strict-transport-security", ""}, // 56
+  {"transfer-encoding", ""}, // 57
+  {"user-agent", ""}, // 58
+  {"vary", ""}, // 59
+  {"via", ""}, // 60
+  {"www-authenticate", ""}, // 61
+};
+
+static const struct {
+  uint32_t code;
+  uint8_t len;
+} huff_codes[257]={
+  {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+  {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+  {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+  {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+  {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+  {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+  {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+  {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+  {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+  {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+  {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+  {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+  {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+  {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+  {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+  {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+  {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+  {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+  {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+  {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+  {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+  {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+  {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+  {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+  {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+  {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+  {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+  {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+  {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+  {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+  {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+  {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+  {0x3fffffff, 30} // EOS
+};
+
+#define HUFF_TREE_SIZE 513 // 257 leaves + 256 inner nodes
+
+static struct {
+  int16_t child[2]; // 0 = none
+  int16_t sym; // -1 = inner node
+} huff_tree[HUFF_TREE_SIZE];
+
+static uint8_t static_name_len[HPACK_STATIC_ENTRIES];
+static uint8_t static_value_len[HPACK_STATIC_ENTRIES];
+
+static void __attribute__ ((constructor)) hpack_build_tables() {
+  int i, b, num_nodes=1;
+  huff_tree[0].sym=-1;
+  for (i=0; i<257; i++) {
+    int node=0;
+    for (b=huff_codes[i].len-1; b>=0; b--) {
+      int bit=(huff_codes[i].code>>b)&1;
+      if (!huff_tree[node].child[bit]) {
+        huff_tree[num_nodes].sym=-1;
+        huff_tree[node].child[bit]=num_nodes++;
+      }
+      node=huff_tree[node].child[bit];
+    }
+    huff_tree[node].sym=i;
+  }
+  for (i=0; i<HPACK_STATIC_ENTRIES; i++) {
+    static_name_len[i]=strlen(static_table[i].name);
+    static_value_len[i]=strlen(static_table[i].value);
+  }
+}
+
+static int huff_decode(const uint8_t* src, int len, char* dst) {
+  const uint8_t* end=src+len;
+  char* p=dst;
+  int node=0, depth=0, all_ones=1;
+  while (src<end) {
+    uint8_t c=*src++;
+    int b;
+    for (b=7; b>=0; b--) {
+      int bit=(c>>b)&1;
+      node=huff_tree[node].child[bit];
+      if (!node) return -1;
+      depth++;
+      all_ones&=bit;
+      if (huff_tree[node].sym>=0) {
+        if (huff_tree[node].sym==256) return -1; // EOS must not appear
+        *p++=(char)huff_tree[node].sym;
+        node=0;
+        depth=0;
+        all_ones=1;
+      }
+    }
+  }
+  if (depth>7 || !all_ones) return -1; // padding must be short EOS prefix
+  return p-dst;
+}
+
+static int huff_encoded_len(const char* src, int len) {
+  uint64_t bits=0;
+  const uint8_t* s=(const uint8_t*)src;
+  const uint8_t* end=s+len;
+  while (s<end) bits+=huff_codes[*s++].len;
+  return (int)((bits+7)>>3);
+}
+
+static void huff_encode(nxb_buffer* nxb, const char* src, int len) {
+  uint64_t acc=0;
+  int nbits=0;
+  const uint8_t* s=(const uint8_t*)src;
+  const uint8_t* end=s+len;
+  while (s<end) {
+    acc=(acc<<huff_codes[*s].len) | huff_codes[*s].code;
+    nbits+=huff_codes[*s].len;
+    s++;
+    while (nbits>=8) {
+      nbits-=8;
+      nxb_append_char_fast(nxb, (char)(acc>>nbits));
+    }
+  }
+  if (nbits) nxb_append_char_fast(nxb, (char)((acc<<(8-nbits)) | (0xff>>nbits)));
+}
+
+static void encode_int(nxb_buffer* nxb, uint8_t first, int prefix_bits, uint32_t n) {
+  uint32_t max=(1<<prefix_bits)-1;
+  nxb_make_room(nxb, 6);
+  if (n<max) {
+    nxb_append_char_fast(nxb, (char)(first|n));
+    return;
+  }
+  nxb_append_char_fast(nxb, (char)(first|max));
+  n-=max;
+  while (n>=128) {
+    nxb_append_char_fast(nxb, (char)(0x80|(n&0x7f)));
+    n>>=7;
+  }
+  nxb_append_char_fast(nxb, (char)n);
+}
+
+static int decode_int(const uint8_t** pp, const uint8_t* end, int prefix_bits, uint32_t* n) {
+  const uint8_t* p=*pp;
+  if (p>=end) return -1;
+  uint32_t max=(1<<prefix_bits)-1;
+  uint32_t v=*p++ & max;
+  if (v==max) {
+    int shift=0;
+    uint8_t c;
+    do {
+      if (p>=end || shift>21) return -1;
+      c=*p++;
+      v+=(uint32_t)(c&0x7f)<<shift;
+      shift+=7;
+    } while (c&0x80);
+    if (v>=HPACK_MAX_INT) return -1;
+  }
+  *n=v;
+  *pp=p;
+  return 0;
+}
+
+static void encode_str(nxb_buffer* nxb, const char* s, int len) {
+  int hlen=huff_encoded_len(s, len);
+  if (hlen<len) {
+    encode_int(nxb, 0x80, 7, hlen);
+    nxb_make_room(nxb, hlen);
+    huff_encode(nxb, s, len);
+  }
+  else {
+    encode_int(nxb, 0, 7, len);
+    nxb_append(nxb, s, len);
+  }
+}
+
+static char* decode_str(const uint8_t** pp, const uint8_t* end, nxb_buffer* nxb, int* len) {
+  const uint8_t* p=*pp;
+  if (p>=end) return 0;
+  _Bool huff=!!(*p&0x80);
+  uint32_t n;
+  if (decode_int(&p, end, 7, &n) || n>end-p) return 0;
+  char* str;
+  if (huff) {
+    str=nxb_alloc_obj(nxb, n*8/5+1);
+    int dlen=huff_decode(p, n, str);
+    if (dlen<0) return 0;
+    *len=dlen;
+  }
+  else {
+    str=nxb_alloc_obj(nxb, n+1);
+    memcpy(str, p, n);
+    *len=n;
+  }
+  str[*len]='\0';
+  *pp=p+n;
+  return str;
+}
+
+static inline nxd_hpack_entry* dyn_entry(nxd_hpack_table* t, int i) {
+  return &t->entries[(t->first+i)%NXD_HPACK_MAX_ENTRIES];
+}
+
+static void evict_to(nxd_hpack_table* t, int max_size) {
+  while (t->count && t->size>max_size) {
+    nxd_hpack_entry* e=dyn_entry(t, t->count-1);
+    t->size-=e->name_len+e->value_len+HPACK_ENTRY_OVERHEAD;
+    nx_free(e->name);
+    e->name=0;
+    t->count--;
+  }
+}
+
+static void add_entry(nxd_hpack_table* t, const char* name, int name_len, const char* value, int value_len) {
+  int esize=name_len+value_len+HPACK_ENTRY_OVERHEAD;
+  if (esize>t->max_size) {
+    evict_to(t, 0);
+    return;
+  }
+  evict_to(t, t->max_size-esize);
+  if (t->count==NXD_HPACK_MAX_ENTRIES) evict_to(t, t->size-1); // drop oldest; only encoder can get here
+  t->first=(t->first+NXD_HPACK_MAX_ENTRIES-1)%NXD_HPACK_MAX_ENTRIES;
+  t->count++;
+  t->size+=esize;
+  nxd_hpack_entry* e=&t->entries[t->first];
+  e->name=nx_alloc(name_len+value_len+2);
+  memcpy(e->name, name, name_len);
+  e->name[name_len]='\0';
+  e->value=e->name+name_len+1;
+  memcpy(e->value, value, value_len);
+  e->value[value_len]='\0';
+  e->name_len=name_len;
+  e->value_len=value_len;
+}
+
+void nxd_hpack_init(nxd_hpack_table* t, int max_size) {
+  memset(t, 0, sizeof(nxd_hpack_table));
+  t->max_size=max_size;
+  t->max_size_limit=max_size;
+}
+
+void nxd_hpack_finalize(nxd_hpack_table* t) {
+  evict_to(t, 0);
+}
+
+void nxd_hpack_set_max_size_limit(nxd_hpack_table* t, int max_size_limit) {
+  t->max_size_limit=max_size_limit;
+  if (t->max_size!=max_size_limit) {
+    t->max_size=max_size_limit;
+    evict_to(t, max_size_limit);
+    t->size_update_pending=1;
+  }
+}
+
+static int lookup_index(nxd_hpack_table* t, uint32_t idx, const char** name, int* name_len, const char** value, int* value_len) {
+  if (!idx) return -1;
+  if (idx<=HPACK_STATIC_ENTRIES) {
+    idx--;
+    *name=static_table[idx].name;
+    *name_len=static_name_len[idx];
+    if (value) {
+      *value=static_table[idx].value;
+      *value_len=static_value_len[idx];
+    }
+    return 0;
+  }
+  idx-=HPACK_STATIC_ENTRIES+1;
+  if (idx>=t->count) return -1;
+  nxd_hpack_entry* e=dyn_entry(t, idx);
+  *name=e->name;
+  *name_len=e->name_len;
+  if (value) {
+    *value=e->value;
+    *value_len=e->value_len;
+  }
+  return 0;
+}
+
+int nxd_hpack_decode(nxd_hpack_table* t, const char* block, int size, nxb_buffer* nxb, int max_list_size, nxweb_http_header** headers) {
+  const uint8_t* p=(const uint8_t*)block;
+  const uint8_t* end=p+size;
+  nxweb_http_header* last=0;
+  int list_size=0;
+  _Bool header_seen=0;
+  *headers=0;
+  while (p<end) {
+    uint8_t c=*p;
+    uint32_t n;
+    const char *name, *value;
+    int name_len, value_len;
+    if ((c&0xe0)==0x20) { // dynamic table size update
+      if (header_seen || decode_int(&p, end, 5, &n) || n>t->max_size_limit) return -1;
+      t->max_size=n;
+      evict_to(t, n);
+      continue;
+    }
+    header_seen=1;
+    if (c&0x80) { // indexed
+      if (decode_int(&p, end, 7, &n) || lookup_index(t, n, &name, &name_len, &value, &value_len)) return -1;
+    }
+    else {
+      _Bool incremental=(c&0xc0)==0x40;
+      if (decode_int(&p, end, incremental? 6 : 4, &n)) return -1;
+      if (n) {
+        if (lookup_index(t, n, &name, &name_len, 0, 0)) return -1;
+        if (n>HPACK_STATIC_ENTRIES) name=nxb_copy_obj(nxb, name, name_len+1); // add_entry() might evict it
+      }
+      else {
+        if (!(name=decode_str(&p, end, nxb, &name_len))) return -1;
+      }
+      if (!(value=decode_str(&p, end, nxb, &value_len))) return -1;
+      if (incremental) add_entry(t, name, name_len, value, value_len);
+    }
+    list_size+=name_len+value_len+HPACK_ENTRY_OVERHEAD;
+    if (list_size>max_list_size) return -1;
+    nxweb_http_header* h=nxb_calloc_obj(nxb, sizeof(nxweb_http_header));
+    // dynamic table entries may be evicted before request is done with them
+    if ((c&0x80) && n>HPACK_STATIC_ENTRIES) {
+      h->name=nxb_copy_obj(nxb, name, name_len+1);
+      h->value=nxb_copy_obj(nxb, value, value_len+1);
+    }
+    else {
+      h->name=name;
+      h->value=value;
+    }
+    if (last) last->next=h;
+    else *headers=h;
+    last=h;
+  }
+  return 0;
+}
+
+static int find_static(const char* name, int name_len, const char* value, int value_len, _Bool* value_match) {
+  int i, name_idx=0;
+  for (i=0; i<HPACK_STATIC_ENTRIES; i++) {
+    if (static_name_len[i]==name_len && !memcmp(static_table[i].name, name, name_len)) {
+      if (static_value_len[i]==value_len && !memcmp(static_table[i].value, value, value_len)) {
+        *value_match=1;
+        return i+1;
+      }
+      if (!name_idx) name_idx=i+1;
+    }
+  }
+  *value_match=0;
+  return name_idx;
+}
+
+void nxd_hpack_encode_start(nxd_hpack_table* t, nxb_buffer* nxb) {
+  if (t->size_update_pending) {
+    encode_int(nxb, 0x20, 5, t->max_size);
+    t->size_update_pending=0;
+  }
+}
+
+void nxd_hpack_encode_header(nxd_hpack_table* t, nxb_buffer* nxb, const char* name, int name_len, const char* value, int value_len, _Bool add_to_table) {
+  _Bool value_match;
+  int idx=find_static(name, name_len, value, value_len, &value_match);
+  if (value_match) {
+    encode_int(nxb, 0x80, 7, idx);
+    return;
+  }
+  int i;
+  for (i=0; i<t->count; i++) {
+    nxd_hpack_entry* e=dyn_entry(t, i);
+    if (e->name_len==name_len && !memcmp(e->name, name, name_len)) {
+      if (e->value_len==value_len && !memcmp(e->value, value, value_len)) {
+        encode_int(nxb, 0x80, 7, HPACK_STATIC_ENTRIES+1+i);
+        return;
+      }
+      if (!idx) idx=HPACK_STATIC_ENTRIES+1+i;
+    }
+  }
+  if (add_to_table) encode_int(nxb, 0x40, 6, idx);
+  else encode_int(nxb, 0, 4, idx);
+  if (!idx) encode_str(nxb, name, name_len);
+  encode_str(nxb, value, value_len);
+  if (add_to_table) add_entry(t, name, name_len, value, value_len);
+}
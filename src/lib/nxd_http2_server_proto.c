@@ -0,0 +1,1104 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+void _nxweb_call_request_finalizers(nxd_http_server_proto* hsp);
+
+/*
+ * HTTP/2 (RFC 7540) server side. Connection starts as HTTP/1 one; when its
+ * first bytes are HTTP/2 preface (h2 chosen by ALPN, or prior knowledge on
+ * plain listener) socket streams are handed over to nxd_http2_server_proto.
+ * Each HTTP/2 stream then gets lightweight server connection of its own with
+ * http2 stream hsp class, so handlers, filters, workers and request body
+ * consumers see ordinary request/response pair.
+ *
+ * Response bodies are pulled into output buffer as DATA frames by scheduler:
+ * streams take turns in deficit round robin proportional to their weight;
+ * stream depending on another stream that can send right now waits for it.
+ */
+
+enum {
+  FRAME_DATA=0,
+  FRAME_HEADERS,
+  FRAME_PRIORITY,
+  FRAME_RST_STREAM,
+  FRAME_SETTINGS,
+  FRAME_PUSH_PROMISE,
+  FRAME_PING,
+  FRAME_GOAWAY,
+  FRAME_WINDOW_UPDATE,
+  FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum {
+  H2_NO_ERROR=0,
+  H2_PROTOCOL_ERROR,
+  H2_INTERNAL_ERROR,
+  H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT,
+  H2_STREAM_CLOSED,
+  H2_FRAME_SIZE_ERROR,
+  H2_REFUSED_STREAM,
+  H2_CANCEL,
+  H2_COMPRESSION_ERROR,
+  H2_CONNECT_ERROR,
+  H2_ENHANCE_YOUR_CALM
+};
+
+enum {
+  SETTINGS_HEADER_TABLE_SIZE=1,
+  SETTINGS_ENABLE_PUSH,
+  SETTINGS_MAX_CONCURRENT_STREAMS,
+  SETTINGS_INITIAL_WINDOW_SIZE,
+  SETTINGS_MAX_FRAME_SIZE,
+  SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+#define FRAME_HEADER_SIZE 9
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_SIZE 24
+#define IBUF_SIZE (FRAME_HEADER_SIZE+NXWEB_HTTP2_MAX_FRAME_SIZE)
+#define DEFAULT_WINDOW 65535
+#define DEFAULT_FRAME_SIZE 16384
+#define DEFAULT_HEADER_TABLE_SIZE 4096
+#define MAX_WINDOW 0x7fffffff
+#define DEFAULT_WEIGHT 16
+
+static int sessions_open;
+static int streams_open;
+static uint64_t sessions_total;
+static uint64_t streams_total;
+static uint64_t streams_refused;
+static uint64_t streams_reset; // by either side
+static uint64_t connection_errors;
+
+static inline uint32_t get_u32(const char* p) {
+  const uint8_t* u=(const uint8_t*)p;
+  return (uint32_t)u[0]<<24 | (uint32_t)u[1]<<16 | (uint32_t)u[2]<<8 | u[3];
+}
+
+static inline void put_u32(char* p, uint32_t v) {
+  p[0]=(char)(v>>24);
+  p[1]=(char)(v>>16);
+  p[2]=(char)(v>>8);
+  p[3]=(char)v;
+}
+
+static inline void put_frame_header(char* p, int len, uint8_t type, uint8_t flags, uint32_t stream_id) {
+  p[0]=(char)(len>>16);
+  p[1]=(char)(len>>8);
+  p[2]=(char)len;
+  p[3]=(char)type;
+  p[4]=(char)flags;
+  put_u32(p+5, stream_id);
+}
+
+static char* obuf_reserve(nxd_http2_server_proto* h2, int size) {
+  int end=h2->obuf_start+h2->obuf_len;
+  if (end+size>h2->obuf_size) {
+    if (h2->obuf_start) {
+      memmove(h2->obuf, h2->obuf+h2->obuf_start, h2->obuf_len);
+      h2->obuf_start=0;
+      end=h2->obuf_len;
+    }
+    if (end+size>h2->obuf_size) {
+      int new_size=h2->obuf_size*2;
+      while (new_size<end+size) new_size*=2;
+      char* p=nx_alloc(new_size);
+      memcpy(p, h2->obuf, end);
+      nx_free(h2->obuf);
+      h2->obuf=p;
+      h2->obuf_size=new_size;
+    }
+  }
+  return h2->obuf+end;
+}
+
+static void wake_output(nxd_http2_server_proto* h2) {
+  if (h2->data_out.pair) nxe_istream_set_ready(h2->data_out.super.loop, &h2->data_out);
+}
+
+static void queue_frame(nxd_http2_server_proto* h2, uint8_t type, uint8_t flags, uint32_t stream_id, const void* payload, int len) {
+  char* p=obuf_reserve(h2, FRAME_HEADER_SIZE+len);
+  put_frame_header(p, len, type, flags, stream_id);
+  if (len) memcpy(p+FRAME_HEADER_SIZE, payload, len);
+  h2->obuf_len+=FRAME_HEADER_SIZE+len;
+  wake_output(h2);
+}
+
+static void queue_rst_stream(nxd_http2_server_proto* h2, uint32_t stream_id, uint32_t code) {
+  char payload[4];
+  put_u32(payload, code);
+  queue_frame(h2, FRAME_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+static void queue_window_update(nxd_http2_server_proto* h2, uint32_t stream_id, uint32_t increment) {
+  char payload[4];
+  put_u32(payload, increment);
+  queue_frame(h2, FRAME_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+static void queue_goaway(nxd_http2_server_proto* h2, uint32_t code) {
+  char payload[8];
+  put_u32(payload, h2->last_stream_id);
+  put_u32(payload+4, code);
+  queue_frame(h2, FRAME_GOAWAY, 0, 0, payload, 8);
+  h2->goaway_sent=1;
+}
+
+static void flush_output(nxd_http2_server_proto* h2) {
+  nxe_ostream* os=h2->data_out.pair;
+  while (h2->obuf_len && os && os->ready) {
+    // write that got nothing through must be repeated with the same size (gnutls buffers it)
+    int size=h2->obuf_retry_size? h2->obuf_retry_size : h2->obuf_len;
+    nxe_flags_t flags=0;
+    nxe_ssize_t bytes_sent=OSTREAM_CLASS(os)->write(os, &h2->data_out, 0, 0, (nxe_data)(const char*)(h2->obuf+h2->obuf_start), size, &flags);
+    if (bytes_sent<=0) {
+      h2->obuf_retry_size=size;
+      break;
+    }
+    h2->obuf_retry_size=0;
+    h2->obuf_start+=bytes_sent;
+    h2->obuf_len-=bytes_sent;
+  }
+  if (!h2->obuf_len) h2->obuf_start=0;
+}
+
+static int connection_error(nxd_http2_server_proto* h2, uint32_t code) {
+  nxweb_log_info("http2 connection %p error %u", h2, code);
+  __sync_add_and_fetch(&connection_errors, 1);
+  if (!h2->goaway_sent) queue_goaway(h2, code);
+  flush_output(h2);
+  h2->input_paused=1;
+  nxe_ostream_unset_ready(&h2->data_in);
+  nxe_publish(h2->events_pub, (nxe_data)NXD_HSP_HTTP2_PROTOCOL_ERROR);
+  return -1;
+}
+
+static nxd_http2_stream* find_stream(nxd_http2_server_proto* h2, uint32_t id) {
+  nxd_http2_stream* st;
+  for (st=h2->first_stream; st; st=st->next) {
+    if (st->id==id) return st;
+  }
+  return 0;
+}
+
+static void link_stream_last(nxd_http2_server_proto* h2, nxd_http2_stream* st) {
+  st->next=0;
+  st->prev=h2->last_stream;
+  if (h2->last_stream) h2->last_stream->next=st;
+  else h2->first_stream=st;
+  h2->last_stream=st;
+}
+
+static void unlink_stream(nxd_http2_server_proto* h2, nxd_http2_stream* st) {
+  if (st->prev) st->prev->next=st->next;
+  else h2->first_stream=st->next;
+  if (st->next) st->next->prev=st->prev;
+  else h2->last_stream=st->prev;
+  st->prev=st->next=0;
+}
+
+static void stream_reset(nxd_http2_stream* st, uint32_t code, _Bool send_rst) {
+  if (st->reset) return;
+  if (send_rst) queue_rst_stream(st->h2, st->id, code);
+  st->reset=1;
+  __sync_add_and_fetch(&streams_reset, 1);
+  nxe_publish(&st->hsp->events_pub, (nxe_data)NXD_HSP_HTTP2_STREAM_RESET);
+}
+
+static void stream_request_complete(nxd_http_server_proto* hsp) {
+  if (hsp->resp_body_in.pair) nxe_disconnect_streams(hsp->resp_body_in.pair, &hsp->resp_body_in);
+  if (hsp->req_body_out.pair) nxe_disconnect_streams(&hsp->req_body_out, hsp->req_body_out.pair);
+  nxe_publish(&hsp->events_pub, (nxe_data)NXD_HSP_REQUEST_COMPLETE);
+}
+
+// response scheduler
+
+static _Bool stream_can_send(nxd_http2_server_proto* h2, nxd_http2_stream* st) {
+  if (!st->response_started || st->end_stream_sent || st->reset || st->hsp->state!=HSP_SENDING_BODY) return 0;
+  nxe_istream* is=st->hsp->resp_body_in.pair;
+  return is && is->ready && st->send_window>0 && h2->send_window>0;
+}
+
+static _Bool stream_must_wait(nxd_http2_server_proto* h2, nxd_http2_stream* st) {
+  if (!st->depends_on || st->depends_on>=st->id) return 0; // only earlier streams count; keeps out of cycles
+  nxd_http2_stream* parent=find_stream(h2, st->depends_on);
+  return parent && stream_can_send(h2, parent);
+}
+
+static _Bool schedule(nxd_http2_server_proto* h2) {
+  nxe_loop* loop=h2->data_out.super.loop;
+  _Bool progress=0;
+  nxd_http2_stream* st=h2->first_stream;
+  nxd_http2_stream* last=h2->last_stream; // one round
+  nxd_http2_stream* next;
+  h2->scheduling=1;
+  while (st && h2->obuf_len<NXWEB_HTTP2_OUTPUT_BUFFER_SIZE && h2->send_window>0) {
+    next=st==last? 0 : st->next;
+    if (stream_can_send(h2, st) && !stream_must_wait(h2, st)) {
+      nxd_http_server_proto* hsp=st->hsp;
+      int quantum=st->weight*NXWEB_HTTP2_PRIORITY_QUANTUM;
+      st->deficit+=quantum;
+      if (st->deficit>quantum) st->deficit=quantum; // no credit saved up while blocked
+      while (st->deficit>0 && h2->obuf_len<NXWEB_HTTP2_OUTPUT_BUFFER_SIZE && stream_can_send(h2, st)) {
+        nxe_istream* is=hsp->resp_body_in.pair;
+        st->progress=0;
+        hsp->resp_body_in.ready=1;
+        ISTREAM_CLASS(is)->do_write(is, &hsp->resp_body_in);
+        if (!st->progress) break;
+        progress=1;
+      }
+      if (!st->end_stream_sent && !st->reset) {
+        nxe_istream* is=hsp->resp_body_in.pair;
+        if (is && !is->ready) {
+          st->deficit=0;
+          nxe_ostream_set_ready(loop, &hsp->resp_body_in); // get notified when content is ready again
+        }
+        else {
+          nxe_ostream_unset_ready(&hsp->resp_body_in);
+          if (st->deficit<=0 && st!=h2->last_stream) { // quantum used up => to the end of round
+            unlink_stream(h2, st);
+            link_stream_last(h2, st);
+          }
+        }
+      }
+    }
+    st=next;
+  }
+  h2->scheduling=0;
+  return progress;
+}
+
+// stream hsp class
+
+static void stream_send_headers(nxd_http2_stream* st, nxweb_http_response* resp, _Bool end_stream) {
+  nxd_http2_server_proto* h2=st->h2;
+  nxb_buffer* nxb=resp->nxb;
+  const char* p=resp->raw_headers;
+  const char* status=strchr(p, ' ');
+  nxb_start_stream(nxb);
+  nxd_hpack_encode_start(&h2->encoder, nxb);
+  nxd_hpack_encode_header(&h2->encoder, nxb, ":status", 7, status? status+1 : "500", 3, 1);
+  p=strchr(p, '\n');
+  while (p && *++p && *p!='\r' && *p!='\n') {
+    const char* eol=strchr(p, '\n');
+    if (!eol) break;
+    const char* colon=memchr(p, ':', eol-p);
+    char name[64];
+    int name_len=colon? colon-p : 0;
+    if (name_len>0 && name_len<(int)sizeof(name)) {
+      int i;
+      for (i=0; i<name_len; i++) name[i]=(p[i]>='A' && p[i]<='Z')? p[i]+('a'-'A') : p[i];
+      name[name_len]='\0';
+      const char* value=colon+1;
+      while (*value==' ' || *value=='\t') value++;
+      const char* value_end=eol;
+      while (value_end>value && (unsigned char)value_end[-1]<=' ') value_end--;
+      if (strcmp(name, "connection") && strcmp(name, "keep-alive") && strcmp(name, "transfer-encoding")
+          && strcmp(name, "upgrade") && strcmp(name, "proxy-connection")) {
+        // values unique to response are not worth table space
+        _Bool index=strcmp(name, "date") && strcmp(name, "content-length") && strcmp(name, "etag")
+                && strcmp(name, "last-modified") && strcmp(name, "expires") && strcmp(name, "set-cookie")
+                && strcmp(name, "content-range") && strcmp(name, "location");
+        nxd_hpack_encode_header(&h2->encoder, nxb, name, name_len, value, value_end-value, index);
+      }
+    }
+    p=eol;
+  }
+  int size;
+  const char* block=nxb_finish_stream(nxb, &size);
+  uint8_t type=FRAME_HEADERS;
+  uint8_t flags=end_stream? FLAG_END_STREAM : 0;
+  do {
+    int len=size>h2->peer_max_frame_size? h2->peer_max_frame_size : size;
+    queue_frame(h2, type, flags|(len==size? FLAG_END_HEADERS : 0), st->id, block, len);
+    block+=len;
+    size-=len;
+    type=FRAME_CONTINUATION;
+    flags=0;
+  } while (size>0);
+}
+
+static void stream_start_sending_response(nxd_http_server_proto* hsp, nxweb_http_response* resp) {
+  if (hsp->state!=HSP_RECEIVING_HEADERS && hsp->state!=HSP_RECEIVING_BODY && hsp->state!=HSP_HANDLING) {
+    nxweb_log_error("illegal state for start_sending_response()");
+    return;
+  }
+
+  nxweb_log_debug("http2 stream_start_sending_response");
+
+  nxd_http2_stream* st=hsp->h2s;
+  nxweb_http_request* req=&hsp->req;
+  hsp->resp=resp;
+  nxe_loop* loop=hsp->events_pub.super.loop;
+  if (!resp->nxb) resp->nxb=hsp->nxb;
+
+  if (req->if_modified_since && resp->last_modified
+      && resp->last_modified<=req->if_modified_since
+      && resp->status_code!=304) {
+    nxweb_log_info("responding with 304 Not Modified for %s", req->uri);
+    nxweb_reset_content_out(hsp, resp);
+    resp->status_code=304;
+    resp->status="Not Modified";
+  }
+
+  nxd_http_server_proto_setup_content_out(hsp, resp);
+
+  nxd_http_server_proto_apply_range(hsp, req, resp);
+
+  if (resp->content_out) {
+    nxe_connect_streams(loop, resp->content_out, &hsp->resp_body_in);
+  }
+  else if (resp->content_length) {
+    nxweb_log_error("http2 stream_start_sending_response(): no content_out stream");
+  }
+
+  if (!resp->raw_headers) _nxweb_prepare_response_headers(loop, resp); // HTTP/1 headers get converted
+
+  hsp->state=HSP_SENDING_HEADERS;
+  if (st->reset) return; // connection is being finalized
+  _Bool no_body=!resp->content_out || !resp->content_length || req->head_method;
+  stream_send_headers(st, resp, no_body);
+  st->response_started=1;
+  if (no_body) {
+    st->end_stream_sent=1;
+    stream_request_complete(hsp);
+    return;
+  }
+  hsp->state=HSP_SENDING_BODY;
+}
+
+static nxe_ssize_t resp_body_in_write(nxe_ostream* os, nxe_istream* is, int fd, nx_file_reader* fr, nxe_data ptr, nxe_size_t size, nxe_flags_t* flags) {
+  nxd_http_server_proto* hsp=OBJ_PTR_FROM_FLD_PTR(nxd_http_server_proto, resp_body_in, os);
+  nxd_http2_stream* st=hsp->h2s;
+
+  nxweb_log_debug("http2 resp_body_in_write");
+
+  if (!st || st->reset || hsp->state!=HSP_SENDING_BODY) {
+    nxe_ostream_unset_ready(os);
+    return 0;
+  }
+  nxd_http2_server_proto* h2=st->h2;
+  if (!h2->scheduling) { // content became ready; let scheduler pull it
+    nxe_ostream_unset_ready(os);
+    wake_output(h2);
+    return 0;
+  }
+  nxe_flags_t wflags=*flags;
+  nxe_size_t limit=h2->peer_max_frame_size;
+  if (limit>st->send_window) limit=st->send_window;
+  if (limit>h2->send_window) limit=h2->send_window;
+  if (limit>st->deficit) limit=st->deficit;
+  if (size>limit) {
+    size=limit;
+    wflags&=~NXEF_EOF;
+  }
+  if (size) nx_file_reader_to_mem_ptr(fd, fr, &ptr, &size, &wflags);
+  _Bool eof=!!(wflags&NXEF_EOF);
+  if (!size && !eof) {
+    nxe_ostream_unset_ready(os);
+    return 0;
+  }
+  char* p=obuf_reserve(h2, FRAME_HEADER_SIZE+size);
+  put_frame_header(p, size, FRAME_DATA, eof? FLAG_END_STREAM : 0, st->id);
+  if (size) memcpy(p+FRAME_HEADER_SIZE, ptr.cptr, size);
+  h2->obuf_len+=FRAME_HEADER_SIZE+size;
+  st->send_window-=size;
+  h2->send_window-=size;
+  st->deficit-=size;
+  st->progress=1;
+  hsp->resp->bytes_sent+=size;
+  if (eof) {
+    st->end_stream_sent=1;
+    stream_request_complete(hsp);
+  }
+  return size;
+}
+
+static void stream_consumed(nxd_http2_stream* st, int size) {
+  st->recv_consumed+=size;
+  if (st->recv_consumed>=NXWEB_HTTP2_STREAM_WINDOW/2 && !st->end_stream_received && !st->reset) {
+    queue_window_update(st->h2, st->id, st->recv_consumed);
+    st->recv_window+=st->recv_consumed;
+    st->recv_consumed=0;
+  }
+}
+
+static nxe_size_t req_body_out_read(nxe_istream* is, nxe_ostream* os, void* ptr, nxe_size_t size, nxe_flags_t* flags) {
+  nxd_http_server_proto* hsp=OBJ_PTR_FROM_FLD_PTR(nxd_http_server_proto, req_body_out, is);
+  nxd_http2_stream* st=hsp->h2s;
+
+  nxweb_log_debug("http2 req_body_out_read");
+
+  if (hsp->state!=HSP_RECEIVING_BODY || !st) {
+    nxe_istream_unset_ready(is);
+    return 0;
+  }
+  nxe_size_t avail=st->body_end-st->body_start;
+  if (size>avail) size=avail;
+  if (size) {
+    memcpy(ptr, st->body_buf+st->body_start, size);
+    st->body_start+=size;
+    if (st->body_start==st->body_end) st->body_start=st->body_end=0;
+    hsp->req.content_received+=size;
+    stream_consumed(st, size);
+  }
+  if (st->body_start==st->body_end) {
+    nxe_istream_unset_ready(is);
+    if (st->end_stream_received) {
+      hsp->state=HSP_HANDLING;
+      *flags|=NXEF_EOF;
+      nxe_publish(&hsp->events_pub, (nxe_data)NXD_HSP_REQUEST_BODY_RECEIVED);
+    }
+  }
+  return size;
+}
+
+static void stream_detach(nxd_http2_stream* st) {
+  nxd_http2_server_proto* h2=st->h2;
+  if (!h2->finalizing && !st->reset) {
+    if (!st->end_stream_sent) queue_rst_stream(h2, st->id, H2_INTERNAL_ERROR); // response aborted
+    else if (!st->end_stream_received) queue_rst_stream(h2, st->id, H2_NO_ERROR); // rest of request body not needed
+  }
+  unlink_stream(h2, st);
+  h2->num_streams--;
+  __sync_sub_and_fetch(&streams_open, 1);
+  if (st->body_buf) nx_free(st->body_buf);
+  nx_free(st);
+  if (!h2->finalizing && !h2->num_streams) nxe_set_timer(h2->data_in.super.loop, NXWEB_TIMER_KEEP_ALIVE, &h2->timer_keep_alive);
+}
+
+static void stream_request_cleanup(nxe_loop* loop, nxd_http_server_proto* hsp) {
+
+  nxweb_log_debug("http2 stream_request_cleanup");
+
+  // stream connection gets finalized right after this
+  _nxweb_call_request_finalizers(hsp);
+  nxd_fbuffer_finalize(&hsp->fb);
+  if (hsp->resp && hsp->resp->sendfile_fd) {
+    nxweb_fd_cache_close(hsp->resp->sendfile_fd);
+    hsp->resp->sendfile_fd=0;
+  }
+  nxb_empty(hsp->nxb);
+  nxp_free(hsp->nxb_pool, hsp->nxb);
+  hsp->nxb=0;
+}
+
+static void stream_finalize(nxd_http_server_proto* hsp) {
+  _nxweb_call_request_finalizers(hsp);
+  while (hsp->events_pub.sub) nxe_unsubscribe(&hsp->events_pub, hsp->events_pub.sub);
+  if (hsp->resp_body_in.pair) nxe_disconnect_streams(hsp->resp_body_in.pair, &hsp->resp_body_in);
+  if (hsp->req_body_out.pair) nxe_disconnect_streams(&hsp->req_body_out, hsp->req_body_out.pair);
+  nxd_fbuffer_finalize(&hsp->fb);
+  if (hsp->resp && hsp->resp->sendfile_fd) nxweb_fd_cache_close(hsp->resp->sendfile_fd);
+  if (hsp->nxb) {
+    nxb_empty(hsp->nxb);
+    nxp_free(hsp->nxb_pool, hsp->nxb);
+    hsp->nxb=0;
+  }
+  if (hsp->h2s) stream_detach(hsp->h2s);
+  hsp->h2s=0;
+}
+
+static void stream_connect_request_body_out(nxd_http_server_proto* hsp, nxe_ostream* os) {
+  nxe_connect_streams(hsp->events_pub.super.loop, &hsp->req_body_out, os);
+}
+
+static nxe_ostream* stream_get_request_body_out_pair(nxd_http_server_proto* hsp) {
+  return hsp->req_body_out.pair;
+}
+
+static void stream_start_receiving_request_body(nxd_http_server_proto* hsp) {
+  nxe_istream_set_ready(hsp->events_pub.super.loop, &hsp->req_body_out);
+}
+
+static const nxe_istream_class req_body_out_class={.read=req_body_out_read};
+static const nxe_ostream_class resp_body_in_class={.write=resp_body_in_write};
+
+static const nxd_http_server_proto_class http2_stream_class={
+  .finalize=stream_finalize,
+  .start_sending_response=stream_start_sending_response,
+  .start_receiving_request_body=stream_start_receiving_request_body,
+  .connect_request_body_out=stream_connect_request_body_out,
+  .get_request_body_out_pair=stream_get_request_body_out_pair,
+  .request_cleanup=stream_request_cleanup
+};
+
+void nxd_http2_stream_proto_init(nxd_http_server_proto* hsp, nxp_pool* nxb_pool, nxd_http2_stream* st) {
+  memset(hsp, 0, sizeof(nxd_http_server_proto));
+  hsp->cls=&http2_stream_class;
+  hsp->nxb_pool=nxb_pool;
+  hsp->events_pub.super.cls.pub_cls=NXE_PUB_DEFAULT;
+  hsp->req_body_out.super.cls.is_cls=&req_body_out_class;
+  hsp->req_body_out.evt.cls=NXE_EV_STREAM;
+  hsp->resp_body_in.super.cls.os_cls=&resp_body_in_class;
+  hsp->resp_body_in.ready=1;
+  hsp->state=HSP_WAITING_FOR_REQUEST;
+  hsp->h2s=st;
+  st->hsp=hsp;
+}
+
+// requests
+
+// Builds HTTP/1 style request head out of decoded header list so that
+// _nxweb_parse_http_request() fills nxweb_http_request as usual.
+static char* build_request_head(nxb_buffer* nxb, nxweb_http_header* headers, int* size) {
+  const char* method=0;
+  const char* scheme=0;
+  const char* path=0;
+  const char* authority=0;
+  const char* p;
+  _Bool regular_seen=0;
+  _Bool cookie_seen=0;
+  nxweb_http_header* h;
+  for (h=headers; h; h=h->next) {
+    for (p=h->value; *p; p++) {
+      if (*p=='\r' || *p=='\n') return 0;
+    }
+    if (*h->name==':') {
+      if (regular_seen) return 0;
+      const char** pseudo;
+      if (!strcmp(h->name, ":method")) pseudo=&method;
+      else if (!strcmp(h->name, ":scheme")) pseudo=&scheme;
+      else if (!strcmp(h->name, ":path")) pseudo=&path;
+      else if (!strcmp(h->name, ":authority")) pseudo=&authority;
+      else return 0;
+      if (*pseudo) return 0;
+      *pseudo=h->value;
+      continue;
+    }
+    regular_seen=1;
+    for (p=h->name; *p; p++) {
+      if ((*p>='A' && *p<='Z') || (unsigned char)*p<=' ' || *p==':') return 0; // must be lowercase token
+    }
+    if (!strcmp(h->name, "connection") || !strcmp(h->name, "keep-alive") || !strcmp(h->name, "proxy-connection")
+        || !strcmp(h->name, "transfer-encoding") || !strcmp(h->name, "upgrade")
+        || (!strcmp(h->name, "te") && strcmp(h->value, "trailers"))) return 0;
+  }
+  if (!method || !scheme || !path || *path!='/') return 0;
+  for (p=method; *p; p++) if ((unsigned char)*p<=' ') return 0;
+  for (p=path; *p; p++) if ((unsigned char)*p<=' ') return 0;
+
+  nxb_start_stream(nxb);
+  nxb_append_str(nxb, method);
+  nxb_append_char(nxb, ' ');
+  nxb_append_str(nxb, path);
+  nxb_append_str(nxb, " HTTP/2.0\n");
+  if (authority) {
+    nxb_append_str(nxb, "host: ");
+    nxb_append_str(nxb, authority);
+    nxb_append_char(nxb, '\n');
+  }
+  for (h=headers; h; h=h->next) {
+    if (*h->name==':') continue;
+    if (!strcmp(h->name, "cookie")) {
+      cookie_seen=1;
+      continue;
+    }
+    if (authority && !strcmp(h->name, "host")) continue;
+    nxb_append_str(nxb, h->name);
+    nxb_append(nxb, ": ", 2);
+    nxb_append_str(nxb, h->value);
+    nxb_append_char(nxb, '\n');
+  }
+  if (cookie_seen) { // cookie crumbs are sent as separate fields
+    _Bool first=1;
+    nxb_append_str(nxb, "cookie: ");
+    for (h=headers; h; h=h->next) {
+      if (strcmp(h->name, "cookie")) continue;
+      if (!first) nxb_append(nxb, "; ", 2);
+      nxb_append_str(nxb, h->value);
+      first=0;
+    }
+    nxb_append_char(nxb, '\n');
+  }
+  nxb_append_char(nxb, '\0'); // _nxweb_parse_http_request() terminates headers here
+  char* head=nxb_finish_stream(nxb, size);
+  (*size)--;
+  return head;
+}
+
+static void free_nxb(nxd_http2_server_proto* h2, nxb_buffer* nxb) {
+  nxb_empty(nxb);
+  nxp_free(h2->nxb_pool, nxb);
+}
+
+static int headers_complete(nxd_http2_server_proto* h2) {
+  nxe_loop* loop=h2->data_in.super.loop;
+  uint32_t id=h2->hblock_stream_id;
+  uint8_t flags=h2->hblock_flags;
+  int block_len=h2->hblock_len;
+  h2->hblock_stream_id=0;
+  h2->hblock_len=0;
+
+  nxb_buffer* nxb=nxp_alloc(h2->nxb_pool);
+  nxb_init(nxb, NXWEB_CONN_NXB_SIZE);
+  nxweb_http_header* headers;
+  if (nxd_hpack_decode(&h2->decoder, h2->hblock, block_len, nxb, NXWEB_HTTP2_MAX_HEADER_LIST_SIZE, &headers)) {
+    free_nxb(h2, nxb);
+    return connection_error(h2, H2_COMPRESSION_ERROR);
+  }
+
+  nxd_http2_stream* st=find_stream(h2, id);
+  if (st) { // trailers
+    free_nxb(h2, nxb);
+    if (!(flags&FLAG_END_STREAM) || st->end_stream_received) {
+      stream_reset(st, H2_PROTOCOL_ERROR, 1);
+      return 0;
+    }
+    st->end_stream_received=1;
+    if (st->hsp->state==HSP_RECEIVING_BODY) nxe_istream_set_ready(loop, &st->hsp->req_body_out);
+    return 0;
+  }
+  if (id<=h2->last_stream_id || !(id&1)) {
+    free_nxb(h2, nxb);
+    return connection_error(h2, id&1? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+  }
+  h2->last_stream_id=id;
+
+  if (h2->goaway_sent || h2->num_streams>=NXWEB_HTTP2_MAX_STREAMS) {
+    free_nxb(h2, nxb);
+    queue_rst_stream(h2, id, H2_REFUSED_STREAM);
+    __sync_add_and_fetch(&streams_refused, 1);
+    return 0;
+  }
+  int head_size;
+  char* head=build_request_head(nxb, headers, &head_size);
+  if (!head) { // malformed
+    free_nxb(h2, nxb);
+    queue_rst_stream(h2, id, H2_PROTOCOL_ERROR);
+    return 0;
+  }
+
+  st=nx_calloc(sizeof(nxd_http2_stream));
+  st->h2=h2;
+  st->id=id;
+  st->depends_on=h2->hblock_depends_on==id? 0 : h2->hblock_depends_on;
+  st->weight=h2->hblock_weight;
+  st->send_window=h2->peer_initial_window;
+  st->recv_window=NXWEB_HTTP2_STREAM_WINDOW;
+  st->end_stream_received=!!(flags&FLAG_END_STREAM);
+  nxd_http_server_proto* hsp=_nxweb_http2_stream_start(h2->conn, st);
+  if (!hsp) {
+    nx_free(st);
+    free_nxb(h2, nxb);
+    queue_rst_stream(h2, id, H2_REFUSED_STREAM);
+    return 0;
+  }
+  link_stream_last(h2, st);
+  if (!h2->num_streams++) nxe_unset_timer(loop, NXWEB_TIMER_KEEP_ALIVE, &h2->timer_keep_alive);
+  __sync_add_and_fetch(&streams_open, 1);
+  __sync_add_and_fetch(&streams_total, 1);
+
+  nxweb_http_request* req=&hsp->req;
+  hsp->nxb=nxb;
+  hsp->state=HSP_RECEIVING_HEADERS;
+  hsp->headers_bytes_received=block_len;
+  req->nxb=nxb;
+  req->uid=nxweb_generate_unique_id();
+  if (_nxweb_parse_http_request(req, head, head+head_size)) {
+    nxweb_http_response* resp=_nxweb_http_response_init(&hsp->_resp, hsp->nxb, 0);
+    nxweb_send_http_error(resp, 400, "Bad Request");
+    hsp->cls->start_sending_response(hsp, resp);
+    return 0;
+  }
+  if (st->end_stream_received) req->content_length=0;
+  else if (!req->content_length) req->content_length=-1; // body length is known at END_STREAM
+  req->chunked_encoding=0; // framing is done by DATA frames
+  req->expect_100_continue=0;
+  hsp->resp=_nxweb_http_response_init(&hsp->_resp, hsp->nxb, req);
+  nxe_publish(&hsp->events_pub, (nxe_data)NXD_HSP_REQUEST_RECEIVED);
+  if (req->content_length) {
+    hsp->state=HSP_RECEIVING_BODY;
+    nxe_istream_set_ready(loop, &hsp->req_body_out);
+  }
+  else {
+    hsp->state=HSP_HANDLING;
+  }
+  return 0;
+}
+
+static int append_header_block(nxd_http2_server_proto* h2, const char* data, int len) {
+  if (h2->hblock_len+len>h2->hblock_size) return connection_error(h2, H2_ENHANCE_YOUR_CALM); // header list too large anyway
+  memcpy(h2->hblock+h2->hblock_len, data, len);
+  h2->hblock_len+=len;
+  return 0;
+}
+
+static int process_data_frame(nxd_http2_server_proto* h2, uint8_t flags, uint32_t id, const char* payload, int len) {
+  nxe_loop* loop=h2->data_in.super.loop;
+  if (!id) return connection_error(h2, H2_PROTOCOL_ERROR);
+  const char* data=payload;
+  int data_len=len;
+  if (flags&FLAG_PADDED) {
+    if (!len) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    int pad=(uint8_t)*data++;
+    data_len--;
+    if (pad>data_len) return connection_error(h2, H2_PROTOCOL_ERROR);
+    data_len-=pad;
+  }
+  h2->recv_unacked+=len;
+  if (h2->recv_unacked>NXWEB_HTTP2_CONN_WINDOW) return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+  if (h2->recv_unacked>=NXWEB_HTTP2_CONN_WINDOW/2) {
+    queue_window_update(h2, 0, h2->recv_unacked);
+    h2->recv_unacked=0;
+  }
+  nxd_http2_stream* st=find_stream(h2, id);
+  if (!st) {
+    if (id>h2->last_stream_id) return connection_error(h2, H2_PROTOCOL_ERROR); // idle stream
+    return 0; // closed recently; connection window is credited anyway
+  }
+  if (st->reset) return 0;
+  if (st->end_stream_received) {
+    stream_reset(st, H2_STREAM_CLOSED, 1);
+    return 0;
+  }
+  if (len>st->recv_window) {
+    stream_reset(st, H2_FLOW_CONTROL_ERROR, 1);
+    return 0;
+  }
+  nxd_http_server_proto* hsp=st->hsp;
+  st->recv_window-=len;
+  st->body_received+=data_len;
+  if (hsp->req.content_length>0 && st->body_received>hsp->req.content_length) {
+    stream_reset(st, H2_PROTOCOL_ERROR, 1);
+    return 0;
+  }
+  if (data_len) {
+    if (!st->body_buf) st->body_buf=nx_alloc(NXWEB_HTTP2_STREAM_WINDOW);
+    if (st->body_end+data_len>NXWEB_HTTP2_STREAM_WINDOW) {
+      memmove(st->body_buf, st->body_buf+st->body_start, st->body_end-st->body_start);
+      st->body_end-=st->body_start;
+      st->body_start=0;
+    }
+    memcpy(st->body_buf+st->body_end, data, data_len);
+    st->body_end+=data_len;
+  }
+  if (flags&FLAG_END_STREAM) st->end_stream_received=1;
+  if (len>data_len) stream_consumed(st, len-data_len); // padding
+  if (hsp->state==HSP_RECEIVING_BODY) nxe_istream_set_ready(loop, &hsp->req_body_out);
+  else if (hsp->state!=HSP_WAITING_FOR_REQUEST && hsp->state!=HSP_RECEIVING_HEADERS && data_len) {
+    // nobody is going to read it
+    st->body_start=st->body_end=0;
+    stream_consumed(st, data_len);
+  }
+  return 0;
+}
+
+static int process_settings_frame(nxd_http2_server_proto* h2, uint8_t flags, uint32_t id, const char* payload, int len) {
+  if (id) return connection_error(h2, H2_PROTOCOL_ERROR);
+  if (flags&FLAG_ACK) {
+    if (len) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+    return 0;
+  }
+  if (len%6) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+  const char* p;
+  for (p=payload; p<payload+len; p+=6) {
+    int param=(uint8_t)p[0]<<8 | (uint8_t)p[1];
+    uint32_t value=get_u32(p+2);
+    switch (param) {
+      case SETTINGS_HEADER_TABLE_SIZE:
+        nxd_hpack_set_max_size_limit(&h2->encoder, value<NXWEB_HTTP2_HEADER_TABLE_SIZE? value : NXWEB_HTTP2_HEADER_TABLE_SIZE);
+        break;
+      case SETTINGS_ENABLE_PUSH:
+        if (value>1) return connection_error(h2, H2_PROTOCOL_ERROR);
+        break;
+      case SETTINGS_INITIAL_WINDOW_SIZE: {
+        if (value>MAX_WINDOW) return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+        int32_t delta=(int32_t)value-h2->peer_initial_window;
+        nxd_http2_stream* st;
+        for (st=h2->first_stream; st; st=st->next) {
+          if ((int64_t)st->send_window+delta>MAX_WINDOW) return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+          st->send_window+=delta;
+        }
+        h2->peer_initial_window=value;
+        break;
+      }
+      case SETTINGS_MAX_FRAME_SIZE:
+        if (value<DEFAULT_FRAME_SIZE || value>0xffffff) return connection_error(h2, H2_PROTOCOL_ERROR);
+        h2->peer_max_frame_size=value<NXWEB_HTTP2_MAX_FRAME_SIZE? value : NXWEB_HTTP2_MAX_FRAME_SIZE;
+        break;
+    }
+  }
+  h2->settings_received=1;
+  queue_frame(h2, FRAME_SETTINGS, FLAG_ACK, 0, 0, 0);
+  return 0;
+}
+
+static int process_frame(nxd_http2_server_proto* h2, uint8_t type, uint8_t flags, uint32_t id, const char* payload, int len) {
+  if (h2->hblock_stream_id && type!=FRAME_CONTINUATION) return connection_error(h2, H2_PROTOCOL_ERROR);
+  if (!h2->settings_received && type!=FRAME_SETTINGS) return connection_error(h2, H2_PROTOCOL_ERROR);
+  nxd_http2_stream* st;
+  switch (type) {
+    case FRAME_DATA:
+      return process_data_frame(h2, flags, id, payload, len);
+    case FRAME_HEADERS: {
+      if (!id) return connection_error(h2, H2_PROTOCOL_ERROR);
+      int pad=0;
+      if (flags&FLAG_PADDED) {
+        if (!len) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+        pad=(uint8_t)*payload++;
+        len--;
+      }
+      h2->hblock_depends_on=0;
+      h2->hblock_weight=DEFAULT_WEIGHT;
+      if (flags&FLAG_PRIORITY) {
+        if (len<5) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+        h2->hblock_depends_on=get_u32(payload)&0x7fffffff;
+        h2->hblock_weight=(uint8_t)payload[4]+1;
+        payload+=5;
+        len-=5;
+      }
+      if (pad>len) return connection_error(h2, H2_PROTOCOL_ERROR);
+      h2->hblock_stream_id=id;
+      h2->hblock_flags=flags;
+      h2->hblock_len=0;
+      if (append_header_block(h2, payload, len-pad)) return -1;
+      if (flags&FLAG_END_HEADERS) return headers_complete(h2);
+      return 0;
+    }
+    case FRAME_CONTINUATION:
+      if (!h2->hblock_stream_id || id!=h2->hblock_stream_id) return connection_error(h2, H2_PROTOCOL_ERROR);
+      if (append_header_block(h2, payload, len)) return -1;
+      if (flags&FLAG_END_HEADERS) return headers_complete(h2);
+      return 0;
+    case FRAME_PRIORITY:
+      if (!id) return connection_error(h2, H2_PROTOCOL_ERROR);
+      if (len!=5) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+      st=find_stream(h2, id);
+      if (st) {
+        uint32_t depends_on=get_u32(payload)&0x7fffffff;
+        if (depends_on!=id) {
+          st->depends_on=depends_on;
+          st->weight=(uint8_t)payload[4]+1;
+        }
+      }
+      return 0;
+    case FRAME_RST_STREAM:
+      if (!id || id>h2->last_stream_id) return connection_error(h2, H2_PROTOCOL_ERROR);
+      if (len!=4) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+      st=find_stream(h2, id);
+      if (st) stream_reset(st, get_u32(payload), 0);
+      return 0;
+    case FRAME_SETTINGS:
+      return process_settings_frame(h2, flags, id, payload, len);
+    case FRAME_PUSH_PROMISE: // clients must not push
+      return connection_error(h2, H2_PROTOCOL_ERROR);
+    case FRAME_PING:
+      if (id) return connection_error(h2, H2_PROTOCOL_ERROR);
+      if (len!=8) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+      if (!(flags&FLAG_ACK)) queue_frame(h2, FRAME_PING, FLAG_ACK, 0, payload, 8);
+      return 0;
+    case FRAME_GOAWAY:
+      if (id) return connection_error(h2, H2_PROTOCOL_ERROR);
+      if (len<8) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+      h2->goaway_received=1; // let open streams finish; client closes connection
+      return 0;
+    case FRAME_WINDOW_UPDATE: {
+      if (len!=4) return connection_error(h2, H2_FRAME_SIZE_ERROR);
+      uint32_t increment=get_u32(payload)&0x7fffffff;
+      if (!id) {
+        if (!increment) return connection_error(h2, H2_PROTOCOL_ERROR);
+        if ((int64_t)h2->send_window+increment>MAX_WINDOW) return connection_error(h2, H2_FLOW_CONTROL_ERROR);
+        h2->send_window+=increment;
+        wake_output(h2);
+        return 0;
+      }
+      st=find_stream(h2, id);
+      if (!st) return 0;
+      if (!increment) stream_reset(st, H2_PROTOCOL_ERROR, 1);
+      else if ((int64_t)st->send_window+increment>MAX_WINDOW) stream_reset(st, H2_FLOW_CONTROL_ERROR, 1);
+      else {
+        st->send_window+=increment;
+        wake_output(h2);
+      }
+      return 0;
+    }
+    default: // unknown frame types must be ignored
+      return 0;
+  }
+}
+
+static void process_input(nxd_http2_server_proto* h2) {
+  char* p=h2->ibuf;
+  char* end=p+h2->ibuf_len;
+  if (!h2->preface_received) {
+    int n=end-p<PREFACE_SIZE? end-p : PREFACE_SIZE;
+    if (memcmp(p, PREFACE, n)) {
+      connection_error(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    if (n<PREFACE_SIZE) return;
+    p+=PREFACE_SIZE;
+    h2->preface_received=1;
+  }
+  while (end-p>=FRAME_HEADER_SIZE && !h2->input_paused) {
+    int len=(uint8_t)p[0]<<16 | (uint8_t)p[1]<<8 | (uint8_t)p[2];
+    if (len>NXWEB_HTTP2_MAX_FRAME_SIZE) {
+      connection_error(h2, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    if (end-p<FRAME_HEADER_SIZE+len) break;
+    if (process_frame(h2, (uint8_t)p[3], (uint8_t)p[4], get_u32(p+5)&0x7fffffff, p+FRAME_HEADER_SIZE, len)) return;
+    p+=FRAME_HEADER_SIZE+len;
+    if (h2->obuf_len>2*NXWEB_HTTP2_OUTPUT_BUFFER_SIZE) { // peer does not read what it asks for
+      h2->input_paused=1;
+      nxe_ostream_unset_ready(&h2->data_in);
+    }
+  }
+  h2->ibuf_len=end-p;
+  if (h2->ibuf_len && p!=h2->ibuf) memmove(h2->ibuf, p, h2->ibuf_len);
+}
+
+static void data_in_do_read(nxe_ostream* os, nxe_istream* is) {
+  nxd_http2_server_proto* h2=OBJ_PTR_FROM_FLD_PTR(nxd_http2_server_proto, data_in, os);
+
+  nxweb_log_debug("http2 data_in_do_read");
+
+  if (h2->input_paused) {
+    nxe_ostream_unset_ready(os);
+    return;
+  }
+  nxe_flags_t flags=0;
+  nxe_size_t bytes_received=ISTREAM_CLASS(is)->read(is, os, h2->ibuf+h2->ibuf_len, IBUF_SIZE-h2->ibuf_len, &flags);
+  if (bytes_received) {
+    h2->ibuf_len+=bytes_received;
+    process_input(h2);
+  }
+}
+
+static void data_out_do_write(nxe_istream* is, nxe_ostream* os) {
+  nxd_http2_server_proto* h2=OBJ_PTR_FROM_FLD_PTR(nxd_http2_server_proto, data_out, is);
+  nxe_loop* loop=is->super.loop;
+
+  nxweb_log_debug("http2 data_out_do_write");
+
+  _Bool progress=schedule(h2);
+  int len=h2->obuf_len;
+  flush_output(h2);
+  if (h2->obuf_len<len) nxe_unset_timer(loop, NXWEB_TIMER_WRITE, &h2->timer_write);
+  if (h2->obuf_len) {
+    if (!h2->timer_write.abs_time) nxe_set_timer(loop, NXWEB_TIMER_WRITE, &h2->timer_write); // socket is full
+  }
+  else if (!progress) {
+    nxe_istream_unset_ready(is);
+  }
+  if (h2->input_paused && !h2->goaway_sent && h2->obuf_len<NXWEB_HTTP2_OUTPUT_BUFFER_SIZE) {
+    h2->input_paused=0;
+    process_input(h2);
+    if (!h2->input_paused) nxe_ostream_set_ready(loop, &h2->data_in);
+  }
+}
+
+static void timer_keep_alive_on_timeout(nxe_timer* timer, nxe_data data) {
+  nxd_http2_server_proto* h2=OBJ_PTR_FROM_FLD_PTR(nxd_http2_server_proto, timer_keep_alive, timer);
+  if (!h2->goaway_sent) queue_goaway(h2, H2_NO_ERROR);
+  flush_output(h2);
+  nxe_publish(h2->events_pub, (nxe_data)NXD_HSP_KEEP_ALIVE_TIMEOUT);
+  nxweb_log_info("http2 connection %p keep-alive timeout", h2);
+}
+
+static void timer_write_on_timeout(nxe_timer* timer, nxe_data data) {
+  nxd_http2_server_proto* h2=OBJ_PTR_FROM_FLD_PTR(nxd_http2_server_proto, timer_write, timer);
+  nxe_publish(h2->events_pub, (nxe_data)NXD_HSP_WRITE_TIMEOUT);
+  nxweb_log_warning("http2 connection %p write timeout", h2);
+}
+
+static const nxe_ostream_class data_in_class={.do_read=data_in_do_read};
+static const nxe_istream_class data_out_class={.do_write=data_out_do_write};
+static const nxe_timer_class timer_keep_alive_class={.on_timeout=timer_keep_alive_on_timeout};
+static const nxe_timer_class timer_write_class={.on_timeout=timer_write_on_timeout};
+
+void nxd_http2_server_proto_init(nxd_http2_server_proto* h2, nxp_pool* nxb_pool) {
+  memset(h2, 0, sizeof(nxd_http2_server_proto));
+  h2->nxb_pool=nxb_pool;
+  h2->data_in.super.cls.os_cls=&data_in_class;
+  h2->data_out.super.cls.is_cls=&data_out_class;
+  h2->data_out.evt.cls=NXE_EV_STREAM;
+  h2->timer_keep_alive.super.cls.timer_cls=&timer_keep_alive_class;
+  h2->timer_write.super.cls.timer_cls=&timer_write_class;
+  h2->data_in.ready=1;
+  nxd_hpack_init(&h2->decoder, NXWEB_HTTP2_HEADER_TABLE_SIZE);
+  nxd_hpack_init(&h2->encoder, DEFAULT_HEADER_TABLE_SIZE);
+  h2->send_window=DEFAULT_WINDOW;
+  h2->peer_initial_window=DEFAULT_WINDOW;
+  h2->peer_max_frame_size=DEFAULT_FRAME_SIZE;
+  h2->ibuf=nx_alloc(IBUF_SIZE);
+  h2->obuf_size=IBUF_SIZE;
+  h2->obuf=nx_alloc(h2->obuf_size);
+  h2->hblock_size=NXWEB_HTTP2_MAX_HEADER_LIST_SIZE;
+  h2->hblock=nx_alloc(h2->hblock_size);
+}
+
+void nxd_http2_server_proto_connect(nxd_http2_server_proto* h2, nxe_loop* loop, nxe_istream* is, nxe_ostream* os, const char* data, int size) {
+  __sync_add_and_fetch(&sessions_open, 1);
+  __sync_add_and_fetch(&sessions_total, 1);
+  nxe_connect_streams(loop, is, &h2->data_in);
+  nxe_connect_streams(loop, &h2->data_out, os);
+
+  char settings[4*6];
+  static const int ids[4]={SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE};
+  const uint32_t values[4]={NXWEB_HTTP2_MAX_STREAMS, NXWEB_HTTP2_STREAM_WINDOW, NXWEB_HTTP2_MAX_FRAME_SIZE, NXWEB_HTTP2_MAX_HEADER_LIST_SIZE};
+  int i;
+  for (i=0; i<4; i++) {
+    settings[i*6]=(char)(ids[i]>>8);
+    settings[i*6+1]=(char)ids[i];
+    put_u32(settings+i*6+2, values[i]);
+  }
+  queue_frame(h2, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+  if (NXWEB_HTTP2_CONN_WINDOW>DEFAULT_WINDOW) queue_window_update(h2, 0, NXWEB_HTTP2_CONN_WINDOW-DEFAULT_WINDOW);
+
+  nxe_set_timer(loop, NXWEB_TIMER_KEEP_ALIVE, &h2->timer_keep_alive);
+  if (size>IBUF_SIZE) size=IBUF_SIZE; // can't be: it is less than HTTP/1 headers buffer
+  memcpy(h2->ibuf, data, size);
+  h2->ibuf_len=size;
+  process_input(h2);
+}
+
+void nxd_http2_server_proto_finalize(nxd_http2_server_proto* h2) {
+  assert(!h2->first_stream); // stream connections are finalized first
+  nxe_loop* loop=h2->data_in.super.loop;
+  if (loop) {
+    nxe_unset_timer(loop, NXWEB_TIMER_KEEP_ALIVE, &h2->timer_keep_alive);
+    nxe_unset_timer(loop, NXWEB_TIMER_WRITE, &h2->timer_write);
+    __sync_sub_and_fetch(&sessions_open, 1);
+  }
+  if (h2->data_in.pair) nxe_disconnect_streams(h2->data_in.pair, &h2->data_in);
+  if (h2->data_out.pair) nxe_disconnect_streams(&h2->data_out, h2->data_out.pair);
+  nxd_hpack_finalize(&h2->decoder);
+  nxd_hpack_finalize(&h2->encoder);
+  nx_free(h2->ibuf);
+  nx_free(h2->obuf);
+  nx_free(h2->hblock);
+}
+
+static void http2_diagnostics() {
+  nxweb_log_error("[diag] http2: sessions=%d/%" PRIu64 " streams=%d/%" PRIu64 " refused=%" PRIu64 " reset=%" PRIu64 " conn_errors=%" PRIu64,
+                  sessions_open, sessions_total, streams_open, streams_total, streams_refused, streams_reset, connection_errors);
+}
+
+NXWEB_MODULE(http2, .on_server_diagnostics=http2_diagnostics);
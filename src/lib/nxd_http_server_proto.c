@@ -25,6 +25,103 @@
 
 static const char* response_100_continue = "HTTP/1.1 100 Continue\r\n\r\n";
 
+static _Bool if_range_matches(const char* if_range, nxweb_http_response* resp) {
+  if (*if_range=='"' || *if_range=='W') { // entity tag; weak tags never match
+    return resp->etag && *resp->etag=='"' && !strcmp(if_range, resp->etag);
+  }
+  return resp->last_modified && nxweb_parse_http_time(if_range)==resp->last_modified;
+}
+
+// Range requests are served from the response's own obuffer/fbuffer, so single range
+// stays zero-copy (sendfile on narrowed fbuffer); multiple ranges go to composite stream.
+// Responses of unknown length (chunked, on-the-fly gzip, ssi, proxy) are sent whole.
+void nxd_http_server_proto_apply_range(nxd_http_server_proto* hsp, nxweb_http_request* req, nxweb_http_response* resp) {
+  if ((resp->status_code && resp->status_code!=200) || resp->content_length<=0 || resp->chunked_autoencode) return;
+  nxd_fbuffer* fb=nxd_fbuffer_from_stream(resp->content_out);
+  nxd_obuffer* ob=fb? 0 : nxd_obuffer_from_stream(resp->content_out);
+  if (fb) {
+    if (fb->end-fb->offset!=resp->content_length) return;
+  }
+  else if (!ob || ob->data_size!=resp->content_length) return;
+
+  resp->accept_ranges=1;
+  if (!req->range || !req->get_method) return;
+  if (req->if_range && !if_range_matches(req->if_range, resp)) return;
+
+  nxweb_http_range ranges[NXWEB_MAX_RANGES];
+  off_t length=resp->content_length;
+  int n=nxweb_parse_http_range(req->range, length, ranges, NXWEB_MAX_RANGES);
+  if (n<0) return;
+  if (n>1 && resp->gzip_encoded) return; // Content-Encoding would apply to multipart body
+  char buf[160];
+  if (!n) {
+    nxweb_log_info("responding with 416 Requested Range Not Satisfiable for %s", req->uri);
+    nxweb_reset_content_out(hsp, resp);
+    resp->status_code=416;
+    resp->status="Requested Range Not Satisfiable";
+    snprintf(buf, sizeof(buf), "bytes */%lld", (long long)length);
+    nxweb_add_response_header(resp, "Content-Range", nxb_copy_str(resp->nxb, buf));
+    return;
+  }
+  resp->status_code=206;
+  resp->status="Partial Content";
+  if (n==1) {
+    off_t start=ranges[0].start, end=ranges[0].end;
+    if (fb) {
+      fb->end=fb->offset+end;
+      fb->offset+=start;
+    }
+    else {
+      ob->data_ptr+=start;
+      ob->data_size=end-start;
+    }
+    resp->content_length=end-start;
+    snprintf(buf, sizeof(buf), "bytes %lld-%lld/%lld", (long long)start, (long long)end-1, (long long)length);
+    nxweb_add_response_header(resp, "Content-Range", nxb_copy_str(resp->nxb, buf));
+    return;
+  }
+
+  nxweb_http_server_connection* conn=OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_connection, hsp, hsp);
+  nxweb_composite_stream* cs=nxweb_composite_stream_init(conn, req);
+  char boundary[24];
+  snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)req->uid);
+  off_t total=0;
+  int i, len;
+  for (i=0; i<n; i++) {
+    off_t start=ranges[i].start, end=ranges[i].end;
+    len=snprintf(buf, sizeof(buf), "\r\n--%s\r\nContent-Range: bytes %lld-%lld/%lld\r\nContent-Type: ",
+            boundary, (long long)start, (long long)end-1, (long long)length);
+    nxb_start_stream(resp->nxb);
+    nxb_append(resp->nxb, buf+(i? 0:2), len-(i? 0:2)); // no leading CRLF before first boundary
+    nxb_append_str(resp->nxb, resp->content_type? resp->content_type : "text/html");
+    if (resp->content_charset) {
+      nxb_append_str(resp->nxb, "; charset=");
+      nxb_append_str(resp->nxb, resp->content_charset);
+    }
+    nxb_append(resp->nxb, "\r\n\r\n", 4);
+    const char* part_header=nxb_finish_stream(resp->nxb, &len);
+    nxweb_composite_stream_append_bytes(cs, part_header, len);
+    total+=len;
+    if (fb) nxweb_composite_stream_append_fd(cs, dup(fb->fd), fb->offset+start, fb->offset+end); // cs closes its fds
+    else nxweb_composite_stream_append_bytes(cs, ob->data_ptr+start, end-start);
+    total+=end-start;
+  }
+  len=snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", boundary);
+  nxweb_composite_stream_append_bytes(cs, nxb_copy_str(resp->nxb, buf), len);
+  total+=len;
+  nxweb_composite_stream_close(cs);
+
+  resp->content_out=&cs->strm.data_out;
+  resp->content_length=total;
+  resp->content_charset=0;
+  nxb_start_stream(resp->nxb);
+  nxb_append_str(resp->nxb, "multipart/byteranges; boundary=");
+  nxb_append_str(resp->nxb, boundary);
+  nxb_append_char(resp->nxb, '\0');
+  resp->content_type=nxb_finish_stream(resp->nxb, 0);
+  nxd_streamer_start(&cs->strm);
+}
+
 static void nxd_http_server_proto_start_sending_response(nxd_http_server_proto* hsp, nxweb_http_response* resp);
 
 void _nxweb_call_request_finalizers(nxd_http_server_proto* hsp) {
@@ -96,7 +193,7 @@ static void request_cleanup(nxe_loop* loop, nxd_http_server_proto* hsp) {
   _nxweb_call_request_finalizers(hsp);
   nxd_fbuffer_finalize(&hsp->fb);
   if (hsp->resp && hsp->resp->sendfile_fd) {
-    close(hsp->resp->sendfile_fd);
+    nxweb_fd_cache_close(hsp->resp->sendfile_fd);
   }
   nxb_empty(hsp->nxb);
   nxp_free(hsp->nxb_pool, hsp->nxb);
@@ -155,6 +252,16 @@ static void data_in_do_read(nxe_ostream* os, nxe_istream* is) {
       int read_buf_size;
       char* read_buf=nxb_get_unfinished(hsp->nxb, &read_buf_size);
       hsp->headers_bytes_received=read_buf_size;
+      if (hsp->detect_http2 && !hsp->request_count) {
+        int n=read_buf_size<16? read_buf_size : 16;
+        if (!memcmp(read_buf, "PRI * HTTP/2.0\r\n", n)) {
+          if (n<16) return; // can't tell yet
+          nxe_unset_timer(loop, NXWEB_TIMER_READ, &hsp->timer_read);
+          nxe_ostream_unset_ready(os);
+          nxe_publish(&hsp->events_pub, (nxe_data)NXD_HSP_HTTP2_PREFACE);
+          return;
+        }
+      }
       char* end_of_headers;
       char* start_of_body;
       if ((end_of_headers=_nxweb_find_end_of_http_headers(read_buf, read_buf_size, &start_of_body))) {
@@ -522,13 +629,33 @@ void nxd_http_server_proto_finalize(nxd_http_server_proto* hsp) {
   if (hsp->resp_body_in.pair) nxe_disconnect_streams(hsp->resp_body_in.pair, &hsp->resp_body_in);
   if (hsp->req_body_out.pair) nxe_disconnect_streams(&hsp->req_body_out, hsp->req_body_out.pair);
   nxd_fbuffer_finalize(&hsp->fb);
-  if (hsp->resp && hsp->resp->sendfile_fd) close(hsp->resp->sendfile_fd);
+  if (hsp->resp && hsp->resp->sendfile_fd) nxweb_fd_cache_close(hsp->resp->sendfile_fd);
   if (hsp->nxb) {
     nxb_empty(hsp->nxb);
     nxp_free(hsp->nxb_pool, hsp->nxb);
   }
 }
 
+void nxd_http_server_proto_upgrade_http2(nxd_http_server_proto* hsp, nxd_http2_server_proto* h2) {
+  nxe_loop* loop=hsp->data_in.super.loop;
+  nxe_istream* is=hsp->data_in.pair;
+  nxe_ostream* os=hsp->data_out.pair;
+  nxe_unset_timer(loop, NXWEB_TIMER_KEEP_ALIVE, &hsp->timer_keep_alive);
+  nxe_unset_timer(loop, NXWEB_TIMER_READ, &hsp->timer_read);
+  nxe_unset_timer(loop, NXWEB_TIMER_WRITE, &hsp->timer_write);
+  nxe_disconnect_streams(is, &hsp->data_in);
+  nxe_disconnect_streams(&hsp->data_out, os);
+  // bytes read so far (preface and maybe more) go to HTTP/2 session
+  int size;
+  const char* data=nxb_get_unfinished(hsp->nxb, &size);
+  nxd_http2_server_proto_connect(h2, loop, is, os, data, size);
+  nxb_empty(hsp->nxb);
+  nxp_free(hsp->nxb_pool, hsp->nxb);
+  hsp->nxb=0;
+  hsp->state=HSP_WAITING_FOR_REQUEST;
+  hsp->headers_bytes_received=0;
+}
+
 void nxd_http_server_proto_finish_response(nxweb_http_response* resp) {
   // make sure there is no unfinished stream left in resp->nxb
   int size;
@@ -562,7 +689,7 @@ void nxd_http_server_proto_setup_content_out(nxd_http_server_proto* hsp, nxweb_h
     resp->content_out=&hsp->fb.data_out;
   }
   else if (resp->sendfile_path && resp->content_length>0) {
-    resp->sendfile_fd=open(resp->sendfile_path, O_RDONLY|O_NONBLOCK);
+    resp->sendfile_fd=nxweb_fd_cache_open(resp->sendfile_path, 0);
     if (resp->sendfile_fd!=-1) {
       assert(resp->sendfile_end - resp->sendfile_offset == resp->content_length);
       assert(!hsp->fb.fd); // must not setup fbuffer twice
@@ -580,7 +707,7 @@ void nxweb_reset_content_out(nxd_http_server_proto* hsp, nxweb_http_response* re
   resp->content=0;
   resp->content_length=0;
   resp->sendfile_path=0;
-  if (resp->sendfile_fd) close(resp->sendfile_fd);
+  if (resp->sendfile_fd) nxweb_fd_cache_close(resp->sendfile_fd);
   if (hsp->fb.fd) nxd_fbuffer_finalize(&hsp->fb);
   resp->sendfile_fd=0;
   resp->chunked_autoencode=0;
@@ -617,6 +744,8 @@ static void nxd_http_server_proto_start_sending_response(nxd_http_server_proto*
 
   nxd_http_server_proto_setup_content_out(hsp, resp);
 
+  nxd_http_server_proto_apply_range(hsp, req, resp);
+
   if (resp->content_out) {
     nxe_connect_streams(loop, resp->content_out, &hsp->resp_body_in);
   }
@@ -37,7 +37,7 @@ static void request_cleanup(nxe_loop* loop, nxd_http_server_proto* hsp) {
   _nxweb_call_request_finalizers(hsp);
   nxd_fbuffer_finalize(&hsp->fb);
   if (hsp->resp && hsp->resp->sendfile_fd) {
-    close(hsp->resp->sendfile_fd);
+    nxweb_fd_cache_close(hsp->resp->sendfile_fd);
   }
   nxb_empty(hsp->nxb);
   nxp_free(hsp->nxb_pool, hsp->nxb);
@@ -55,7 +55,7 @@ static void subrequest_finalize(nxd_http_server_proto* hsp) {
   nxe_loop* loop=hsp->events_pub.super.loop;
   while (hsp->events_pub.sub) nxe_unsubscribe(&hsp->events_pub, hsp->events_pub.sub);
   nxd_fbuffer_finalize(&hsp->fb);
-  if (hsp->resp && hsp->resp->sendfile_fd) close(hsp->resp->sendfile_fd);
+  if (hsp->resp && hsp->resp->sendfile_fd) nxweb_fd_cache_close(hsp->resp->sendfile_fd);
   if (hsp->nxb) {
     nxb_empty(hsp->nxb);
     nxp_free(hsp->nxb_pool, hsp->nxb);
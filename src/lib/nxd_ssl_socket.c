@@ -26,8 +26,21 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <gnutls/gnutls.h>
 
+#ifdef HAVE_LINUX_TLS_H
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif // HAVE_LINUX_TLS_H
+
 static gnutls_dh_params_t dh_params_generated=0;
 
 int nxd_ssl_socket_global_init(void) __attribute__ ((constructor));
@@ -189,6 +202,115 @@ static const char *bin2hex(const void *bin, size_t bin_size) { // not optimized!
 }
 */
 
+// Kernel TLS: handshake stays in gnutls; then write keys are handed to the kernel (TLS_TX)
+// so response bodies go out by plain write() and zero-copy sendfile().
+// Receive side stays in gnutls: requests are small and it handles alerts & post-handshake messages.
+// Any failure leaves the session in gnutls (userspace encryption).
+
+#ifdef HAVE_LINUX_TLS_H
+
+static _Bool ktls_unavailable; // kernel has no tls ULP; don't try again
+
+static int ktls_enable_tx(nxd_ssl_socket* ss) {
+  if (ktls_unavailable) return -1;
+  gnutls_protocol_t version=gnutls_protocol_get_version(ss->session);
+  gnutls_cipher_algorithm_t cipher=gnutls_cipher_get(ss->session);
+  gnutls_datum_t iv, key;
+  unsigned char seq[8];
+  if (gnutls_record_get_state(ss->session, 0, 0, &iv, &key, seq)<0) return -1;
+
+  union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes128;
+#ifdef TLS_CIPHER_AES_GCM_256
+    struct tls12_crypto_info_aes_gcm_256 aes256;
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+  } ci;
+  socklen_t ci_len;
+  memset(&ci, 0, sizeof(ci));
+  if (version==GNUTLS_TLS1_2) ci.info.version=TLS_1_2_VERSION;
+#ifdef TLS_1_3_VERSION
+  else if (version==GNUTLS_TLS1_3) ci.info.version=TLS_1_3_VERSION;
+#endif
+  else return -1;
+
+// TLS 1.2 GCM: gnutls IV is 4-byte salt, explicit nonce starts at seq; TLS 1.3: IV is salt+iv
+#define KTLS_SET_GCM(gcm, type, key_size) \
+  if (key.size!=(key_size) || iv.size!=(ci.info.version==TLS_1_2_VERSION? 4 : 12)) return -1; \
+  gcm.info.cipher_type=(type); \
+  memcpy(gcm.salt, iv.data, 4); \
+  if (ci.info.version==TLS_1_2_VERSION) memcpy(gcm.iv, seq, 8); \
+  else memcpy(gcm.iv, iv.data+4, 8); \
+  memcpy(gcm.key, key.data, key.size); \
+  memcpy(gcm.rec_seq, seq, 8); \
+  ci_len=sizeof(gcm)
+
+  if (cipher==GNUTLS_CIPHER_AES_128_GCM) {
+    KTLS_SET_GCM(ci.aes128, TLS_CIPHER_AES_GCM_128, 16);
+  }
+#ifdef TLS_CIPHER_AES_GCM_256
+  else if (cipher==GNUTLS_CIPHER_AES_256_GCM) {
+    KTLS_SET_GCM(ci.aes256, TLS_CIPHER_AES_GCM_256, 32);
+  }
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  else if (cipher==GNUTLS_CIPHER_CHACHA20_POLY1305) {
+    if (key.size!=32 || iv.size!=12) return -1;
+    ci.chacha.info.cipher_type=TLS_CIPHER_CHACHA20_POLY1305;
+    memcpy(ci.chacha.iv, iv.data, 12);
+    memcpy(ci.chacha.key, key.data, 32);
+    memcpy(ci.chacha.rec_seq, seq, 8);
+    ci_len=sizeof(ci.chacha);
+  }
+#endif
+  else return -1;
+#undef KTLS_SET_GCM
+
+  int fd=ss->fs.fd;
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))==-1) {
+    if (errno==ENOENT || errno==ENOPROTOOPT) {
+      if (!ktls_unavailable) nxweb_log_warning("kernel TLS not available (tls module not loaded?); encrypting in userspace");
+      ktls_unavailable=1;
+    }
+    return -1;
+  }
+  // tls ULP without TX state passes data through, so gnutls can continue on failure
+  if (setsockopt(fd, SOL_TLS, TLS_TX, &ci, ci_len)==-1) {
+    nxweb_log_info("kernel TLS_TX setup failed errno=%d", errno);
+    return -1;
+  }
+  return 0;
+}
+
+static void ktls_send_close_notify(nxd_ssl_socket* ss) {
+  unsigned char alert[2]={1, 0}; // warning, close_notify
+  char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+  struct iovec iov={.iov_base=alert, .iov_len=sizeof(alert)};
+  struct msghdr msg={.msg_iov=&iov, .msg_iovlen=1, .msg_control=cbuf, .msg_controllen=sizeof(cbuf)};
+  struct cmsghdr* cmsg=CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level=SOL_TLS;
+  cmsg->cmsg_type=TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len=CMSG_LEN(sizeof(unsigned char));
+  *CMSG_DATA(cmsg)=21; // alert record
+  sendmsg(ss->fs.fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+#else
+
+static int ktls_enable_tx(nxd_ssl_socket* ss) {
+  return -1;
+}
+
+static void ktls_send_close_notify(nxd_ssl_socket* ss) {
+}
+
+#endif // HAVE_LINUX_TLS_H
+
+static int handshake_result(nxd_ssl_socket* ss, int ret);
+
 static int do_handshake(nxd_ssl_socket* ss) {
 
   nxweb_log_debug("ssl do_handshake");
@@ -210,9 +332,24 @@ static int do_handshake(nxd_ssl_socket* ss) {
     nxe_ostream_set_ready(loop, &ss->handshake_stub_os);
   }
 
-  int ret=gnutls_handshake(ss->session);
+  if (ss->handshake_in_crypto) {
+    ss->handshake_retry=1;
+    return 1;
+  }
+  if (ss->offload_handshake && !ss->offload_handshake(ss)) {
+    ss->handshake_in_crypto=1;
+    ss->handshake_retry=0;
+    return 1;
+  }
+  return handshake_result(ss, gnutls_handshake(ss->session));
+}
+
+static int handshake_result(nxd_ssl_socket* ss, int ret) {
+  nxe_loop* loop=ss->fs.data_is.super.loop;
   if (ret==GNUTLS_E_SUCCESS) {
     ss->handshake_complete=1;
+    if (ss->ktls) ss->ktls_tx=!ktls_enable_tx(ss);
+    _nxweb_ssl_count_handshake(gnutls_session_is_resumed(ss->session));
 
     nxe_istream_unset_ready(&ss->handshake_stub_is);
     nxe_disconnect_streams(&ss->handshake_stub_is, &ss->fs.data_os);
@@ -248,6 +385,18 @@ static int do_handshake(nxd_ssl_socket* ss) {
   return 1;
 }
 
+void nxd_ssl_socket_handshake_step_complete(nxd_ssl_socket* ss) {
+  ss->handshake_in_crypto=0;
+  int rc=handshake_result(ss, ss->handshake_ret);
+  if (rc>0 && ss->handshake_retry) rc=do_handshake(ss);
+  if (!rc) {
+    // events that came while in crypto thread have been consumed; recheck socket
+    nxe_loop* loop=ss->fs.data_is.super.loop;
+    nxe_istream_set_ready(loop, &ss->fs.data_is);
+    nxe_ostream_set_ready(loop, &ss->fs.data_os);
+  }
+}
+
 static void handshake_stub_is_do_write(nxe_istream* is, nxe_ostream* os) {
   nxd_ssl_socket* ss=(nxd_ssl_socket*)((char*)is-offsetof(nxd_ssl_socket, handshake_stub_is));
 
@@ -322,6 +471,31 @@ static nxe_ssize_t sock_data_send_write(nxe_ostream* os, nxe_istream* is, int fd
     }
   }
 
+  if (ss->ktls_tx) { // same as plain nxd_socket
+    if (size>0) {
+      nxe_loop* loop=os->super.loop;
+      if (!loop->batch_write_fd) {
+        _nxweb_batch_write_begin(fs->fd);
+        loop->batch_write_fd=fs->fd;
+      }
+      nxe_ssize_t bytes_sent=fd? sendfile(fs->fd, fd, &ptr.offs, size) : write(fs->fd, ptr.cptr, size);
+      if (bytes_sent<0) {
+        nxe_ostream_unset_ready(os);
+        if (errno!=EAGAIN) nxe_publish(&fs->data_error, (nxe_data)NXE_ERROR);
+        return 0;
+      }
+      if (bytes_sent<size) {
+        nxe_ostream_unset_ready(os);
+        if (bytes_sent==0 && !fd) {
+          nxe_publish(&fs->data_error, (nxe_data)NXE_WRITTEN_NONE);
+          return 0;
+        }
+      }
+      return bytes_sent;
+    }
+    return 0;
+  }
+
   nxe_flags_t flags=*_flags;
   nx_file_reader_to_mem_ptr(fd, fr, &ptr, &size, &flags);
   if (size) {
@@ -383,7 +557,8 @@ static nxe_ssize_t sock_data_send_write(nxe_ostream* os, nxe_istream* is, int fd
 static void sock_data_send_shutdown(nxe_ostream* os) {
   //nxe_fd_source* fs=(nxe_fd_source*)((char*)os-offsetof(nxe_fd_source, data_os));
   nxd_ssl_socket* ss=(nxd_ssl_socket*)((char*)os-offsetof(nxe_fd_source, data_os)-offsetof(nxd_ssl_socket, fs));
-  gnutls_bye(ss->session, GNUTLS_SHUT_WR);
+  if (ss->ktls_tx) ktls_send_close_notify(ss);
+  else gnutls_bye(ss->session, GNUTLS_SHUT_WR);
 }
 
 static const nxe_istream_class sock_data_recv_class={.read=sock_data_recv_read};
@@ -405,27 +580,11 @@ static int handshake_post_hello(gnutls_session_t session) {
 }
 */
 
-/*
-static int db_store_func(void* p, gnutls_datum_t key, gnutls_datum_t data) {
-  nxweb_log_error("db_store_func(%p, %d, %d)", p, key.size, data.size);
-  return 0;
-}
-
-static gnutls_datum_t db_retr_func(void* p, gnutls_datum_t key) {
-  nxweb_log_error("db_retr_func(%p, %d)", p, key.size);
-  gnutls_datum_t d={0, 0};
-  return d;
-}
-
-static int db_remove_func(void* p, gnutls_datum_t key) {
-  //nxweb_log_error("db_remove_func(%p, %d)", p, key.size);
-  return 0;
-}
-*/
-
 static void socket_shutdown(nxd_socket* sock) {
   nxd_ssl_socket* ss=(nxd_ssl_socket*)sock;
-  gnutls_bye(ss->session, GNUTLS_SHUT_WR);
+  if (ss->handshake_in_crypto) return;
+  if (ss->ktls_tx) ktls_send_close_notify(ss);
+  else gnutls_bye(ss->session, GNUTLS_SHUT_WR);
 }
 
 static void socket_finalize(nxd_socket* sock, int good) {
@@ -449,20 +608,18 @@ void nxd_ssl_server_socket_init(nxd_ssl_socket* ss, gnutls_certificate_credentia
   // If we did we would need to verify it.
   gnutls_certificate_server_set_request(ss->session, GNUTLS_CERT_IGNORE);
 
-  gnutls_session_ticket_enable_server(ss->session, session_ticket_key);
-
-/*
-  gnutls_db_set_retrieve_function(ss->session, db_retr_func);
-  gnutls_db_set_store_function(ss->session, db_store_func);
-  gnutls_db_set_remove_function(ss->session, db_remove_func);
-  gnutls_db_set_ptr(ss->session, ss);
-*/
+  if (session_ticket_key) gnutls_session_ticket_enable_server(ss->session, session_ticket_key);
 
   gnutls_credentials_set(ss->session, GNUTLS_CRD_CERTIFICATE, x509_cred);
 
   //gnutls_handshake_set_post_client_hello_function(ss->session, handshake_post_hello);
 }
 
+void nxd_ssl_server_socket_enable_http2(nxd_ssl_socket* ss) {
+  static const gnutls_datum_t protocols[2]={{(unsigned char*)"h2", 2}, {(unsigned char*)"http/1.1", 8}};
+  gnutls_alpn_set_protocols(ss->session, protocols, 2, GNUTLS_ALPN_SERVER_PRECEDENCE);
+}
+
 void nxd_ssl_server_socket_finalize(nxd_ssl_socket* ss, int good) {
   if (ss->fs.data_is.super.loop) nxe_unregister_fd_source(&ss->fs); // this also disconnects streams and unsubscribes subscribers
   gnutls_deinit(ss->session);
@@ -137,10 +137,9 @@ void nxd_streamer_add_node(nxd_streamer* strm, nxd_streamer_node* snode, int fin
     strm->head=snode;
   }
   else {
-    nxd_streamer_node* prev=strm->head;
-    while (prev->next) prev=prev->next;
-    prev->next=snode;
+    strm->tail->next=snode;
   }
+  strm->tail=snode;
   snode->strm=strm;
   snode->final=!!final;
   if (strm->running && (!strm->current || strm->current->complete)) {
@@ -152,8 +151,9 @@ void nxd_streamer_node_finalize(nxd_streamer_node* snode) {
 
   nxweb_log_debug("nxd_streamer_node_finalize");
 
-  if (snode->data_in.pair) nxe_disconnect_streams(snode->data_in.pair, &snode->data_in);
-  if (snode->next) nxd_streamer_node_finalize(snode->next);
+  for (; snode; snode=snode->next) { // iterative: streams may have hundreds of nodes
+    if (snode->data_in.pair) nxe_disconnect_streams(snode->data_in.pair, &snode->data_in);
+  }
 }
 
 void nxd_streamer_finalize(nxd_streamer* strm) {
@@ -180,12 +180,11 @@ void nxd_streamer_start(nxd_streamer* strm) {
 }
 
 void nxd_streamer_close(nxd_streamer* strm) {
-  nxd_streamer_node* snode=strm->head;
+  nxd_streamer_node* snode=strm->tail;
   if (!snode) { // closing empty streamer
     strm->force_eof=1;
   }
   else {
-    while (snode->next) snode=snode->next; // find last node
     snode->final=1;
     if (snode->complete) {
       // final node has already been transmitted => force EOF
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+nxweb_frame* _nxweb_frame_alloc(int size) {
+  nxweb_frame* frame=nx_alloc(offsetof(nxweb_frame, data)+size);
+  frame->refcount=1;
+  frame->size=size;
+  return frame;
+}
+
+void nxweb_frame_unref(nxweb_frame* frame) {
+  if (!__sync_sub_and_fetch(&frame->refcount, 1)) nx_free(frame);
+}
+
+int _nxweb_frame_queue_push(nxweb_frame_queue* q, nxweb_frame* frame, int limit) {
+  if (q->count>=limit) return -1;
+  if (q->count==q->size) {
+    int size=q->size? q->size*2 : 4;
+    if (size>limit) size=limit;
+    nxweb_frame** ring=nx_alloc(size*sizeof(nxweb_frame*));
+    int i;
+    for (i=0; i<q->count; i++) ring[i]=q->ring[(q->first+i)%q->size];
+    if (q->ring) nx_free(q->ring);
+    q->ring=ring;
+    q->size=size;
+    q->first=0;
+  }
+  nxweb_frame_ref(frame);
+  q->ring[(q->first+q->count)%q->size]=frame;
+  q->count++;
+  return 0;
+}
+
+void _nxweb_frame_queue_drop(nxweb_frame_queue* q) {
+  // frame partially written must be finished to keep stream parseable
+  int keep=q->offset || q->retry_size? 1 : 0;
+  while (q->count>keep) {
+    q->count--;
+    nxweb_frame_unref(q->ring[(q->first+q->count)%q->size]);
+  }
+}
+
+void _nxweb_frame_queue_clear(nxweb_frame_queue* q) {
+  while (q->count) {
+    nxweb_frame_unref(q->ring[q->first]);
+    q->first=(q->first+1)%q->size;
+    q->count--;
+  }
+  if (q->ring) nx_free(q->ring);
+  q->ring=0;
+  q->size=0;
+  q->first=0;
+  q->offset=0;
+  q->retry_size=0;
+}
+
+nxe_size_t _nxweb_frame_queue_write(nxweb_frame_queue* q, nxe_istream* is, nxe_ostream* os) {
+  nxe_size_t total=0;
+  while (q->count && os->ready) {
+    nxweb_frame* frame=q->ring[q->first];
+    int size=q->retry_size? q->retry_size : frame->size-q->offset;
+    nxe_flags_t flags=0;
+    nxe_ssize_t bytes_sent=OSTREAM_CLASS(os)->write(os, is, 0, 0, (nxe_data)(const char*)(frame->data+q->offset), size, &flags);
+    if (bytes_sent<=0) {
+      q->retry_size=size;
+      break;
+    }
+    q->retry_size=0;
+    q->offset+=bytes_sent;
+    total+=bytes_sent;
+    if (q->offset==frame->size) {
+      q->offset=0;
+      q->first=(q->first+1)%q->size;
+      q->count--;
+      nxweb_frame_unref(frame);
+    }
+  }
+  return total;
+}
+
+/*
+ * Inbox item carries either one frame for one endpoint (post) or one
+ * frame for all subscribers of a list in the receiving thread (publish),
+ * so fan-out costs one item per net thread regardless of subscriber count.
+ */
+
+typedef struct pubsub_inbox_item {
+  nxw_completion c;
+  const nxweb_pubsub_class* cls;
+  void* endpoint; // either endpoint
+  nxweb_subscriber_list* list; // or list to deliver to
+  nxweb_frame* frame;
+} pubsub_inbox_item;
+
+int _nxweb_pubsub_subscribe(nxweb_subscription** subscriptions, nxweb_subscriber_list* list, void* endpoint, int thread_num) {
+  nxweb_subscription* s;
+  for (s=*subscriptions; s; s=s->next_of_endpoint) {
+    if (s->list==list) return 0; // already subscribed
+  }
+  s=nx_alloc(sizeof(nxweb_subscription));
+  s->list=list;
+  s->endpoint=endpoint;
+  s->thread_num=thread_num;
+  s->prev=0;
+  s->next=list->first[thread_num];
+  if (s->next) s->next->prev=s;
+  list->first[thread_num]=s;
+  list->count[thread_num]++;
+  s->next_of_endpoint=*subscriptions;
+  *subscriptions=s;
+  return 1;
+}
+
+static void unlink_subscription(nxweb_subscription* s) {
+  nxweb_subscriber_list* list=s->list;
+  int t=s->thread_num;
+  if (s->prev) s->prev->next=s->next;
+  else list->first[t]=s->next;
+  if (s->next) s->next->prev=s->prev;
+  list->count[t]--;
+}
+
+int _nxweb_pubsub_unsubscribe(nxweb_subscription** subscriptions, nxweb_subscriber_list* list) {
+  nxweb_subscription** ps;
+  for (ps=subscriptions; *ps; ps=&(*ps)->next_of_endpoint) {
+    nxweb_subscription* s=*ps;
+    if (s->list==list) {
+      *ps=s->next_of_endpoint;
+      unlink_subscription(s);
+      nx_free(s);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void _nxweb_pubsub_unsubscribe_all(nxweb_subscription** subscriptions) {
+  while (*subscriptions) {
+    nxweb_subscription* s=*subscriptions;
+    *subscriptions=s->next_of_endpoint;
+    unlink_subscription(s);
+    nx_free(s);
+  }
+}
+
+static void deliver(const nxweb_pubsub_class* cls, nxweb_subscriber_list* list, nxweb_frame* frame) {
+  // endpoints that overflow only start closing here; nobody leaves the list while we walk it
+  int t=_nxweb_net_thread_data->thread_num;
+  nxweb_subscription* s;
+  int n=0;
+  for (s=list->first[t]; s; s=s->next) {
+    if (!cls->send(s->endpoint, frame)) n++;
+  }
+  nxweb_log_debug("%s: delivered to %d subscribers", cls->name, n);
+}
+
+static void inbox_on_complete(nxw_completion* c) {
+  pubsub_inbox_item* item=OBJ_PTR_FROM_FLD_PTR(pubsub_inbox_item, c, c);
+  const nxweb_pubsub_class* cls=item->cls;
+  if (item->endpoint) {
+    cls->send(item->endpoint, item->frame); // fails if endpoint has gone meanwhile
+    cls->endpoint_unref(item->endpoint);
+  }
+  else {
+    deliver(cls, item->list, item->frame);
+    if (cls->list_unref) cls->list_unref(item->list);
+  }
+  nxweb_frame_unref(item->frame);
+  nx_free(item);
+}
+
+static int inbox_post(const nxweb_pubsub_class* cls, nxweb_net_thread_data* tdata, void* endpoint, nxweb_subscriber_list* list, nxweb_frame* frame) {
+  pubsub_inbox_item* item=nx_alloc(sizeof(pubsub_inbox_item));
+  item->c.on_complete=inbox_on_complete;
+  item->cls=cls;
+  item->endpoint=endpoint;
+  item->list=list;
+  item->frame=frame;
+  if (endpoint) cls->endpoint_ref(endpoint);
+  else if (cls->list_ref) cls->list_ref(list);
+  nxweb_frame_ref(frame);
+  if (_nxweb_net_thread_post(tdata, &item->c)) {
+    if (endpoint) cls->endpoint_unref(endpoint);
+    else if (cls->list_unref) cls->list_unref(list);
+    nxweb_frame_unref(frame);
+    nx_free(item);
+    return -1;
+  }
+  return 0;
+}
+
+int _nxweb_pubsub_post(const nxweb_pubsub_class* cls, nxweb_net_thread_data* tdata, void* endpoint, nxweb_frame* frame) {
+  return inbox_post(cls, tdata, endpoint, 0, frame);
+}
+
+int _nxweb_pubsub_publish(const nxweb_pubsub_class* cls, nxweb_subscriber_list* list, nxweb_frame* frame) {
+  nxweb_net_thread_data* cur=_nxweb_net_thread_data; // 0 in worker and other threads
+  int i, n=0;
+  for (i=0; i<_nxweb_num_net_threads; i++) {
+    if (!list->first[i] || &_nxweb_net_threads[i]==cur) continue;
+    if (!inbox_post(cls, &_nxweb_net_threads[i], 0, list, frame)) n++;
+  }
+  // own thread last so that other threads start sending meanwhile
+  if (cur && list->first[cur->thread_num]) {
+    deliver(cls, list, frame);
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+/*
+ * Compiled form of handler_list used by the default dispatcher. Handlers
+ * are grouped by vhost: exact vhosts and wildcard ones (".example.com")
+ * share one open-addressing hash, so wildcard match costs one lookup per
+ * label of request host. Each group keeps radix tree of url prefixes where
+ * node lists handlers having exactly its prefix, in routing list order.
+ * Request walks the trees once; matching node lists are then merged by
+ * route_order, which keeps dispatch and NXWEB_NEXT semantics of the list.
+ */
+
+typedef struct route_node {
+  const char* key; // url prefix this node stands for (points into handler's prefix)
+  int key_len;
+  int num_handlers;
+  nxweb_handler** handlers;
+  int num_children;
+  struct route_node** children; // sorted by their key[key_len]
+} route_node;
+
+typedef struct route_vhost {
+  const char* vhost; // 0 = empty slot
+  int vhost_len;
+  route_node* root;
+} route_vhost;
+
+struct nxweb_router {
+  route_node* any_vhost;
+  route_vhost* vhosts;
+  int vhosts_mask; // hash size - 1
+  int num_vhosts;
+  _Bool has_wildcards;
+  int num_nodes;
+};
+
+static route_node* node_create(nxweb_router* r, const char* key, int key_len) {
+  route_node* node=nx_calloc(sizeof(route_node));
+  node->key=key;
+  node->key_len=key_len;
+  r->num_nodes++;
+  return node;
+}
+
+static void node_free(route_node* node) {
+  int i;
+  for (i=0; i<node->num_children; i++) node_free(node->children[i]);
+  if (node->children) nx_free(node->children);
+  if (node->handlers) nx_free(node->handlers);
+  nx_free(node);
+}
+
+static int child_idx(const route_node* node, char c) { // binary search; -1 = none
+  int lo=0, hi=node->num_children-1;
+  while (lo<=hi) {
+    int mid=(lo+hi)>>1;
+    char mc=node->children[mid]->key[node->key_len];
+    if (mc==c) return mid;
+    if (mc<c) lo=mid+1;
+    else hi=mid-1;
+  }
+  return -1;
+}
+
+static void child_insert(route_node* node, route_node* child) {
+  route_node** children=nx_alloc((node->num_children+1)*sizeof(route_node*));
+  char c=child->key[node->key_len];
+  int i, j=0;
+  for (i=0; i<node->num_children && node->children[i]->key[node->key_len]<c; i++) children[j++]=node->children[i];
+  children[j++]=child;
+  for (; i<node->num_children; i++) children[j++]=node->children[i];
+  if (node->children) nx_free(node->children);
+  node->children=children;
+  node->num_children++;
+}
+
+static void handler_add(route_node* node, nxweb_handler* h) {
+  nxweb_handler** handlers=nx_alloc((node->num_handlers+1)*sizeof(nxweb_handler*));
+  if (node->num_handlers) {
+    memcpy(handlers, node->handlers, node->num_handlers*sizeof(nxweb_handler*));
+    nx_free(node->handlers);
+  }
+  handlers[node->num_handlers++]=h; // list is walked in order => stays sorted by route_order
+  node->handlers=handlers;
+}
+
+static void tree_insert(nxweb_router* r, route_node* node, nxweb_handler* h) {
+  const char* prefix=h->prefix;
+  int prefix_len=h->prefix_len;
+  while (node->key_len<prefix_len) {
+    int i=child_idx(node, prefix[node->key_len]);
+    if (i<0) {
+      route_node* leaf=node_create(r, prefix, prefix_len);
+      child_insert(node, leaf);
+      node=leaf;
+      break;
+    }
+    route_node* child=node->children[i];
+    int l=node->key_len+1;
+    while (l<child->key_len && l<prefix_len && child->key[l]==prefix[l]) l++;
+    if (l<child->key_len) { // split edge
+      route_node* mid=node_create(r, prefix, l);
+      node->children[i]=mid;
+      child_insert(mid, child);
+      child=mid;
+    }
+    node=child;
+  }
+  handler_add(node, h);
+}
+
+// hashed right to left: one pass over request host yields hashes of all its suffixes
+#define HASH_INIT 2166136261u // FNV-1a
+#define HASH_STEP(h, c) (((h)^(unsigned char)(c))*16777619u)
+
+static uint32_t vhost_hash(const char* s, int len) {
+  uint32_t h=HASH_INIT;
+  while (len--) h=HASH_STEP(h, s[len]);
+  return h;
+}
+
+static route_vhost* vhost_find(const nxweb_router* r, uint32_t hash, char first, const char* s, int len) {
+  // first!=0 looks up first+s (used for "."+host)
+  int klen=len+(first? 1 : 0);
+  uint32_t i=hash;
+  route_vhost* v;
+  for (;; i++) {
+    v=&r->vhosts[i&r->vhosts_mask];
+    if (!v->vhost) return v;
+    if (v->vhost_len!=klen) continue;
+    if (first) {
+      if (v->vhost[0]==first && !memcmp(v->vhost+1, s, len)) return v;
+    }
+    else if (!memcmp(v->vhost, s, len)) return v;
+  }
+}
+
+nxweb_router* _nxweb_router_create(nxweb_handler* handler_list) {
+  nxweb_router* r=nx_calloc(sizeof(nxweb_router));
+  nxweb_handler* h;
+  int n=0;
+  for (h=handler_list; h; h=h->next) n++;
+  int size=16;
+  while (size<n*2) size<<=1; // load factor <= 0.5
+  r->vhosts=nx_calloc(size*sizeof(route_vhost));
+  r->vhosts_mask=size-1;
+  r->any_vhost=node_create(r, "", 0);
+  int order=0;
+  for (h=handler_list; h; h=h->next) {
+    h->route_order=order++;
+    route_node* root=r->any_vhost;
+    if (h->vhost_len) {
+      route_vhost* v=vhost_find(r, vhost_hash(h->vhost, h->vhost_len), 0, h->vhost, h->vhost_len);
+      if (!v->vhost) {
+        v->vhost=h->vhost;
+        v->vhost_len=h->vhost_len;
+        v->root=node_create(r, "", 0);
+        r->num_vhosts++;
+        if (*h->vhost=='.') r->has_wildcards=1;
+      }
+      root=v->root;
+    }
+    tree_insert(r, root, h);
+  }
+  return r;
+}
+
+void _nxweb_router_free(nxweb_router* r) {
+  int i;
+  for (i=0; i<=r->vhosts_mask; i++) {
+    if (r->vhosts[i].vhost) node_free(r->vhosts[i].root);
+  }
+  node_free(r->any_vhost);
+  nx_free(r->vhosts);
+  nx_free(r);
+}
+
+void _nxweb_router_stats(const nxweb_router* r, int* num_vhosts, int* num_nodes) {
+  *num_vhosts=r->num_vhosts;
+  *num_nodes=r->num_nodes;
+}
+
+static int add_list(nxweb_route_match* m, const route_node* node) {
+  if (m->num_lists==NXWEB_ROUTER_MAX_MATCHES) return -1;
+  m->list[m->num_lists]=node->handlers;
+  m->list_len[m->num_lists]=node->num_handlers;
+  m->num_lists++;
+  return 0;
+}
+
+static int tree_match(const route_node* node, nxweb_route_match* m, const char* uri, int uri_len) {
+  // root has empty key: its handlers have no prefix and match any uri
+  if (node->num_handlers && add_list(m, node)) return -1;
+  while (node->num_children && node->key_len<uri_len) {
+    int i=child_idx(node, uri[node->key_len]);
+    if (i<0) break;
+    const route_node* child=node->children[i];
+    if (child->key_len>uri_len || memcmp(uri+node->key_len+1, child->key+node->key_len+1, child->key_len-node->key_len-1)) break;
+    node=child;
+    if (node->num_handlers) {
+      char endc=uri[node->key_len]; // same rule as nxweb_url_prefix_match()
+      if ((!endc || endc=='/' || endc=='?' || endc==';') && add_list(m, node)) return -1;
+    }
+  }
+  return 0;
+}
+
+int _nxweb_router_match(const nxweb_router* r, nxweb_route_match* m, const char* host, int host_len, const char* uri, int uri_len) {
+  m->num_lists=0;
+  if (tree_match(r->any_vhost, m, uri, uri_len)) return -1;
+  if (!host_len || !r->num_vhosts) return 0;
+  // ".example.com" matches example.com and any host ending with .example.com
+  route_vhost* v;
+  uint32_t h=HASH_INIT;
+  int i;
+  for (i=host_len-1; i>=0; i--) {
+    h=HASH_STEP(h, host[i]);
+    if (host[i]=='.' && r->has_wildcards) {
+      v=vhost_find(r, h, 0, host+i, host_len-i);
+      if (v->vhost && tree_match(v->root, m, uri, uri_len)) return -1;
+    }
+  }
+  v=vhost_find(r, h, 0, host, host_len);
+  if (v->vhost && *host!='.' && tree_match(v->root, m, uri, uri_len)) return -1; // host starting with dot is done above
+  if (r->has_wildcards) {
+    v=vhost_find(r, HASH_STEP(h, '.'), '.', host, host_len);
+    if (v->vhost && tree_match(v->root, m, uri, uri_len)) return -1;
+  }
+  return 0;
+}
+
+nxweb_handler* _nxweb_router_next(nxweb_route_match* m, int min_order) {
+  nxweb_handler* best=0;
+  int i, best_i=0;
+  for (i=0; i<m->num_lists; i++) {
+    while (m->list_len[i] && m->list[i][0]->route_order<min_order) {
+      m->list[i]++;
+      m->list_len[i]--;
+    }
+    if (m->list_len[i] && (!best || m->list[i][0]->route_order<best->route_order)) {
+      best=m->list[i][0];
+      best_i=i;
+    }
+  }
+  if (best) {
+    m->list[best_i]++;
+    m->list_len[best_i]--;
+  }
+  return best;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#ifdef WITH_SSL
+
+#include <pthread.h>
+
+/*
+ * Crypto threads shared by all net threads. Each gnutls_handshake() step
+ * (key exchange, signing) of a connection is queued here instead of running
+ * in its net thread; the connection is then handed back through completion
+ * queue of its net thread. Socket stays registered with the net thread loop,
+ * which only notes readiness while the step is in crypto thread.
+ */
+
+static pthread_t crypto_threads[NXWEB_MAX_SSL_HANDSHAKE_THREADS];
+static int num_crypto_threads;
+static pthread_mutex_t queue_mux;
+static pthread_cond_t queue_cond;
+static nxw_completion* queue_head; // linked by conn->ssl_handshake_step
+static nxw_completion* queue_tail;
+static _Bool shutdown_in_progress;
+static int steps_pending; // queued or running
+static int steps_pending_max;
+static uint64_t steps_done;
+
+int _nxweb_ssl_handshake_offload(nxd_ssl_socket* ss) {
+  nxweb_http_server_connection* conn=OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_connection, sock, ss);
+  pthread_mutex_lock(&queue_mux);
+  if (shutdown_in_progress) {
+    pthread_mutex_unlock(&queue_mux);
+    return -1;
+  }
+  conn->ssl_handshake_step.next=0;
+  if (queue_tail) queue_tail->next=&conn->ssl_handshake_step;
+  else queue_head=&conn->ssl_handshake_step;
+  queue_tail=&conn->ssl_handshake_step;
+  int pending=__sync_add_and_fetch(&steps_pending, 1); // decremented by crypto threads outside queue_mux
+  if (pending>steps_pending_max) steps_pending_max=pending;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_mux);
+  conn->tdata->ssl_handshakes_in_crypto++;
+  return 0;
+}
+
+_Bool _nxweb_ssl_handshake_limit_reached() {
+  return num_crypto_threads && nxweb_server_config.max_ssl_handshakes
+      && __sync_add_and_fetch(&steps_pending, 0)>=nxweb_server_config.max_ssl_handshakes;
+}
+
+static void* crypto_thread_main(void* ptr) {
+  nxw_completion* step;
+  while (1) {
+    pthread_mutex_lock(&queue_mux);
+    while (!queue_head && !shutdown_in_progress) pthread_cond_wait(&queue_cond, &queue_mux);
+    step=queue_head;
+    if (step) {
+      queue_head=step->next;
+      if (!queue_head) queue_tail=0;
+    }
+    pthread_mutex_unlock(&queue_mux);
+    if (!step) break;
+
+    nxweb_http_server_connection* conn=OBJ_PTR_FROM_FLD_PTR(nxweb_http_server_connection, ssl_handshake_step, step);
+    conn->sock.handshake_ret=gnutls_handshake(conn->sock.session);
+
+    __sync_sub_and_fetch(&steps_pending, 1);
+    __sync_add_and_fetch(&steps_done, 1);
+    nxw_complete(&conn->tdata->ssl_handshakes_done, step);
+  }
+  return 0;
+}
+
+static int ssl_handshake_pool_init() {
+  pthread_mutex_init(&queue_mux, 0);
+  pthread_cond_init(&queue_cond, 0);
+  int n=nxweb_server_config.ssl_handshake_threads;
+  if (n>NXWEB_MAX_SSL_HANDSHAKE_THREADS) n=NXWEB_MAX_SSL_HANDSHAKE_THREADS;
+  for (num_crypto_threads=0; num_crypto_threads<n; num_crypto_threads++) {
+    if (pthread_create(&crypto_threads[num_crypto_threads], 0, crypto_thread_main, 0)) {
+      nxweb_log_error("can't create ssl handshake thread");
+      break;
+    }
+  }
+  nxweb_server_config.ssl_handshake_threads=num_crypto_threads;
+  return 0;
+}
+
+static void ssl_handshake_pool_finalize() {
+  pthread_mutex_lock(&queue_mux);
+  shutdown_in_progress=1;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_mux);
+  int i;
+  for (i=0; i<num_crypto_threads; i++) pthread_join(crypto_threads[i], 0);
+  num_crypto_threads=0;
+  pthread_cond_destroy(&queue_cond);
+  pthread_mutex_destroy(&queue_mux);
+}
+
+static void ssl_handshake_pool_diagnostics() {
+  if (!num_crypto_threads) return;
+  nxweb_log_error("[diag] ssl handshake pool: threads=%d pending=%d/%d pending_max=%d steps=%" PRIu64,
+                  num_crypto_threads, __sync_add_and_fetch(&steps_pending, 0), nxweb_server_config.max_ssl_handshakes, steps_pending_max, steps_done);
+}
+
+NXWEB_MODULE(ssl_handshake_pool, .on_server_startup=ssl_handshake_pool_init,
+        .on_server_shutdown=ssl_handshake_pool_finalize, .on_server_diagnostics=ssl_handshake_pool_diagnostics);
+
+#endif // WITH_SSL
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#ifdef WITH_SSL
+
+#include <pthread.h>
+#include <gnutls/gnutls.h>
+
+/*
+ * TLS session resumption shared by all net threads.
+ *
+ * Session id resumption (TLS 1.2 and below) is served by a bounded in-memory
+ * cache plugged into gnutls db callbacks. The cache is split into shards,
+ * each with its own lock, hash table and LRU list; entries expire after
+ * ssl_session_timeout.
+ *
+ * Session tickets (the only resumption method of TLS 1.3) are encrypted with
+ * per-listener master key which is replaced every ssl_ticket_key_rotation
+ * seconds. Previous key is still accepted for ssl_session_timeout after
+ * rotation. Ticket starts with key_name derived by gnutls from master key;
+ * we learn key_names from tickets we issue, so when client hello carries
+ * a ticket issued under previous key that session gets old key. Everyone
+ * else (including current key tickets) keeps current key.
+ * gnutls fixes ticket encryption key once per session, so a session
+ * resumed from old ticket is reissued a ticket under old key as well; its
+ * key_name is then recorded for old key.
+ */
+
+#define SHARD_MASK (NXWEB_SSL_SESSION_CACHE_SHARDS-1)
+
+typedef struct ssl_session_entry {
+  struct ssl_session_entry* hash_next;
+  struct ssl_session_entry* prev; // LRU list; head = most recently used
+  struct ssl_session_entry* next;
+  time_t expires;
+  uint32_t hash;
+  int lconf_idx;
+  unsigned key_size;
+  unsigned data_size;
+  unsigned char bytes[]; // key followed by data
+} ssl_session_entry;
+
+typedef struct ssl_session_shard {
+  pthread_mutex_t mutex;
+  ssl_session_entry** buckets;
+  ssl_session_entry* head;
+  ssl_session_entry* tail;
+  int size;
+  int max_size;
+  uint64_t hits, misses, stores, evictions;
+} ssl_session_shard;
+
+static ssl_session_shard shards[NXWEB_SSL_SESSION_CACHE_SHARDS];
+static int num_buckets; // per shard; power of 2
+static _Bool session_cache_enabled;
+static pthread_mutex_t ticket_key_mutex;
+static uint64_t handshakes_full, handshakes_resumed, ticket_keys_rotated;
+
+static inline uint32_t session_hash(const unsigned char* key, unsigned size, int lconf_idx) {
+  uint32_t h=2166136261u^(uint32_t)lconf_idx; // FNV-1a
+  while (size--) {
+    h^=*key++;
+    h*=16777619u;
+  }
+  return h;
+}
+
+static inline ssl_session_shard* get_shard(uint32_t hash) {
+  return &shards[(hash>>24)&SHARD_MASK]; // low bits are used for buckets
+}
+
+static inline void entry_link(ssl_session_shard* sh, ssl_session_entry* e) {
+  // add to head
+  e->prev=0;
+  e->next=sh->head;
+  if (sh->head) sh->head->prev=e;
+  else sh->tail=e;
+  sh->head=e;
+}
+
+static inline void entry_unlink(ssl_session_shard* sh, ssl_session_entry* e) {
+  if (e->prev) e->prev->next=e->next;
+  else sh->head=e->next;
+  if (e->next) e->next->prev=e->prev;
+  else sh->tail=e->prev;
+}
+
+static void entry_remove(ssl_session_shard* sh, ssl_session_entry* e) { // call under mutex
+  ssl_session_entry** pe=&sh->buckets[e->hash&(num_buckets-1)];
+  while (*pe!=e) pe=&(*pe)->hash_next;
+  *pe=e->hash_next;
+  entry_unlink(sh, e);
+  sh->size--;
+  nx_free(e);
+}
+
+static ssl_session_entry* entry_find(ssl_session_shard* sh, uint32_t hash, int lconf_idx, const gnutls_datum_t* key) { // call under mutex
+  ssl_session_entry* e;
+  for (e=sh->buckets[hash&(num_buckets-1)]; e; e=e->hash_next) {
+    if (e->hash==hash && e->lconf_idx==lconf_idx && e->key_size==key->size
+        && !memcmp(e->bytes, key->data, key->size)) return e;
+  }
+  return 0;
+}
+
+static inline int lconf_index(void* ptr) {
+  return (int)((nxweb_server_listen_config*)ptr-nxweb_server_config.listen_config);
+}
+
+static int db_store_func(void* ptr, gnutls_datum_t key, gnutls_datum_t data) {
+  int lconf_idx=lconf_index(ptr);
+  uint32_t hash=session_hash(key.data, key.size, lconf_idx);
+  ssl_session_shard* sh=get_shard(hash);
+  ssl_session_entry* ne=nx_alloc(offsetof(ssl_session_entry, bytes)+key.size+data.size);
+  if (!ne) return -1;
+  time_t now=nxe_get_time_usec()/1000000;
+  ne->expires=now+nxweb_server_config.ssl_session_timeout;
+  ne->hash=hash;
+  ne->lconf_idx=lconf_idx;
+  ne->key_size=key.size;
+  ne->data_size=data.size;
+  memcpy(ne->bytes, key.data, key.size);
+  memcpy(ne->bytes+key.size, data.data, data.size);
+
+  pthread_mutex_lock(&sh->mutex);
+  ssl_session_entry* e=entry_find(sh, hash, lconf_idx, &key);
+  if (e) entry_remove(sh, e);
+  while (sh->tail && (sh->size>=sh->max_size || sh->tail->expires<=now)) {
+    if (sh->tail->expires>now) sh->evictions++;
+    entry_remove(sh, sh->tail);
+  }
+  ssl_session_entry** bucket=&sh->buckets[hash&(num_buckets-1)];
+  ne->hash_next=*bucket;
+  *bucket=ne;
+  entry_link(sh, ne);
+  sh->size++;
+  sh->stores++;
+  pthread_mutex_unlock(&sh->mutex);
+  return 0;
+}
+
+static gnutls_datum_t db_retr_func(void* ptr, gnutls_datum_t key) {
+  gnutls_datum_t res={0, 0};
+  int lconf_idx=lconf_index(ptr);
+  uint32_t hash=session_hash(key.data, key.size, lconf_idx);
+  ssl_session_shard* sh=get_shard(hash);
+  pthread_mutex_lock(&sh->mutex);
+  ssl_session_entry* e=entry_find(sh, hash, lconf_idx, &key);
+  if (e && e->expires<=nxe_get_time_usec()/1000000) {
+    entry_remove(sh, e);
+    e=0;
+  }
+  if (e && (res.data=gnutls_malloc(e->data_size))) {
+    memcpy(res.data, e->bytes+e->key_size, e->data_size);
+    res.size=e->data_size;
+    entry_unlink(sh, e);
+    entry_link(sh, e);
+    sh->hits++;
+  }
+  else {
+    sh->misses++;
+  }
+  pthread_mutex_unlock(&sh->mutex);
+  return res;
+}
+
+static int db_remove_func(void* ptr, gnutls_datum_t key) {
+  int lconf_idx=lconf_index(ptr);
+  uint32_t hash=session_hash(key.data, key.size, lconf_idx);
+  ssl_session_shard* sh=get_shard(hash);
+  pthread_mutex_lock(&sh->mutex);
+  ssl_session_entry* e=entry_find(sh, hash, lconf_idx, &key);
+  if (e) entry_remove(sh, e);
+  pthread_mutex_unlock(&sh->mutex);
+  return e? 0 : -1;
+}
+
+static int find_ticket_key_name(void* ctx, unsigned tls_id, const unsigned char* data, unsigned data_size) {
+  unsigned char* name=ctx;
+  if (tls_id==35 && data_size>=16) { // session_ticket: the ticket itself
+    memcpy(name, data, 16);
+  }
+  else if (tls_id==41 && data_size>=4+16) { // pre_shared_key: first identity is the ticket
+    unsigned id_size=(unsigned)data[2]<<8 | data[3];
+    if (id_size>=16 && id_size<=data_size-4) memcpy(name, data+4, 16);
+  }
+  return 0;
+}
+
+static _Bool ticket_key_name_known(unsigned char names[][16], int num_names, const unsigned char* name) {
+  int i;
+  for (i=0; i<num_names; i++) {
+    if (!memcmp(names[i], name, 16)) return 1;
+  }
+  return 0;
+}
+
+static void ticket_key_name_add(unsigned char names[][16], int* num_names, const unsigned char* name) {
+  if (ticket_key_name_known(names, *num_names, name)) return;
+  if (*num_names==NXWEB_SSL_TICKET_KEY_NAMES) { // forget oldest
+    memmove(names[0], names[1], (NXWEB_SSL_TICKET_KEY_NAMES-1)*16);
+    --*num_names;
+  }
+  memcpy(names[(*num_names)++], name, 16);
+}
+
+static int ticket_key_hook(gnutls_session_t session, unsigned htype, unsigned when, unsigned incoming, const gnutls_datum_t* msg) {
+  nxweb_server_listen_config* lconf=gnutls_db_get_ptr(session);
+  unsigned char name[16];
+  if (htype==GNUTLS_HANDSHAKE_CLIENT_HELLO && when==GNUTLS_HOOK_PRE && incoming) {
+    // pick previous key only if client's ticket was issued under it
+    static const unsigned char no_name[16];
+    memset(name, 0, 16);
+    if (gnutls_ext_raw_parse(name, find_ticket_key_name, msg, GNUTLS_EXT_RAW_FLAG_TLS_CLIENT_HELLO)<0 || !memcmp(name, no_name, 16)) return 0;
+    unsigned char key_bytes[64];
+    gnutls_datum_t key={key_bytes, 0};
+    pthread_mutex_lock(&ticket_key_mutex);
+    if (lconf->prev_session_ticket_key.data && lconf->prev_session_ticket_key.size<=sizeof(key_bytes)
+        && nxe_get_time_usec()/1000000<lconf->prev_ticket_key_expires
+        && ticket_key_name_known(lconf->prev_ticket_key_names, lconf->num_prev_ticket_key_names, name)) {
+      key.size=lconf->prev_session_ticket_key.size;
+      memcpy(key_bytes, lconf->prev_session_ticket_key.data, key.size);
+      gnutls_session_set_ptr(session, (void*)(uintptr_t)(lconf->ticket_key_gen-1));
+    }
+    pthread_mutex_unlock(&ticket_key_mutex);
+    if (key.size) gnutls_session_ticket_enable_server(session, &key);
+  }
+  else if (htype==GNUTLS_HANDSHAKE_NEW_SESSION_TICKET && when==GNUTLS_HOOK_POST && !incoming) {
+    // remember key_name of issued ticket for the key this session uses
+    const unsigned char* p=msg->data;
+    unsigned off=4; // ticket_lifetime
+    if (gnutls_protocol_get_version(session)==GNUTLS_TLS1_3) {
+      off+=4; // ticket_age_add
+      if (off>=msg->size) return 0;
+      off+=1+p[off]; // ticket_nonce
+    }
+    if (off+2+16>msg->size || ((unsigned)p[off]<<8 | p[off+1])<16) return 0;
+    memcpy(name, p+off+2, 16);
+    unsigned gen=(unsigned)(uintptr_t)gnutls_session_get_ptr(session);
+    pthread_mutex_lock(&ticket_key_mutex);
+    if (gen==lconf->ticket_key_gen) ticket_key_name_add(lconf->ticket_key_names, &lconf->num_ticket_key_names, name);
+    else if (gen==lconf->ticket_key_gen-1) ticket_key_name_add(lconf->prev_ticket_key_names, &lconf->num_prev_ticket_key_names, name);
+    pthread_mutex_unlock(&ticket_key_mutex);
+  }
+  return 0;
+}
+
+void _nxweb_ssl_session_setup(gnutls_session_t session, nxweb_server_listen_config* lconf) {
+  if (session_cache_enabled) {
+    gnutls_db_set_retrieve_function(session, db_retr_func);
+    gnutls_db_set_store_function(session, db_store_func);
+    gnutls_db_set_remove_function(session, db_remove_func);
+  }
+  gnutls_db_set_ptr(session, lconf);
+  gnutls_db_set_cache_expiration(session, nxweb_server_config.ssl_session_timeout);
+
+  time_t now=nxe_get_time_usec()/1000000;
+  unsigned char key_bytes[64];
+  gnutls_datum_t key={key_bytes, 0};
+  pthread_mutex_lock(&ticket_key_mutex);
+  if (!lconf->ticket_key_time) lconf->ticket_key_time=now;
+  else if (nxweb_server_config.ssl_ticket_key_rotation>0 && now>=lconf->ticket_key_time+nxweb_server_config.ssl_ticket_key_rotation) {
+    gnutls_datum_t new_key;
+    if (!gnutls_session_ticket_key_generate(&new_key)) {
+      if (lconf->prev_session_ticket_key.data) gnutls_free(lconf->prev_session_ticket_key.data);
+      lconf->prev_session_ticket_key=lconf->session_ticket_key;
+      lconf->prev_ticket_key_expires=now+nxweb_server_config.ssl_session_timeout;
+      lconf->session_ticket_key=new_key;
+      lconf->ticket_key_time=now;
+      lconf->ticket_key_gen++;
+      memcpy(lconf->prev_ticket_key_names, lconf->ticket_key_names, sizeof(lconf->ticket_key_names));
+      lconf->num_prev_ticket_key_names=lconf->num_ticket_key_names;
+      lconf->num_ticket_key_names=0;
+      ticket_keys_rotated++;
+    }
+  }
+  if (lconf->session_ticket_key.size<=sizeof(key_bytes)) {
+    key.size=lconf->session_ticket_key.size;
+    memcpy(key_bytes, lconf->session_ticket_key.data, key.size);
+  }
+  gnutls_session_set_ptr(session, (void*)(uintptr_t)lconf->ticket_key_gen);
+  pthread_mutex_unlock(&ticket_key_mutex);
+
+  if (key.size) {
+    gnutls_session_ticket_enable_server(session, &key);
+    // gnutls keeps single hook per session: both client hello and new session ticket go through it
+    gnutls_handshake_set_hook_function(session, GNUTLS_HANDSHAKE_ANY, GNUTLS_HOOK_BOTH, ticket_key_hook);
+  }
+}
+
+void _nxweb_ssl_count_handshake(_Bool resumed) {
+  if (resumed) __sync_add_and_fetch(&handshakes_resumed, 1);
+  else __sync_add_and_fetch(&handshakes_full, 1);
+}
+
+static int ssl_session_cache_init() {
+  int i;
+  pthread_mutex_init(&ticket_key_mutex, 0);
+  int max_size=nxweb_server_config.ssl_session_cache_size/NXWEB_SSL_SESSION_CACHE_SHARDS;
+  if (nxweb_server_config.ssl_session_cache_size>0 && max_size<1) max_size=1;
+  session_cache_enabled=max_size>0;
+  for (num_buckets=16; num_buckets<max_size; num_buckets<<=1) ;
+  for (i=0; i<NXWEB_SSL_SESSION_CACHE_SHARDS; i++) {
+    ssl_session_shard* sh=&shards[i];
+    pthread_mutex_init(&sh->mutex, 0);
+    sh->max_size=max_size;
+    if (session_cache_enabled) sh->buckets=nx_calloc(num_buckets*sizeof(ssl_session_entry*));
+  }
+  return 0;
+}
+
+static void ssl_session_cache_finalize() {
+  int i;
+  for (i=0; i<NXWEB_SSL_SESSION_CACHE_SHARDS; i++) {
+    ssl_session_shard* sh=&shards[i];
+    pthread_mutex_lock(&sh->mutex);
+    while (sh->head) entry_remove(sh, sh->head);
+    if (sh->buckets) nx_free(sh->buckets);
+    sh->buckets=0;
+    pthread_mutex_unlock(&sh->mutex);
+    pthread_mutex_destroy(&sh->mutex);
+  }
+  session_cache_enabled=0;
+  nxweb_server_listen_config* lconf;
+  for (i=0, lconf=nxweb_server_config.listen_config; i<NXWEB_MAX_LISTEN_SOCKETS; i++, lconf++) {
+    if (lconf->prev_session_ticket_key.data) {
+      gnutls_free(lconf->prev_session_ticket_key.data);
+      lconf->prev_session_ticket_key.data=0;
+    }
+  }
+  pthread_mutex_destroy(&ticket_key_mutex);
+}
+
+static void ssl_session_cache_diagnostics() {
+  int i, size=0;
+  uint64_t hits=0, misses=0, stores=0, evictions=0;
+  for (i=0; i<NXWEB_SSL_SESSION_CACHE_SHARDS; i++) {
+    ssl_session_shard* sh=&shards[i];
+    pthread_mutex_lock(&sh->mutex);
+    size+=sh->size;
+    hits+=sh->hits;
+    misses+=sh->misses;
+    stores+=sh->stores;
+    evictions+=sh->evictions;
+    pthread_mutex_unlock(&sh->mutex);
+  }
+  nxweb_log_error("[diag] ssl sessions: handshakes full=%" PRIu64 " resumed=%" PRIu64 " cache entries=%d/%d hits=%" PRIu64
+                  " misses=%" PRIu64 " stores=%" PRIu64 " evictions=%" PRIu64 " ticket_keys_rotated=%" PRIu64,
+                  handshakes_full, handshakes_resumed, size, shards[0].max_size*NXWEB_SSL_SESSION_CACHE_SHARDS,
+                  hits, misses, stores, evictions, ticket_keys_rotated);
+}
+
+NXWEB_MODULE(ssl_session_cache, .on_server_startup=ssl_session_cache_init,
+        .on_server_shutdown=ssl_session_cache_finalize, .on_server_diagnostics=ssl_session_cache_diagnostics);
+
+#endif // WITH_SSL
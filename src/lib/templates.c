@@ -25,11 +25,28 @@
 //#define MISSING_BLOCK_STUB "<!--[missing block]-->"
 #define MISSING_BLOCK_STUB ""
 
+static int nxt_grow_block_names(nxt_context* ctx);
+
 void nxt_init(nxt_context* ctx, nxb_buffer* nxb, nxt_loader loader, nxe_data loader_data) {
   memset(ctx, 0, sizeof(*ctx));
   ctx->nxb=nxb;
   ctx->load=loader;
   ctx->loader_data=loader_data;
+  nxt_grow_block_names(ctx);
+}
+
+void nxt_add_dependency(nxt_context* ctx, const char* fpath, time_t mtime) {
+  nxt_dependency* d;
+  for (d=ctx->deps; d; d=d->next) {
+    if (!strcmp(d->fpath, fpath)) return;
+  }
+  d=nxb_alloc_obj(ctx->nxb, sizeof(nxt_dependency));
+  d->fpath=nxb_copy_str(ctx->nxb, fpath);
+  d->mtime=mtime;
+  d->next=ctx->deps;
+  ctx->deps=d;
+  ctx->num_deps++;
+  ctx->deps_size+=strlen(fpath)+1;
 }
 
 static enum nxt_cmd nxt_parse_cmd(char* buf, int buf_len, char** args) {
@@ -140,51 +157,85 @@ NOT_FOUND:
   return NXT_NONE;
 }
 
-static nxt_block* nxt_block_create(nxt_file* file, const char* name) {
-  nxt_context* ctx=file->ctx;
-  int id;
-  if (name) {
-    for (id=0; id<ctx->next_free_block_id; id++) {
-      if (ctx->block_names[id].name && !strcmp(name, ctx->block_names[id].name)) break;
-    }
-    if (id==ctx->next_free_block_id) {
-      ctx->next_free_block_id++;
-      ctx->block_names[id].name=name;
-    }
+static inline uint32_t nxt_name_hash(const char* name) { // FNV-1a
+  uint32_t h=2166136261U;
+  const unsigned char* p;
+  for (p=(const unsigned char*)name; *p; p++) h=(h^*p)*16777619U;
+  return h;
+}
+
+static int nxt_grow_block_names(nxt_context* ctx) {
+  int size=ctx->block_names_size? ctx->block_names_size*2 : NXT_INITIAL_BLOCKS;
+  if (size>NXT_MAX_BLOCKS) {
+    nxweb_log_error("template error: too many blocks (NXT_MAX_BLOCKS=%d)", NXT_MAX_BLOCKS);
+    return -1;
   }
-  else {
-    id=ctx->next_free_block_id++;
+  nxt_block_name* bnames=nxb_calloc_obj(ctx->nxb, size*sizeof(nxt_block_name));
+  if (ctx->next_free_block_id) memcpy(bnames, ctx->block_names, ctx->next_free_block_id*sizeof(nxt_block_name));
+  ctx->block_names=bnames;
+  ctx->block_names_size=size;
+  // rebuild name index at twice the size of names array
+  int mask=size*2-1;
+  int* index=nxb_alloc_obj(ctx->nxb, (mask+1)*sizeof(int));
+  memset(index, 0xff, (mask+1)*sizeof(int));
+  int id;
+  for (id=0; id<ctx->next_free_block_id; id++) {
+    if (!bnames[id].name) continue;
+    int i=bnames[id].name_hash & mask;
+    while (index[i]>=0) i=(i+1) & mask;
+    index[i]=id;
   }
+  ctx->name_index=index;
+  ctx->name_index_mask=mask;
+  return 0;
+}
 
-  nxt_block* blk;
-  if (file->first_block) {
-    blk=file->first_block;
-    while (1) {
-      if (blk->id==id) return blk; // return existing block
-      if (!blk->next) break;
-      blk=blk->next;
-    }
-    blk=blk->next=nxb_calloc_obj(ctx->nxb, sizeof(nxt_block));
-  }
-  else {
-    blk=file->first_block=nxb_calloc_obj(ctx->nxb, sizeof(nxt_block));
+static int nxt_block_name_id(nxt_context* ctx, const char* name) {
+  if (ctx->next_free_block_id>=ctx->block_names_size && nxt_grow_block_names(ctx)) return -1;
+  if (!name) return ctx->next_free_block_id++; // anonymous (include) block
+  uint32_t h=nxt_name_hash(name);
+  int i=h & ctx->name_index_mask;
+  int id;
+  while ((id=ctx->name_index[i])>=0) {
+    nxt_block_name* bn=&ctx->block_names[id];
+    if (bn->name_hash==h && !strcmp(name, bn->name)) return id;
+    i=(i+1) & ctx->name_index_mask;
   }
+  id=ctx->next_free_block_id++;
+  ctx->block_names[id].name=name;
+  ctx->block_names[id].name_hash=h;
+  ctx->name_index[i]=id;
+  return id;
+}
+
+static nxt_block* nxt_block_create(nxt_file* file, const char* name) {
+  nxt_context* ctx=file->ctx;
+  int id=nxt_block_name_id(ctx, name);
+  if (id<0) return 0;
+  nxt_block_name* bn=&ctx->block_names[id];
+  if (bn->last_file==file) return bn->last_file_block; // return existing block
+
+  nxt_block* blk=nxb_calloc_obj(ctx->nxb, sizeof(nxt_block));
+  if (file->last_block) file->last_block->next=blk;
+  else file->first_block=blk;
+  file->last_block=blk;
   blk->id=id;
+  bn->last_file=file;
+  bn->last_file_block=blk;
 
   return blk;
 }
 
 nxt_value_part* nxt_block_append_value(nxt_context* ctx, nxt_block* blk, const char* text, int text_len, int insert_after_text_id) {
-  nxt_value_part* vp;
+  nxt_value_part* vp=nxb_calloc_obj(ctx->nxb, sizeof(nxt_value_part));
   if (blk->value && !blk->clear_on_append) {
-    vp=blk->value;
-    while (vp->next) vp=vp->next;
-    vp=vp->next=nxb_calloc_obj(ctx->nxb, sizeof(nxt_value_part));
+    blk->last_value->next=vp;
   }
   else {
-    vp=blk->value=nxb_calloc_obj(ctx->nxb, sizeof(nxt_value_part));
+    blk->value=vp;
     blk->clear_on_append=0;
   }
+  blk->last_value=vp;
   vp->text=text;
   vp->text_len=text_len;
   vp->insert_after_text_id=insert_after_text_id;
@@ -224,6 +275,8 @@ static nxt_block* nxt_include(nxt_file* cur_file, nxt_block* cur_block, const ch
   new_uri=nxt_resolve_uri(ctx, cur_file->uri, new_uri);
   if (!new_uri) return 0;
   nxt_block* include_blk=nxt_block_create(cur_file, 0);
+  if (!include_blk) return 0;
+  include_blk->include_uri=new_uri;
   if (ctx->load(ctx, new_uri, 0, include_blk)) return 0;
   ctx->files_pending++; // increment upon successful load
   return include_blk;
@@ -268,6 +321,7 @@ int nxt_parse_file(nxt_file* file, char* buf, int buf_len) {
   enum nxt_cmd cmd=NXT_NONE;
 
   cur_block=nxt_block_create(file, "_top_");
+  if (!cur_block) goto ERROR;
 
   for (;;) {
     cmd=nxt_get_next_cmd(file, &raw_mode, &ptr, &text, &text_len, args);
@@ -290,6 +344,7 @@ int nxt_parse_file(nxt_file* file, char* buf, int buf_len) {
         block_stack[block_stack_idx++]=cur_block;
         *args[1]='\0';
         nxt_block* new_block=nxt_block_create(file, args[0]);
+        if (!new_block) goto ERROR;
         nxt_block_append_value(ctx, cur_block, text, text_len, new_block->id);
         new_block->clear_on_append=1;
         cur_block=new_block;
@@ -454,3 +509,154 @@ void nxt_serialize_to_cs(nxt_context* ctx, nxweb_composite_stream* cs) {
   }
   nxt_serialize_block_to_cs(ctx, ctx->block_names[0].block, cs);
 }
+
+// Compiled templates
+
+typedef struct nxt_flattener {
+  nxt_context* ctx;
+  char* text; // null on sizing pass
+  int text_len;
+  nxt_compiled_node* nodes;
+  int num_nodes;
+  int uris_len;
+  char* uris;
+  int node_text_start;
+} nxt_flattener;
+
+static void nxt_flatten_text(nxt_flattener* fl, const char* text, int text_len) {
+  if (fl->text) memcpy(fl->text+fl->text_len, text, text_len);
+  fl->text_len+=text_len;
+}
+
+static void nxt_flatten_break(nxt_flattener* fl, const char* include_uri) {
+  if (fl->text) {
+    nxt_compiled_node* n=&fl->nodes[fl->num_nodes];
+    n->text=fl->text+fl->node_text_start;
+    n->text_len=fl->text_len-fl->node_text_start;
+    if (include_uri) {
+      n->include_uri=fl->uris;
+      strcpy(fl->uris, include_uri);
+      fl->uris+=strlen(include_uri)+1;
+    }
+  }
+  else if (include_uri) {
+    fl->uris_len+=strlen(include_uri)+1;
+  }
+  fl->num_nodes++;
+  fl->node_text_start=fl->text_len;
+}
+
+static void nxt_flatten_block(nxt_flattener* fl, nxt_block* blk) {
+  if (!blk) {
+    nxt_flatten_text(fl, MISSING_BLOCK_STUB, sizeof(MISSING_BLOCK_STUB)-1);
+    return;
+  }
+  if (blk->dynamic) {
+    nxt_flatten_break(fl, blk->include_uri);
+    return;
+  }
+  nxt_value_part* vp;
+  for (vp=blk->value; vp; vp=vp->next) {
+    if (vp->text_len) nxt_flatten_text(fl, vp->text, vp->text_len);
+    if (vp->insert_after_text_id>0) {
+      nxt_flatten_block(fl, fl->ctx->block_names[vp->insert_after_text_id].block);
+    }
+    else if (vp->insert_after_text_id==BN_PARENT_ID) {
+      nxt_flatten_block(fl, blk->parent);
+    }
+  }
+}
+
+nxt_compiled* nxt_compile(nxt_context* ctx, const char* key, time_t mtime, time_t last_modified) {
+  if (ctx->error || ctx->uncacheable || !ctx->block_names[0].block) return 0;
+  // sizing pass
+  nxt_flattener fl={.ctx=ctx};
+  nxt_flatten_block(&fl, ctx->block_names[0].block);
+  nxt_flatten_break(&fl, 0);
+  int key_len=strlen(key);
+  nxt_compiled* tc=nx_calloc(sizeof(nxt_compiled)+fl.num_nodes*sizeof(nxt_compiled_node)+ctx->num_deps*sizeof(nxt_dependency)
+                             +fl.text_len+fl.uris_len+key_len+1+ctx->deps_size);
+  if (!tc) return 0;
+  tc->nodes=(nxt_compiled_node*)(tc+1);
+  tc->deps=(nxt_dependency*)(tc->nodes+fl.num_nodes);
+  char* text=(char*)(tc->deps+ctx->num_deps);
+  char* uris=text+fl.text_len;
+  char* tc_key=uris+fl.uris_len;
+  memcpy(tc_key, key, key_len+1);
+  char* fpaths=tc_key+key_len+1;
+  nxt_dependency* d;
+  for (d=ctx->deps; d; d=d->next, tc->num_deps++) {
+    tc->deps[tc->num_deps].fpath=strcpy(fpaths, d->fpath);
+    tc->deps[tc->num_deps].mtime=d->mtime;
+    fpaths+=strlen(fpaths)+1;
+  }
+  tc->entry.key=tc_key;
+  tc->entry.mtime=mtime;
+  tc->last_modified=last_modified;
+  tc->entry.ref_count=1;
+  // copy pass
+  nxt_flattener fl2={.ctx=ctx, .text=text, .nodes=tc->nodes, .uris=uris};
+  nxt_flatten_block(&fl2, ctx->block_names[0].block);
+  nxt_flatten_break(&fl2, 0);
+  assert(fl2.text_len==fl.text_len && fl2.num_nodes==fl.num_nodes);
+  tc->num_nodes=fl2.num_nodes;
+  return tc;
+}
+
+void nxt_compiled_to_cs(nxt_compiled* tc, nxweb_composite_stream* cs) {
+  int i;
+  nxt_compiled_node* n;
+  for (i=tc->num_nodes, n=tc->nodes; i>0; i--, n++) {
+    if (n->text_len) nxweb_composite_stream_append_bytes(cs, n->text, n->text_len);
+    if (n->include_uri) nxweb_composite_stream_append_subrequest(cs, 0, n->include_uri);
+  }
+}
+
+// 1 = all files unchanged; -1 = some file changed; 0 = unknown (stat would block net thread)
+static int nxt_compiled_revalidate(nx_refcache_entry* e) {
+  nxt_compiled* tc=(nxt_compiled*)e;
+  int i;
+  struct stat finfo;
+  // start template mtime already checked by nx_refcache_get(); parents & includes stat'ed here
+  for (i=0; i<tc->num_deps; i++) {
+    int r=nxweb_fd_cache_stat(tc->deps[i].fpath, &finfo, nxweb_server_config.offload_file_io);
+    if (r==-2) return 0;
+    if (r==-1 || finfo.st_mtime!=tc->deps[i].mtime) return -1;
+  }
+  return 1;
+}
+
+static void nxt_compiled_free(nx_refcache_entry* e) {
+  nx_free(e);
+}
+
+static nx_refcache nxt_cache={.name="compiled templates", .max_entries=NXT_MAX_COMPILED_TEMPLATES,
+        .ttl=NXT_COMPILED_TEMPLATE_TTL, .free_entry=nxt_compiled_free, .revalidate=nxt_compiled_revalidate};
+
+nxt_compiled* nxt_cache_get(const char* key, time_t mtime, nxe_time_t loop_time) {
+  return (nxt_compiled*)nx_refcache_get(&nxt_cache, key, mtime, loop_time);
+}
+
+void nxt_cache_store(nxt_compiled* tc, nxe_time_t loop_time) {
+  nx_refcache_store(&nxt_cache, &tc->entry, loop_time);
+}
+
+void nxt_compiled_unref(nxt_compiled* tc) {
+  nx_refcache_unref(&nxt_cache, &tc->entry);
+}
+
+static int nxt_cache_init() {
+  nx_refcache_init(&nxt_cache);
+  return 0;
+}
+
+static void nxt_cache_finalize() {
+  nx_refcache_finalize(&nxt_cache);
+}
+
+static void nxt_cache_diagnostics() {
+  nx_refcache_diagnostics(&nxt_cache);
+}
+
+NXWEB_MODULE(compiled_templates, .on_server_startup=nxt_cache_init, .on_server_shutdown=nxt_cache_finalize,
+        .on_server_diagnostics=nxt_cache_diagnostics);
@@ -0,0 +1,564 @@
+/*
+ * Copyright (c) 2011-2012 Yaroslav Stavnichiy <yarosla@gmail.com>
+ *
+ * This file is part of NXWEB.
+ *
+ * NXWEB is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * NXWEB is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with NXWEB. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nxweb.h"
+
+#include "deps/sha1-c/sha1.h"
+
+/*
+ * WebSocket connection takes over socket streams of HTTP/1.1 connection
+ * after 101 response, the way HTTP/2 does. Request stays with connection
+ * until it closes, so access log gets one line per websocket session with
+ * total bytes sent.
+ *
+ * Channels and cross-thread posts go through pubsub.c; only framing and
+ * connection handling live here.
+ */
+
+#define OP_CONTINUATION 0x0
+#define OP_TEXT 0x1
+#define OP_BINARY 0x2
+#define OP_CLOSE 0x8
+#define OP_PING 0x9
+#define OP_PONG 0xA
+
+#define MAX_QUEUED NXWEB_WEBSOCKET_MAX_QUEUED_MESSAGES
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+static __thread nxweb_websocket* thread_websockets; // open websockets of this net thread
+
+static int websockets_open;
+static uint64_t websockets_total;
+static uint64_t messages_received;
+static uint64_t messages_sent; // queued to connections, counting each fan-out recipient
+static uint64_t messages_published;
+static uint64_t slow_consumers;
+static uint64_t protocol_errors;
+
+static nxweb_ws_message* frame_create(uint8_t opcode, const void* data, nxe_size_t size) {
+  int hlen=size<126? 2 : (size<65536? 4 : 10);
+  nxweb_ws_message* msg=_nxweb_frame_alloc(hlen+size);
+  char* p=msg->data;
+  *p++=(char)(0x80|opcode); // FIN
+  if (size<126) {
+    *p++=(char)size;
+  }
+  else if (size<65536) {
+    *p++=126;
+    *p++=(char)(size>>8);
+    *p++=(char)size;
+  }
+  else {
+    *p++=127;
+    uint64_t len=size;
+    int i;
+    for (i=7; i>=0; i--) *p++=(char)(len>>(i*8));
+  }
+  if (size) memcpy(p, data, size);
+  return msg;
+}
+
+nxweb_ws_message* nxweb_ws_message_create(const void* data, nxe_size_t size, _Bool binary) {
+  return frame_create(binary? OP_BINARY : OP_TEXT, data, size);
+}
+
+void nxweb_websocket_ref(nxweb_websocket* ws) {
+  __sync_add_and_fetch(&ws->refcount, 1);
+}
+
+void nxweb_websocket_unref(nxweb_websocket* ws) {
+  if (!__sync_sub_and_fetch(&ws->refcount, 1)) nx_free(ws);
+}
+
+static void wake_output(nxweb_websocket* ws) {
+  if (ws->data_out.pair) nxe_istream_set_ready(ws->data_out.super.loop, &ws->data_out);
+}
+
+static int out_push(nxweb_websocket* ws, nxweb_ws_message* msg, int limit) {
+  if (_nxweb_frame_queue_push(&ws->out, msg, limit)) return -1;
+  wake_output(ws);
+  return 0;
+}
+
+static void send_own_frame(nxweb_websocket* ws, nxweb_ws_message* msg, int limit) {
+  out_push(ws, msg, limit);
+  nxweb_ws_message_unref(msg);
+}
+
+static void start_close(nxweb_websocket* ws, int code, _Bool drop) {
+  if (ws->close_sent || !ws->conn) return;
+  if (drop) _nxweb_frame_queue_drop(&ws->out);
+  char payload[2]={(char)(code>>8), (char)code};
+  send_own_frame(ws, frame_create(OP_CLOSE, payload, 2), MAX_QUEUED+2);
+  ws->close_sent=1;
+  if (!ws->close_received) nxe_set_timer(ws->data_in.super.loop, NXWEB_TIMER_READ, &ws->timer_close);
+}
+
+static void fail(nxweb_websocket* ws, int code) {
+  nxweb_log_info("websocket %p failed with code %d", ws, code);
+  __sync_add_and_fetch(&protocol_errors, 1);
+  start_close(ws, code, 1);
+  ws->close_received=1; // do not wait for reply
+  ws->close_code=NXWEB_WS_CLOSE_ABNORMAL;
+  nxe_ostream_unset_ready(&ws->data_in);
+  nxe_unset_timer(ws->data_in.super.loop, NXWEB_TIMER_READ, &ws->timer_close);
+}
+
+int nxweb_websocket_send_message(nxweb_websocket* ws, nxweb_ws_message* msg) {
+  if (!ws->conn || ws->close_sent) return -1;
+  if (out_push(ws, msg, MAX_QUEUED)) {
+    // peer does not read fast enough; stop here rather than buffer without limit
+    nxweb_log_info("websocket %p slow consumer", ws);
+    __sync_add_and_fetch(&slow_consumers, 1);
+    start_close(ws, NXWEB_WS_CLOSE_POLICY_VIOLATION, 1);
+    return -1;
+  }
+  __sync_add_and_fetch(&messages_sent, 1);
+  return 0;
+}
+
+int nxweb_websocket_send(nxweb_websocket* ws, const void* data, nxe_size_t size, _Bool binary) {
+  if (!ws->conn || ws->close_sent) return -1;
+  nxweb_ws_message* msg=nxweb_ws_message_create(data, size, binary);
+  int res=nxweb_websocket_send_message(ws, msg);
+  nxweb_ws_message_unref(msg);
+  return res;
+}
+
+void nxweb_websocket_close(nxweb_websocket* ws, int code) {
+  start_close(ws, code, 0);
+}
+
+static int pubsub_send(void* ws, nxweb_frame* msg) {
+  return nxweb_websocket_send_message(ws, msg);
+}
+
+static void pubsub_ws_ref(void* ws) {
+  nxweb_websocket_ref(ws);
+}
+
+static void pubsub_ws_unref(void* ws) {
+  nxweb_websocket_unref(ws);
+}
+
+static const nxweb_pubsub_class ws_pubsub_class={.name="websocket channel", .send=pubsub_send,
+        .endpoint_ref=pubsub_ws_ref, .endpoint_unref=pubsub_ws_unref};
+
+int nxweb_websocket_post(nxweb_websocket* ws, const void* data, nxe_size_t size, _Bool binary) {
+  if (!ws->conn) return -1; // racy, but saves building message for closed websocket
+  nxweb_ws_message* msg=nxweb_ws_message_create(data, size, binary);
+  int res=_nxweb_pubsub_post(&ws_pubsub_class, ws->tdata, ws, msg);
+  nxweb_ws_message_unref(msg);
+  return res;
+}
+
+int nxweb_ws_channel_subscribe(nxweb_ws_channel* ch, nxweb_websocket* ws) {
+  if (!ws->conn) return -1;
+  _nxweb_pubsub_subscribe(&ws->subscriptions, &ch->subscribers, ws, ws->tdata->thread_num);
+  return 0;
+}
+
+void nxweb_ws_channel_unsubscribe(nxweb_ws_channel* ch, nxweb_websocket* ws) {
+  _nxweb_pubsub_unsubscribe(&ws->subscriptions, &ch->subscribers);
+}
+
+int nxweb_ws_channel_publish(nxweb_ws_channel* ch, const void* data, nxe_size_t size, _Bool binary) {
+  nxweb_ws_message* msg=nxweb_ws_message_create(data, size, binary);
+  __sync_add_and_fetch(&messages_published, 1);
+  int n=_nxweb_pubsub_publish(&ws_pubsub_class, &ch->subscribers, msg);
+  nxweb_ws_message_unref(msg);
+  return n;
+}
+
+static _Bool utf8_valid(const unsigned char* p, nxe_size_t size) {
+  const unsigned char* end=p+size;
+  while (p<end) {
+    unsigned c=*p++;
+    if (c<0x80) continue;
+    int n;
+    unsigned min;
+    if ((c&0xE0)==0xC0) { n=1; min=0x80; c&=0x1F; }
+    else if ((c&0xF0)==0xE0) { n=2; min=0x800; c&=0x0F; }
+    else if ((c&0xF8)==0xF0) { n=3; min=0x10000; c&=0x07; }
+    else return 0;
+    if (end-p<n) return 0;
+    while (n--) {
+      if ((*p&0xC0)!=0x80) return 0;
+      c=(c<<6)|(*p++&0x3F);
+    }
+    if (c<min || c>0x10FFFF || (c>=0xD800 && c<=0xDFFF)) return 0;
+  }
+  return 1;
+}
+
+static int deliver_message(nxweb_websocket* ws, uint8_t opcode, const char* data, nxe_size_t size) {
+  if (opcode==OP_TEXT && !utf8_valid((const unsigned char*)data, size)) {
+    fail(ws, NXWEB_WS_CLOSE_INVALID_DATA);
+    return -1;
+  }
+  __sync_add_and_fetch(&messages_received, 1);
+  if (ws->close_sent) return 0; // we are closing; ignore
+  ws->handler->on_ws_message(ws, data, size, opcode==OP_BINARY);
+  return 0;
+}
+
+static void send_control(nxweb_websocket* ws, uint8_t opcode, const char* payload, int size) {
+  if (ws->close_sent) return;
+  send_own_frame(ws, frame_create(opcode, payload, size), MAX_QUEUED+1); // keep last slot for close frame
+}
+
+static int process_frame(nxweb_websocket* ws, _Bool fin, uint8_t opcode, const char* payload, nxe_size_t len) {
+  switch (opcode) {
+    case OP_CONTINUATION:
+      if (!ws->msg_opcode) {
+        fail(ws, NXWEB_WS_CLOSE_PROTOCOL_ERROR);
+        return -1;
+      }
+      if (ws->msg_len+len>ws->msg_size) {
+        int new_size=ws->msg_size? ws->msg_size*2 : NXWEB_WEBSOCKET_IBUF_SIZE;
+        while (new_size<ws->msg_len+len) new_size*=2;
+        char* b=nx_alloc(new_size);
+        if (ws->msg_len) memcpy(b, ws->msg, ws->msg_len);
+        if (ws->msg) nx_free(ws->msg);
+        ws->msg=b;
+        ws->msg_size=new_size;
+      }
+      memcpy(ws->msg+ws->msg_len, payload, len);
+      ws->msg_len+=len;
+      if (fin) {
+        uint8_t op=ws->msg_opcode;
+        ws->msg_opcode=0;
+        int res=deliver_message(ws, op, ws->msg, ws->msg_len);
+        ws->msg_len=0;
+        return res;
+      }
+      return 0;
+    case OP_TEXT:
+    case OP_BINARY:
+      if (ws->msg_opcode) {
+        fail(ws, NXWEB_WS_CLOSE_PROTOCOL_ERROR);
+        return -1;
+      }
+      if (fin) return deliver_message(ws, opcode, payload, len); // straight from input buffer
+      ws->msg_opcode=opcode;
+      ws->msg_len=0;
+      return process_frame(ws, 0, OP_CONTINUATION, payload, len);
+    case OP_CLOSE:
+      if (len==1) {
+        fail(ws, NXWEB_WS_CLOSE_PROTOCOL_ERROR);
+        return -1;
+      }
+      ws->close_code=len>=2? (uint8_t)payload[0]<<8 | (uint8_t)payload[1] : NXWEB_WS_CLOSE_NO_STATUS;
+      ws->close_received=1;
+      nxe_unset_timer(ws->data_in.super.loop, NXWEB_TIMER_READ, &ws->timer_close);
+      nxe_ostream_unset_ready(&ws->data_in);
+      start_close(ws, len>=2? ws->close_code : NXWEB_WS_CLOSE_NORMAL, 0); // echo
+      wake_output(ws); // close handshake completes once output is flushed
+      return -1;
+    case OP_PING:
+      send_control(ws, OP_PONG, payload, len);
+      return 0;
+    case OP_PONG:
+      return 0;
+    default:
+      fail(ws, NXWEB_WS_CLOSE_PROTOCOL_ERROR);
+      return -1;
+  }
+}
+
+static void process_input(nxweb_websocket* ws) {
+  char* p=ws->ibuf;
+  char* end=p+ws->ibuf_len;
+  while (end-p>=2) {
+    uint8_t b0=(uint8_t)p[0], b1=(uint8_t)p[1];
+    uint8_t opcode=b0&0x0F;
+    _Bool fin=!!(b0&0x80);
+    uint64_t len=b1&0x7F;
+    int hlen=2;
+    if ((b0&0x70) || !(b1&0x80)) { // no extensions negotiated; client frames must be masked
+      fail(ws, NXWEB_WS_CLOSE_PROTOCOL_ERROR);
+      return;
+    }
+    if (len==126) {
+      if (end-p<4) break;
+      len=(uint8_t)p[2]<<8 | (uint8_t)p[3];
+      hlen=4;
+    }
+    else if (len==127) {
+      if (end-p<10) break;
+      int i;
+      for (i=2, len=0; i<10; i++) len=len<<8 | (uint8_t)p[i];
+      hlen=10;
+    }
+    hlen+=4; // masking key
+    if (opcode&0x8) {
+      if (!fin || len>125) {
+        fail(ws, NXWEB_WS_CLOSE_PROTOCOL_ERROR);
+        return;
+      }
+    }
+    else if (len>NXWEB_WEBSOCKET_MAX_MESSAGE_SIZE || (uint64_t)ws->msg_len+len>NXWEB_WEBSOCKET_MAX_MESSAGE_SIZE) {
+      fail(ws, NXWEB_WS_CLOSE_MESSAGE_TOO_BIG);
+      return;
+    }
+    if (end-p<hlen+(int)len) {
+      if (hlen+(int)len>ws->ibuf_size) { // make room for whole frame
+        int new_size=ws->ibuf_size*2;
+        while (new_size<hlen+(int)len) new_size*=2;
+        char* b=nx_alloc(new_size);
+        memcpy(b, p, end-p);
+        nx_free(ws->ibuf);
+        ws->ibuf=b;
+        ws->ibuf_size=new_size;
+        ws->ibuf_len=end-p;
+        return;
+      }
+      break;
+    }
+    char* payload=p+hlen;
+    const char* mask=payload-4;
+    int i;
+    for (i=0; i<(int)len; i++) payload[i]^=mask[i&3];
+    p+=hlen+len;
+    if (process_frame(ws, fin, opcode, payload, len)) break;
+  }
+  ws->ibuf_len=end-p;
+  if (ws->ibuf_len && p!=ws->ibuf) memmove(ws->ibuf, p, ws->ibuf_len);
+}
+
+static void data_in_do_read(nxe_ostream* os, nxe_istream* is) {
+  nxweb_websocket* ws=OBJ_PTR_FROM_FLD_PTR(nxweb_websocket, data_in, os);
+
+  nxweb_log_debug("websocket data_in_do_read");
+
+  if (ws->close_received) {
+    nxe_ostream_unset_ready(os);
+    return;
+  }
+  nxe_flags_t flags=0;
+  nxe_size_t bytes_received=ISTREAM_CLASS(is)->read(is, os, ws->ibuf+ws->ibuf_len, ws->ibuf_size-ws->ibuf_len, &flags);
+  if (bytes_received) {
+    ws->got_input=1;
+    ws->ibuf_len+=bytes_received;
+    process_input(ws);
+  }
+}
+
+static void data_out_do_write(nxe_istream* is, nxe_ostream* os) {
+  nxweb_websocket* ws=OBJ_PTR_FROM_FLD_PTR(nxweb_websocket, data_out, is);
+  nxe_loop* loop=is->super.loop;
+
+  nxweb_log_debug("websocket data_out_do_write");
+
+  nxe_size_t bytes_sent=_nxweb_frame_queue_write(&ws->out, is, os);
+  ws->conn->hsp._resp.bytes_sent+=bytes_sent;
+  if (bytes_sent) nxe_unset_timer(loop, NXWEB_TIMER_WRITE, &ws->timer_write);
+  if (ws->out.count) {
+    if (!ws->timer_write.abs_time) nxe_set_timer(loop, NXWEB_TIMER_WRITE, &ws->timer_write); // socket is full
+    return;
+  }
+  nxe_istream_unset_ready(is);
+  if (ws->close_sent && ws->close_received && !ws->closed) {
+    ws->closed=1;
+    nxe_publish(&ws->conn->hsp.events_pub, (nxe_data)NXD_HSP_WEBSOCKET_CLOSED);
+  }
+}
+
+static void timer_keep_alive_on_timeout(nxe_timer* timer, nxe_data data) {
+  nxweb_websocket* ws=OBJ_PTR_FROM_FLD_PTR(nxweb_websocket, timer_keep_alive, timer);
+  nxe_loop* loop=ws->data_in.super.loop;
+  if (ws->got_input || !ws->ping_sent) {
+    // idle: check peer is still there
+    ws->got_input=0;
+    ws->ping_sent=1;
+    send_control(ws, OP_PING, 0, 0);
+    nxe_set_timer(loop, NXWEB_TIMER_KEEP_ALIVE, &ws->timer_keep_alive);
+    return;
+  }
+  nxe_publish(&ws->conn->hsp.events_pub, (nxe_data)NXD_HSP_KEEP_ALIVE_TIMEOUT);
+  nxweb_log_info("websocket %p keep-alive timeout", ws);
+}
+
+static void timer_close_on_timeout(nxe_timer* timer, nxe_data data) {
+  nxweb_websocket* ws=OBJ_PTR_FROM_FLD_PTR(nxweb_websocket, timer_close, timer);
+  nxe_publish(&ws->conn->hsp.events_pub, (nxe_data)NXD_HSP_READ_TIMEOUT);
+  nxweb_log_info("websocket %p close timeout", ws);
+}
+
+static void timer_write_on_timeout(nxe_timer* timer, nxe_data data) {
+  nxweb_websocket* ws=OBJ_PTR_FROM_FLD_PTR(nxweb_websocket, timer_write, timer);
+  nxe_publish(&ws->conn->hsp.events_pub, (nxe_data)NXD_HSP_WRITE_TIMEOUT);
+  nxweb_log_warning("websocket %p write timeout", ws);
+}
+
+static const nxe_ostream_class data_in_class={.do_read=data_in_do_read};
+static const nxe_istream_class data_out_class={.do_write=data_out_do_write};
+static const nxe_timer_class timer_keep_alive_class={.on_timeout=timer_keep_alive_on_timeout};
+static const nxe_timer_class timer_close_class={.on_timeout=timer_close_on_timeout};
+static const nxe_timer_class timer_write_class={.on_timeout=timer_write_on_timeout};
+
+static void base64_encode(const unsigned char* src, int len, char* dst) {
+  static const char tbl[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int i;
+  for (i=0; i+2<len; i+=3) {
+    *dst++=tbl[src[i]>>2];
+    *dst++=tbl[(src[i]&0x03)<<4 | src[i+1]>>4];
+    *dst++=tbl[(src[i+1]&0x0F)<<2 | src[i+2]>>6];
+    *dst++=tbl[src[i+2]&0x3F];
+  }
+  if (i<len) {
+    *dst++=tbl[src[i]>>2];
+    if (i+1<len) {
+      *dst++=tbl[(src[i]&0x03)<<4 | src[i+1]>>4];
+      *dst++=tbl[(src[i+1]&0x0F)<<2];
+    }
+    else {
+      *dst++=tbl[(src[i]&0x03)<<4];
+      *dst++='=';
+    }
+    *dst++='=';
+  }
+  *dst='\0';
+}
+
+static void accept_key(const char* key, char* result) { // result: 29 bytes
+  SHA1Context sha;
+  SHA1Reset(&sha);
+  SHA1Input(&sha, (const unsigned char*)key, strlen(key));
+  SHA1Input(&sha, (const unsigned char*)WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID)-1);
+  SHA1Result(&sha);
+  unsigned char digest[20];
+  int i;
+  for (i=0; i<20; i++) digest[i]=(unsigned char)(sha.Message_Digest[i>>2]>>(24-(i&3)*8));
+  base64_encode(digest, 20, result);
+}
+
+static nxweb_result upgrade_refused(nxweb_http_server_connection* conn, nxweb_http_response* resp, int code, const char* message) {
+  nxweb_send_http_error(resp, code, message);
+  if (code==426) {
+    nxweb_add_response_header(resp, "Upgrade", "websocket");
+    nxweb_add_response_header(resp, "Sec-WebSocket-Version", "13");
+  }
+  nxweb_start_sending_response(conn, resp);
+  return NXWEB_ERROR;
+}
+
+nxweb_result _nxweb_websocket_upgrade(nxweb_http_server_connection* conn, nxweb_http_request* req, nxweb_http_response* resp) {
+  const char* upgrade=nxweb_get_request_header(req, "Upgrade");
+  if (conn->parent || conn->h2_conn || !req->http11 || !req->connection_upgrade
+      || !upgrade || nx_strcasecmp(upgrade, "websocket")) { // WebSocket over HTTP/2 (RFC 8441) is not supported
+    return upgrade_refused(conn, resp, 426, "Upgrade Required");
+  }
+  const char* version=nxweb_get_request_header(req, "Sec-WebSocket-Version");
+  if (!version || strcmp(version, "13")) return upgrade_refused(conn, resp, 426, "Upgrade Required");
+  const char* key=nxweb_get_request_header(req, "Sec-WebSocket-Key");
+  if (!req->get_method || !key || strlen(key)!=24) return upgrade_refused(conn, resp, 400, "Bad Request");
+
+  nxd_http_server_proto* hsp=&conn->hsp;
+  nxe_loop* loop=hsp->data_in.super.loop;
+  nxe_istream* is=hsp->data_in.pair;
+  nxe_ostream* os=hsp->data_out.pair;
+  nxe_unset_timer(loop, NXWEB_TIMER_KEEP_ALIVE, &hsp->timer_keep_alive);
+  nxe_unset_timer(loop, NXWEB_TIMER_READ, &hsp->timer_read);
+  nxe_unset_timer(loop, NXWEB_TIMER_WRITE, &hsp->timer_write);
+  nxe_disconnect_streams(is, &hsp->data_in);
+  nxe_disconnect_streams(&hsp->data_out, os);
+  hsp->headers_bytes_received=0; // socket errors from now on are normal close
+  resp->status_code=101;
+  resp->status="Switching Protocols";
+
+  nxweb_websocket* ws=nx_calloc(sizeof(nxweb_websocket));
+  ws->refcount=1; // released in _nxweb_websocket_finalize()
+  ws->conn=conn;
+  ws->handler=conn->handler;
+  ws->tdata=conn->tdata;
+  ws->data_in.super.cls.os_cls=&data_in_class;
+  ws->data_out.super.cls.is_cls=&data_out_class;
+  ws->data_out.evt.cls=NXE_EV_STREAM;
+  ws->data_in.ready=1;
+  nxe_init_timer(&ws->timer_keep_alive, &timer_keep_alive_class);
+  nxe_init_timer(&ws->timer_close, &timer_close_class);
+  nxe_init_timer(&ws->timer_write, &timer_write_class);
+  ws->ibuf_size=NXWEB_WEBSOCKET_IBUF_SIZE;
+  ws->ibuf=nx_alloc(ws->ibuf_size);
+  conn->ws=ws;
+  ws->next=thread_websockets;
+  if (ws->next) ws->next->prev=ws;
+  thread_websockets=ws;
+  __sync_add_and_fetch(&websockets_open, 1);
+  __sync_add_and_fetch(&websockets_total, 1);
+
+  char accept[32];
+  accept_key(key, accept);
+  static const char head[]="HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+  nxweb_ws_message* msg=_nxweb_frame_alloc(sizeof(head)-1+28+4);
+  memcpy(msg->data, head, sizeof(head)-1);
+  memcpy(msg->data+sizeof(head)-1, accept, 28);
+  memcpy(msg->data+sizeof(head)-1+28, "\r\n\r\n", 4);
+
+  nxe_connect_streams(loop, is, &ws->data_in);
+  nxe_connect_streams(loop, &ws->data_out, os);
+  send_own_frame(ws, msg, MAX_QUEUED);
+  nxe_set_timer(loop, NXWEB_TIMER_KEEP_ALIVE, &ws->timer_keep_alive);
+
+  if (ws->handler->on_ws_open) ws->handler->on_ws_open(ws, req);
+  return NXWEB_OK;
+}
+
+void _nxweb_websocket_finalize(nxweb_websocket* ws) {
+  nxe_loop* loop=ws->data_in.super.loop;
+  if (!ws->close_received) ws->close_code=NXWEB_WS_CLOSE_ABNORMAL;
+  if (ws->handler->on_ws_close) ws->handler->on_ws_close(ws, ws->close_code);
+  _nxweb_pubsub_unsubscribe_all(&ws->subscriptions);
+  nxe_unset_timer(loop, NXWEB_TIMER_KEEP_ALIVE, &ws->timer_keep_alive);
+  nxe_unset_timer(loop, NXWEB_TIMER_READ, &ws->timer_close);
+  nxe_unset_timer(loop, NXWEB_TIMER_WRITE, &ws->timer_write);
+  if (ws->data_in.pair) nxe_disconnect_streams(ws->data_in.pair, &ws->data_in);
+  if (ws->data_out.pair) nxe_disconnect_streams(&ws->data_out, ws->data_out.pair);
+  _nxweb_frame_queue_clear(&ws->out);
+  nx_free(ws->ibuf);
+  if (ws->msg) nx_free(ws->msg);
+  ws->ibuf=ws->msg=0;
+  if (ws->prev) ws->prev->next=ws->next;
+  else thread_websockets=ws->next;
+  if (ws->next) ws->next->prev=ws->prev;
+  ws->conn->ws=0;
+  ws->conn=0;
+  __sync_sub_and_fetch(&websockets_open, 1);
+  nxweb_websocket_unref(ws);
+}
+
+void _nxweb_websocket_shutdown_thread() {
+  nxweb_websocket* ws;
+  nxweb_websocket* next;
+  for (ws=thread_websockets; ws; ws=next) {
+    next=ws->next;
+    start_close(ws, NXWEB_WS_CLOSE_GOING_AWAY, 1);
+    if (ws->data_out.pair && ws->data_out.pair->ready) data_out_do_write(&ws->data_out, ws->data_out.pair); // best effort
+    nxweb_http_server_connection_finalize(ws->conn, 1);
+  }
+}
+
+static void websocket_diagnostics() {
+  nxweb_log_error("[diag] websocket: open=%d/%" PRIu64 " received=%" PRIu64 " sent=%" PRIu64 " published=%" PRIu64 " slow_consumers=%" PRIu64 " errors=%" PRIu64,
+                  websockets_open, websockets_total, messages_received, messages_sent, messages_published, slow_consumers, protocol_errors);
+}
+
+NXWEB_MODULE(websocket, .on_server_diagnostics=websocket_diagnostics);